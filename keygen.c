@@ -19,15 +19,16 @@
 #include <stdlib.h>
 #include <time.h>
 
-#define MIN_CHAR 64 // The minimum integer value of a character to be randomly generated ('@', to be replaced by space)
-#define MAX_CHAR 90 // The maximum integer value of a character to be randomly generated ('Z')
+#include "otp_kernels.h"
+
+#define CHUNK_LEN 65536 // Number of key characters to generate and write at a time
 
 void error(const char *msg) { perror(msg); exit(1); } // Error function used for reporting issues
 
 int main(int argc, char *argv[]) {
 
-    char c;
-    int i, keylength;
+    char chunk[CHUNK_LEN]; // Key characters waiting to be written
+    int n, keylength;
 
     if (argc != 2) { fprintf(stderr, "USAGE: %s keylength\n", argv[0]); exit(1); } // Check usage & args
     keylength = atoi(argv[1]); // Get the keylength
@@ -37,12 +38,12 @@ int main(int argc, char *argv[]) {
     unsigned seed = time(0);
     srand(seed);
 
-    // Generate the key
-    for (i = 0; i < keylength; i++) {
+    // Generate the key a chunk at a time and print to stdout
+    for (; keylength > 0; keylength -= n) {
 
-        c = (char)(rand() % (MAX_CHAR - MIN_CHAR + 1) + MIN_CHAR); // Generate a random character
-        if (c == '@') { c = ' '; } // Replace '@' w/ ' '
-        printf("%c", c); // Print to stdout
+        n = keylength < CHUNK_LEN ? keylength : CHUNK_LEN;
+        keychars(chunk, n);
+        fwrite(chunk, 1, n, stdout);
     }
     printf("\n"); // Add a newline character
 
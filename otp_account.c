@@ -0,0 +1,295 @@
+/*************************************************************************************************************************
+ *
+ * NAME
+ *    otp_account.c
+ * SYNOPSIS
+ *    Allocation and syscall accounting for a daemon under a fixed request load, checked against budgets.
+ * DESCRIPTION
+ *    Starts a daemon with otp_account.so preloaded (see otp_account_preload.c), which counts every allocator call and
+ *       every request path syscall in the daemon and in each request process it forks. Then drives it with otp_bench:
+ *       a warm up run first, then the measured run, and reports the counts the measured run added divided by its
+ *       number of requests, so one-time start up costs are left out and only the steady state is counted.
+ *    Before each reading it waits until every request process the daemon forked has exited, so nothing is missed.
+ *       The daemon's long lived helpers (its log drain process, and its metrics process if it has one) only exit with
+ *       it, so they're counted as exited: they're the children that named themselves something other than the daemon.
+ *    Any daemon that takes a port as its last argument and speaks the same protocol can be measured, so a new serving
+ *       model can be compared against the fork per request one on the same load.
+ *    Exits 0 when the steady state is within every budget given, 1 when it's over any of them, and 2 if the
+ *       measurement couldn't be made.
+ * INSTRUCTIONS
+ *    Use the included compileall script to compile this program and otp_account.so as well as the other programs.
+ *    Run it from the build directory (it runs otp_bench and loads otp_account.so from the same directory):
+ *       otp_account [--dec] [--requests N] [--warmup N] [--connections N] [--sizes SIZE:WEIGHT,...] [--port PORT]
+ *                   [--max-allocs N] [--max-alloc-bytes N] [--max-syscalls N] [--json] [DAEMON]
+ *    DAEMON defaults to otp_enc_d (otp_dec_d with --dec) from the same directory. Budgets are per request.
+ *    e.g. otp_account --requests 500 --max-allocs 3 --max-syscalls 24 (a request allocates its text, key and result)
+ * AUTHOR
+ *    Written by Andrew Swaim
+ *
+*************************************************************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "otp_account.h"
+
+typedef enum { false, true } bool; // Create bool type for C89/C99 compilation.
+
+#define SETTLE_TRIES 500 // How many 10ms waits to give request processes to exit before a reading
+
+/*************************************************************************************************************************
+ * Globals
+*************************************************************************************************************************/
+
+static const char* accountNames[ACC_CALLS] = { // Names to report each call under
+    "malloc", "calloc", "realloc", "free", "accept", "fork", "waitpid", "send", "recv", "read", "write", "close",
+    "setsockopt", "getsockopt", "poll", "getpid", "getrusage", "sigaction", "clock_gettime", "exit"
+};
+
+char binDir[1024] = "."; // Directory holding otp_bench, otp_account.so and the daemons
+volatile struct account* counters; // The daemon's counters, shared through the counter file
+
+/*************************************************************************************************************************
+ * Function Declarations
+*************************************************************************************************************************/
+
+pid_t startdaemon(const char*, int, const char*); // To start the daemon with the shim and wait for it to listen
+bool runbench(int, long, int, const char*, bool); // To send a fixed number of requests with otp_bench
+void snapshot(pid_t, struct account*); // To read the counters once every request process has exited
+int helpers(pid_t); // To count the daemon's long lived helper processes
+
+/*************************************************************************************************************************
+ * Main
+*************************************************************************************************************************/
+
+int main(int argc, char *argv[]) {
+
+    int opt, port = 57393, conns = 1, fd, i, over = 0;
+    long requests = 200, warmup = 50;
+    double maxAllocs = -1, maxBytes = -1, maxSyscalls = -1, perCall[ACC_CALLS], allocs = 0, syscalls = 0, bytes;
+    bool dec = false, json = false;
+    const char* sizes = "1000";
+    char daemon[1100], counterFile[] = "/tmp/otp_account.XXXXXX";
+    struct account before, after;
+    pid_t pid;
+
+    static struct option longopts[] = {
+        { "dec", no_argument, NULL, 'd' }, { "requests", required_argument, NULL, 'n' },
+        { "warmup", required_argument, NULL, 'w' }, { "connections", required_argument, NULL, 'c' },
+        { "sizes", required_argument, NULL, 's' }, { "port", required_argument, NULL, 'p' },
+        { "max-allocs", required_argument, NULL, 'A' }, { "max-alloc-bytes", required_argument, NULL, 'B' },
+        { "max-syscalls", required_argument, NULL, 'S' }, { "json", no_argument, NULL, 'j' }, { NULL, 0, NULL, 0 }
+    };
+
+    // Check usage & args
+    while ((opt = getopt_long(argc, argv, "dn:w:c:s:p:A:B:S:j", longopts, NULL)) != -1) {
+        if (opt == 'd') { dec = true; }
+        else if (opt == 'n') { requests = atol(optarg); }
+        else if (opt == 'w') { warmup = atol(optarg); }
+        else if (opt == 'c') { conns = atoi(optarg); }
+        else if (opt == 's') { sizes = optarg; }
+        else if (opt == 'p') { port = atoi(optarg); }
+        else if (opt == 'A') { maxAllocs = atof(optarg); }
+        else if (opt == 'B') { maxBytes = atof(optarg); }
+        else if (opt == 'S') { maxSyscalls = atof(optarg); }
+        else if (opt == 'j') { json = true; }
+        else { argc = 0; }
+    }
+    if (argc == 0 || argc - optind > 1 || requests < 1 || warmup < 0 || conns < 1 || port < 1 || port > 65535) {
+        fprintf(stderr, "USAGE: %s [--dec] [--requests N] [--warmup N] [--connections N] [--sizes SIZE:WEIGHT,...]\n"
+                        "       [--port PORT] [--max-allocs N] [--max-alloc-bytes N] [--max-syscalls N] [--json] [DAEMON]\n",
+                argv[0]);
+        exit(2);
+    }
+    if (strrchr(argv[0], '/') != NULL) { // Find the other programs next to this one
+        snprintf(binDir, sizeof(binDir), "%.*s", (int)(strrchr(argv[0], '/') - argv[0]), argv[0]);
+    }
+    if (optind < argc) { snprintf(daemon, sizeof(daemon), "%s", argv[optind]); }
+    else { snprintf(daemon, sizeof(daemon), "%s/%s", binDir, dec ? "otp_dec_d" : "otp_enc_d"); }
+
+    // Start the daemon counting into a fresh counter file, and map the file to read them
+    if ((fd = mkstemp(counterFile)) < 0 || ftruncate(fd, sizeof(struct account)) < 0) {
+        fprintf(stderr, "otp_account: ERROR, creating counter file\n"); exit(2);
+    }
+    if ((pid = startdaemon(daemon, port, counterFile)) < 0) {
+        fprintf(stderr, "otp_account: ERROR, could not start \'%s\' with the accounting shim\n", daemon);
+        unlink(counterFile); exit(2);
+    }
+    counters = mmap(NULL, sizeof(struct account), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    unlink(counterFile);
+    if (counters == MAP_FAILED || counters->magic != ACCOUNT_MAGIC) {
+        fprintf(stderr, "otp_account: ERROR, the daemon isn't counting (was otp_account.so built?)\n");
+        kill(pid, SIGTERM); exit(2);
+    }
+
+    // Warm up, then count the measured run alone
+    if (warmup > 0 && !runbench(port, warmup, conns, sizes, dec)) {
+        fprintf(stderr, "otp_account: ERROR, otp_bench failed\n"); kill(pid, SIGTERM); exit(2);
+    }
+    snapshot(pid, &before);
+    if (!runbench(port, requests, conns, sizes, dec)) {
+        fprintf(stderr, "otp_account: ERROR, otp_bench failed\n"); kill(pid, SIGTERM); exit(2);
+    }
+    snapshot(pid, &after);
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+
+    // Work out the steady state per request and check it against the budgets
+    for (i = 0; i < ACC_CALLS; i++) {
+        perCall[i] = (double)(after.calls[i] - before.calls[i]) / requests;
+        if (i < ACC_FIRST_SYSCALL && i != ACC_FREE) { allocs += perCall[i]; }
+        else if (i >= ACC_FIRST_SYSCALL) { syscalls += perCall[i]; }
+    }
+    bytes = (double)(after.allocBytes - before.allocBytes) / requests;
+    if (maxAllocs >= 0 && allocs > maxAllocs) { over++; }
+    if (maxBytes >= 0 && bytes > maxBytes) { over++; }
+    if (maxSyscalls >= 0 && syscalls > maxSyscalls) { over++; }
+
+    // Report
+    if (json) {
+        printf("{ \"daemon\": \"%s\", \"requests\": %ld, \"allocs_per_request\": %.3f, \"alloc_bytes_per_request\": %.1f, "
+               "\"syscalls_per_request\": %.3f, \"per_request\": { ", daemon, requests, allocs, bytes, syscalls);
+        for (i = 0; i < ACC_CALLS; i++) { printf("\"%s\": %.3f%s", accountNames[i], perCall[i], i < ACC_CALLS - 1 ? ", " : ""); }
+        printf(" }, \"over_budget\": %d }\n", over);
+    }
+    else {
+        printf("%s: %ld requests (after %ld warm up)\n", daemon, requests, warmup);
+        printf("per request: %.3f allocations (%.1f bytes), %.3f syscalls\n", allocs, bytes, syscalls);
+        for (i = 0; i < ACC_CALLS; i++) { printf("  %-14s %10.3f\n", accountNames[i], perCall[i]); }
+        if (maxAllocs >= 0) { printf("allocations %s budget of %g\n", allocs > maxAllocs ? "OVER" : "within", maxAllocs); }
+        if (maxBytes >= 0) { printf("allocated bytes %s budget of %g\n", bytes > maxBytes ? "OVER" : "within", maxBytes); }
+        if (maxSyscalls >= 0) {
+            printf("syscalls %s budget of %g\n", syscalls > maxSyscalls ? "OVER" : "within", maxSyscalls);
+        }
+    }
+    return over > 0 ? 1 : 0;
+}
+
+/*************************************************************************************************************************
+ * Function Definitions
+*************************************************************************************************************************/
+
+/*
+ * Start a daemon in the background with the accounting shim preloaded, and wait until it accepts connections
+ * const char* daemon: path to the daemon
+ * int port: the port for it to listen on
+ * const char* counterFile: the file for the shim to count into
+ * Returns the daemon's pid, or -1 if it didn't come up
+*/
+pid_t startdaemon(const char* daemon, int port, const char* counterFile) {
+
+    char shim[2100], portStr[16];
+    struct sockaddr_in addr;
+    pid_t pid;
+    int i, fd, null;
+
+    snprintf(shim, sizeof(shim), "%s/otp_account.so", binDir);
+    if (access(shim, R_OK) < 0) { return -1; }
+    if (shim[0] != '/') { // The dynamic linker needs a path it can find from the daemon's directory too
+        char cwd[1024];
+        if (getcwd(cwd, sizeof(cwd)) == NULL) { return -1; }
+        if (snprintf(shim, sizeof(shim), "%s/%s/otp_account.so", cwd, binDir) >= (int)sizeof(shim)) { return -1; }
+    }
+    snprintf(portStr, sizeof(portStr), "%d", port);
+    if ((pid = fork()) < 0) { return -1; }
+    if (pid == 0) { // Daemon process, with its output out of the way of the report
+        if ((null = open("/dev/null", O_WRONLY)) >= 0) { dup2(null, 1); dup2(null, 2); }
+        setenv("OTP_ACCOUNT_FILE", counterFile, 1);
+        setenv("LD_PRELOAD", shim, 1);
+        execl(daemon, daemon, portStr, (char*)NULL);
+        _exit(127);
+    }
+
+    memset((char*)&addr, '\0', sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for (i = 0; i < 50; i++) { // Give it up to 5 seconds
+        usleep(100000);
+        if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) { break; }
+        if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0) { close(fd); return pid; }
+        close(fd);
+        if (waitpid(pid, NULL, WNOHANG) == pid) { return -1; } // It died (port in use?)
+    }
+    kill(pid, SIGTERM);
+    return -1;
+}
+
+/*
+ * Send a fixed number of requests with otp_bench
+ * int port: the daemon's port
+ * long requests: the number of requests to send
+ * int conns: the number of concurrent connections
+ * const char* sizes: the otp_bench message size mix
+ * bool dec: whether the daemon is otp_dec_d
+ * Returns true if every request succeeded
+*/
+bool runbench(int port, long requests, int conns, const char* sizes, bool dec) {
+
+    char cmd[2048];
+
+    snprintf(cmd, sizeof(cmd), "\'%s/otp_bench\' %s--connections %d --requests %ld --duration 3600 --sizes \'%s\' %d "
+             ">/dev/null", binDir, dec ? "--dec " : "", conns, requests, sizes, port);
+    return system(cmd) == 0;
+}
+
+/*
+ * Read the counters once every request process the daemon forked has exited (or a few seconds have passed)
+ * pid_t daemon: the daemon
+ * struct account* snap: where to copy the counters
+*/
+void snapshot(pid_t daemon, struct account* snap) {
+
+    int i;
+
+    for (i = 0; i < SETTLE_TRIES && counters->exits + helpers(daemon) < counters->calls[ACC_FORK]; i++) {
+        usleep(10000);
+    }
+    memcpy(snap, (const void*)counters, sizeof(*snap));
+}
+
+/*
+ * Count the daemon's children that are long lived helpers rather than request processes: request processes keep the
+ *    daemon's name, and the helpers give themselves their own (see otp_log.h and otp_metrics.h)
+ * pid_t daemon: the daemon
+ * Returns the number of helpers
+*/
+int helpers(pid_t daemon) {
+
+    static char list[65536];
+    char path[64], name[32], own[32] = "";
+    char *p, *end;
+    int n, count = 0;
+    pid_t pid;
+    FILE* fd;
+
+    snprintf(path, sizeof(path), "/proc/%d/comm", (int)daemon);
+    if ((fd = fopen(path, "r")) == NULL) { return 0; }
+    if (fgets(own, sizeof(own), fd) == NULL) { own[0] = '\0'; }
+    fclose(fd);
+
+    snprintf(path, sizeof(path), "/proc/%d/task/%d/children", (int)daemon, (int)daemon);
+    if ((fd = fopen(path, "r")) == NULL) { return 0; }
+    n = fread(list, 1, sizeof(list) - 1, fd);
+    fclose(fd);
+    list[n > 0 ? n : 0] = '\0';
+    for (p = list; (pid = strtol(p, &end, 10)) > 0; p = end) {
+        snprintf(path, sizeof(path), "/proc/%d/comm", (int)pid);
+        if ((fd = fopen(path, "r")) == NULL) { continue; } // It exited since the list was read
+        if (fgets(name, sizeof(name), fd) != NULL && strcmp(name, own) != 0) { count++; }
+        fclose(fd);
+    }
+    return count;
+}
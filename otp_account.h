@@ -0,0 +1,38 @@
+/*************************************************************************************************************************
+ *
+ * NAME
+ *    otp_account.h
+ * SYNOPSIS
+ *    Layout of the allocation and syscall counters shared by otp_account.so and the otp_account driver.
+ * DESCRIPTION
+ *    otp_account.so (built from otp_account_preload.c) is preloaded into a daemon with LD_PRELOAD and maps the file
+ *       named by OTP_ACCOUNT_FILE as one struct account, shared with every process the daemon forks. Each wrapped
+ *       call adds to its counter atomically, so the driver can map the same file and read the totals across the
+ *       daemon and all of its request processes at any time.
+ * AUTHOR
+ *    Written by Andrew Swaim
+ *
+*************************************************************************************************************************/
+
+#ifndef OTP_ACCOUNT_H
+#define OTP_ACCOUNT_H
+
+#define ACCOUNT_MAGIC 0x6f74706163637431LL // Marks a counter file that's been set up ("otpacct1")
+
+enum { // Wrapped calls
+    ACC_MALLOC, ACC_CALLOC, ACC_REALLOC, ACC_FREE, // Allocator calls
+    ACC_ACCEPT, ACC_FORK, ACC_WAITPID, ACC_SEND, ACC_RECV, ACC_READ, ACC_WRITE, ACC_CLOSE, ACC_SETSOCKOPT, // Syscalls
+    ACC_GETSOCKOPT, ACC_POLL, ACC_GETPID, ACC_GETRUSAGE, ACC_SIGACTION, ACC_CLOCK, ACC_EXIT,
+    ACC_CALLS
+};
+
+#define ACC_FIRST_SYSCALL ACC_ACCEPT // Calls from here on are syscalls
+
+struct account {
+    long long magic;
+    long long calls[ACC_CALLS]; // Number of calls to each wrapped function
+    long long allocBytes; // Bytes asked for by malloc, calloc and realloc
+    long long exits; // Number of processes that have exited normally
+};
+
+#endif
@@ -0,0 +1,259 @@
+/*************************************************************************************************************************
+ *
+ * NAME
+ *    otp_account_preload.c
+ * SYNOPSIS
+ *    LD_PRELOAD shim that counts allocations and syscalls in a daemon and every process it forks.
+ * DESCRIPTION
+ *    Wraps the allocator (malloc, calloc, realloc, free) and the syscalls the request path makes (accept, fork,
+ *       waitpid, send, recv, read, write, close, setsockopt, getsockopt, poll, getpid, getrusage, sigaction and
+ *       signal, clock_gettime and _exit), counting each call in a file backed shared mapping (see otp_account.h)
+ *       before passing it on to the real function. The mapping is made when the shim loads, so the daemon's request
+ *       processes inherit it and all their counts land in the same place.
+ *    A process that returns from main() or calls exit() is counted as one exit (its exit_group) when it runs the
+ *       shim's destructor. clock_gettime() is only counted for CPU time clocks, since the vDSO answers the others
+ *       without entering the kernel.
+ *    Only calls that go through the dynamic linker are seen: syscalls glibc makes internally (e.g. the write() behind
+ *       printf) aren't counted.
+ * INSTRUCTIONS
+ *    Built as otp_account.so by the compileall script, and normally used through the otp_account driver:
+ *       OTP_ACCOUNT_FILE=/tmp/counts LD_PRELOAD=./otp_account.so otp_enc_d PORT &
+ *    Without OTP_ACCOUNT_FILE the shim passes every call through without counting.
+ * AUTHOR
+ *    Written by Andrew Swaim
+ *
+*************************************************************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dlfcn.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "otp_account.h"
+
+#define BOOT_LEN 4096 // Bytes handed out while dlsym() itself allocates, before the real calloc() is known
+
+/*************************************************************************************************************************
+ * Globals
+*************************************************************************************************************************/
+
+static struct account* counters = NULL; // Shared counters, or NULL when not counting
+static char bootBuf[BOOT_LEN];
+static size_t bootUsed = 0; // Bytes of bootBuf handed out
+static int resolving = 0; // Set while looking up the real functions
+
+static void* (*realmalloc)(size_t);
+static void* (*realcalloc)(size_t, size_t);
+static void* (*realrealloc)(void*, size_t);
+static void (*realfree)(void*);
+static int (*realaccept)(int, struct sockaddr*, socklen_t*);
+static pid_t (*realfork)(void);
+static pid_t (*realwaitpid)(pid_t, int*, int);
+static ssize_t (*realsend)(int, const void*, size_t, int);
+static ssize_t (*realrecv)(int, void*, size_t, int);
+static ssize_t (*realread)(int, void*, size_t);
+static ssize_t (*realwrite)(int, const void*, size_t);
+static int (*realclose)(int);
+static int (*realsetsockopt)(int, int, int, const void*, socklen_t);
+static int (*realgetsockopt)(int, int, int, void*, socklen_t*);
+static int (*realpoll)(struct pollfd*, nfds_t, int);
+static pid_t (*realgetpid)(void);
+static int (*realgetrusage)(__rusage_who_t, struct rusage*);
+static int (*realsigaction)(int, const struct sigaction*, struct sigaction*);
+static sighandler_t (*realsignal)(int, sighandler_t);
+static int (*realclockgettime)(clockid_t, struct timespec*);
+static void (*realexit)(int) __attribute__((noreturn));
+
+/*************************************************************************************************************************
+ * Set Up
+*************************************************************************************************************************/
+
+/*
+ * Look up the real version of every wrapped function
+*/
+static void resolve(void) {
+
+    resolving = 1;
+    realmalloc = dlsym(RTLD_NEXT, "malloc");
+    realcalloc = dlsym(RTLD_NEXT, "calloc");
+    realrealloc = dlsym(RTLD_NEXT, "realloc");
+    realfree = dlsym(RTLD_NEXT, "free");
+    realaccept = dlsym(RTLD_NEXT, "accept");
+    realfork = dlsym(RTLD_NEXT, "fork");
+    realwaitpid = dlsym(RTLD_NEXT, "waitpid");
+    realsend = dlsym(RTLD_NEXT, "send");
+    realrecv = dlsym(RTLD_NEXT, "recv");
+    realread = dlsym(RTLD_NEXT, "read");
+    realwrite = dlsym(RTLD_NEXT, "write");
+    realclose = dlsym(RTLD_NEXT, "close");
+    realsetsockopt = dlsym(RTLD_NEXT, "setsockopt");
+    realgetsockopt = dlsym(RTLD_NEXT, "getsockopt");
+    realpoll = dlsym(RTLD_NEXT, "poll");
+    realgetpid = dlsym(RTLD_NEXT, "getpid");
+    realgetrusage = dlsym(RTLD_NEXT, "getrusage");
+    realsigaction = dlsym(RTLD_NEXT, "sigaction");
+    realsignal = dlsym(RTLD_NEXT, "signal");
+    realclockgettime = dlsym(RTLD_NEXT, "clock_gettime");
+    realexit = dlsym(RTLD_NEXT, "_exit");
+    resolving = 0;
+}
+
+/*
+ * Map the counter file when the shim is loaded, before the daemon starts
+*/
+__attribute__((constructor)) static void accountinit(void) {
+
+    const char* path = getenv("OTP_ACCOUNT_FILE");
+    int fd;
+
+    if (realmalloc == NULL) { resolve(); }
+    if (path == NULL || (fd = open(path, O_RDWR | O_CREAT, 0600)) < 0) { return; }
+    if (ftruncate(fd, sizeof(struct account)) == 0) {
+        counters = mmap(NULL, sizeof(struct account), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (counters == MAP_FAILED) { counters = NULL; }
+        else { memset(counters, 0, sizeof(*counters)); counters->magic = ACCOUNT_MAGIC; }
+    }
+    realclose(fd);
+}
+
+/*
+ * Count the exit of each process that exits normally, so the driver can tell when request processes are done
+*/
+__attribute__((destructor)) static void accountexit(void) {
+
+    if (counters != NULL) {
+        __atomic_fetch_add(&counters->calls[ACC_EXIT], 1, __ATOMIC_RELAXED); // exit() ends in exit_group like _exit()
+        __atomic_fetch_add(&counters->exits, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Hand out static memory while dlsym() allocates during resolve(), before the real allocator is known
+ * size_t n: the number of bytes wanted
+ * Returns the memory, or NULL if the static buffer is used up
+*/
+static void* bootalloc(size_t n) {
+
+    void* p = bootBuf + bootUsed;
+
+    bootUsed += (n + 15) & ~(size_t)15;
+    return bootUsed <= BOOT_LEN ? p : NULL;
+}
+
+/*
+ * Count a call
+ * int call: the call (ACC_MALLOC, ACC_SEND, ...)
+*/
+static inline void count(int call) {
+
+    if (counters != NULL) { __atomic_fetch_add(&counters->calls[call], 1, __ATOMIC_RELAXED); }
+}
+
+/*************************************************************************************************************************
+ * Wrappers
+*************************************************************************************************************************/
+
+void* malloc(size_t n) {
+
+    if (resolving) { return bootalloc(n); }
+    if (realmalloc == NULL) { resolve(); }
+    count(ACC_MALLOC);
+    if (counters != NULL) { __atomic_fetch_add(&counters->allocBytes, (long long)n, __ATOMIC_RELAXED); }
+    return realmalloc(n);
+}
+
+void* calloc(size_t n, size_t size) {
+
+    void* p;
+
+    if (resolving) { return (p = bootalloc(n * size)) != NULL ? memset(p, 0, n * size) : NULL; }
+    if (realcalloc == NULL) { resolve(); }
+    count(ACC_CALLOC);
+    if (counters != NULL) { __atomic_fetch_add(&counters->allocBytes, (long long)(n * size), __ATOMIC_RELAXED); }
+    return realcalloc(n, size);
+}
+
+void* realloc(void* p, size_t n) {
+
+    void* q;
+    size_t held;
+
+    if ((char*)p >= bootBuf && (char*)p < bootBuf + BOOT_LEN) { // Static memory: move it, never hand it to glibc
+        held = bootBuf + BOOT_LEN - (char*)p; // The block's size isn't kept, but it can't run past the buffer
+        if ((q = resolving ? bootalloc(n) : malloc(n)) != NULL) { memcpy(q, p, n < held ? n : held); }
+        return q;
+    }
+    if (resolving) { return bootalloc(n); }
+    if (realrealloc == NULL) { resolve(); }
+    count(ACC_REALLOC);
+    if (counters != NULL) { __atomic_fetch_add(&counters->allocBytes, (long long)n, __ATOMIC_RELAXED); }
+    return realrealloc(p, n);
+}
+
+void free(void* p) {
+
+    if ((char*)p >= bootBuf && (char*)p < bootBuf + BOOT_LEN) { return; } // Static memory from bootalloc()
+    if (realfree == NULL) { resolve(); }
+    if (p != NULL) { count(ACC_FREE); }
+    realfree(p);
+}
+
+int accept(int fd, struct sockaddr* addr, socklen_t* len) { count(ACC_ACCEPT); return realaccept(fd, addr, len); }
+
+pid_t fork(void) { count(ACC_FORK); return realfork(); }
+
+pid_t waitpid(pid_t pid, int* status, int options) { count(ACC_WAITPID); return realwaitpid(pid, status, options); }
+
+ssize_t send(int fd, const void* buf, size_t len, int flags) { count(ACC_SEND); return realsend(fd, buf, len, flags); }
+
+ssize_t recv(int fd, void* buf, size_t len, int flags) { count(ACC_RECV); return realrecv(fd, buf, len, flags); }
+
+ssize_t read(int fd, void* buf, size_t len) { count(ACC_READ); return realread(fd, buf, len); }
+
+ssize_t write(int fd, const void* buf, size_t len) { count(ACC_WRITE); return realwrite(fd, buf, len); }
+
+int close(int fd) { count(ACC_CLOSE); return realclose(fd); }
+
+int setsockopt(int fd, int level, int name, const void* val, socklen_t len) {
+
+    count(ACC_SETSOCKOPT);
+    return realsetsockopt(fd, level, name, val, len);
+}
+
+int getsockopt(int fd, int level, int name, void* val, socklen_t* len) {
+
+    count(ACC_GETSOCKOPT);
+    return realgetsockopt(fd, level, name, val, len);
+}
+
+int poll(struct pollfd* fds, nfds_t n, int timeout) { count(ACC_POLL); return realpoll(fds, n, timeout); }
+
+pid_t getpid(void) { count(ACC_GETPID); return realgetpid(); }
+
+int getrusage(__rusage_who_t who, struct rusage* usage) { count(ACC_GETRUSAGE); return realgetrusage(who, usage); }
+
+int sigaction(int sig, const struct sigaction* act, struct sigaction* old) {
+
+    count(ACC_SIGACTION);
+    return realsigaction(sig, act, old);
+}
+
+sighandler_t signal(int sig, sighandler_t handler) { count(ACC_SIGACTION); return realsignal(sig, handler); } // One too
+
+int clock_gettime(clockid_t id, struct timespec* ts) {
+
+    if (id == CLOCK_PROCESS_CPUTIME_ID || id == CLOCK_THREAD_CPUTIME_ID || id < 0) { count(ACC_CLOCK); } // Not vDSO
+    return realclockgettime(id, ts);
+}
+
+void _exit(int status) { count(ACC_EXIT); realexit(status); }
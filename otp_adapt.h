@@ -0,0 +1,173 @@
+/*************************************************************************************************************************
+ *
+ * NAME
+ *    otp_adapt.h
+ * SYNOPSIS
+ *    Adaptive per message size socket buffer classes and first allocations for the daemons, retuned from the request
+ *       sizes they see.
+ * DESCRIPTION
+ *    When a daemon is started with --adapt, each request process adds its text length to a histogram of power of 2
+ *       size bins in an anonymous shared mapping, once the length header arrives. Every ADAPT_EVERY connections the
+ *       daemon rebuilds the size classes otp_tune.h applies from the histogram, in place of a --tune file:
+ *       - class boundaries fall where the histogram does, each class closing once it holds about 1/ADAPT_CLASSES of
+ *         the requests, so a skewed workload gets narrow classes where most of its requests are and few elsewhere
+ *       - each class's send and receive buffers are sized for the largest message in it, at least ADAPT_MIN_BUF,
+ *         instead of the kernel's defaults. A class that would need more than ADAPT_MAX_BUF, or more than the
+ *         kernel lets a socket ask for (net.core.rmem_max and wmem_max), keeps the defaults instead: setting a buffer
+ *         turns off TCP's autotuning for that socket, which can grow it further (up to tcp_rmem and tcp_wmem's max)
+ *       - a last class for anything larger than what's been seen leaves the kernel's defaults alone, so a rare big
+ *         message isn't held back by buffers sized for the usual ones
+ *    The histogram is halved at each rebuild, rounding down, so it follows the workload as it shifts and a bin that
+ *       sees nothing new empties instead of holding one old outlier's class in place forever. Request processes are
+ *       forked after a rebuild and inherit the classes with the rest of the daemon's memory, so only the histogram is
+ *       shared.
+ *    The daemons receive each text and key into a heap buffer that starts at adaptinitial() characters and doubles
+ *       (up to the length header) only as characters actually arrive, so a header can't make a request process commit
+ *       memory for text that never comes. A message within the classes seen so far gets its whole buffer up front,
+ *       with no reallocation. One larger than any seen starts at the largest seen, or ADAPT_FIRST_BUF if that's more
+ *       (or there are no classes yet), and grows from there. The daemons' --max-len bounds it all, rejecting longer
+ *       headers with BADL.
+ *    The chunk size of every class is the daemon's default (see otp_calibrate.h).
+ * AUTHOR
+ *    Written by Andrew Swaim
+ *
+*************************************************************************************************************************/
+
+#ifndef OTP_ADAPT_H
+#define OTP_ADAPT_H
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+
+#include "otp_tune.h"
+
+#define ADAPT_BINS 31 // Size bins: up to 1, 2, 4, ... 1G characters
+#define ADAPT_CLASSES 8 // Classes to split the requests seen into, plus one for anything larger
+#define ADAPT_EVERY 256 // Connections between rebuilds
+#define ADAPT_MIN_BUF 4096 // Smallest socket buffer to ask for
+#define ADAPT_MAX_BUF (4 << 20) // Largest socket buffer to ask for, larger classes are left to autotuning
+#define ADAPT_FIRST_BUF (1 << 20) // Allocated up front for messages up to this long, even if none that long were seen
+
+static long long* adaptBins = NULL; // Shared histogram of text lengths, or NULL when adapting is off
+static long long adaptAccepted = 0; // Connections since the last rebuild, only counted by the daemon
+static long adaptMaxBuf = ADAPT_MAX_BUF; // Largest buffer to ask for, lowered to what the kernel allows
+static long adaptLargest = 0; // Upper bound of the largest size bin seen at the last rebuild, 0 before one
+
+/*
+ * Map the shared histogram, before the daemon forks any request process, and find the largest buffer the kernel
+ *    lets a socket ask for
+ * Returns 0, or -1 if it couldn't be mapped
+*/
+static int adaptopen(void) {
+
+    const char* limits[] = { "/proc/sys/net/core/rmem_max", "/proc/sys/net/core/wmem_max" };
+    FILE* fd;
+    long max;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        if ((fd = fopen(limits[i], "r")) == NULL) { continue; }
+        if (fscanf(fd, "%ld", &max) == 1 && max > 0 && max < adaptMaxBuf) { adaptMaxBuf = max; }
+        fclose(fd);
+    }
+    adaptBins = mmap(NULL, ADAPT_BINS * sizeof(long long), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (adaptBins == MAP_FAILED) { adaptBins = NULL; return -1; }
+    return 0;
+}
+
+/*
+ * Add a message's text length to the histogram, in the request process once the length is known
+ * long len: the text length
+*/
+static void adaptrecord(long len) {
+
+    int i;
+
+    if (adaptBins == NULL || len < 1) { return; }
+    for (i = 0; i < ADAPT_BINS - 1 && len > (1L << i); i++) { }
+    __atomic_fetch_add(&adaptBins[i], 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Rebuild the size classes from the histogram and halve it
+ * Returns the number of classes, or 0 if no requests have been seen yet (the classes are left as they were)
+*/
+static int adaptrebuild(void) {
+
+    long long counts[ADAPT_BINS], total = 0, seen = 0, held = 0;
+    long buf;
+    int i, n = 0;
+
+    for (i = 0; i < ADAPT_BINS; i++) {
+        counts[i] = __atomic_load_n(&adaptBins[i], __ATOMIC_RELAXED);
+        __atomic_fetch_sub(&adaptBins[i], (counts[i] + 1) / 2, __ATOMIC_RELAXED); // Decay, keeping what arrived since
+        total += counts[i];
+    }
+    if (total == 0) { return 0; }
+
+    for (i = 0; i < ADAPT_BINS; i++) { if (counts[i] > 0) { adaptLargest = 1L << i; } }
+    for (i = 0; i < ADAPT_BINS && seen < total && n < TUNE_CLASSES - 1; i++) {
+        seen += counts[i];
+        held += counts[i];
+        if (counts[i] == 0 || (held * ADAPT_CLASSES < total && seen < total)) { continue; } // Keep filling the class
+        buf = (1L << i) + 1024; // The message plus room for its length header
+        if (buf < ADAPT_MIN_BUF) { buf = ADAPT_MIN_BUF; }
+        if (buf > adaptMaxBuf) { buf = 0; } // Too big to set without capping it, so leave it to autotuning
+        tuneClasses[n].maxSize = 1L << i;
+        tuneClasses[n].chunk = tuneChunk;
+        tuneClasses[n].sndbuf = tuneClasses[n].rcvbuf = (int)buf;
+        n++;
+        held = 0;
+    }
+    if (tuneClasses[n - 1].maxSize < (1L << (ADAPT_BINS - 1))) { // Anything larger keeps the kernel's defaults
+        tuneClasses[n].maxSize = 1L << (ADAPT_BINS - 1);
+        tuneClasses[n].chunk = tuneChunk;
+        tuneClasses[n].sndbuf = tuneClasses[n].rcvbuf = 0;
+        n++;
+    }
+    tuneCount = n;
+    return n;
+}
+
+/*
+ * Get how much of a message's buffer to allocate before any of it arrives
+ * long len: the length from the message's header
+ * Returns len if it's within the largest size class seen (or ADAPT_FIRST_BUF), otherwise that
+*/
+static long adaptinitial(long len) {
+
+    long first = adaptLargest > ADAPT_FIRST_BUF ? adaptLargest : ADAPT_FIRST_BUF;
+
+    return len < first ? len : first;
+}
+
+/*
+ * Count an accepted connection, in the daemon, and rebuild the classes every ADAPT_EVERY of them
+ * Returns the number of classes if they were rebuilt, otherwise 0
+*/
+static int adaptaccept(void) {
+
+    if (adaptBins == NULL || ++adaptAccepted < ADAPT_EVERY) { return 0; }
+    adaptAccepted = 0;
+    return adaptrebuild();
+}
+
+/*
+ * Describe the current classes, for the log
+ * char* buf: where to put the description
+ * int len: the size of buf
+*/
+static void adaptdescribe(char* buf, int len) {
+
+    int i, used = 0;
+
+    buf[0] = '\0';
+    for (i = 0; i < tuneCount && used < len; i++) {
+        used += snprintf(buf + used, len - used, "%s%ld:%d", i > 0 ? " " : "", tuneClasses[i].maxSize,
+                         tuneClasses[i].rcvbuf);
+    }
+}
+
+#endif
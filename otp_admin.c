@@ -0,0 +1,68 @@
+/*************************************************************************************************************************
+ *
+ * NAME
+ *    otp_admin.c
+ * SYNOPSIS
+ *    Sends a command to a daemon's admin socket and prints the reply.
+ * DESCRIPTION
+ *    Connects to the Unix socket a daemon started with --admin PATH listens on (see otp_admin.h), sends the rest of
+ *       the command line as one command, and prints the daemon's reply. Exits with 1 if the daemon answered with an
+ *       error, and 2 if it couldn't be reached.
+ * INSTRUCTIONS
+ *    Use the included compileall script to compile this program as well as the other programs.
+ *    Start a daemon with --admin PATH, then run:
+ *       otp_admin PATH COMMAND [ARG]
+ *    e.g. otp_admin /tmp/otp_enc_d.sock workers 8
+ *    otp_admin PATH help lists the commands.
+ * AUTHOR
+ *    Written by Andrew Swaim
+ *
+*************************************************************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define LINE_LEN 256 // Longest command line the daemons take
+
+/*************************************************************************************************************************
+ * Main
+*************************************************************************************************************************/
+
+int main(int argc, char *argv[]) {
+
+    struct sockaddr_un addr;
+    char line[LINE_LEN], reply[4096];
+    int fd, i, n, len = 0, total = 0;
+
+    // Check usage & args
+    if (argc < 3 || argc > 4) { fprintf(stderr, "USAGE: %s PATH COMMAND [ARG]\n", argv[0]); exit(1); }
+    if (strlen(argv[1]) >= sizeof(addr.sun_path)) { fprintf(stderr, "otp_admin: ERROR, path too long\n"); exit(1); }
+    for (i = 2; i < argc && len < (int)sizeof(line); i++) {
+        len += snprintf(line + len, sizeof(line) - len, "%s%s", argv[i], i + 1 < argc ? " " : "\n");
+    }
+    if (len >= (int)sizeof(line)) { fprintf(stderr, "otp_admin: ERROR, command too long\n"); exit(1); }
+
+    // Connect, send the command and print the reply until the daemon closes the connection
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, argv[1]);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "otp_admin: ERROR, connecting to \'%s\'\n", argv[1]); exit(2);
+    }
+    if (send(fd, line, len, MSG_NOSIGNAL) != len) {
+        fprintf(stderr, "otp_admin: ERROR, sending the command\n"); exit(2);
+    }
+    while (total < (int)sizeof(reply) - 1 && (n = recv(fd, reply + total, sizeof(reply) - 1 - total, 0)) > 0) {
+        total += n;
+    }
+    reply[total] = '\0';
+    close(fd);
+    if (total == 0) { fprintf(stderr, "otp_admin: ERROR, no reply from \'%s\'\n", argv[1]); exit(2); }
+    fputs(reply, strncmp(reply, "error:", 6) == 0 ? stderr : stdout);
+    return strncmp(reply, "error:", 6) == 0 ? 1 : 0;
+}
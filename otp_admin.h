@@ -0,0 +1,412 @@
+/*************************************************************************************************************************
+ *
+ * NAME
+ *    otp_admin.h
+ * SYNOPSIS
+ *    Local admin socket for the daemons, to change their limits and log level and drain them while they run.
+ * DESCRIPTION
+ *    When a daemon is started with --admin PATH, it listens on a Unix socket at PATH as well as its port, and waits
+ *       for either with poll() instead of blocking in accept(). Each admin connection sends one command line and gets
+ *       its reply back, then the daemon closes it (otp_admin sends them from the command line):
+ *       status                   the daemon's limits, connections accepted and active, and totals if --stats is on
+ *       workers N                run at most N request processes at once, 0 for no limit (the default). Connections
+ *                                past the limit wait in the listen queue until a request process finishes
+ *       scale MIN:MAX            scale the worker limit between MIN and MAX from the queue wait and CPU use (see
+ *                                otp_scale.h), or "off" to leave it where it is
+ *       rate N                   accept at most N connections a second, in bursts of up to N, 0 for no limit
+ *       backlog N                resize the listen queue (listen() again on the same socket)
+ *       log LEVEL                log at error, warn, info or debug from now on (SIGHUP then toggles debug from it)
+ *       flight                   dump the flight recorder, as SIGUSR2 does (needs --flight)
+ *       memory                   print the request memory report, as SIGUSR1 does
+ *       drain                    stop listening, so new connections are refused, let the request processes running
+ *                                finish, then exit. Connections already waiting in the listen queue are reset
+ *       help                     list the commands
+ *    Replies are lines of text, starting with "error:" if the command failed. Commands are handled by the daemon
+ *       between connections, so they take effect for the next connection it accepts; a request process already
+ *       running keeps going.
+ *    The socket is created 0600, so only the daemon's user can connect to it. An admin connection's command line is
+ *       read as it arrives from the same poll() as everything else, so a slow or silent admin client never holds up
+ *       accepting; one admin connection is read at a time, and it gets ADMIN_READ_MS to send its line.
+ *    Only the daemon reads the limits, so they're plain variables in it. It counts request processes as it forks and
+ *       reaps them (leaving out the log drain and metrics processes). A SIGCHLD handler writes to a pipe that poll()
+ *       also waits on, so a request process that finishes wakes the daemon to reap it straight away, and a slot freed
+ *       under a workers limit goes to the next waiting connection without delay.
+ *    --scale MIN:MAX starts the daemon scaling without an admin socket; it waits with poll() the same way, so it can
+ *       sample the listen queue and decide the limit on time.
+ * AUTHOR
+ *    Written by Andrew Swaim
+ *
+*************************************************************************************************************************/
+
+#ifndef OTP_ADMIN_H
+#define OTP_ADMIN_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "otp_log.h"
+#include "otp_memstat.h"
+#include "otp_metrics.h"
+#include "otp_stats.h"
+#include "otp_flight.h"
+#include "otp_scale.h"
+
+#define ADMIN_LINE_LEN 256 // Longest command line
+#define ADMIN_REPLY_LEN 4096 // Longest reply
+#define ADMIN_TICK_MS 20 // How often to check again while a limit holds off accepting, if there's no SIGCHLD pipe
+#define ADMIN_READ_MS 1000 // How long an admin connection gets to send its command line
+
+static int adminFD = -1; // The admin socket, or -1 when there isn't one
+static pid_t adminPid = 0; // The daemon, the only process that removes the socket
+static char adminPath[sizeof(((struct sockaddr_un*)0)->sun_path)];
+static int adminWorkers = 0; // Most request processes at once, 0 for no limit
+static int adminRate = 0; // Most connections accepted a second, 0 for no limit
+static int adminBacklog = 0; // The listen queue size
+static int adminDraining = 0; // Whether the daemon is draining
+static long long adminAccepted = 0; // Connections accepted
+static int adminActive = 0; // Request processes running
+static double adminTokens = 0; // Connections the rate limit allows right now
+static double adminRefilled = 0; // When the tokens were last topped up, in seconds
+static int adminChildPipe[2] = { -1, -1 }; // Written to on SIGCHLD, to wake poll() when a request process finishes
+static int adminWatching = 0; // Whether the SIGCHLD pipe has been set up (or tried)
+static int adminConn = -1; // The admin connection whose command line is being read, or -1
+static char adminLine[ADMIN_LINE_LEN]; // What has arrived of its command line
+static int adminLineLen = 0;
+static double adminDeadline = 0; // When to stop waiting for the rest of its line, in seconds
+
+/*
+ * Get a monotonic timestamp in seconds
+*/
+static double adminnow(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Remove the socket when the daemon exits
+*/
+static void admindone(void) {
+
+    if (adminFD >= 0 && getpid() == adminPid) { close(adminFD); unlink(adminPath); }
+}
+
+/*
+ * Listen on the admin socket, once the daemon is listening on its port
+ * const char* path: where to put the socket
+ * int backlog: the backlog the daemon is listening with
+ * Returns 0, or -1 if the socket couldn't be set up
+*/
+static int adminopen(const char* path, int backlog) {
+
+    struct sockaddr_un addr;
+    struct stat st;
+    mode_t mask;
+
+    if (strlen(path) >= sizeof(adminPath)) { errno = ENAMETOOLONG; return -1; }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    strcpy(adminPath, path);
+    if (lstat(path, &st) == 0) { // Replace a socket left behind by a daemon that was killed, but nothing else
+        if (!S_ISSOCK(st.st_mode)) { errno = EEXIST; return -1; }
+        unlink(path);
+    }
+    if ((adminFD = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) { return -1; }
+    mask = umask(0177); // Create it 0600 whatever the daemon's umask, with no window before a chmod() where it isn't
+    if (bind(adminFD, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(adminFD, 5) < 0) {
+        umask(mask); close(adminFD); adminFD = -1; return -1;
+    }
+    umask(mask);
+    fcntl(adminFD, F_SETFL, O_NONBLOCK); // A client that gives up between poll() and accept() can't block the daemon
+    adminPid = getpid();
+    adminBacklog = backlog;
+    atexit(admindone);
+    return 0;
+}
+
+/*
+ * Wake the daemon's poll() when a child process finishes, on SIGCHLD
+*/
+static void adminchildsignal(int sig) {
+
+    int saved = errno;
+
+    (void)sig;
+    if (getpid() == adminPid) { write(adminChildPipe[1], "", 1); } // Not in request processes, which inherit it
+    errno = saved;
+}
+
+/*
+ * Set up the SIGCHLD pipe, the first time the daemon waits with poll()
+*/
+static void adminwatch(void) {
+
+    struct sigaction sa;
+
+    adminWatching = 1;
+    adminPid = getpid();
+    if (pipe(adminChildPipe) < 0) { adminChildPipe[0] = adminChildPipe[1] = -1; return; }
+    fcntl(adminChildPipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(adminChildPipe[1], F_SETFL, O_NONBLOCK); // Never block in the handler, a full pipe wakes poll() anyway
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = adminchildsignal;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP; // accept() carries on; poll() returns anyway, since the pipe is ready
+    sigaction(SIGCHLD, &sa, NULL);
+}
+
+/*
+ * Start scaling the worker limit between bounds, or stop
+ * const char* bounds: MIN:MAX, or "off"
+ * Returns 0, or -1 if the bounds aren't valid
+*/
+static int adminscale(const char* bounds) {
+
+    int min, max;
+
+    if (strcmp(bounds, "off") == 0) { scaleset(0, 0); return 0; }
+    if (sscanf(bounds, "%d:%d", &min, &max) != 2 || min < 1 || max < min) { return -1; }
+    scaleset(min, max);
+    adminWorkers = adminWorkers == 0 || adminWorkers < min ? min : adminWorkers > max ? max : adminWorkers;
+    return 0;
+}
+
+/*
+ * Add up the stats segment's slots into the status reply
+ * char* reply: the reply so far
+ * int len: its length
+ * Returns its new length
+*/
+static int adminstats(char* reply, int len) {
+
+    struct statslot slot;
+    long long requests = 0, failed = 0, bytesIn = 0, bytesOut = 0;
+    int i;
+
+    if (statsSeg == NULL) { return len; }
+    for (i = 0; i < STATS_SLOTS; i++) {
+        if (statsread(&statsSeg->slots[i], &slot) < 0) { continue; }
+        requests += slot.requests; failed += slot.failed; bytesIn += slot.bytesIn; bytesOut += slot.bytesOut;
+    }
+    return len + snprintf(reply + len, ADMIN_REPLY_LEN - len, "requests %lld\nfailed %lld\nbytes_in %lld\n"
+                          "bytes_out %lld\nkilled %lld\n", requests, failed, bytesIn, bytesOut, statsSeg->killed);
+}
+
+/*
+ * Carry out one command
+ * char* line: the command line, which is split up in place
+ * int listeningFD: the daemon's listening socket
+ * char* reply: where to put the reply, ADMIN_REPLY_LEN long
+ * Returns the length of the reply
+*/
+static int admincommand(char* line, int listeningFD, char* reply) {
+
+    char* cmd = strtok(line, " \t\r\n");
+    char* arg = strtok(NULL, " \t\r\n");
+    int n = arg != NULL ? atoi(arg) : -1, level;
+
+#define REPLY(...) snprintf(reply, ADMIN_REPLY_LEN, __VA_ARGS__)
+    if (cmd == NULL || strcmp(cmd, "help") == 0) {
+        return REPLY("status\nworkers N\nscale MIN:MAX|off\nrate N\nbacklog N\nlog error|warn|info|debug\n"
+                     "flight\nmemory\ndrain\n");
+    }
+    if (strcmp(cmd, "status") == 0 || strcmp(cmd, "stats") == 0) {
+        level = logShared != NULL ? __atomic_load_n(&logShared->level, __ATOMIC_RELAXED) : logLevel;
+        return adminstats(reply, REPLY("pid %d\naccepted %lld\nactive %d\nworkers %d\nscale %d:%d\nqueue_wait_ms %.3f\n"
+                                       "cpu %.3f\nrate %d\nbacklog %d\nlog %s\ndraining %s\n", (int)getpid(),
+                                       adminAccepted, adminActive, adminWorkers, scaleMin, scaleMax, scaleWaitMs,
+                                       scaleCpu, adminRate, adminBacklog, logLevelNames[level],
+                                       adminDraining ? "yes" : "no"));
+    }
+    if (strcmp(cmd, "workers") == 0 || strcmp(cmd, "rate") == 0 || strcmp(cmd, "backlog") == 0) {
+        if (arg == NULL || n < 0 || (n == 0 && cmd[0] == 'b')) { return REPLY("error: %s needs a number\n", cmd); }
+        if (cmd[0] == 'w') { adminWorkers = n; }
+        else if (cmd[0] == 'r') { adminRate = n; adminTokens = n; adminRefilled = adminnow(); }
+        else if (listen(listeningFD, n) < 0) { return REPLY("error: listen: %s\n", strerror(errno)); }
+        else {
+            adminBacklog = n;
+            if (statsSeg != NULL) { statsSeg->backlog = n; }
+        }
+        logmsg(LEVEL_INFO, "admin: %s set to %d", cmd, n);
+        return REPLY("ok %s %d\n", cmd, n);
+    }
+    if (strcmp(cmd, "scale") == 0) {
+        if (arg == NULL || adminscale(arg) < 0) {
+            return REPLY("error: scale needs MIN:MAX (1 <= MIN <= MAX) or off\n");
+        }
+        logmsg(LEVEL_INFO, "admin: scale set to %s", arg);
+        return REPLY("ok scale %s, workers %d\n", arg, adminWorkers);
+    }
+    if (strcmp(cmd, "log") == 0) {
+        if (arg == NULL || (level = loglevel(arg)) < 0) {
+            return REPLY("error: log needs error, warn, info or debug\n");
+        }
+        logLevel = level; // What SIGHUP toggles back to
+        if (logShared != NULL) { __atomic_store_n(&logShared->level, level, __ATOMIC_RELAXED); }
+        return REPLY("ok log %s\n", arg);
+    }
+    if (strcmp(cmd, "flight") == 0) {
+        if (flight == NULL) { return REPLY("error: the flight recorder is off (start with --flight FILE)\n"); }
+        flightDump = 1;
+        return REPLY("ok dumping to %s\n", flightPath);
+    }
+    if (strcmp(cmd, "memory") == 0) {
+        memReport = 1;
+        return REPLY("ok printing the memory report\n");
+    }
+    if (strcmp(cmd, "drain") == 0) {
+        if (!adminDraining) {
+            adminDraining = 1;
+            shutdown(listeningFD, SHUT_RDWR); // Stops listening in every process that shares the socket
+            logmsg(LEVEL_INFO, "admin: draining %d active requests", adminActive);
+        }
+        return REPLY("ok draining %d active\n", adminActive);
+    }
+    return REPLY("error: unknown command '%s' (try help)\n", cmd);
+#undef REPLY
+}
+
+/*
+ * Accept an admin connection, to read its command line as it arrives
+*/
+static void adminconnect(void) {
+
+    if ((adminConn = accept(adminFD, NULL, NULL)) < 0) { return; }
+    fcntl(adminConn, F_SETFL, O_NONBLOCK);
+    adminLineLen = 0;
+    adminDeadline = adminnow() + ADMIN_READ_MS / 1000.0;
+}
+
+/*
+ * Read what has arrived of the admin connection's command line, and answer it once it's whole
+ * The line is whole at a newline, when the client stops sending, when it fills the buffer or when time is up
+ * int listeningFD: the daemon's listening socket
+*/
+static void adminread(int listeningFD) {
+
+    char reply[ADMIN_REPLY_LEN];
+    int n, len;
+
+    n = recv(adminConn, adminLine + adminLineLen, sizeof(adminLine) - 1 - adminLineLen, 0);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) && adminnow() < adminDeadline) { return; }
+    if (n > 0) {
+        adminLineLen += n;
+        if (memchr(adminLine, '\n', adminLineLen) == NULL && adminLineLen < (int)sizeof(adminLine) - 1
+            && adminnow() < adminDeadline) {
+            return;
+        }
+    }
+    adminLine[adminLineLen] = '\0';
+    len = admincommand(adminLine, listeningFD, reply);
+    if (len >= ADMIN_REPLY_LEN) { len = ADMIN_REPLY_LEN - 1; }
+    send(adminConn, reply, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+    shutdown(adminConn, SHUT_RDWR); // Request processes forked meanwhile hold copies, so end it for the client now
+    close(adminConn);
+    adminConn = -1;
+}
+
+/*
+ * Wait until the daemon should accept a connection, answering admin connections meanwhile
+ * int listeningFD: the daemon's listening socket
+ * Returns 1 when a connection is waiting to be accepted, 0 to go round the daemon's loop again (to reap finished
+ *    request processes and check its signals), or -1 once the daemon has drained and should exit
+*/
+static int adminwait(int listeningFD) {
+
+    struct pollfd fds[4];
+    struct tcp_info info;
+    socklen_t infoLen = sizeof(info);
+    int accepting = 1, timeout = -1, wait, ready;
+    char drain[64];
+    double now;
+
+    if (adminFD < 0 && scaleMax == 0) { return 1; } // No admin socket or scaling, so no limits: block in accept()
+    if (!adminWatching) { adminwatch(); }
+    if (scaleMax > 0) { // Sample the queue for the autoscaler, and let it decide the limit if an interval has passed
+        memset(&info, 0, sizeof(info));
+        getsockopt(listeningFD, IPPROTO_TCP, TCP_INFO, &info, &infoLen); // For a listening socket: the accept queue
+        scalesample((int)info.tcpi_unacked, adminActive);
+        adminWorkers = scaletick(adminWorkers);
+    }
+    if (adminDraining) {
+        if (adminActive == 0) { logmsg(LEVEL_INFO, "admin: drained, exiting"); return -1; }
+        accepting = 0;
+    }
+    else if (adminWorkers > 0 && adminActive >= adminWorkers) { accepting = 0; }
+    else if (adminRate > 0) {
+        now = adminnow();
+        adminTokens += (now - adminRefilled) * adminRate;
+        if (adminTokens > adminRate) { adminTokens = adminRate; }
+        adminRefilled = now;
+        if (adminTokens < 1) { accepting = 0; timeout = (int)((1 - adminTokens) * 1000 / adminRate) + 1; }
+    }
+    if (!accepting && timeout < 0 && adminChildPipe[0] < 0) { timeout = ADMIN_TICK_MS; } // No SIGCHLD to wake it
+    if (scaleMax > 0 && (timeout < 0 || scaletimeout() < timeout)) { timeout = scaletimeout(); }
+    if (adminConn >= 0) { // Wake in time to answer an admin connection that stops short of a whole line
+        wait = (int)((adminDeadline - adminnow()) * 1000) + 1;
+        if (wait < 0) { wait = 0; }
+        if (timeout < 0 || wait < timeout) { timeout = wait; }
+    }
+
+    fds[0].fd = adminConn < 0 ? adminFD : -1; fds[0].events = POLLIN; fds[0].revents = 0; // poll() skips -1
+    fds[1].fd = adminChildPipe[0]; fds[1].events = POLLIN; fds[1].revents = 0;
+    fds[2].fd = adminConn; fds[2].events = POLLIN; fds[2].revents = 0;
+    fds[3].fd = listeningFD; fds[3].events = POLLIN; fds[3].revents = 0;
+    ready = poll(fds, accepting ? 4 : 3, timeout);
+    if (adminConn >= 0 && (fds[2].revents != 0 || adminnow() >= adminDeadline)) { // The limits may change
+        adminread(listeningFD);
+        return 0;
+    }
+    if (ready <= 0) { return 0; }
+    if (fds[1].revents & POLLIN) { // A child finished: go round to reap it, which may free a slot
+        while (read(adminChildPipe[0], drain, sizeof(drain)) > 0) { }
+        return 0;
+    }
+    if (fds[0].revents & POLLIN) { // The line has usually arrived with the connection, so try reading it right away
+        adminconnect();
+        if (adminConn >= 0) { adminread(listeningFD); }
+        return 0;
+    }
+    return accepting && (fds[3].revents & POLLIN) ? 1 : 0;
+}
+
+/*
+ * Count an accepted connection, in the daemon
+*/
+static void adminaccept(void) {
+
+    adminAccepted++;
+    scaleaccept();
+    if (adminRate > 0) { adminTokens -= 1; }
+}
+
+/*
+ * Count a request process forked, in the daemon
+*/
+static void adminforked(void) { adminActive++; }
+
+/*
+ * Count a request process finished, when the daemon reaps it
+ * pid_t pid: the process reaped
+*/
+static void adminreap(pid_t pid) {
+
+    if (pid != metricsPid && pid != logDrainPid && adminActive > 0) { adminActive--; }
+}
+
+#endif
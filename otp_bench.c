@@ -0,0 +1,462 @@
+/*************************************************************************************************************************
+ *
+ * NAME
+ *    otp_bench.c
+ * SYNOPSIS
+ *    Concurrent load generator for the One-Time Pad daemons.
+ * DESCRIPTION
+ *    Opens up to N concurrent connections to otp_enc_d or otp_dec_d and drives full requests (authorization, text,
+ *       key and result, exactly like otp_enc/otp_dec) with a weighted mix of message sizes.
+ *    By default each connection sends its next request as soon as the last one finishes (closed loop). With --rate the
+ *       requests are instead scheduled at a fixed (or, with --poisson, exponentially distributed) interval regardless
+ *       of how fast the daemon answers (open loop), and latency is measured from when each request was scheduled to
+ *       start rather than from when a connection got around to sending it, so a stalled daemon can't hide its queueing
+ *       delay (coordinated omission).
+ *    Latencies are recorded in a per-thread log-linear histogram (HdrHistogram style, 3 significant digits) that is
+ *       merged at the end to report percentiles and throughput.
+ * INSTRUCTIONS
+ *    Use the included compileall script to compile this program as well as the other programs.
+ *    Start the daemon to test, then run:
+ *       otp_bench [--dec] [--connections N] [--sizes SIZE:WEIGHT,...] [--rate REQ_PER_SEC [--poisson]]
+ *                 [--duration SECONDS] [--requests N] [--json] [--perf DAEMON_PID] [--timing] [--nodelay] PORT
+ *    --perf counts hardware performance counters (see otp_perf.h) on the daemon process and every request process it
+ *       forks during the run, and reports them per request and per byte.
+ *    --timing reads the daemon's timing trailer after every result (see otp_timing.h) and reports the mean time the
+ *       server spent in each phase of a request, next to the mean time the client saw, so the difference is the
+ *       network and the client.
+ *    --nodelay sets TCP_NODELAY on every connection. The clients send each length header and its text or key as
+ *       separate writes, and without it Nagle's algorithm holds the second write back until the daemon's delayed ACK
+ *       (about 40ms on Linux), which then dominates small request latency instead of the daemon's own work.
+ *    e.g. otp_bench --connections 16 --sizes 100:70,10000:25,1000000:5 --rate 2000 --duration 30 50001
+ * AUTHOR
+ *    Written by Andrew Swaim
+ *
+*************************************************************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "otp_kernels.h"
+#include "otp_perf.h"
+#include "otp_timing.h"
+
+typedef enum { false, true } bool; // Create bool type for C89/C99 compilation.
+
+#define ID_LEN 7 // Number of characters to send for the client id
+#define AUTH_LEN 4 // Number of characters to receive for the server's authorization
+#define BUF_LEN 9 // Number of digits (characters) to send for the length of the next transmission
+#define STAT_LEN 4 // Number of characters to receive for the server's validation of the text and key
+#define MAX_SIZES 16 // Most message sizes allowed in the mix
+#define MAX_CONNS 1024 // Most concurrent connections allowed
+#define HIST_SUB_BITS 11 // Histogram sub-buckets per power of 2 (2^11 = 2048 gives 3 significant digits)
+#define HIST_BUCKETS 40 // Powers of 2 covered by the histogram (ns up to about 10^12 = 18 minutes)
+
+/*************************************************************************************************************************
+ * Types and Globals
+*************************************************************************************************************************/
+
+struct hist { // Log-linear latency histogram in nanoseconds
+    long counts[HIST_BUCKETS << HIST_SUB_BITS];
+    long total, min, max;
+};
+
+struct worker { // Per-thread state, only touched by its own thread until the end
+    pthread_t thread;
+    struct hist lat;
+    long requests, errors, bytes;
+    long timed; // Requests with a timing trailer, for --timing
+    double serverUs[TIMING_PHASES+1], clientUs; // Sums of the server's phases and total, and of the client's time
+};
+
+struct sizemix { long size; double weight; };
+
+struct sizemix sizes[MAX_SIZES] = { { 1000, 1.0 } }; // Message size mix, one 1000 character message by default
+int numSizes = 1;
+long maxSize = 1000;
+double totalWeight = 1.0;
+
+struct sockaddr_in server; // Address of the daemon under test
+const char* clientId = "otp_enc"; // Client id to authorize with
+double rate = 0; // Open loop requests per second, or 0 for closed loop
+bool poisson = false; // Whether open loop arrivals are exponentially distributed instead of evenly spaced
+bool timing = false; // Whether to read the server's timing trailer after every result
+bool nodelay = false; // Whether to disable Nagle's algorithm on every connection
+double startTime, endTime; // When the run started and when no more requests should be started
+long maxRequests = 0; // Most requests to send in total, or 0 for no limit
+long nextRequest = 0; // Next request number to claim (shared between threads)
+double nextArrival = 0; // Scheduled start of the next open loop request (shared between threads)
+pthread_mutex_t scheduleLock = PTHREAD_MUTEX_INITIALIZER; // Guards nextRequest and nextArrival
+char *text, *key; // Valid payloads at least maxSize long
+
+/*************************************************************************************************************************
+ * Function Declarations
+*************************************************************************************************************************/
+
+void* runworker(void*); // To send requests from one thread until the run is over
+bool claim(double*, unsigned*); // To claim the next request and when it should start
+bool request(long, double*); // To send one request through to the result
+int sendrecv(int, char*, int, bool); // To send or receive data to or from a server
+void histadd(struct hist*, long); // To record a latency
+void histmerge(struct hist*, struct hist*); // To add one histogram into another
+long histpercentile(struct hist*, double); // To read a percentile back out
+double now(void); // To get a monotonic timestamp in seconds
+
+/*************************************************************************************************************************
+ * Main
+*************************************************************************************************************************/
+
+int main(int argc, char *argv[]) {
+
+    int conns = 1, opt, port, i, j;
+    double duration = 10, elapsed;
+    bool json = false;
+    char *spec, *item;
+    long requests = 0, errors = 0, bytes = 0, timed = 0;
+    double serverUs[TIMING_PHASES+1] = { 0 }, clientUs = 0; // Sums over every timed request
+    struct worker* workers;
+    struct hist* all;
+    pid_t perfPid = 0; // Daemon to count with hardware performance counters, if any
+    struct perfset perf;
+    long long counts[PERF_COUNTERS];
+
+    static struct option longopts[] = {
+        { "dec", no_argument, NULL, 'd' }, { "connections", required_argument, NULL, 'c' },
+        { "sizes", required_argument, NULL, 's' }, { "rate", required_argument, NULL, 'r' },
+        { "poisson", no_argument, NULL, 'p' }, { "duration", required_argument, NULL, 't' },
+        { "requests", required_argument, NULL, 'n' }, { "json", no_argument, NULL, 'j' },
+        { "perf", required_argument, NULL, 'P' }, { "timing", no_argument, NULL, 'T' },
+        { "nodelay", no_argument, NULL, 'N' }, { NULL, 0, NULL, 0 }
+    };
+
+    // Check usage & args
+    while ((opt = getopt_long(argc, argv, "dc:s:r:pt:n:jP:TN", longopts, NULL)) != -1) {
+        if (opt == 'd') { clientId = "otp_dec"; }
+        else if (opt == 'c') { conns = atoi(optarg); }
+        else if (opt == 'r') { rate = atof(optarg); }
+        else if (opt == 'p') { poisson = true; }
+        else if (opt == 't') { duration = atof(optarg); }
+        else if (opt == 'n') { maxRequests = atol(optarg); }
+        else if (opt == 'j') { json = true; }
+        else if (opt == 'P') { perfPid = atoi(optarg); }
+        else if (opt == 'T') { timing = true; }
+        else if (opt == 'N') { nodelay = true; }
+        else if (opt == 's') { // Parse SIZE:WEIGHT,SIZE:WEIGHT,...
+
+            numSizes = 0; maxSize = 0; totalWeight = 0;
+            for (spec = optarg; (item = strtok(spec, ",")) != NULL && numSizes < MAX_SIZES; spec = NULL) {
+                sizes[numSizes].size = atol(item);
+                sizes[numSizes].weight = strchr(item, ':') ? atof(strchr(item, ':') + 1) : 1.0;
+                if (sizes[numSizes].size < 1 || sizes[numSizes].size > 999999999 || sizes[numSizes].weight <= 0) {
+                    fprintf(stderr, "otp_bench: ERROR, bad size \'%s\'\n", item); exit(1);
+                }
+                if (sizes[numSizes].size > maxSize) { maxSize = sizes[numSizes].size; }
+                totalWeight += sizes[numSizes++].weight;
+            }
+        }
+        else { argc = 0; }
+    }
+    if (argc - optind != 1 || conns < 1 || conns > MAX_CONNS || rate < 0 || numSizes < 1) {
+        fprintf(stderr, "USAGE: %s [--dec] [--connections N] [--sizes SIZE:WEIGHT,...] [--rate REQ_PER_SEC [--poisson]]\n"
+                        "       [--duration SECONDS] [--requests N] [--json] [--perf DAEMON_PID] [--timing] [--nodelay]\n"
+                        "       PORT\n",
+                argv[0]);
+        exit(1);
+    }
+
+    // Get and validate port number
+    port = atoi(argv[optind]);
+    if (port < 0 || port > 65535) { fprintf(stderr, "otp_bench: ERROR, invalid port %d\n", port); exit(2); }
+    memset((char*)&server, '\0', sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons(port);
+    server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    // Generate valid payloads for the largest message (the same bytes are reused for every request)
+    if ((text = malloc(maxSize + 1)) == NULL || (key = malloc(maxSize + 1)) == NULL
+        || (workers = calloc(conns, sizeof(struct worker))) == NULL || (all = calloc(1, sizeof(struct hist))) == NULL) {
+        fprintf(stderr, "otp_bench: ERROR, out of memory\n"); exit(1);
+    }
+    srand(time(0));
+    keychars(text, maxSize);
+    keychars(key, maxSize);
+
+    // Count the daemon and the request processes it forks from here on
+    if (perfPid > 0 && perfopen(&perf, perfPid, 1) == 0) {
+        fprintf(stderr, "otp_bench: WARNING, no performance counters available for pid %d\n", (int)perfPid);
+    }
+    if (perfPid > 0) { perfstart(&perf); }
+
+    // Run every connection in its own thread until the duration or request count is used up
+    startTime = nextArrival = now();
+    endTime = startTime + duration;
+    for (i = 0; i < conns; i++) {
+        if (pthread_create(&workers[i].thread, NULL, runworker, &workers[i]) != 0) {
+            fprintf(stderr, "otp_bench: ERROR, creating thread\n"); exit(1);
+        }
+    }
+    for (i = 0; i < conns; i++) {
+        pthread_join(workers[i].thread, NULL);
+        histmerge(all, &workers[i].lat);
+        requests += workers[i].requests;
+        errors += workers[i].errors;
+        bytes += workers[i].bytes;
+        timed += workers[i].timed;
+        clientUs += workers[i].clientUs;
+        for (j = 0; j <= TIMING_PHASES; j++) { serverUs[j] += workers[i].serverUs[j]; }
+    }
+    elapsed = now() - startTime;
+    if (perfPid > 0) { perfstop(&perf, counts); perfclose(&perf); }
+
+    // Report the results
+    if (json) {
+        printf("{ \"connections\": %d, \"mode\": \"%s\", \"rate\": %g, \"seconds\": %.3f, \"requests\": %ld, "
+               "\"errors\": %ld, \"req_per_sec\": %.1f, \"mb_per_sec\": %.3f, \"latency_us\": { \"min\": %.1f, "
+               "\"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"p9999\": %.1f, \"max\": %.1f }",
+               conns, rate > 0 ? "open" : "closed", rate, elapsed, requests, errors, requests / elapsed,
+               bytes / elapsed / 1e6, all->min / 1e3, histpercentile(all, 50) / 1e3, histpercentile(all, 90) / 1e3,
+               histpercentile(all, 99) / 1e3, histpercentile(all, 99.9) / 1e3, histpercentile(all, 99.99) / 1e3,
+               all->max / 1e3);
+        if (perfPid > 0 && requests > 0) {
+            printf(", \"perf_per_request\": { "); perfjson(stdout, counts, requests);
+            printf(" }, \"perf_per_byte\": { "); perfjson(stdout, counts, bytes); printf(" }");
+        }
+        if (timing && timed > 0) {
+            printf(", \"server_us\": { ");
+            for (j = 0; j < TIMING_PHASES; j++) { printf("\"%s\": %.1f, ", timingPhaseNames[j], serverUs[j] / timed); }
+            printf("\"total\": %.1f }, \"client_us\": %.1f", serverUs[TIMING_PHASES] / timed, clientUs / timed);
+        }
+        printf(" }\n");
+    }
+    else {
+        printf("%ld requests (%ld errors) in %.2fs over %d connections, %s loop\n", requests, errors, elapsed, conns,
+               rate > 0 ? "open" : "closed");
+        printf("throughput: %.1f req/s, %.3f MB/s\n", requests / elapsed, bytes / elapsed / 1e6);
+        printf("latency (us): min %.1f  p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  p99.99 %.1f  max %.1f\n",
+               all->min / 1e3, histpercentile(all, 50) / 1e3, histpercentile(all, 90) / 1e3,
+               histpercentile(all, 99) / 1e3, histpercentile(all, 99.9) / 1e3, histpercentile(all, 99.99) / 1e3,
+               all->max / 1e3);
+        if (perfPid > 0 && requests > 0) {
+            printf("daemon per request: "); perfjson(stdout, counts, requests); printf("\n");
+            printf("daemon per byte: "); perfjson(stdout, counts, bytes); printf("\n");
+        }
+        if (timing && timed > 0) {
+            printf("server time per request (us): ");
+            for (j = 0; j < TIMING_PHASES; j++) { printf("%s %.1f  ", timingPhaseNames[j], serverUs[j] / timed); }
+            printf("total %.1f\n", serverUs[TIMING_PHASES] / timed);
+            printf("client time per request (us): %.1f, %.1f outside the server\n", clientUs / timed,
+                   (clientUs - serverUs[TIMING_PHASES]) / timed);
+        }
+        else if (timing) { printf("server time per request: no timing trailers received\n"); }
+    }
+    return errors > 0 ? 1 : 0;
+}
+
+/*************************************************************************************************************************
+ * Function Definitions
+*************************************************************************************************************************/
+
+/*
+ * Send requests from one thread until the run is over, recording each latency in the thread's own histogram
+ * void* arg: the thread's struct worker
+*/
+void* runworker(void* arg) {
+
+    struct worker* w = arg;
+    unsigned seed = (unsigned)(size_t)arg; // Per-thread seed for picking message sizes
+    double scheduled, wait, r, start, phaseUs[TIMING_PHASES+1];
+    long size;
+    int i, j;
+
+    w->lat.min = -1;
+    while (claim(&scheduled, &seed)) {
+
+        // In open loop mode, wait for the request's scheduled start time
+        if ((wait = scheduled - now()) > 0) { usleep((useconds_t)(wait * 1e6)); }
+
+        // Pick a message size from the weighted mix
+        r = rand_r(&seed) / ((double)RAND_MAX + 1) * totalWeight;
+        for (i = 0; i < numSizes - 1 && (r -= sizes[i].weight) >= 0; i++) { }
+        size = sizes[i].size;
+
+        start = now();
+        if (request(size, timing ? phaseUs : NULL)) {
+            w->requests++; w->bytes += size;
+            if (timing && phaseUs[TIMING_PHASES] >= 0) { // Add up the server's timing next to the client's own
+                for (j = 0; j <= TIMING_PHASES; j++) { w->serverUs[j] += phaseUs[j]; }
+                w->clientUs += (now() - start) * 1e6;
+                w->timed++;
+            }
+        }
+        else { w->errors++; }
+        histadd(&w->lat, (long)((now() - scheduled) * 1e9)); // From the scheduled start, not the actual one
+    }
+    return NULL;
+}
+
+/*
+ * Claim the next request and work out when it should start
+ * double* scheduled: set to the time the request should start (now, in closed loop mode)
+ * unsigned* seed: the calling thread's random seed, for Poisson arrivals
+ * Returns false once the run is over
+*/
+bool claim(double* scheduled, unsigned* seed) {
+
+    bool ok;
+    double t = now(), u;
+
+    pthread_mutex_lock(&scheduleLock);
+    if (rate > 0) {
+        *scheduled = nextArrival;
+        u = (rand_r(seed) + 1.0) / ((double)RAND_MAX + 2);
+        nextArrival += poisson ? -log(u) / rate : 1.0 / rate;
+    }
+    else { *scheduled = t; }
+    ok = (maxRequests == 0 || nextRequest < maxRequests) && *scheduled < endTime;
+    if (ok) { nextRequest++; }
+    pthread_mutex_unlock(&scheduleLock);
+    return ok;
+}
+
+/*
+ * Send one request through the same protocol as otp_enc/otp_dec, reading the whole result back
+ * long size: the number of characters of text (and key) to send
+ * double* phaseUs: where to put the server's timing trailer (phases, then total) if it's read, or NULL to skip it;
+ *    the total is -1 if the daemon didn't send one
+ * Returns true if the daemon accepted the request and sent back the full result
+*/
+bool request(long size, double* phaseUs) {
+
+    int sockFD, len = (int)size;
+    bool ok = false;
+    char id[ID_LEN+1], auth[AUTH_LEN+1], lenBuf[BUF_LEN+1], result[STAT_LEN+1], trailer[TIMING_LEN+1];
+    char* reply = malloc(size + 1);
+
+    if (reply == NULL || (sockFD = socket(AF_INET, SOCK_STREAM, 0)) < 0) { free(reply); return false; }
+    if (connect(sockFD, (struct sockaddr*)&server, sizeof(server)) < 0) { close(sockFD); free(reply); return false; }
+    setsockopt(sockFD, SOL_SOCKET, SO_RCVTIMEO, &(struct timeval){ 30, 0 }, sizeof(struct timeval)); // Don't hang forever
+    if (nodelay) { setsockopt(sockFD, IPPROTO_TCP, TCP_NODELAY, &(int){ 1 }, sizeof(int)); }
+
+    // Authorize, send the text and key, then check the result and read the output back
+    strcpy(id, clientId);
+    if (phaseUs != NULL) { id[3] = TIMING_ASK; } // Ask for the timing trailer
+    memset(lenBuf, '\0', sizeof(lenBuf));
+    snprintf(lenBuf, sizeof(lenBuf), "%d", len);
+    if (sendrecv(sockFD, id, ID_LEN, true) == ID_LEN && sendrecv(sockFD, auth, AUTH_LEN, false) == AUTH_LEN
+        && strcmp(auth, "PASS") == 0 && sendrecv(sockFD, lenBuf, BUF_LEN, true) == BUF_LEN
+        && sendrecv(sockFD, text, len, true) == len && sendrecv(sockFD, lenBuf, BUF_LEN, true) == BUF_LEN
+        && sendrecv(sockFD, key, len, true) == len && sendrecv(sockFD, result, STAT_LEN, false) == STAT_LEN
+        && strcmp(result, "PASS") == 0 && sendrecv(sockFD, reply, len, false) == len) {
+        ok = true;
+    }
+    if (ok && phaseUs != NULL && (sendrecv(sockFD, trailer, TIMING_LEN, false) != TIMING_LEN
+                                  || timingparse(trailer, phaseUs, &phaseUs[TIMING_PHASES]) < 0)) {
+        phaseUs[TIMING_PHASES] = -1;
+    }
+
+    close(sockFD);
+    free(reply);
+    return ok;
+}
+
+/*
+ * Send or receive data to or from a socket file descriptor
+ * int sockFD: the socket file descriptor the client is connected to the server on
+ * char* str: the string with the data to send or to hold the data that is received
+ * int len: the length of the data to send or receive
+ * bool sendMode: true for sending data, false for receiving data
+*/
+int sendrecv(int sockFD, char* str, int len, bool sendMode) {
+
+    int total = 0; // To calculate the total chars that get sent/received
+    int n;         // To hold how many chars get sent with each send()/recv() call
+
+    if (!sendMode) { memset(str, '\0', len+1); } // If receiving, clear buffer
+
+    while (total < len) { // Loop to ensure that all data is sent or received
+
+        if (sendMode) { n = send(sockFD, str+total, len-total, MSG_NOSIGNAL); } // Errors instead of SIGPIPE
+        else { n = recv(sockFD, str+total, len-total, 0); }
+        if (n <= 0) { break; }
+        total += n;
+    }
+    return total; // If successful, total should equal len
+}
+
+/*
+ * Record a latency in a log-linear histogram: values below 2^HIST_SUB_BITS are exact, larger ones keep
+ *    HIST_SUB_BITS significant bits
+ * struct hist* h: the histogram
+ * long ns: the latency in nanoseconds
+*/
+void histadd(struct hist* h, long ns) {
+
+    int bucket = 0;
+    long v;
+
+    if (ns < 0) { ns = 0; }
+    for (v = ns >> HIST_SUB_BITS; v > 0 && bucket < HIST_BUCKETS - 1; v >>= 1) { bucket++; }
+    v = ns >> bucket; // Between 2^(HIST_SUB_BITS-1) and 2^HIST_SUB_BITS, or below that in bucket 0
+    if (v >= (1L << HIST_SUB_BITS)) { v = (1L << HIST_SUB_BITS) - 1; } // Clamp past the top bucket
+    h->counts[(bucket << HIST_SUB_BITS) + v]++;
+    h->total++;
+    if (h->min < 0 || ns < h->min) { h->min = ns; }
+    if (ns > h->max) { h->max = ns; }
+}
+
+/*
+ * Add every count in one histogram into another
+ * struct hist* into: the histogram to add to
+ * struct hist* from: the histogram to add
+*/
+void histmerge(struct hist* into, struct hist* from) {
+
+    int i;
+
+    for (i = 0; i < (HIST_BUCKETS << HIST_SUB_BITS); i++) { into->counts[i] += from->counts[i]; }
+    if (from->total > 0 && (into->total == 0 || from->min < into->min)) { into->min = from->min; }
+    if (from->max > into->max) { into->max = from->max; }
+    into->total += from->total;
+}
+
+/*
+ * Get the latency at a percentile, as the highest value that falls in the bucket where the percentile lands
+ * struct hist* h: the histogram
+ * double pct: the percentile (0-100)
+*/
+long histpercentile(struct hist* h, double pct) {
+
+    long target = (long)ceil(h->total * pct / 100.0), seen = 0;
+    int i;
+
+    if (h->total == 0) { return 0; }
+    if (target < 1) { target = 1; }
+    for (i = 0; i < (HIST_BUCKETS << HIST_SUB_BITS); i++) {
+        if ((seen += h->counts[i]) >= target) {
+            long value = (((long)(i & ((1 << HIST_SUB_BITS) - 1)) + 1) << (i >> HIST_SUB_BITS)) - 1;
+            return value < h->max ? value : h->max;
+        }
+    }
+    return h->max;
+}
+
+/*
+ * Get a monotonic timestamp in seconds
+*/
+double now(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -0,0 +1,231 @@
+/*************************************************************************************************************************
+ *
+ * NAME
+ *    otp_calibrate.h
+ * SYNOPSIS
+ *    Startup calibration of the cipher kernel tier and transfer chunk size for the daemons.
+ * DESCRIPTION
+ *    calibrate() times every cipher tier built into otp_kernels.h (encrypt() plus decrypt() on a 64K buffer, best of a
+ *       few runs) and a few send()/recv() chunk sizes (a 4M transfer over loopback TCP to a forked receiver), then
+ *       sets cipherTier and the default chunk size used by tunechunk() (see otp_tune.h) to the fastest of each.
+ *    The choice is cached in a small file with one line per machine:
+ *       KEY<tab>cipher=TIER<tab>chunk=BYTES
+ *    where KEY is the CPU model from /proc/cpuinfo plus the compiler and the build configuration (or just whether it
+ *       optimized, without the Makefile), since different builds can rank the tiers differently on the same CPU. A
+ *       restart on the same machine and build finds its line and uses it without timing anything, so it adds no
+ *       delay. The last line for a key wins.
+ *    Takes about a tenth of a second when it does run, and logs what it chose either way, at info level.
+ * AUTHOR
+ *    Written by Andrew Swaim
+ *
+*************************************************************************************************************************/
+
+#ifndef OTP_CALIBRATE_H
+#define OTP_CALIBRATE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "otp_kernels.h"
+#include "otp_tune.h"
+#include "otp_log.h"
+
+#define CALIBRATE_LEN 65536 // Characters to encrypt and decrypt when timing a cipher tier
+#define CALIBRATE_XFER (4 << 20) // Bytes to transfer when timing a chunk size
+#define CALIBRATE_RUNS 3 // Runs of each timing to take the best of
+#define CALIBRATE_KEY_LEN 256 // Longest cache key
+#if defined(OTP_BUILD) // Set by the Makefile to the configuration and MARCH tier
+#define CALIBRATE_BUILD "gcc " __VERSION__ " " OTP_BUILD
+#elif defined(__OPTIMIZE__)
+#define CALIBRATE_BUILD "gcc " __VERSION__ " optimized"
+#else
+#define CALIBRATE_BUILD "gcc " __VERSION__ " unoptimized"
+#endif
+
+static const int calibrateChunks[] = { 0, 4096, 16384, 65536, 262144 }; // Chunk sizes to try (0 for no limit)
+
+/*
+ * Get a monotonic timestamp in seconds
+*/
+static double calibratenow(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Build the cache key for this machine and build: the CPU model, then the compiler and optimization
+ * char* key: the buffer to hold the key, CALIBRATE_KEY_LEN long
+*/
+static void calibratekey(char* key) {
+
+    FILE* fd;
+    char line[512], *p;
+
+    strcpy(key, "unknown cpu");
+    if ((fd = fopen("/proc/cpuinfo", "r")) != NULL) {
+        while (fgets(line, sizeof(line), fd) != NULL) {
+            if (strncmp(line, "model name", 10) == 0 && (p = strchr(line, ':')) != NULL) {
+                snprintf(key, CALIBRATE_KEY_LEN / 2, "%s", p + 2);
+                key[strcspn(key, "\n")] = '\0';
+                break;
+            }
+        }
+        fclose(fd);
+    }
+    snprintf(key + strlen(key), CALIBRATE_KEY_LEN - strlen(key), " [%s]", CALIBRATE_BUILD);
+    for (p = key; *p; p++) { if (*p == '\t') { *p = ' '; } } // Tabs separate the fields of the cache
+}
+
+/*
+ * Time a cipher tier: encrypt() then decrypt() over CALIBRATE_LEN characters, best of CALIBRATE_RUNS
+ * int tier: the tier to time (CIPHER_SCALAR, CIPHER_SSE2, ...)
+ * Returns the throughput in GB/s
+*/
+static double calibratecipher(int tier) {
+
+    static char text[CALIBRATE_LEN + 1], key[CALIBRATE_LEN + 1], out[CALIBRATE_LEN + 1];
+    static char textInit[CALIBRATE_LEN], keyInit[CALIBRATE_LEN];
+    double start, best = 0;
+    int i, saved = cipherTier;
+
+    keychars(textInit, CALIBRATE_LEN);
+    keychars(keyInit, CALIBRATE_LEN);
+    cipherTier = tier;
+    for (i = 0; i < CALIBRATE_RUNS; i++) {
+        memcpy(text, textInit, CALIBRATE_LEN); // Fresh inputs every run, the scalar kernels write '@' over spaces
+        memcpy(key, keyInit, CALIBRATE_LEN);
+        start = calibratenow();
+        encrypt(text, key, out, CALIBRATE_LEN);
+        decrypt(out, key, text, CALIBRATE_LEN);
+        start = calibratenow() - start;
+        if (start > 0 && 2.0 * CALIBRATE_LEN / start / 1e9 > best) { best = 2.0 * CALIBRATE_LEN / start / 1e9; }
+    }
+    cipherTier = saved;
+    return best;
+}
+
+/*
+ * Time a chunk size: send CALIBRATE_XFER bytes over loopback TCP to a forked receiver, both asking for at most chunk
+ *    bytes per call, best of CALIBRATE_RUNS
+ * int chunk: the chunk size to time (0 for no limit)
+ * Returns the throughput in GB/s, or 0 if the transfer couldn't be set up
+*/
+static double calibratechunk(int chunk) {
+
+    static char buf[CALIBRATE_XFER];
+    struct sockaddr_in addr;
+    socklen_t addrLen = sizeof(addr);
+    double start, best = 0;
+    int listenFD, fd, run, n, total, want;
+    pid_t pid;
+
+    memset(&addr, '\0', sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if ((listenFD = socket(AF_INET, SOCK_STREAM, 0)) < 0 || bind(listenFD, (struct sockaddr*)&addr, sizeof(addr)) < 0
+        || getsockname(listenFD, (struct sockaddr*)&addr, &addrLen) < 0 || listen(listenFD, CALIBRATE_RUNS) < 0) {
+        if (listenFD >= 0) { close(listenFD); }
+        return 0;
+    }
+    fflush(stdout); // So the receiver doesn't inherit anything unwritten
+    if ((pid = fork()) < 0) { close(listenFD); return 0; }
+    if (pid == 0) { // Receiver: read each transfer, then acknowledge it with one byte
+        for (run = 0; run < CALIBRATE_RUNS && (fd = accept(listenFD, NULL, NULL)) >= 0; run++) {
+            for (total = 0; total < CALIBRATE_XFER; total += n) {
+                want = chunk > 0 && CALIBRATE_XFER - total > chunk ? chunk : CALIBRATE_XFER - total;
+                if ((n = recv(fd, buf + total, want, 0)) <= 0) { break; }
+            }
+            send(fd, buf, 1, 0);
+            close(fd);
+        }
+        _exit(0);
+    }
+
+    close(listenFD);
+    for (run = 0; run < CALIBRATE_RUNS; run++) {
+        if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) { break; }
+        if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) { close(fd); break; }
+        start = calibratenow();
+        for (total = 0; total < CALIBRATE_XFER; total += n) {
+            want = chunk > 0 && CALIBRATE_XFER - total > chunk ? chunk : CALIBRATE_XFER - total;
+            if ((n = send(fd, buf + total, want, 0)) <= 0) { break; }
+        }
+        if (total == CALIBRATE_XFER && recv(fd, buf, 1, 0) == 1) {
+            start = calibratenow() - start;
+            if (start > 0 && CALIBRATE_XFER / start / 1e9 > best) { best = CALIBRATE_XFER / start / 1e9; }
+        }
+        close(fd);
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    return best;
+}
+
+/*
+ * Pick the cipher tier and default chunk size, from the cache if this machine has a line in it, or by timing them
+ *    and adding a line otherwise
+ * const char* cacheFile: the calibration cache
+*/
+static void calibrate(const char* cacheFile) {
+
+    FILE* fd;
+    char key[CALIBRATE_KEY_LEN], line[CALIBRATE_KEY_LEN + 64], tierName[16], *fields;
+    int tier = -1, chunk = 0, i, n;
+    double speed, best, cipherBest;
+
+    // Look for this machine's line (the last one, if there are several)
+    calibratekey(key);
+    if ((fd = fopen(cacheFile, "r")) != NULL) {
+        while (fgets(line, sizeof(line), fd) != NULL) {
+            if ((fields = strchr(line, '\t')) == NULL || fields - line != (long)strlen(key)
+                || strncmp(line, key, strlen(key)) != 0
+                || sscanf(fields, "\tcipher=%15s\tchunk=%d", tierName, &n) != 2) {
+                continue;
+            }
+            for (i = 0; i < CIPHER_TIERS; i++) {
+                if (strcmp(tierName, cipherTierNames[i]) == 0 && cipherTierBuilt[i] && n >= 0) { tier = i; chunk = n; }
+            }
+        }
+        fclose(fd);
+    }
+    if (tier >= 0) {
+        cipherTier = tier;
+        tuneChunk = chunk;
+        logmsg(LEVEL_INFO, "using cached calibration for %s: cipher %s, chunk %d", key, cipherTierNames[tier], chunk);
+        return;
+    }
+
+    // Time every tier and chunk size and keep the fastest
+    for (best = 0, i = 0; i < CIPHER_TIERS; i++) {
+        if (cipherTierBuilt[i] && (speed = calibratecipher(i)) > best) { best = speed; tier = i; }
+    }
+    cipherBest = best;
+    for (best = 0, i = 0; i < (int)(sizeof(calibrateChunks) / sizeof(calibrateChunks[0])); i++) {
+        if ((speed = calibratechunk(calibrateChunks[i])) > best) { best = speed; chunk = calibrateChunks[i]; }
+    }
+    logmsg(LEVEL_INFO, "calibrated cipher %s (%.3f GB/s), chunk %d (%.3f GB/s) for %s", cipherTierNames[tier], cipherBest,
+           chunk, best, key);
+    cipherTier = tier;
+    tuneChunk = chunk;
+
+    // Cache it for next time
+    if ((fd = fopen(cacheFile, "a")) == NULL) {
+        logmsg(LEVEL_WARN, "could not write calibration cache \'%s\'", cacheFile); return;
+    }
+    fprintf(fd, "%s\tcipher=%s\tchunk=%d\n", key, cipherTierNames[tier], chunk);
+    fclose(fd);
+}
+
+#endif
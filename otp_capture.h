@@ -0,0 +1,126 @@
+/*************************************************************************************************************************
+ *
+ * NAME
+ *    otp_capture.h
+ * SYNOPSIS
+ *    Request metadata capture for the daemons, replayed by otp_replay.
+ * DESCRIPTION
+ *    When a daemon is started with --capture FILE, each request process appends one tab separated line to FILE as it
+ *       exits, with when the connection was accepted, the text and key lengths, the result status and how long each
+ *       phase of the request took. Payloads are never recorded.
+ *    Columns (described again by the "#" comment line written at the top of a new file):
+ *       daemon     otp_enc_d or otp_dec_d
+ *       conn       connection number, counted by the daemon from 1 in the order they were accepted
+ *       req        request number on the connection (always 1, the protocol closes the connection after one request)
+ *       arrival    wall clock time the connection was accepted, in seconds since the epoch
+ *       text_len   text length the client sent (0 if it never got that far)
+ *       key_len    key length the client sent (0 if it never got that far)
+ *       status     PASS, FAIL (authorization), BADL, BADT, BADK or SHRT, or "-" if the client disconnected early
+ *       auth_us    receiving the client id and sending the authorization
+ *       text_us    receiving and validating the text length and text
+ *       key_us     receiving and validating the key length and key
+ *       cipher_us  encrypting or decrypting
+ *       send_us    sending the status and the result
+ *       total_us   from accept to exit, including the fork
+ *    Each line is written with one write() to a file opened with O_APPEND, so lines from concurrent request processes
+ *       never interleave.
+ * AUTHOR
+ *    Written by Andrew Swaim
+ *
+*************************************************************************************************************************/
+
+#ifndef OTP_CAPTURE_H
+#define OTP_CAPTURE_H
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "otp_timing.h"
+
+#define CAPTURE_PHASES 5 // Number of timed phases in a request
+
+enum { PHASE_AUTH, PHASE_TEXT, PHASE_KEY, PHASE_CIPHER, PHASE_SEND };
+
+struct capture {
+    int fd; // Capture file, or -1 when capture is off
+    const char* daemon; // Name of the daemon writing the capture
+    long conn; // Connection number
+    double arrival; // Wall clock time the connection was accepted
+    unsigned long long start, mark; // When the connection was accepted, and when the last phase ended (timingstamp())
+    int textLen, keyLen;
+    char status[5];
+    double phase[CAPTURE_PHASES]; // Microseconds spent in each phase
+    long long bytesIn, bytesOut; // Bytes received from and sent to the client
+};
+
+static struct capture cap = { -1 }; // This process's capture state
+
+/*
+ * Open the capture file for appending, writing the column header if the file is new
+ * const char* path: the capture file
+ * const char* daemon: the name of the daemon to record on each line
+ * Returns 0 on success, -1 if the file couldn't be opened
+*/
+static int captureopen(const char* path, const char* daemon) {
+
+    static const char header[] = "# daemon\tconn\treq\tarrival\ttext_len\tkey_len\tstatus\tauth_us\ttext_us\tkey_us\t"
+                                 "cipher_us\tsend_us\ttotal_us\n";
+    struct stat st;
+
+    if ((cap.fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644)) < 0) { return -1; }
+    if (fstat(cap.fd, &st) == 0 && st.st_size == 0) { write(cap.fd, header, sizeof(header) - 1); }
+    cap.daemon = daemon;
+    return 0;
+}
+
+/*
+ * Start timing a new connection, called by the daemon right after accept() so the request process inherits it
+*/
+static void capturestart(void) {
+
+    struct timespec wall;
+
+    cap.start = cap.mark = timingstamp();
+    if (cap.fd >= 0) {
+        clock_gettime(CLOCK_REALTIME, &wall);
+        cap.arrival = wall.tv_sec + wall.tv_nsec / 1e9;
+    }
+    cap.conn++;
+    cap.textLen = cap.keyLen = 0;
+    strcpy(cap.status, "-");
+    memset(cap.phase, 0, sizeof(cap.phase));
+}
+
+/*
+ * End a phase of the request, counting the time since the last phase ended
+ * int phase: the phase that just ended (PHASE_AUTH, PHASE_TEXT, ...)
+*/
+static void capturemark(int phase) {
+
+    unsigned long long now = timingstamp();
+
+    cap.phase[phase] += timingus(cap.mark, now);
+    cap.mark = now;
+}
+
+/*
+ * Write the request's line, registered with atexit() in the request process so every way out of it is recorded
+*/
+static void capturedone(void) {
+
+    char line[256];
+    int len;
+
+    if (cap.fd < 0) { return; }
+    len = snprintf(line, sizeof(line), "%s\t%ld\t1\t%.6f\t%d\t%d\t%s\t%.1f\t%.1f\t%.1f\t%.1f\t%.1f\t%.1f\n",
+                   cap.daemon, cap.conn, cap.arrival, cap.textLen, cap.keyLen, cap.status, cap.phase[PHASE_AUTH],
+                   cap.phase[PHASE_TEXT], cap.phase[PHASE_KEY], cap.phase[PHASE_CIPHER], cap.phase[PHASE_SEND],
+                   timingus(cap.start, timingstamp()));
+    write(cap.fd, line, len);
+}
+
+#endif
@@ -0,0 +1,279 @@
+/*************************************************************************************************************************
+ *
+ * NAME
+ *    otp_check.c
+ * SYNOPSIS
+ *    Exactness checks for the plaintext codec and the SIMD cipher kernels.
+ * DESCRIPTION
+ *    Round trips text through the entropy coder in otp_codec.h and checks that every coded stream is made of valid
+ *       characters, fits in codecbound(), records the right length in its header and decodes back to the exact text.
+ *    The built in cases cover every length from 0 to CHECK_MAX_SHORT and a few large ones, for uniform text, English
+ *       letter frequencies, all spaces and only the longest codes, each generated from --seed. Plaintext files given
+ *       on the command line (e.g. a corpus made by otp_corpus) are round tripped as well.
+ *    Where the SSE2 cipher tier is built in, encryptsse2() and decryptsse2() are compared with the scalar kernels at
+ *       every tail length 0-15 after 0 to CHECK_BLOCKS full 16 character blocks, at each of 16 buffer alignments. Their
+ *       output must match exactly (including the null character after it), their inputs must be left unchanged and
+ *       decrypting must give back the plaintext.
+ *    Every failure is printed to stderr, and the exit status is 1 if there were any.
+ * INSTRUCTIONS
+ *    Use the included compileall script to compile this program as well as the other programs (make check also runs
+ *       it from the release check build).
+ *    Syntax:
+ *       otp_check [--seed N] [PLAINTEXT...]
+ *    e.g. otp_corpus --files 20 --no-keys corpus && otp_check corpus/plaintext_*
+ * AUTHOR
+ *    Written by Andrew Swaim
+ *
+*************************************************************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#include "otp_kernels.h"
+#include "otp_codec.h"
+
+typedef enum { false, true } bool; // Create bool type for C89/C99 compilation.
+
+#define CHECK_MAX_SHORT 300 // Every length up to this is checked
+#define CHECK_MAX_LEN (1 << 20) // Largest built in case
+#define CHECK_BLOCKS 4 // Most full SIMD blocks before the tail in the cipher tier checks
+#define CHECK_TIER_LEN (16 * CHECK_BLOCKS + 15 + 16) // Longest cipher tier case, plus room to misalign it
+
+/*************************************************************************************************************************
+ * Types and Globals
+*************************************************************************************************************************/
+
+struct profile { const char* name; const char* chars; }; // Text made of characters drawn evenly from chars
+
+struct profile profiles[] = { // Built in kinds of text (English repeats letters in proportion to their frequency)
+    { "uniform", "ABCDEFGHIJKLMNOPQRSTUVWXYZ " },
+    { "english", "AAAAAAABCCDDDDEEEEEEEEEEEFFGGHHHHHIIIIIILLLMMNNNNNNOOOOOOPPRRRRRSSSSSTTTTTTTTUUVWWYY"
+                 "                   " },
+    { "spaces", " " },
+    { "longest", "JQXZ" },
+};
+
+int checks = 0, failures = 0; // Number of checks run, and how many failed
+
+/*************************************************************************************************************************
+ * Function Declarations
+*************************************************************************************************************************/
+
+void checkcodec(const char*, int, const char*); // To round trip one text through the codec
+void checkfile(const char*); // To round trip a plaintext file through the codec
+#ifdef __SSE2__
+void checktiers(unsigned long long*); // To compare the SSE2 cipher kernels with the scalar ones
+#endif
+void fail(const char*, const char*, int); // To report a failed check
+void filltext(char*, int, const char*, unsigned long long*); // To fill a buffer with characters from a profile
+unsigned long long nextrand(unsigned long long*); // To step a xorshift64* generator
+
+/*************************************************************************************************************************
+ * Main
+*************************************************************************************************************************/
+
+int main(int argc, char *argv[]) {
+
+    unsigned long long seed = 1;
+    char* text;
+    int opt, len, i;
+    const int longLens[] = { 1000, 4096, 65535, 65536, 65537, CHECK_MAX_LEN };
+
+    static struct option longopts[] = { { "seed", required_argument, NULL, 's' }, { NULL, 0, NULL, 0 } };
+
+    // Check usage & args
+    while ((opt = getopt_long(argc, argv, "s:", longopts, NULL)) != -1) {
+        if (opt == 's') { seed = strtoull(optarg, NULL, 10); }
+        else { argc = 0; }
+    }
+    if (argc == 0) {
+        fprintf(stderr, "USAGE: %s [--seed N] [PLAINTEXT...]\n", argv[0]);
+        exit(1);
+    }
+    if (seed == 0) { seed = 1; } // xorshift never leaves 0
+
+    if ((text = malloc(CHECK_MAX_LEN + 1)) == NULL) { fprintf(stderr, "otp_check: ERROR, out of memory\n"); exit(1); }
+
+    // Built in cases
+    for (i = 0; i < (int)(sizeof(profiles) / sizeof(profiles[0])); i++) {
+        for (len = 0; len <= CHECK_MAX_SHORT; len++) {
+            filltext(text, len, profiles[i].chars, &seed);
+            checkcodec(text, len, profiles[i].name);
+        }
+        for (len = 0; len < (int)(sizeof(longLens) / sizeof(longLens[0])); len++) {
+            filltext(text, longLens[len], profiles[i].chars, &seed);
+            checkcodec(text, longLens[len], profiles[i].name);
+        }
+    }
+
+#ifdef __SSE2__
+    checktiers(&seed);
+#endif
+
+    // Given files
+    for (i = optind; i < argc; i++) { checkfile(argv[i]); }
+
+    free(text);
+    if (failures > 0) { fprintf(stderr, "otp_check: %d of %d checks failed\n", failures, checks); exit(1); }
+    printf("otp_check: all %d checks passed\n", checks);
+    return 0;
+}
+
+/*************************************************************************************************************************
+ * Functions
+*************************************************************************************************************************/
+
+/*
+ * Encode a text, check the coded stream, then decode it and compare it with the text
+ * const char* text: the text, valid characters only
+ * int len: the length of the text
+ * const char* what: what the text is, for failure messages
+*/
+void checkcodec(const char* text, int len, const char* what) {
+
+    long bound = codecbound(len), n;
+    char *coded, *plain;
+
+    checks++;
+    if ((coded = malloc(bound + 1)) == NULL || (plain = malloc(len + 1)) == NULL) {
+        fprintf(stderr, "otp_check: ERROR, out of memory\n");
+        exit(1);
+    }
+
+    n = codecencode(text, len, coded);
+    if (n > bound) { fail("codec stream is longer than codecbound() for", what, len); }
+    else if (!validchars(coded, n)) { fail("codec stream has bad characters for", what, len); }
+    else if (codeclength(coded, n) != len) { fail("codec header has the wrong length for", what, len); }
+    else if (codecdecode(coded, n, plain) != len || memcmp(plain, text, len) != 0) {
+        fail("codec round trip changed", what, len);
+    }
+
+    free(coded);
+    free(plain);
+}
+
+/*
+ * Read a plaintext file like otp_enc does (dropping the trailing newline) and round trip it through the codec
+ * const char* path: the file
+*/
+void checkfile(const char* path) {
+
+    FILE* file;
+    char* text;
+    long len;
+
+    if ((file = fopen(path, "r")) == NULL || fseek(file, 0, SEEK_END) != 0 || (len = ftell(file)) < 0) {
+        fprintf(stderr, "otp_check: ERROR, could not read %s\n", path);
+        exit(1);
+    }
+    rewind(file);
+    if ((text = malloc(len + 1)) == NULL) { fprintf(stderr, "otp_check: ERROR, out of memory\n"); exit(1); }
+    if ((long)fread(text, 1, len, file) != len) {
+        fprintf(stderr, "otp_check: ERROR, could not read %s\n", path);
+        exit(1);
+    }
+    fclose(file);
+
+    if (len > 0 && text[len - 1] == '\n') { len--; }
+    if (!validchars(text, len)) { fprintf(stderr, "otp_check: ERROR, %s has bad characters\n", path); exit(1); }
+    checkcodec(text, (int)len, path);
+    free(text);
+}
+
+#ifdef __SSE2__
+/*
+ * Compare encryptsse2() and decryptsse2() with the scalar kernels at every block count, tail length and alignment
+ * unsigned long long* state: the generator to draw the texts and keys from
+*/
+void checktiers(unsigned long long* state) {
+
+    char text[CHECK_TIER_LEN], key[CHECK_TIER_LEN], cipher[CHECK_TIER_LEN + 1], plain[CHECK_TIER_LEN + 1];
+    char textCopy[CHECK_TIER_LEN], keyCopy[CHECK_TIER_LEN], scalarOut[CHECK_TIER_LEN + 1];
+    int blocks, tail, align, len;
+
+    for (blocks = 0; blocks <= CHECK_BLOCKS; blocks++) {
+        for (tail = 0; tail < 16; tail++) {
+            for (align = 0; align < 16; align++) {
+
+                len = 16 * blocks + tail;
+                checks++;
+                filltext(text + align, len, profiles[0].chars, state);
+                filltext(key + align, len, profiles[0].chars, state);
+
+                // Encrypt with both tiers (the scalar kernels write '@' over spaces, so they get copies)
+                memcpy(textCopy, text + align, len);
+                memcpy(keyCopy, key + align, len);
+                memset(cipher, 'X', sizeof(cipher));
+                encryptsse2(text + align, key + align, cipher + align, len);
+                if (memcmp(text + align, textCopy, len) != 0 || memcmp(key + align, keyCopy, len) != 0) {
+                    fail("encryptsse2() changed its input on", "uniform", len);
+                    continue;
+                }
+                encryptscalar(textCopy, keyCopy, scalarOut, len);
+                if (memcmp(cipher + align, scalarOut, len + 1) != 0) {
+                    fail("encryptsse2() differs from encryptscalar() on", "uniform", len);
+                    continue;
+                }
+
+                // Decrypt with both tiers, back to the plaintext
+                memcpy(textCopy, cipher + align, len);
+                memcpy(keyCopy, key + align, len);
+                memset(plain, 'X', sizeof(plain));
+                decryptsse2(cipher + align, key + align, plain + align, len);
+                if (memcmp(cipher + align, textCopy, len) != 0 || memcmp(key + align, keyCopy, len) != 0) {
+                    fail("decryptsse2() changed its input on", "uniform", len);
+                    continue;
+                }
+                decryptscalar(textCopy, keyCopy, scalarOut, len);
+                if (memcmp(plain + align, scalarOut, len + 1) != 0) {
+                    fail("decryptsse2() differs from decryptscalar() on", "uniform", len);
+                }
+                else if (memcmp(plain + align, text + align, len) != 0) {
+                    fail("encryptsse2() and decryptsse2() don't round trip", "uniform", len);
+                }
+            }
+        }
+    }
+}
+#endif
+
+/*
+ * Report a failed check
+ * const char* check: what went wrong
+ * const char* what: what the text was
+ * int len: the length of the text
+*/
+void fail(const char* check, const char* what, int len) {
+
+    failures++;
+    fprintf(stderr, "otp_check: FAIL, %s %s text of length %d\n", check, what, len);
+}
+
+/*
+ * Fill a buffer with characters drawn evenly from a profile's characters
+ * char* buf: the buffer to fill
+ * int len: the number of characters to generate
+ * const char* chars: the characters to draw from
+ * unsigned long long* state: the generator to draw from
+*/
+void filltext(char* buf, int len, const char* chars, unsigned long long* state) {
+
+    int i, n = strlen(chars);
+
+    for (i = 0; i < len; i++) { buf[i] = chars[nextrand(state) % n]; }
+}
+
+/*
+ * Step a xorshift64* generator
+ * unsigned long long* state: the generator's state (never 0)
+ * Returns the next 64 random bits
+*/
+unsigned long long nextrand(unsigned long long* state) {
+
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
@@ -0,0 +1,200 @@
+/*************************************************************************************************************************
+ *
+ * NAME
+ *    otp_codec.h
+ * SYNOPSIS
+ *    Optional static Huffman entropy coder for plaintext over the 27 character alphabet (A-Z and the space character).
+ * DESCRIPTION
+ *    Every plaintext character normally consumes one key character. English-like text carries far fewer than the
+ *       log2(27) = 4.75 bits per character the alphabet can hold, so otp_enc can optionally compress the plaintext
+ *       before it is sent for encryption, and otp_dec reverses it after decryption. The coded stream is itself made of
+ *       the same 27 characters, so the daemons, the key format and the cipher do not change at all.
+ *    Stream format:
+ *       - CODEC_HDR_LEN characters holding the original plaintext length as base 27 digits (least significant first)
+ *       - the canonical Huffman codes of the plaintext characters packed MSB first into a bit stream, where every
+ *         CODEC_GROUP_BITS bits are written as CODEC_GROUP_LEN base 27 digits (2^14 <= 27^3), zero padded at the end
+ *    A base 27 digit d is written as ' ' for 0 and as the letter 'A'+d-1 otherwise, the same mapping the cipher uses.
+ *    The code lengths come from a static English letter frequency table, so encoder and decoder never exchange one.
+ * AUTHOR
+ *    Written by Andrew Swaim
+ *
+*************************************************************************************************************************/
+
+#ifndef OTP_CODEC_H
+#define OTP_CODEC_H
+
+#include <stdint.h>
+
+#define CODEC_SYMBOLS 27 // Number of characters in the alphabet (the space character, then A-Z)
+#define CODEC_MAX_BITS 10 // Longest code length in the table below
+#define CODEC_HDR_LEN 7 // Number of base 27 digits holding the plaintext length (27^7 > 9 digit lengths)
+#define CODEC_GROUP_BITS 14 // Number of bits packed into each group of digits
+#define CODEC_GROUP_LEN 3 // Number of base 27 digits per group of bits
+
+/*
+ * Huffman code lengths for ' ', 'A', 'B', ... 'Z', built from English letter frequencies (including spaces).
+ * Averages about 4.1 bits per character on typical English text. Must be identical in the encoder and decoder.
+*/
+static const unsigned char codecLens[CODEC_SYMBOLS] = {
+    3, 4, 6, 5, 5, 3, 6, 6, 4, 4, 10, 8, 5, 6, 4, 4, 6, 10, 4, 4, 4, 5, 7, 6, 10, 6, 10
+};
+
+static uint16_t codecCodes[CODEC_SYMBOLS]; // Canonical code for each symbol, built by codecinit()
+static unsigned char codecTable[1 << CODEC_MAX_BITS]; // Decoding table indexed by the next CODEC_MAX_BITS bits
+static int codecReady = 0; // Whether the tables above have been built yet
+
+/*
+ * Convert between a character of the alphabet and its 0-26 symbol value, returning -1 for bad characters
+ * char c: the character to convert
+*/
+static inline int codecsym(char c) {
+
+    if (c == ' ') { return 0; }
+    if (c >= 'A' && c <= 'Z') { return c - 'A' + 1; }
+    return -1;
+}
+static inline char codecchar(int d) { return d == 0 ? ' ' : (char)('A' + d - 1); }
+
+/*
+ * Build the canonical codes and the decoding table from the code lengths (only done once per process)
+*/
+static void codecinit(void) {
+
+    int len, sym, code = 0, i;
+
+    if (codecReady) { return; }
+
+    // Assign canonical codes in order of length, then symbol
+    for (len = 1; len <= CODEC_MAX_BITS; len++) {
+        for (sym = 0; sym < CODEC_SYMBOLS; sym++) {
+            if (codecLens[sym] != len) { continue; }
+            codecCodes[sym] = (uint16_t)code;
+
+            // Every table index starting with this code decodes to this symbol
+            for (i = 0; i < (1 << (CODEC_MAX_BITS - len)); i++) {
+                codecTable[(code << (CODEC_MAX_BITS - len)) | i] = (unsigned char)sym;
+            }
+            code++;
+        }
+        code <<= 1;
+    }
+    codecReady = 1;
+}
+
+/*
+ * Get the largest possible encoded length for a plaintext of the given length (to size the output buffer)
+ * int len: the length of the plaintext
+*/
+static inline long codecbound(int len) {
+
+    long bits = (long)len * CODEC_MAX_BITS;
+    return CODEC_HDR_LEN + (bits + CODEC_GROUP_BITS - 1) / CODEC_GROUP_BITS * CODEC_GROUP_LEN;
+}
+
+/*
+ * Encode plaintext into a coded stream of the same alphabet
+ * Assumes the plaintext has already been validated and out can hold codecbound(len) characters
+ * const char* in: the plaintext to encode
+ * int len: the length of the plaintext
+ * char* out: the string container to hold the coded stream (not null terminated)
+ * Returns the length of the coded stream
+*/
+static int codecencode(const char* in, int len, char* out) {
+
+    uint64_t acc = 0; // Bit accumulator, the low nbits bits are pending output
+    int nbits = 0, i, j, sym, n = 0;
+    unsigned v;
+
+    codecinit();
+
+    // Write the original length header
+    v = (unsigned)len;
+    for (i = 0; i < CODEC_HDR_LEN; i++) { out[n++] = codecchar(v % 27); v /= 27; }
+
+    for (i = 0; i <= len; i++) {
+
+        if (i < len) { // Append the next code
+            sym = codecsym(in[i]);
+            acc = (acc << codecLens[sym]) | codecCodes[sym];
+            nbits += codecLens[sym];
+        }
+        else if (nbits > 0) { // Zero pad the final group
+            acc <<= CODEC_GROUP_BITS - nbits;
+            nbits = CODEC_GROUP_BITS;
+        }
+
+        // Flush every complete group as base 27 digits
+        while (nbits >= CODEC_GROUP_BITS) {
+            nbits -= CODEC_GROUP_BITS;
+            v = (unsigned)(acc >> nbits) & ((1u << CODEC_GROUP_BITS) - 1);
+            for (j = 0; j < CODEC_GROUP_LEN; j++) { out[n++] = codecchar(v % 27); v /= 27; }
+        }
+    }
+    return n;
+}
+
+/*
+ * Get the original plaintext length stored in a coded stream's header
+ * const char* in: the coded stream
+ * int len: the length of the coded stream
+ * Returns the plaintext length, or -1 if the header is missing or bad
+*/
+static long codeclength(const char* in, int len) {
+
+    long n = 0;
+    int i, d;
+
+    if (len < CODEC_HDR_LEN) { return -1; }
+    for (i = CODEC_HDR_LEN - 1; i >= 0; i--) {
+        if ((d = codecsym(in[i])) < 0) { return -1; }
+        n = n * 27 + d;
+    }
+    if (n * 3 > (long)(len - CODEC_HDR_LEN) / CODEC_GROUP_LEN * CODEC_GROUP_BITS) { return -1; } // Codes are >= 3 bits
+    return n;
+}
+
+/*
+ * Decode a coded stream back into plaintext
+ * const char* in: the coded stream
+ * int len: the length of the coded stream
+ * char* out: the string container to hold the plaintext, at least codeclength() characters (not null terminated)
+ * Returns the length of the plaintext, or -1 if the stream is corrupt
+*/
+static long codecdecode(const char* in, int len, char* out) {
+
+    uint64_t acc = 0; // Bit accumulator, the low nbits bits are pending input
+    long total, n = 0;
+    int nbits = 0, i, j, d, sym;
+    unsigned v, idx;
+
+    codecinit();
+    if ((total = codeclength(in, len)) < 0) { return -1; }
+    if ((len - CODEC_HDR_LEN) % CODEC_GROUP_LEN != 0) { return -1; }
+
+    for (i = CODEC_HDR_LEN; i <= len && n < total; i += CODEC_GROUP_LEN) {
+
+        if (i < len) { // Pull in the next group of bits
+            v = 0;
+            for (j = CODEC_GROUP_LEN - 1; j >= 0; j--) {
+                if ((d = codecsym(in[i+j])) < 0) { return -1; }
+                v = v * 27 + d;
+            }
+            if (v >= (1u << CODEC_GROUP_BITS)) { return -1; }
+            acc = (acc << CODEC_GROUP_BITS) | v;
+            nbits += CODEC_GROUP_BITS;
+        }
+
+        // Decode while a full table index is available, or drain what's left after the last group
+        while (n < total && (nbits >= CODEC_MAX_BITS || (i >= len && nbits > 0))) {
+            if (nbits >= CODEC_MAX_BITS) { idx = (unsigned)(acc >> (nbits - CODEC_MAX_BITS)); }
+            else { idx = (unsigned)(acc << (CODEC_MAX_BITS - nbits)); }
+            sym = codecTable[idx & ((1u << CODEC_MAX_BITS) - 1)];
+            if (codecLens[sym] > nbits) { return -1; } // Code runs past the end of the stream
+            nbits -= codecLens[sym];
+            out[n++] = codecchar(sym);
+        }
+    }
+    return n == total ? n : -1;
+}
+
+#endif
@@ -0,0 +1,368 @@
+/*************************************************************************************************************************
+ *
+ * NAME
+ *    otp_corpus.c
+ * SYNOPSIS
+ *    Generates plaintext corpora and matching key files for benchmark workloads.
+ * DESCRIPTION
+ *    Writes N plaintext files of valid characters (A-Z and the space character) with sizes drawn from a distribution,
+ *       and a key file for each one exactly as long as its plaintext (what keygen would make for it).
+ *    Sizes can be fixed, log-normal around a median, or bimodal (a mix of two log-normal modes, e.g. many small
+ *       messages and a few large ones).
+ *    The plaintext letter frequencies follow a profile: "english" (letter and space frequencies of English text),
+ *       "uniform" (all 27 characters equally likely, like a key) or "spaces" (English words broken up by long runs of
+ *       spaces). Keys are always uniform.
+ *    Characters come from a 65536 entry lookup table indexed by 16 bit slices of a xorshift64* generator, four
+ *       characters per random number with no branches (each character's share is rounded to 1/65536, which is close
+ *       enough for a benchmark), and files are generated in parallel by a pool of threads. Each file has its own
+ *       generator seeded from --seed and its number, so the same seed gives the same corpus no matter how many
+ *       threads made it.
+ *    A manifest listing each plaintext, its key and its size is written next to them.
+ * INSTRUCTIONS
+ *    Use the included compileall script to compile this program as well as the other programs.
+ *    Syntax:
+ *       otp_corpus [--files N] [--sizes fixed:N | lognormal:MEDIAN,SIGMA | bimodal:SMALL,LARGE,SMALL_FRACTION]
+ *                  [--profile english|uniform|spaces] [--seed N] [--threads N] [--no-keys] DIRECTORY
+ *    e.g. otp_corpus --files 1000 --sizes bimodal:200,5000000,0.9 --profile english corpus
+ *    Each file ends with a newline like the ones keygen makes, which otp_enc and otp_dec strip.
+ * AUTHOR
+ *    Written by Andrew Swaim
+ *
+*************************************************************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+typedef enum { false, true } bool; // Create bool type for C89/C99 compilation.
+
+#define TABLE_SIZE (1 << 16) // Entries in a character lookup table, one per 16 bit index
+#define CHUNK_LEN (1 << 20) // Number of characters to generate before each write
+#define MAX_SIZE 999999999 // Largest message the 9 digit length header can describe
+#define MAX_THREADS 256 // Most generator threads allowed
+#define MODE_SIGMA 0.25 // Spread of each mode of the bimodal distribution
+
+/*************************************************************************************************************************
+ * Types and Globals
+*************************************************************************************************************************/
+
+enum { SIZES_FIXED, SIZES_LOGNORMAL, SIZES_BIMODAL };
+enum { PROFILE_ENGLISH, PROFILE_UNIFORM, PROFILE_SPACES };
+
+static const char alphabet[27] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ ";
+static const int englishFreq[27] = { // Relative frequency of each character of the alphabet in English text
+    65, 12, 22, 35, 102, 18, 16, 50, 57, 1, 6, 33, 20, 57, 62, 15, 1, 49, 53, 75, 23, 8, 19, 1, 16, 1, 182
+};
+
+char englishTable[TABLE_SIZE], uniformTable[TABLE_SIZE]; // Character lookup tables
+
+int profile = PROFILE_ENGLISH; // Letter frequency profile for the plaintexts
+bool keys = true; // Whether to write a key for each plaintext
+const char* directory; // Where to write the corpus
+long* fileSizes; // Size of each file, drawn up front so the corpus doesn't depend on the thread count
+int numFiles = 100;
+unsigned long long seed; // Seed for the whole corpus
+int nextFile = 0; // Next file number to claim (shared between threads)
+pthread_mutex_t fileLock = PTHREAD_MUTEX_INITIALIZER; // Guards nextFile
+bool failed = false; // Set by any thread that couldn't write its file
+
+/*************************************************************************************************************************
+ * Function Declarations
+*************************************************************************************************************************/
+
+void buildtable(char*, const int*); // To fill a lookup table in proportion to character frequencies
+void* runworker(void*); // To generate files from one thread until they're all claimed
+bool writefile(const char*, long, int, unsigned long long); // To generate and write one plaintext or key file
+void fillchars(char*, long, const char*, unsigned long long*); // To fill a buffer from a lookup table
+void fillspaces(char*, long, unsigned long long*, long*); // To fill a buffer with English words and runs of spaces
+long drawsize(int, double, double, double, unsigned long long*); // To draw a file size from the distribution
+double normal(unsigned long long*); // To draw from the standard normal distribution
+unsigned long long nextrand(unsigned long long*); // To step a xorshift64* generator
+
+/*************************************************************************************************************************
+ * Main
+*************************************************************************************************************************/
+
+int main(int argc, char *argv[]) {
+
+    int opt, threads = (int)sysconf(_SC_NPROCESSORS_ONLN), sizeMode = SIZES_LOGNORMAL, i;
+    double a = 1000, b = 1.0, c = 0; // Distribution parameters (median and sigma by default)
+    unsigned long long sizeState;
+    long long total = 0;
+    struct timespec start, end;
+    char path[4096];
+    pthread_t pool[MAX_THREADS];
+    FILE* manifest;
+
+    static struct option longopts[] = {
+        { "files", required_argument, NULL, 'n' }, { "sizes", required_argument, NULL, 's' },
+        { "profile", required_argument, NULL, 'p' }, { "seed", required_argument, NULL, 'S' },
+        { "threads", required_argument, NULL, 't' }, { "no-keys", no_argument, NULL, 'k' }, { NULL, 0, NULL, 0 }
+    };
+
+    seed = (unsigned long long)time(0);
+
+    // Check usage & args
+    while ((opt = getopt_long(argc, argv, "n:s:p:S:t:k", longopts, NULL)) != -1) {
+        if (opt == 'n') { numFiles = atoi(optarg); }
+        else if (opt == 'S') { seed = strtoull(optarg, NULL, 10); }
+        else if (opt == 't') { threads = atoi(optarg); }
+        else if (opt == 'k') { keys = false; }
+        else if (opt == 'p') {
+            if (strcmp(optarg, "english") == 0) { profile = PROFILE_ENGLISH; }
+            else if (strcmp(optarg, "uniform") == 0) { profile = PROFILE_UNIFORM; }
+            else if (strcmp(optarg, "spaces") == 0) { profile = PROFILE_SPACES; }
+            else { fprintf(stderr, "otp_corpus: ERROR, unknown profile \'%s\'\n", optarg); exit(1); }
+        }
+        else if (opt == 's') { // Parse the distribution and its parameters
+            if (strncmp(optarg, "fixed:", 6) == 0 && sscanf(optarg + 6, "%lf", &a) == 1 && a >= 1) {
+                sizeMode = SIZES_FIXED;
+            }
+            else if (strncmp(optarg, "lognormal:", 10) == 0 && sscanf(optarg + 10, "%lf,%lf", &a, &b) == 2
+                     && a >= 1 && b >= 0) {
+                sizeMode = SIZES_LOGNORMAL;
+            }
+            else if (strncmp(optarg, "bimodal:", 8) == 0 && sscanf(optarg + 8, "%lf,%lf,%lf", &a, &b, &c) == 3
+                     && a >= 1 && b >= 1 && c >= 0 && c <= 1) {
+                sizeMode = SIZES_BIMODAL;
+            }
+            else { fprintf(stderr, "otp_corpus: ERROR, bad size distribution \'%s\'\n", optarg); exit(1); }
+        }
+        else { argc = 0; }
+    }
+    if (argc - optind != 1 || numFiles < 1 || threads < 1) {
+        fprintf(stderr, "USAGE: %s [--files N] [--sizes fixed:N | lognormal:MEDIAN,SIGMA | bimodal:SMALL,LARGE,FRACTION]\n"
+                        "       [--profile english|uniform|spaces] [--seed N] [--threads N] [--no-keys] DIRECTORY\n",
+                argv[0]);
+        exit(1);
+    }
+    if (threads > MAX_THREADS) { threads = MAX_THREADS; }
+    if (threads > numFiles) { threads = numFiles; }
+    directory = argv[optind];
+    if (mkdir(directory, 0755) < 0 && errno != EEXIST) {
+        fprintf(stderr, "otp_corpus: ERROR, creating directory \'%s\'\n", directory); exit(1);
+    }
+
+    buildtable(englishTable, englishFreq);
+    buildtable(uniformTable, NULL);
+
+    // Draw every size up front from its own generator and list them in the manifest
+    if ((fileSizes = malloc(numFiles * sizeof(long))) == NULL) { fprintf(stderr, "otp_corpus: ERROR, out of memory\n"); exit(1); }
+    sizeState = seed * 0x9E3779B97F4A7C15ULL + 1;
+    snprintf(path, sizeof(path), "%s/manifest", directory);
+    if ((manifest = fopen(path, "w")) == NULL) { fprintf(stderr, "otp_corpus: ERROR, writing \'%s\'\n", path); exit(1); }
+    for (i = 0; i < numFiles; i++) {
+        fileSizes[i] = drawsize(sizeMode, a, b, c, &sizeState);
+        total += fileSizes[i];
+        fprintf(manifest, "plaintext_%06d %s %ld\n", i, keys ? "key" : "-", fileSizes[i]);
+    }
+    fclose(manifest);
+
+    // Generate the files in parallel
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < threads; i++) {
+        if (pthread_create(&pool[i], NULL, runworker, NULL) != 0) {
+            fprintf(stderr, "otp_corpus: ERROR, creating thread\n"); exit(1);
+        }
+    }
+    for (i = 0; i < threads; i++) { pthread_join(pool[i], NULL); }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (failed) { exit(2); }
+
+    total *= keys ? 2 : 1;
+    printf("otp_corpus: %d files, %lld bytes in %.2fs (%.2f GB/s) to \'%s\'\n", numFiles * (keys ? 2 : 1), total,
+           (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9,
+           total / 1e9 / ((end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9 + 1e-9), directory);
+    return 0;
+}
+
+/*************************************************************************************************************************
+ * Function Definitions
+*************************************************************************************************************************/
+
+/*
+ * Fill a lookup table so each character takes up a share of entries proportional to its frequency
+ * char* table: the TABLE_SIZE entry table to fill
+ * const int* freq: relative frequency of each character of the alphabet, or NULL for all equal
+*/
+void buildtable(char* table, const int* freq) {
+
+    int i, j, pos = 0, sum = 0, cumulative = 0;
+
+    for (i = 0; i < 27; i++) { sum += freq ? freq[i] : 1; }
+    for (i = 0; i < 27; i++) {
+        cumulative += freq ? freq[i] : 1;
+        for (j = pos; j < (int)((long)TABLE_SIZE * cumulative / sum); j++) { table[j] = alphabet[i]; }
+        pos = j;
+    }
+}
+
+/*
+ * Claim files one at a time and write each plaintext and key until they're all done
+ * void* arg: unused
+*/
+void* runworker(void* arg) {
+
+    int n;
+    char path[4096];
+
+    (void)arg;
+    for (;;) {
+
+        pthread_mutex_lock(&fileLock);
+        n = nextFile++;
+        pthread_mutex_unlock(&fileLock);
+        if (n >= numFiles || failed) { return NULL; }
+
+        snprintf(path, sizeof(path), "%s/plaintext_%06d", directory, n);
+        if (!writefile(path, fileSizes[n], profile, seed ^ (2ULL * n + 1) * 0x9E3779B97F4A7C15ULL)) { failed = true; }
+        if (!keys) { continue; }
+        snprintf(path, sizeof(path), "%s/key_%06d", directory, n);
+        if (!writefile(path, fileSizes[n], PROFILE_UNIFORM, seed ^ (2ULL * n + 2) * 0x9E3779B97F4A7C15ULL)) {
+            failed = true;
+        }
+    }
+}
+
+/*
+ * Generate a file of characters in chunks and write it followed by a newline
+ * const char* path: the file to write
+ * long size: the number of characters to generate
+ * int prof: the letter frequency profile to use
+ * unsigned long long fileSeed: seed for this file's generator
+ * Returns true on success, false (after printing why) on failure
+*/
+bool writefile(const char* path, long size, int prof, unsigned long long fileSeed) {
+
+    static __thread char* buf = NULL; // Each thread reuses one chunk buffer
+    unsigned long long state = fileSeed ? fileSeed : 1; // xorshift64* can't start at 0
+    long done = 0, len, run = 0;
+    int fd;
+
+    if (buf == NULL && (buf = malloc(CHUNK_LEN + 1)) == NULL) {
+        fprintf(stderr, "otp_corpus: ERROR, out of memory\n"); return false;
+    }
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+        fprintf(stderr, "otp_corpus: ERROR, writing \'%s\'\n", path); return false;
+    }
+    while (done <= size) {
+
+        len = size - done < CHUNK_LEN ? size - done : CHUNK_LEN;
+        if (prof == PROFILE_SPACES) { fillspaces(buf, len, &state, &run); }
+        else { fillchars(buf, len, prof == PROFILE_ENGLISH ? englishTable : uniformTable, &state); }
+        done += len;
+        if (done == size) { buf[len++] = '\n'; done++; } // End with a newline like keygen
+
+        if (write(fd, buf, len) != len) {
+            fprintf(stderr, "otp_corpus: ERROR, writing \'%s\'\n", path); close(fd); return false;
+        }
+    }
+    close(fd);
+    return true;
+}
+
+/*
+ * Fill a buffer with characters from a lookup table, four per random number
+ * char* buf: the buffer to fill
+ * long len: the number of characters to generate
+ * const char* table: the TABLE_SIZE entry lookup table
+ * unsigned long long* state: the generator to draw from
+*/
+void fillchars(char* buf, long len, const char* table, unsigned long long* state) {
+
+    unsigned long long r;
+    long i;
+
+    for (i = 0; i + 4 <= len; i += 4) {
+        r = nextrand(state);
+        buf[i] = table[r & 0xFFFF];
+        buf[i + 1] = table[(r >> 16) & 0xFFFF];
+        buf[i + 2] = table[(r >> 32) & 0xFFFF];
+        buf[i + 3] = table[r >> 48];
+    }
+    for (r = nextrand(state); i < len; i++, r >>= 16) { buf[i] = table[r & 0xFFFF]; }
+}
+
+/*
+ * Fill a buffer with stretches of English text broken up by long runs of spaces, continuing across chunks
+ * char* buf: the buffer to fill
+ * long len: the number of characters to generate
+ * unsigned long long* state: the generator to draw from
+ * long* run: characters left in the current stretch (negative for spaces), kept between chunks
+*/
+void fillspaces(char* buf, long len, unsigned long long* state, long* run) {
+
+    long i = 0, n;
+
+    while (i < len) {
+
+        // Alternate between 1-128 characters of English and runs of 16-1024 spaces
+        if (*run == 0) {
+            *run = (long)(nextrand(state) % 128) + 1;
+            if (i > 0 && buf[i - 1] != ' ') { *run = -((long)(nextrand(state) % 1009) + 16); }
+        }
+        n = labs(*run) < len - i ? labs(*run) : len - i;
+        if (*run > 0) { fillchars(buf + i, n, englishTable, state); *run -= n; }
+        else { memset(buf + i, ' ', n); *run += n; }
+        i += n;
+    }
+}
+
+/*
+ * Draw a file size from the chosen distribution, clamped to what the protocol can send
+ * int mode: SIZES_FIXED, SIZES_LOGNORMAL or SIZES_BIMODAL
+ * double a: the fixed size, the median, or the small mode
+ * double b: the sigma of the log-normal, or the large mode
+ * double c: the fraction of small messages for the bimodal distribution
+ * unsigned long long* state: the generator to draw from
+ * Returns the size
+*/
+long drawsize(int mode, double a, double b, double c, unsigned long long* state) {
+
+    double size;
+
+    if (mode == SIZES_FIXED) { size = a; }
+    else if (mode == SIZES_LOGNORMAL) { size = a * exp(b * normal(state)); }
+    else {
+        size = (nextrand(state) >> 11) * (1.0 / 9007199254740992.0) < c ? a : b;
+        size *= exp(MODE_SIGMA * normal(state));
+    }
+    if (size < 1) { return 1; }
+    if (size > MAX_SIZE) { return MAX_SIZE; }
+    return (long)size;
+}
+
+/*
+ * Draw from the standard normal distribution (Box-Muller)
+ * unsigned long long* state: the generator to draw from
+ * Returns the sample
+*/
+double normal(unsigned long long* state) {
+
+    double u1 = ((nextrand(state) >> 11) + 1) * (1.0 / 9007199254740993.0); // (0, 1], so the log is finite
+    double u2 = (nextrand(state) >> 11) * (1.0 / 9007199254740992.0);
+
+    return sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2);
+}
+
+/*
+ * Step a xorshift64* generator
+ * unsigned long long* state: the generator's state (never 0)
+ * Returns the next 64 random bits
+*/
+unsigned long long nextrand(unsigned long long* state) {
+
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
@@ -12,8 +12,13 @@
  *    Use the included compileall script to compile this program as well as the other four programs.
  *    Make sure the decryption daemon server is running and listening on the target port before running this program.
  *    Then start this program by using the command line:
- *       otp_dec CIPHERTEXT KEY PORT
+ *       otp_dec [--compress] [--timing] CIPHERTEXT KEY PORT
  *    If successful the decrypted text will be printed to stdout.
+ *    Use --compress for ciphertext produced by otp_enc --compress, the decrypted text is then decoded back into the
+ *       original plaintext (see otp_codec.h).
+ *    With --timing, the server's timing of the request (see otp_timing.h) is read after the result and printed to
+ *       stderr next to the client's own time for it. A server that fails the id asking for it is connected to again
+ *       without asking, and the request goes ahead without the server's timing.
  * AUTHOR
  *    Written by Andrew Swaim
  *
@@ -27,12 +32,18 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netdb.h>
+#include <getopt.h>
+
+#include "otp_codec.h"
+#include "otp_timing.h"
 
 typedef enum { false, true } bool; // Create bool type for C89/C99 compilation.
 
 #define ID_LEN 7 // Number of characters to send for this client's id (in the format "otp_xxx")
 #define AUTH_LEN 4 // Number of characters to receive for the server's authorization
 #define BUF_LEN 9 // Number of digits (characters) to send for the length of the next transmission (int up to 9 digits)
+#define MAX_LEN 999999999 // Longest text or key whose length fits in BUF_LEN digits
+#define STAT_LEN 4 // Number of characters to receive for the server's validation of the text and key
 #define DEBUG false // Turn this on to true to enable debug mode
 
 /*************************************************************************************************************************
@@ -49,13 +60,32 @@ int sendrecv(int, char*, int, bool); // To send or receive data to or from a ser
 
 int main(int argc, char *argv[]) {
 
-    int sockFD, port, chars, textLen, keyLen;
+    int sockFD, port, chars, textLen, keyLen, opt;
+    long plainLen;
+    bool compress = false; // Whether the decrypted text needs to be entropy decoded
+    bool timing = false; // Whether to read and print the server's timing of the request
+    bool oldDaemon = false; // Whether the server failed the id asking for timing, so it has to go without
+    double startUs; // When the request started, for --timing
     struct sockaddr_in addr;
     struct hostent* host;
     char id[ID_LEN+1] = "otp_dec"; // To send to the server for authentication
     char auth[AUTH_LEN+1]; // To receive an authentication response from the server
+    char result[STAT_LEN+1]; // To receive the server's validation result
 
-    if (argc != 4) { fprintf(stderr, "USAGE: %s <ciphertext> <key> <port>\n", argv[0]); exit(1); } // Check usage & args
+    static struct option longopts[] = {
+        { "compress", no_argument, NULL, 'z' }, { "timing", no_argument, NULL, 't' }, { NULL, 0, NULL, 0 }
+    };
+
+    // Check usage & args, then shift the options off so argv[1] is the ciphertext
+    while ((opt = getopt_long(argc, argv, "zt", longopts, NULL)) != -1) {
+        if (opt == 'z') { compress = true; }
+        else if (opt == 't') { timing = true; }
+        else { argc = 0; }
+    }
+    if (argc - optind != 3) {
+        fprintf(stderr, "USAGE: %s [--compress] [--timing] <ciphertext> <key> <port>\n", argv[0]); exit(1);
+    }
+    argv += optind - 1;
 
     // Get and validate port number
     port = atoi(argv[3]);
@@ -69,6 +99,9 @@ int main(int argc, char *argv[]) {
 
     // Make sure the key file is longer than the ciphertext file
     if (keyLen < textLen) { fprintf(stderr, "otp_dec: ERROR, key \'%s\' is too short\n", argv[2]); exit(1); }
+    if (textLen > MAX_LEN || keyLen > MAX_LEN) { // The lengths are sent as BUF_LEN digits
+        fprintf(stderr, "otp_dec: ERROR, ciphertext or key is over %d characters\n", MAX_LEN); exit(1);
+    }
 
     // Get the contents of the ciphertext file
     char ciphertext[textLen+1]; // +1 for the ending null character
@@ -92,28 +125,39 @@ int main(int argc, char *argv[]) {
     memcpy((char*)&addr.sin_addr.s_addr, (char*)host->h_addr, host->h_length); // Copy host info to address
     if (DEBUG) { printf("DEBUG: host info processed\n"); } // DEBUG
 
-    // Create and set up the socket
-    if ((sockFD = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        fprintf(stderr, "otp_dec: ERROR opening socket\n"); exit(2); 
-    }
-    if (DEBUG) { printf("DEBUG: socket FD setup: %d\n", sockFD); } // DEBUG
+    // Connect and authorize, once more without asking for the timing trailer if the server fails the id that asks for
+    //    it (as a daemon from before --timing does, since it doesn't know that id)
+    for (;;) {
 
-    // Connect socket to address in order to connect to the server
-    if (connect(sockFD, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
-        fprintf(stderr, "otp_dec: ERROR connecting\n"); exit(2);
-    }
-    if (DEBUG) { printf("DEBUG: sending id to server: %s\n", id); } // DEBUG
+        // Create and set up the socket
+        if ((sockFD = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+            fprintf(stderr, "otp_dec: ERROR opening socket\n"); exit(2); 
+        }
+        if (DEBUG) { printf("DEBUG: socket FD setup: %d\n", sockFD); } // DEBUG
 
-    // Send id to server for authorization
-    if ((chars = sendrecv(sockFD, id, ID_LEN, true)) != ID_LEN) {
-        fprintf(stderr, "otp_dec: ERROR, only %d chars of id were sent to server on port %d\n", chars, port);
-    }
+        // Connect socket to address in order to connect to the server
+        startUs = timingnow(); // From the connect that gets the answer
+        if (connect(sockFD, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+            fprintf(stderr, "otp_dec: ERROR connecting\n"); exit(2);
+        }
+        if (DEBUG) { printf("DEBUG: sending id to server: %s\n", id); } // DEBUG
 
-    // Receive authorization response from server
-    if ((chars = sendrecv(sockFD, auth, AUTH_LEN, false)) != AUTH_LEN) {
-        fprintf(stderr, "otp_dec: ERROR, only %d chars of auth were received from server on port %d\n", chars, port);
+        // Send id to server for authorization, asking for the timing trailer with --timing
+        id[3] = timing && !oldDaemon ? TIMING_ASK : '_';
+        if ((chars = sendrecv(sockFD, id, ID_LEN, true)) != ID_LEN) {
+            fprintf(stderr, "otp_dec: ERROR, only %d chars of id were sent to server on port %d\n", chars, port);
+        }
+
+        // Receive authorization response from server
+        if ((chars = sendrecv(sockFD, auth, AUTH_LEN, false)) != AUTH_LEN) {
+            fprintf(stderr, "otp_dec: ERROR, only %d chars of auth were received from server on port %d\n", chars,
+                    port);
+        }
+        if (DEBUG) { printf("DEBUG: received auth from server: %s\n", auth); } // DEBUG
+        if (strcmp(auth, "PASS") == 0 || !timing || oldDaemon) { break; }
+        close(sockFD);
+        oldDaemon = true;
     }
-    if (DEBUG) { printf("DEBUG: received auth from server: %s\n", auth); } // DEBUG
 
     // Evaluate authorization
     if (strcmp(auth, "PASS") != 0) { 
@@ -123,7 +167,7 @@ int main(int argc, char *argv[]) {
     else { // If authorization passed
 
         // Send the ciphertext file length, up to 9 digits
-        char textLenBuf[BUF_LEN+1];
+        char textLenBuf[BUF_LEN+3]; // Room for any int, though only BUF_LEN digits are sent
         memset(textLenBuf, '\0', sizeof(textLenBuf));
         snprintf(textLenBuf, sizeof(textLenBuf), "%d", textLen); // Convert from int to string
         if ((chars = sendrecv(sockFD, textLenBuf, BUF_LEN, true)) != BUF_LEN) {
@@ -138,7 +182,7 @@ int main(int argc, char *argv[]) {
         if (DEBUG) { printf("DEBUG: ciphertext contents sent to server: %s\n", ciphertext); } // DEBUG
 
         // Send key file length
-        char keyLenBuf[BUF_LEN+1];
+        char keyLenBuf[BUF_LEN+3];
         memset(keyLenBuf, '\0', sizeof(keyLenBuf));
         snprintf(keyLenBuf, sizeof(keyLenBuf), "%d", keyLen);
         if ((chars = sendrecv(sockFD, keyLenBuf, BUF_LEN, true)) != BUF_LEN) {
@@ -152,14 +196,52 @@ int main(int argc, char *argv[]) {
         }
         if (DEBUG) { printf("DEBUG: key contents sent to server: %s\n", key); } // DEBUG
 
+        // Receive the validation result, the server only sends the result of the cipher if the text and key passed
+        if ((chars = sendrecv(sockFD, result, STAT_LEN, false)) != STAT_LEN) {
+            fprintf(stderr, "otp_dec: ERROR, only %d chars of result were received from server on port %d\n", chars, port);
+        }
+        if (strcmp(result, "PASS") != 0) {
+            if (strcmp(result, "BADT") == 0) {
+                fprintf(stderr, "otp_dec: ERROR, server found bad characters in \'%s\'\n", argv[1]);
+            }
+            else if (strcmp(result, "BADK") == 0) {
+                fprintf(stderr, "otp_dec: ERROR, server found bad characters in \'%s\'\n", argv[2]);
+            }
+            else if (strcmp(result, "BADL") == 0) {
+                fprintf(stderr, "otp_dec: ERROR, text or key is longer than the server on port %d accepts\n", port);
+            }
+            else if (strcmp(result, "SHRT") == 0) {
+                fprintf(stderr, "otp_dec: ERROR, key \'%s\' is too short\n", argv[2]);
+            }
+            else { fprintf(stderr, "otp_dec: ERROR, server rejected the request on port %d\n", port); }
+            exit(1);
+        }
+
         // Receive decrypted plaintext back
         char plaintext[textLen+1];
         if ((chars = sendrecv(sockFD, plaintext, textLen, false)) != textLen) {
             fprintf(stderr, "otp_dec: ERROR, only %d chars of encryption were recevied from server on port %d\n", chars, port);
         }
 
+        // Decode the decrypted text back into the original plaintext if it was compressed
+        char* text = plaintext;
+        if (compress) {
+            if ((plainLen = codeclength(plaintext, textLen)) < 0 || (text = malloc(plainLen + 1)) == NULL
+                || codecdecode(plaintext, textLen, text) != plainLen) {
+                fprintf(stderr, "otp_dec: ERROR, decrypted text is not a valid compressed message\n"); exit(1);
+            }
+            text[plainLen] = '\0';
+        }
+
         // Print decryption result
-        printf("%s\n", plaintext);
+        printf("%s\n", text);
+    }
+
+    // Read the server's timing of the request after the result, if asked for
+    if (timing) {
+        char trailer[TIMING_LEN+1] = ""; // Left empty for a server that can't send one, to say so
+        if (!oldDaemon) { sendrecv(sockFD, trailer, TIMING_LEN, false); }
+        timingprint("otp_dec", timingnow() - startUs, trailer);
     }
 
     close(sockFD); // Close the socket
@@ -234,7 +316,7 @@ int sendrecv(int sockFD, char* str, int len, bool sendMode) {
 
         if (sendMode) { n = send(sockFD, str+total, rem, 0); }
         else { n = recv(sockFD, str+total, rem, 0); }
-        if (n == -1) { break; }
+        if (n <= 0) { break; } // Stop on an error or if the other side closed the connection
         total += n;
         rem -= n;
         if (DEBUG) { printf("DEBUG: bytes sent/recv: %d\nbytes total: %d\nbytes rem:%d\n", n, total, rem); } // DEBUG
@@ -12,8 +12,16 @@
  *    Use the included compileall script to compile this program as well as the other four programs.
  *    Make sure the encryption daemon server is running and listening on the target port before running this program.
  *    Then start this program by using the command line:
- *       otp_enc PLAINTEXT KEY PORT
+ *       otp_enc [--compress] [--sanitize[=drop]] [--timing] PLAINTEXT KEY PORT
  *    If successful the encrypted text will be printed to stdout.
+ *    With --compress the plaintext is entropy coded before it is encrypted (see otp_codec.h), which uses up fewer key
+ *       characters on English-like text. The result must then be decrypted with otp_dec --compress.
+ *    With --sanitize, lowercase letters in the plaintext are folded to uppercase, any other bad character (punctuation,
+ *       digits, tabs, inner newlines) is replaced by a space (or removed with --sanitize=drop), and trailing newlines
+ *       are stripped, instead of the whole file being rejected.
+ *    With --timing, the server's timing of the request (see otp_timing.h) is read after the result and printed to
+ *       stderr next to the client's own time for it. A server that fails the id asking for it is connected to again
+ *       without asking, and the request goes ahead without the server's timing.
  * AUTHOR
  *    Written by Andrew Swaim
  *
@@ -27,20 +35,31 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netdb.h>
+#include <getopt.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "otp_codec.h"
+#include "otp_timing.h"
 
 typedef enum { false, true } bool; // Create bool type for C89/C99 compilation.
 
 #define ID_LEN 7 // Number of characters to send for this client's id (in the format "otp_xxx")
 #define AUTH_LEN 4 // Number of characters to receive for the server's authorization
 #define BUF_LEN 9 // Number of digits (characters) to send for the length of the next transmission (int up to 9 digits)
+#define MAX_LEN 999999999 // Longest text or key whose length fits in BUF_LEN digits
+#define STAT_LEN 4 // Number of characters to receive for the server's validation of the text and key
 #define DEBUG false // Turn this on to true to enable debug mode
 
+enum { STRICT, SANITIZE, SANITIZE_DROP }; // How loadfile() treats bad characters
+
 /*************************************************************************************************************************
  * Function Declarations
 *************************************************************************************************************************/
 
-int scanfile(char*); // To get a file content's length up to the newline and validate bad characters
-void readfile(char*, char*, int); // To get the content of a file up to the newline character
+char* loadfile(char*, int*, int); // To read a file's content up to the newline and validate (or sanitize) it
+int cleantext(char*, int, int); // To validate or sanitize a buffer of text in place
 int sendrecv(int, char*, int, bool); // To send or receive data to or from a server
 
 /*************************************************************************************************************************
@@ -49,13 +68,34 @@ int sendrecv(int, char*, int, bool); // To send or receive data to or from a ser
 
 int main(int argc, char *argv[]) {
 
-    int sockFD, port, chars, textLen, keyLen;
+    int sockFD, port, chars, textLen, keyLen, sendLen, opt, mode = STRICT;
+    bool compress = false; // Whether to entropy code the plaintext before sending it
+    bool timing = false; // Whether to read and print the server's timing of the request
+    bool oldDaemon = false; // Whether the server failed the id asking for timing, so it has to go without
+    double startUs; // When the request started, for --timing
     struct sockaddr_in addr;
     struct hostent* host;
     char id[ID_LEN+1] = "otp_enc"; // To send to the server for authentication
     char auth[AUTH_LEN+1]; // To receive an authentication response from the server
-
-    if (argc != 4) { fprintf(stderr, "USAGE: %s <plaintext> <key> <port>\n", argv[0]); exit(1); } // Check usage & args
+    char result[STAT_LEN+1]; // To receive the server's validation result
+
+    static struct option longopts[] = {
+        { "compress", no_argument, NULL, 'z' }, { "sanitize", optional_argument, NULL, 's' },
+        { "timing", no_argument, NULL, 't' }, { NULL, 0, NULL, 0 }
+    };
+
+    // Check usage & args, then shift the options off so argv[1] is the plaintext
+    while ((opt = getopt_long(argc, argv, "zs::t", longopts, NULL)) != -1) {
+        if (opt == 'z') { compress = true; }
+        else if (opt == 't') { timing = true; }
+        else if (opt == 's' && optarg == NULL) { mode = SANITIZE; }
+        else if (opt == 's' && strcmp(optarg, "drop") == 0) { mode = SANITIZE_DROP; }
+        else { argc = 0; }
+    }
+    if (argc - optind != 3) {
+        fprintf(stderr, "USAGE: %s [--compress] [--sanitize[=drop]] [--timing] <plaintext> <key> <port>\n", argv[0]); exit(1);
+    }
+    argv += optind - 1;
 
     // Get and validate port number
     port = atoi(argv[3]);
@@ -63,23 +103,30 @@ int main(int argc, char *argv[]) {
     if (port < 50000) { printf("otp_enc: WARNING, recommended to use a port number above 50000\n"); }
     if (DEBUG) { printf("DEBUG: using port: %d\n", port); } // DEBUG
 
-    // Get the length of the files (up to the newline character) and validate their contents
-    if ((textLen = scanfile(argv[1])) < 1) { fprintf(stderr, "otp_enc: ERROR, plaintext file cannot be empty\n"); exit(1); } 
-    if ((keyLen = scanfile(argv[2])) < 1) { fprintf(stderr, "otp_enc: ERROR, key file cannot be empty\n"); exit(1); }
-
-    // Make sure the key file is longer than the plaintext file
-    if (keyLen < textLen) { fprintf(stderr, "otp_enc: ERROR, key \'%s\' is too short\n", argv[2]); exit(1); }
-
-    // Get the contents of the plaintext file
-    char plaintext[textLen+1]; // +1 for the ending null character
-    readfile(argv[1], plaintext, sizeof(plaintext));
+    // Get the contents of the files (up to the newline character), validating or sanitizing them as they're loaded
+    char* plaintext = loadfile(argv[1], &textLen, mode);
+    if (textLen < 1) { fprintf(stderr, "otp_enc: ERROR, plaintext file cannot be empty\n"); exit(1); } 
     if (DEBUG) { printf("DEBUG: plaintext file contents read: %s\n", plaintext); } // DEBUG
-
-    // Get the contents of the key file
-    char key[keyLen+1];
-    readfile(argv[2], key, sizeof(key));
+    char* key = loadfile(argv[2], &keyLen, STRICT);
+    if (keyLen < 1) { fprintf(stderr, "otp_enc: ERROR, key file cannot be empty\n"); exit(1); }
     if (DEBUG) { printf("DEBUG: key file contents read: %s\n", key); } // DEBUG
 
+    // Entropy code the plaintext if asked, the coded text is what gets encrypted
+    char* text = plaintext;
+    sendLen = textLen;
+    if (compress) {
+        if ((text = malloc(codecbound(textLen) + 1)) == NULL) { fprintf(stderr, "otp_enc: ERROR, out of memory\n"); exit(1); }
+        sendLen = codecencode(plaintext, textLen, text);
+        text[sendLen] = '\0';
+        if (DEBUG) { printf("DEBUG: plaintext compressed from %d to %d chars\n", textLen, sendLen); } // DEBUG
+    }
+
+    // Make sure the key file is longer than the (possibly compressed) plaintext
+    if (keyLen < sendLen) { fprintf(stderr, "otp_enc: ERROR, key \'%s\' is too short\n", argv[2]); exit(1); }
+    if (sendLen > MAX_LEN || keyLen > MAX_LEN) { // The lengths are sent as BUF_LEN digits
+        fprintf(stderr, "otp_enc: ERROR, plaintext or key is over %d characters\n", MAX_LEN); exit(1);
+    }
+
     // Set up the server address struct 
     memset((char*)&addr, '\0', sizeof(addr)); // Clear out the address struct
     addr.sin_family = AF_INET; // Create a network-capable socket
@@ -92,28 +139,39 @@ int main(int argc, char *argv[]) {
     memcpy((char*)&addr.sin_addr.s_addr, (char*)host->h_addr, host->h_length); // Copy host info to address
     if (DEBUG) { printf("DEBUG: host info processed\n"); } // DEBUG
 
-    // Create and set up the socket
-    if ((sockFD = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        fprintf(stderr, "otp_enc: ERROR opening socket\n"); exit(2); 
-    }
-    if (DEBUG) { printf("DEBUG: socket FD setup: %d\n", sockFD); } // DEBUG
+    // Connect and authorize, once more without asking for the timing trailer if the server fails the id that asks for
+    //    it (as a daemon from before --timing does, since it doesn't know that id)
+    for (;;) {
 
-    // Connect socket to address in order to connect to the server
-    if (connect(sockFD, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
-        fprintf(stderr, "otp_enc: ERROR connecting\n"); exit(2);
-    }
+        // Create and set up the socket
+        if ((sockFD = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+            fprintf(stderr, "otp_enc: ERROR opening socket\n"); exit(2); 
+        }
+        if (DEBUG) { printf("DEBUG: socket FD setup: %d\n", sockFD); } // DEBUG
 
-    // Send id to server for authorization
-    if (DEBUG) { printf("DEBUG: sending id to server: %s\n", id); } // DEBUG
-    if ((chars = sendrecv(sockFD, id, ID_LEN, true)) != ID_LEN) {
-        fprintf(stderr, "otp_enc: ERROR, only %d chars of id were sent to server on port %d\n", chars, port);
-    }
+        // Connect socket to address in order to connect to the server
+        startUs = timingnow(); // From the connect that gets the answer
+        if (connect(sockFD, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+            fprintf(stderr, "otp_enc: ERROR connecting\n"); exit(2);
+        }
+
+        // Send id to server for authorization, asking for the timing trailer with --timing
+        id[3] = timing && !oldDaemon ? TIMING_ASK : '_';
+        if (DEBUG) { printf("DEBUG: sending id to server: %s\n", id); } // DEBUG
+        if ((chars = sendrecv(sockFD, id, ID_LEN, true)) != ID_LEN) {
+            fprintf(stderr, "otp_enc: ERROR, only %d chars of id were sent to server on port %d\n", chars, port);
+        }
 
-    // Receive authorization response from server
-    if ((chars = sendrecv(sockFD, auth, AUTH_LEN, false)) != AUTH_LEN) {
-        fprintf(stderr, "otp_enc: ERROR, only %d chars of auth were received from server on port %d\n", chars, port);
+        // Receive authorization response from server
+        if ((chars = sendrecv(sockFD, auth, AUTH_LEN, false)) != AUTH_LEN) {
+            fprintf(stderr, "otp_enc: ERROR, only %d chars of auth were received from server on port %d\n", chars,
+                    port);
+        }
+        if (DEBUG) { printf("DEBUG: received auth from server: %s\n", auth); } // DEBUG
+        if (strcmp(auth, "PASS") == 0 || !timing || oldDaemon) { break; }
+        close(sockFD);
+        oldDaemon = true;
     }
-    if (DEBUG) { printf("DEBUG: received auth from server: %s\n", auth); } // DEBUG
 
     // Evaluate authorization
     if (strcmp(auth, "PASS") != 0) { 
@@ -123,22 +181,22 @@ int main(int argc, char *argv[]) {
     else { // If authorization passed
 
         // Send the plaintext file length, up to 9 digits
-        char textLenBuf[BUF_LEN+1];
+        char textLenBuf[BUF_LEN+3]; // Room for any int, though only BUF_LEN digits are sent
         memset(textLenBuf, '\0', sizeof(textLenBuf));
-        snprintf(textLenBuf, sizeof(textLenBuf), "%d", textLen); // Convert from int to string
+        snprintf(textLenBuf, sizeof(textLenBuf), "%d", sendLen); // Convert from int to string
         if ((chars = sendrecv(sockFD, textLenBuf, BUF_LEN, true)) != BUF_LEN) {
             fprintf(stderr, "otp_enc: ERROR, only %d chars of textLen were sent to server on port %d\n", chars, port);
         }
         if (DEBUG) { printf("DEBUG: text length sent to server: %s\n", textLenBuf); } // DEBUG
 
         // Send plaintext file contents
-        if ((chars = sendrecv(sockFD, plaintext, textLen, true)) != textLen) {
+        if ((chars = sendrecv(sockFD, text, sendLen, true)) != sendLen) {
             fprintf(stderr, "otp_enc: ERROR, only %d chars of plaintext were sent to server on port %d\n", chars, port);
         }
-        if (DEBUG) { printf("DEBUG: plainttext contents sent to server: %s\n", plaintext); } // DEBUG
+        if (DEBUG) { printf("DEBUG: plainttext contents sent to server: %s\n", text); } // DEBUG
 
         // Send key file length
-        char keyLenBuf[BUF_LEN+1];
+        char keyLenBuf[BUF_LEN+3];
         memset(keyLenBuf, '\0', sizeof(keyLenBuf));
         snprintf(keyLenBuf, sizeof(keyLenBuf), "%d", keyLen);
         if ((chars = sendrecv(sockFD, keyLenBuf, BUF_LEN, true)) != BUF_LEN) {
@@ -152,9 +210,30 @@ int main(int argc, char *argv[]) {
         }
         if (DEBUG) { printf("DEBUG: key contents sent to server: %s\n", key); } // DEBUG
 
+        // Receive the validation result, the server only sends the result of the cipher if the text and key passed
+        if ((chars = sendrecv(sockFD, result, STAT_LEN, false)) != STAT_LEN) {
+            fprintf(stderr, "otp_enc: ERROR, only %d chars of result were received from server on port %d\n", chars, port);
+        }
+        if (strcmp(result, "PASS") != 0) {
+            if (strcmp(result, "BADT") == 0) {
+                fprintf(stderr, "otp_enc: ERROR, server found bad characters in \'%s\'\n", argv[1]);
+            }
+            else if (strcmp(result, "BADK") == 0) {
+                fprintf(stderr, "otp_enc: ERROR, server found bad characters in \'%s\'\n", argv[2]);
+            }
+            else if (strcmp(result, "BADL") == 0) {
+                fprintf(stderr, "otp_enc: ERROR, text or key is longer than the server on port %d accepts\n", port);
+            }
+            else if (strcmp(result, "SHRT") == 0) {
+                fprintf(stderr, "otp_enc: ERROR, key \'%s\' is too short\n", argv[2]);
+            }
+            else { fprintf(stderr, "otp_enc: ERROR, server rejected the request on port %d\n", port); }
+            exit(1);
+        }
+
         // Receive encrypted cyphertext back
-        char cyphertext[textLen+1];
-        if ((chars = sendrecv(sockFD, cyphertext, textLen, false)) != textLen) {
+        char cyphertext[sendLen+1];
+        if ((chars = sendrecv(sockFD, cyphertext, sendLen, false)) != sendLen) {
             fprintf(stderr, "otp_enc: ERROR, only %d chars of encryption were recevied from server on port %d\n", chars, port);
         }
 
@@ -162,6 +241,13 @@ int main(int argc, char *argv[]) {
         printf("%s\n", cyphertext);
     }
 
+    // Read the server's timing of the request after the result, if asked for
+    if (timing) {
+        char trailer[TIMING_LEN+1] = ""; // Left empty for a server that can't send one, to say so
+        if (!oldDaemon) { sendrecv(sockFD, trailer, TIMING_LEN, false); }
+        timingprint("otp_enc", timingnow() - startUs, trailer);
+    }
+
     close(sockFD); // Close the socket
     return 0;
 }
@@ -171,46 +257,97 @@ int main(int argc, char *argv[]) {
 *************************************************************************************************************************/
 
 /*
- * Get the length of a file's contents up to the newline character, and also check that there are no bad characters
- * char* filename: the name of the file to scan
-*/ 
-int scanfile(char* filename) {
+ * Read a file's contents up to the newline character in one read, then validate or sanitize them in one pass
+ * Exits with an error if the file can't be read, or has bad characters in STRICT mode
+ * char* filename: the name of the file to load
+ * int* len: set to the length of the contents (not including the newline)
+ * int mode: STRICT to reject bad characters, SANITIZE to replace them with spaces, or SANITIZE_DROP to remove them
+ * Returns the null terminated contents, which the caller owns
+*/
+char* loadfile(char* filename, int* len, int mode) {
 
     FILE* fd; // File descriptor
-    int length = 0; // Length of the file (not including the newline)
-    char c; // Character to be processed
-
-    // Try to open the file
-    if ((fd = fopen(filename, "r")) == NULL) { fprintf(stderr, "otp_dec: ERROR, opening file \'%s\'\n", filename); exit(1); }
-    if (DEBUG) { printf("DEBUG: file \'%s\' opened for scanning\n", filename); } // DEBUG
-
-    // Loop through each character in the file until a newline is reached
-    while ((c = fgetc(fd)) != '\n') { 
-        
-        if (DEBUG) { printf("DEBUG: character retrieved from file: %c\n", c); } // DEBUG
-        if (c == ' ' || (c >= 'A' && c <= 'Z')) { length++; } // If valid increase the count
-        else { fprintf(stderr, "otp_dec: ERROR, \'%s\' contains bad characters\n", filename); exit(1); }
-    }
+    char* str = NULL; // Contents of the file
+    size_t size = 0, cap = 0, n; // Bytes read so far, bytes allocated, bytes read by each fread()
 
+    if ((fd = fopen(filename, "r")) == NULL) { fprintf(stderr, "otp_enc: ERROR, opening file \'%s\'\n", filename); exit(1); }
+    if (fseek(fd, 0, SEEK_END) == 0) { cap = ftell(fd) + 2; rewind(fd); } // Size regular files so one fread() hits EOF
+
+    // Read the whole file, growing the buffer for pipes and other unsized files
+    do {
+        if (str == NULL || size + 1 >= cap) {
+            if (size + 1 >= cap) { cap = cap < 4096 ? 4096 : cap * 2; }
+            if ((str = realloc(str, cap)) == NULL) { fprintf(stderr, "otp_enc: ERROR, out of memory\n"); exit(1); }
+        }
+        size += (n = fread(str + size, 1, cap - size - 1, fd));
+    } while (n > 0 && !feof(fd));
     fclose(fd); // Close the file
-    if (DEBUG) { printf("DEBUG: file \'%s\' closed after scanning\nlength to return: %d\n", filename, length); } // DEBUG
-    return length; // Return the length of the file
+    if (size > 999999999) { fprintf(stderr, "otp_enc: ERROR, file \'%s\' is too large\n", filename); exit(1); }
+
+    if ((*len = cleantext(str, (int)size, mode)) < 0) {
+        fprintf(stderr, "otp_enc: ERROR, \'%s\' contains bad characters\n", filename); exit(1);
+    }
+    str[*len] = '\0';
+    if (DEBUG) { printf("DEBUG: file \'%s\' loaded\nlength to return: %d\n", filename, *len); } // DEBUG
+    return str;
 }
 
 /*
- * Get and store the contents of a file up to the ending newline character
- * char* filename: the name of the file
- * char* str: the string container to hold the contents of the file
- * int len: the length of the content to get up to the newline character (as discovered by scanfile())
+ * Validate or sanitize text in place, 16 characters at a time with SSE2 where available
+ * In STRICT mode the text ends at the first newline, which must be preceded by only spaces and capital letters.
+ * In the SANITIZE modes, trailing newlines are stripped, lowercase is folded to uppercase, and every other bad character
+ *    is replaced by a space or dropped.
+ * char* str: the text to process
+ * int len: the length of the text
+ * int mode: STRICT, SANITIZE or SANITIZE_DROP
+ * Returns the resulting length, or -1 if a bad character was found in STRICT mode
 */
-void readfile(char* filename, char* str, int len) {
+int cleantext(char* str, int len, int mode) {
 
-    FILE* fd; // File descriptor
+    int i = 0, n = 0, end, bad = 0;
+    char c;
 
-    memset(str, '\0', len); // Clear the string
-    if ((fd = fopen(filename, "r")) == NULL) { fprintf(stderr, "otp_dec: ERROR, opening file \'%s\'\n", filename); exit(1); }
-    fgets(str, len, fd); // Store the contents
-    fclose(fd); // Close the file
+    if (mode != STRICT) { while (len > 0 && (str[len-1] == '\n' || str[len-1] == '\r')) { len--; } }
+
+    while (i < len) {
+
+        end = len; // Where the scalar loop below stops, the end of the text unless a vector needs a closer look
+#ifdef __SSE2__
+        const __m128i below = _mm_set1_epi8('A' - 1), above = _mm_set1_epi8('Z' + 1), space = _mm_set1_epi8(' ');
+        const __m128i lowBelow = _mm_set1_epi8('a' - 1), lowAbove = _mm_set1_epi8('z' + 1), caseBit = _mm_set1_epi8(0x20);
+
+        for (; i + 16 <= len; i += 16, n += 16) {
+
+            __m128i x = _mm_loadu_si128((const __m128i*)(str + i));
+
+            if (mode != STRICT) { // Fold lowercase to uppercase (signed compares leave bytes >= 0x80 alone)
+                __m128i lower = _mm_and_si128(_mm_cmpgt_epi8(x, lowBelow), _mm_cmplt_epi8(x, lowAbove));
+                x = _mm_sub_epi8(x, _mm_and_si128(lower, caseBit));
+            }
+            __m128i valid = _mm_or_si128(_mm_and_si128(_mm_cmpgt_epi8(x, below), _mm_cmplt_epi8(x, above)),
+                                         _mm_cmpeq_epi8(x, space));
+            bad = ~_mm_movemask_epi8(valid) & 0xFFFF;
+
+            if (mode == SANITIZE) { x = _mm_or_si128(_mm_and_si128(valid, x), _mm_andnot_si128(valid, space)); }
+            else if (bad) { end = i + 16; break; } // Hand this vector to the scalar loop
+            _mm_storeu_si128((__m128i*)(str + n), x);
+        }
+#endif
+
+        // Process a vector with bad characters, or the tail, one character at a time
+        for (; i < end; i++) {
+
+            c = str[i];
+            if (mode != STRICT && c >= 'a' && c <= 'z') { c -= 0x20; }
+            if (c != ' ' && (c < 'A' || c > 'Z')) {
+                if (mode == STRICT) { return c == '\n' ? n : -1; }
+                if (mode == SANITIZE_DROP) { continue; }
+                c = ' ';
+            }
+            str[n++] = c;
+        }
+    }
+    return n;
 }
 
 /*
@@ -232,7 +369,7 @@ int sendrecv(int sockFD, char* str, int len, bool sendMode) {
 
         if (sendMode) { n = send(sockFD, str+total, rem, 0); }
         else { n = recv(sockFD, str+total, rem, 0); }
-        if (n == -1) { break; }
+        if (n <= 0) { break; } // Stop on an error or if the other side closed the connection
         total += n;
         rem -= n;
         if (DEBUG) { printf("DEBUG: bytes sent/recv: %d\nbytes total: %d\nbytes rem:%d\n", n, total, rem); } // DEBUG
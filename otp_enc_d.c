@@ -15,6 +15,39 @@
  *    Then start this program running in the background by using the command:
  *       otp_enc_c PORT &
  *    If successful, this daemon will run in the background listening for connections forever until its manually killed.
+ *    Start it with --capture FILE to append a line of metadata about every request (arrival time, lengths, status and
+ *       phase timings, never the text or key) to FILE for otp_replay (see otp_capture.h):
+ *       otp_enc_d --capture FILE PORT &
+ *    Start it with --tune FILE to load per message size chunk and socket buffer sizes recommended by otp_sweep (see
+ *       otp_tune.h).
+ *    Start it with --adapt instead to size the socket buffers from a histogram of the message sizes it actually sees,
+ *       rebuilt every few hundred connections (see otp_adapt.h).
+ *    Start it with --max-len N to reject texts and keys longer than N characters with BADL (999999999 by default, all
+ *       the 9 digit length header can send). Either way, each text and key buffer starts no bigger than the size
+ *       classes seen so far call for and only grows as the characters actually arrive (see otp_adapt.h).
+ *    Start it with --calibrate FILE to time the cipher kernel tiers and a few chunk sizes on this CPU and use the
+ *       fastest, caching the choice in FILE so later starts on the same machine reuse it without the delay (see
+ *       otp_calibrate.h). A --tune file still takes precedence for the chunk size of the messages it covers.
+ *    Send it SIGUSR1 to print the peak memory of its request processes so far by message size (see otp_memstat.h):
+ *       kill -USR1 <pid>
+ *    Start it with --metrics PORT to serve Prometheus text format metrics (request counts by outcome, bytes, active
+ *       connections, listen queue depth and phase latency histograms) at http://HOST:PORT/metrics (see otp_metrics.h).
+ *    Start it with --stats to publish live counters in the shared memory segment /otp_stats_PORT for otp_top to
+ *       watch (see otp_stats.h).
+ *    Start it with --flight FILE to keep compact records of the last few thousand requests (sizes, phase timings, peer
+ *       and outcome) in memory, and send it SIGUSR2 to dump them to FILE for otp_flight to decode (see otp_flight.h):
+ *       kill -USR2 <pid>
+ *    Start it with --admin PATH to take commands on a Unix socket at PATH while it runs: change the most request
+ *       processes it runs at once, its accept rate limit, listen backlog and log level, dump its stats or flight
+ *       recorder, or drain it (see otp_admin.h). otp_admin sends them:
+ *       otp_admin PATH workers 8
+ *    Start it with --scale MIN:MAX to have it grow and shrink that limit between MIN and MAX by itself, from how long
+ *       connections wait in the listen queue and how busy the CPU is (see otp_scale.h).
+ *    USDT tracepoints at accept, the authorization result, each length header, each payload, the cipher and the reply
+ *       let perf or bpftrace trace requests in a running daemon (see otp_probe.h).
+ *    Errors and other messages go to stderr through an asynchronous logger (see otp_log.h), as logfmt lines. Start it
+ *       with --log-level LEVEL (error, warn, info or debug; warn by default) to choose which are logged, and send it
+ *       SIGHUP to toggle debug messages while it runs. Texts and keys are never logged, only their lengths and hashes.
  * AUTHOR
  *    Written by Andrew Swaim
  *
@@ -28,20 +61,38 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <getopt.h>
+#include <errno.h>
+
+#include "otp_kernels.h"
+#include "otp_capture.h"
+#include "otp_tune.h"
+#include "otp_calibrate.h"
+#include "otp_memstat.h"
+#include "otp_metrics.h"
+#include "otp_log.h"
+#include "otp_probe.h"
+#include "otp_stats.h"
+#include "otp_flight.h"
+#include "otp_adapt.h"
+#include "otp_admin.h"
 
 typedef enum { false, true } bool; // Create bool type for C89/C99 compilation.
 
 #define ID_LEN 7 // Number of characters to receive for client id (in the format "otp_xxx")
 #define AUTH_LEN 4 // Number of characters to send for authorization ("PASS" or "FAIL")
 #define BUF_LEN 9 // Number of digits (characters) to receive for the length of the next transmission (int up to 9 digits)
-#define DEBUG false // Turn this on to true to enable debug mode
+#define STAT_LEN 4 // Number of characters to send for the validation result ("PASS", "BADL", "BADT", "BADK" or "SHRT")
+#define MAX_LEN 999999999 // Longest text or key the length header can describe
 
 /*************************************************************************************************************************
  * Function Declarations
 *************************************************************************************************************************/
 
 int sendrecv(int, char*, int, bool); // To send or receive data to or from a client
-void encrypt(char*, char*, char*, int); // To encrypt the plaintext received from a client
+int recvvalid(int, char**, int, int, bool*); // To receive text from a client, validating it as it arrives
+void reapchildren(void); // To reap any child processes that have finished
 
 /*************************************************************************************************************************
  * Main 
@@ -49,20 +100,78 @@ void encrypt(char*, char*, char*, int); // To encrypt the plaintext received fro
 
 int main(int argc, char *argv[]) {
 
-    int listeningFD, connectedFD, port, chars, textLen, keyLen, status;
+    int listeningFD, connectedFD, port, chars, textLen, keyLen, opt, ready;
+    int maxLen = MAX_LEN; // Longest text or key to accept
     socklen_t clientSize;
     struct sockaddr_in server, client;
     pid_t pid;
     char id[ID_LEN+1]; // Client ID for authrization
     char auth[AUTH_LEN+1]; // Authorization result to send to client
+    char result[STAT_LEN+1]; // Validation result to send to client before any ciphertext
+    bool textOK, keyOK; // Whether the received text and key contained only valid characters
+    char* calibrateFile = NULL; // Calibration cache, if calibrating
+    char trailer[TIMING_LEN+1]; // Server side timing of the request to send after the result
+    bool wantTiming = false; // Whether the client asked for the trailer
+    int metricsPort = -1; // Port to serve metrics on, if serving them
+    bool stats = false; // Whether to publish live counters for otp_top
+    bool adapt = false; // Whether to size socket buffers from the message sizes seen
+    char classes[512]; // The adapted size classes, for the log
+    char* adminFile = NULL; // Admin socket, if taking commands
     
-    if (argc != 2) { fprintf(stderr, "USAGE: %s <port>\n", argv[0]); exit(1); } // Check usage & args
+    static struct option longopts[] = {
+        { "capture", required_argument, NULL, 'c' }, { "tune", required_argument, NULL, 't' },
+        { "calibrate", required_argument, NULL, 'C' }, { "metrics", required_argument, NULL, 'm' },
+        { "log-level", required_argument, NULL, 'l' }, { "stats", no_argument, NULL, 's' },
+        { "flight", required_argument, NULL, 'f' }, { "adapt", no_argument, NULL, 'a' },
+        { "admin", required_argument, NULL, 'A' }, { "max-len", required_argument, NULL, 'L' },
+        { "scale", required_argument, NULL, 'S' }, { NULL, 0, NULL, 0 }
+    };
+
+    // Check usage & args, then shift the options off so argv[1] is the port
+    while ((opt = getopt_long(argc, argv, "c:t:C:m:l:sf:aA:S:L:", longopts, NULL)) != -1) {
+        if (opt == 'c' && captureopen(optarg, "otp_enc_d") < 0) {
+            fprintf(stderr, "otp_enc_d: ERROR, opening capture file \'%s\'\n", optarg); exit(2);
+        }
+        else if (opt == 't' && tuneload(optarg, "tcp") < 0) {
+            fprintf(stderr, "otp_enc_d: ERROR, reading tuning file \'%s\'\n", optarg); exit(2);
+        }
+        else if (opt == 'f' && flightopen(optarg, "otp_enc_d") < 0) {
+            fprintf(stderr, "otp_enc_d: ERROR, mapping the flight recorder\n"); exit(2);
+        }
+        else if (opt == 'C') { calibrateFile = optarg; }
+        else if (opt == 'm') { metricsPort = atoi(optarg); }
+        else if (opt == 's') { stats = true; }
+        else if (opt == 'a') { adapt = true; }
+        else if (opt == 'A') { adminFile = optarg; }
+        else if (opt == 'L' && ((maxLen = atoi(optarg)) < 1 || maxLen > MAX_LEN)) {
+            fprintf(stderr, "otp_enc_d: ERROR, bad maximum length \'%s\' (1 to %d)\n", optarg, MAX_LEN); exit(1);
+        }
+        else if (opt == 'S' && adminscale(optarg) < 0) {
+            fprintf(stderr, "otp_enc_d: ERROR, bad scale bounds \'%s\' (MIN:MAX, 1 <= MIN <= MAX)\n", optarg); exit(1);
+        }
+        else if (opt == 'l' && (logLevel = loglevel(optarg)) < 0) {
+            fprintf(stderr, "otp_enc_d: ERROR, unknown log level \'%s\' (error, warn, info or debug)\n", optarg); exit(1);
+        }
+        else if (opt != 'c' && opt != 't' && opt != 'f' && opt != 'l' && opt != 'S' && opt != 'L') { argc = 0; }
+    }
+    if (adapt && tuneCount > 0) {
+        fprintf(stderr, "otp_enc_d: ERROR, --adapt and --tune can't be used together\n"); exit(1);
+    }
+    if (argc - optind != 1) {
+        fprintf(stderr, "USAGE: %s [--capture FILE] [--tune FILE] [--calibrate FILE] [--metrics PORT] [--log-level LEVEL]"
+                        " [--stats]\n       [--flight FILE] [--adapt] [--admin PATH] [--scale MIN:MAX] [--max-len N]"
+                        " <port>\n", argv[0]);
+        exit(1);
+    }
+    argv += optind - 1;
 
     // Get and validate port number as integer not string
     port = atoi(argv[1]);
     if (port < 0 || port > 65535) { fprintf(stderr, "otp_enc_d: ERROR, invalid port %d\n", port); exit(2); }
-    if (port < 50000) { printf("otp_enc_d: WARNING, recommended to use a port number above 50000\n"); }
-    if (DEBUG) { printf("DEBUG: using port: %d\n", port); } // DEBUG
+    logopen("otp_enc_d"); // Log through the drain process from here on (or straight to stderr if it can't start)
+    if (port < 50000) { logmsg(LEVEL_WARN, "recommended to use a port number above 50000"); }
+    if (calibrateFile != NULL) { calibrate(calibrateFile); } // Pick the cipher tier and chunk size
+    logmsg(LEVEL_DEBUG, "using port: %d", port);
 
     // Set up the address struct for this process (the server)
     memset((char *)&server, '\0', sizeof(server)); // Clear out the address struct
@@ -74,46 +183,93 @@ int main(int argc, char *argv[]) {
     if ((listeningFD = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
         fprintf(stderr, "otp_enc_d: ERROR, opening socket\n"); exit(2);
     }
-    if (DEBUG) { printf("DEBUG: listening ocket FD setup: %d\n", listeningFD); } // DEBUG
+    logmsg(LEVEL_DEBUG, "listening socket FD setup: %d", listeningFD);
+
+    // Allow restarting on the same port while connections from the last run are still in TIME_WAIT
+    setsockopt(listeningFD, SOL_SOCKET, SO_REUSEADDR, &(int){ 1 }, sizeof(int));
 
     // Enable the socket to begin listening
     if (bind(listeningFD, (struct sockaddr *)&server, sizeof(server)) < 0) { // Connect socket to port
         fprintf(stderr, "otp_enc_d: ERROR, on binding\n"); exit(2);
     }
     listen(listeningFD, 5); // Flip the socket on - it can now receive up to 5 connections
-    if (DEBUG) { printf("DEBUG: socket binded and now listening for connections\n"); } // DEBUG
+    logmsg(LEVEL_DEBUG, "socket binded and now listening for connections");
+
+    memstatopen(); // Track request memory by message size, reported on SIGUSR1
+    timingcalibrate(); // Measure the TSC rate for the phase timings
+    if (metricsPort >= 0 && metricsopen(metricsPort, "otp_enc_d", listeningFD) < 0) {
+        fprintf(stderr, "otp_enc_d: ERROR, serving metrics on port %d\n", metricsPort); exit(2);
+    }
+    if (stats && statsopen(port, "otp_enc_d", 5) < 0) {
+        fprintf(stderr, "otp_enc_d: ERROR, creating the stats segment for port %d\n", port); exit(2);
+    }
+    if (adapt && adaptopen() < 0) { fprintf(stderr, "otp_enc_d: ERROR, mapping the size histogram\n"); exit(2); }
+    if (adminFile != NULL && adminopen(adminFile, 5) < 0) {
+        fprintf(stderr, "otp_enc_d: ERROR, opening admin socket \'%s\': %s\n", adminFile, strerror(errno)); exit(2);
+    }
 
     // Enter infinite loop
     while(1) {
         
+        if (memReport) { memstatreport("otp_enc_d"); } // Print the memory report if SIGUSR1 asked for one
+        if (flightDump) { // Dump the flight recorder if SIGUSR2 asked for it
+            if ((chars = flightdumpfile()) < 0) { logmsg(LEVEL_ERROR, "writing flight recorder to %s", flightPath); }
+            else { logmsg(LEVEL_INFO, "flight recorder: dumped %d requests to %s", chars, flightPath); }
+        }
+
+        // Wait for a connection, or with --admin for the limits to allow one, answering admin commands meanwhile
+        if ((ready = adminwait(listeningFD)) < 0) { break; } // Drained
+        if (ready == 0) { reapchildren(); continue; }
+
         // Accept a connection, blocking if one is not available until one connects
         clientSize = sizeof(client); // Get the size of the address for the client that will connect
         if ((connectedFD = accept(listeningFD, (struct sockaddr *)&client, &clientSize)) < 0) { // Accept the connection
-            fprintf(stderr, "otp_enc_d: ERROR, on accept\n");
+            if (errno != EINTR) { logmsg(LEVEL_ERROR, "on accept: %s", strerror(errno)); }
+            continue;
         }
-        if (DEBUG) { printf("DEBUG: accepted client on socket FD: %d\n", connectedFD); } // DEBUG
+        logmsg(LEVEL_DEBUG, "accepted client on socket FD: %d", connectedFD);
+        capturestart(); // Start the clock for this connection's metadata, if capturing or serving metrics
+        metricsaccept();
+        statsaccept();
+        adminaccept();
+        if (adaptaccept() > 0) { // Rebuilt the size classes, before forking so the request process gets them
+            adaptdescribe(classes, sizeof(classes));
+            logmsg(LEVEL_INFO, "adapted buffer size classes (max size:buffer): %s", classes);
+        }
+        PROBE2(accept, cap.conn, connectedFD); // Tracepoint (see otp_probe.h), a nop unless traced
 
         pid = fork(); // Spawn new child process
 
-        if (pid < 0) { fprintf(stderr, "otp_enc_d: ERROR, fork() failure\n"); } // If the fork failed
+        if (pid < 0) { logmsg(LEVEL_ERROR, "fork() failure: %s", strerror(errno)); } // If the fork failed
         else if (pid == 0) { // Child process
 
+            logstart(cap.conn); // Claim a log ring of this process's own
+            statsstart(cap.conn); // Mark a stats slot busy, to add this request to at exit
+            flightstart(&client); // Add this request to the flight recorder at exit
+            if (cap.fd >= 0) { atexit(capturedone); } // Record this request however the process ends
+            memstatstart(); // Note the memory this process starts with, to add its peak to its size class at exit
+            metricsstart(&client); // Publish this request's counts and CPU time however the process ends
+
             // Receive authentication from client
             if ((chars = sendrecv(connectedFD, id, ID_LEN, false)) != ID_LEN) {
-                fprintf(stderr, "otp_enc_d: ERROR, only %d chars were received from client on port %d\n", chars, port);
+                logmsg(LEVEL_ERROR, "only %d chars were received from client on port %d", chars, port);
             }
-            if (DEBUG) { printf("DEBUG: received id from client: %s\n", id); } // DEBUG
+            logmsg(LEVEL_DEBUG, "received id from client: %s", id);
+            if (id[3] == TIMING_ASK) { wantTiming = true; id[3] = '_'; } // Asking for the timing trailer
 
             // Validate authorization
             memset(auth, '\0', sizeof(auth));
             if (strcmp(id, "otp_enc") == 0) { strcpy(auth, "PASS"); } 
             else { strcpy(auth, "FAIL"); }
-            if (DEBUG) { printf("DEBUG: sending auth back to client: %s\n", auth); } // DEBUG
+            logmsg(LEVEL_DEBUG, "sending auth back to client: %s", auth);
 
             // Send authorization result back to client
             if ((chars = sendrecv(connectedFD, auth, AUTH_LEN, true)) != AUTH_LEN) {
-                fprintf(stderr, "otp_enc_d: ERROR, only %d chars were sent to client on port %d\n", chars, port);
+                logmsg(LEVEL_ERROR, "only %d chars were sent to client on port %d", chars, port);
             }
+            capturemark(PHASE_AUTH);
+            PROBE2(auth, cap.conn, auth[0] == 'P');
+            if (strcmp(auth, "PASS") != 0) { strcpy(cap.status, "FAIL"); }
             
             // If authorization was successful, prepare to receive next messags
             if (strcmp(auth, "PASS") == 0) {
@@ -121,55 +277,104 @@ int main(int argc, char *argv[]) {
                 // Receive the plaintext file length from the client
                 char textLenBuf[BUF_LEN+1]; // To hold the length of the plaintext file (no more than 9 digit long number)
                 if ((chars = sendrecv(connectedFD, textLenBuf, BUF_LEN, false)) != BUF_LEN) {
-                    fprintf(stderr, "otp_enc_d: ERROR, only %d chars were received from client on port %d\n", chars, port);
+                    logmsg(LEVEL_ERROR, "only %d chars were received from client on port %d", chars, port);
                 }
                 textLen = atoi(textLenBuf); // Convert to int
-                if (DEBUG) { printf("DEBUG: text length received from client: %d\n", textLen); } // DEBUG
+                cap.textLen = textLen;
+                memLen = textLen;
+                PROBE3(header, cap.conn, 0, textLen);
+                logmsg(LEVEL_DEBUG, "text length received from client: %d", textLen);
+                if (textLen < 1 || textLen > maxLen) { // Reject bad lengths before they're used to size anything
+                    logmsg(LEVEL_ERROR, "bad text length received from client on port %d", port);
+                    strcpy(cap.status, "BADL"); sendrecv(connectedFD, "BADL", STAT_LEN, true); exit(1);
+                }
+                adaptrecord(textLen); // Count this message size towards the next size classes, if adapting
+                tuneapply(connectedFD, textLen); // Use the chunk and buffer sizes for this message size, if tuned
         
-                // Receive the plaintext file content from the client
-                char plaintext[textLen+1]; // +1 for the ending null character
-                if ((chars = sendrecv(connectedFD, plaintext, textLen, false)) != textLen) {
-                    fprintf(stderr, "otp_enc_d: ERROR, only %d chars were received from client on port %d\n", chars, port);
+                // Receive the plaintext file content from the client, into a buffer that grows as it arrives
+                char* plaintext = malloc(adaptinitial(textLen) + 1); // +1 for the ending null character
+                if (plaintext == NULL) { logmsg(LEVEL_ERROR, "out of memory for the text"); exit(1); }
+                if ((chars = recvvalid(connectedFD, &plaintext, textLen, adaptinitial(textLen), &textOK)) != textLen) {
+                    logmsg(LEVEL_ERROR, "only %d chars were received from client on port %d", chars, port);
                 }
-                if (DEBUG) { printf("DEBUG: plaintext content received from client: %s\n", plaintext); } // DEBUG
+                logpayload(LEVEL_DEBUG, "plaintext received from client", plaintext, textLen); // Never the payload itself
+                capturemark(PHASE_TEXT);
+                PROBE3(payload, cap.conn, 0, chars);
 
                 // Receive the key file length from the client
                 char keyLenBuf[BUF_LEN+1]; // To hold the length of the key file
                 if ((chars = sendrecv(connectedFD, keyLenBuf, BUF_LEN, false)) != BUF_LEN) {
-                    fprintf(stderr, "otp_enc_d: ERROR, only %d chars were received from client on port %d\n", chars, port);
+                    logmsg(LEVEL_ERROR, "only %d chars were received from client on port %d", chars, port);
                 }
                 keyLen = atoi(keyLenBuf); // Convert to int
-                if (DEBUG) { printf("DEBUG: key length received from client: %d\n", keyLen); } // DEBUG
+                cap.keyLen = keyLen;
+                PROBE3(header, cap.conn, 1, keyLen);
+                logmsg(LEVEL_DEBUG, "key length received from client: %d", keyLen);
+                if (keyLen < 1 || keyLen > maxLen) {
+                    logmsg(LEVEL_ERROR, "bad key length received from client on port %d", port);
+                    strcpy(cap.status, "BADL"); sendrecv(connectedFD, "BADL", STAT_LEN, true); exit(1);
+                }
                 
                 // Receive the key file content from the client
-                char key[keyLen+1];
-                if ((chars = sendrecv(connectedFD, key, keyLen, false)) != keyLen) {
-                    fprintf(stderr, "otp_enc_d: ERROR, only %d chars were received from client on port %d\n", chars, port);
+                char* key = malloc(adaptinitial(keyLen) + 1);
+                if (key == NULL) { logmsg(LEVEL_ERROR, "out of memory for the key"); exit(1); }
+                if ((chars = recvvalid(connectedFD, &key, keyLen, adaptinitial(keyLen), &keyOK)) != keyLen) {
+                    logmsg(LEVEL_ERROR, "only %d chars were received from client on port %d", chars, port);
+                }
+                logpayload(LEVEL_DEBUG, "key received from client", key, keyLen); // Never the payload itself
+                capturemark(PHASE_KEY);
+                PROBE3(payload, cap.conn, 1, chars);
+
+                // Send the validation result back to the client, the ciphertext only follows if it passed
+                if (!textOK) { strcpy(result, "BADT"); }
+                else if (!keyOK) { strcpy(result, "BADK"); }
+                else if (keyLen < textLen) { strcpy(result, "SHRT"); }
+                else { strcpy(result, "PASS"); }
+                strcpy(cap.status, result);
+                if ((chars = sendrecv(connectedFD, result, STAT_LEN, true)) != STAT_LEN) {
+                    logmsg(LEVEL_ERROR, "only %d chars were sent to client on port %d", chars, port);
+                }
+                capturemark(PHASE_SEND);
+                if (strcmp(result, "PASS") != 0) {
+                    logmsg(LEVEL_WARN, "rejected request from client on port %d (%s)", port, result);
+                    close(connectedFD); exit(1);
                 }
-                if (DEBUG) { printf("DEBUG: key contents received from client: %s\n", key); } // DEBUG
 
                 // Encrypt the plaintext file contents
-                char ciphertext[textLen+1];
+                char* ciphertext = malloc(textLen + 1); // All of the text has arrived by now
+                if (ciphertext == NULL) { logmsg(LEVEL_ERROR, "out of memory for the result"); exit(1); }
+                PROBE2(cipher_start, cap.conn, textLen);
                 encrypt(plaintext, key, ciphertext, textLen);
-                if (DEBUG) { printf("DEBUG: sending encrypted ciphertext to client: %s\n", ciphertext); } // DEBUG
+                PROBE2(cipher_end, cap.conn, textLen);
+                capturemark(PHASE_CIPHER);
+                logpayload(LEVEL_DEBUG, "ciphertext sent to client", ciphertext, textLen); // Never the payload itself
 
                 // Send the encrypted ciphertext back to the client
                 if ((chars = sendrecv(connectedFD, ciphertext, textLen, true)) != textLen) {
-                    fprintf(stderr, "otp_enc_d: ERROR, only %d chars were sent to client on port %d\n", chars, port);
+                    logmsg(LEVEL_ERROR, "only %d chars were sent to client on port %d", chars, port);
+                }
+                capturemark(PHASE_SEND);
+                PROBE3(reply, cap.conn, cap.bytesIn, cap.bytesOut);
+
+                // Send the server side timing of the request, if the client asked for it
+                if (wantTiming) {
+                    timingformat(trailer, cap.phase, timingus(cap.start, timingstamp()));
+                    send(connectedFD, trailer, TIMING_LEN, MSG_NOSIGNAL); // The client may have closed already
                 }
             }
 
             close(listeningFD); // Close the child's copy of the listening file descriptor
             close(connectedFD); // Close child's copy of new file descriptor
 
-            if (DEBUG) { printf("DEBUG: end of child process %d reached\n", pid); }
+            logmsg(LEVEL_DEBUG, "end of child process reached");
             exit(0); // Exit child process
         }
         else { // Parent process
 
             close(connectedFD); // Close the parent's new file descriptor which is connected to the client
-            while (pid > 0) { pid = waitpid(-1, &status, WNOHANG); } // Check if any child processes have completed
-            if (DEBUG) { printf("DEBUG: end of parent process %d reached\n", pid); } // DEBUG
+            adminforked();
+            reapchildren(); // Check if any child processes have completed
+            logmsg(LEVEL_DEBUG, "end of parent process reached");
         }
     } // End main while loop
 
@@ -198,52 +403,66 @@ int sendrecv(int sockFD, char* str, int len, bool sendMode) {
 
     while (total < len) { // Process the entire buffer
 
-        if (sendMode) { n = send(sockFD, str+total, rem, 0); }
-        else { n = recv(sockFD, str+total, rem, 0); }
-        if (n == -1) { break; }
+        if (sendMode) { n = send(sockFD, str+total, tunechunk(rem), 0); }
+        else { n = recv(sockFD, str+total, tunechunk(rem), 0); }
+        if (n <= 0) { break; } // Stop on an error or if the other side closed the connection
         total += n;
         rem -= n;
-        if (DEBUG) { printf("DEBUG: bytes sent/recv: %d\nbytes total: %d\nbytes rem:%d\n", n, total, rem); } // DEBUG
+        logmsg(LEVEL_DEBUG, "bytes sent/recv: %d, total %d, remaining %d", n, total, rem);
     }
+    if (sendMode) { cap.bytesOut += total; } // Count for the metrics
+    else { cap.bytesIn += total; }
 
-    if (DEBUG) { printf("DEBUG: total bytes sent/recv: %d out of %d\n", total, len); } // DEBUG
+    logmsg(LEVEL_DEBUG, "total bytes sent/recv: %d out of %d", total, len);
     return total; // If processed successfully, total should equal len
 }
 
 /*
- * Encrypts the given plaintext using the given key to produce the ciphertext message
- * Assumes keyLen > textLen and that all arguments are valid with no bad characters (all validation done client side)
- * char* plain: the plaintext to encrypt
- * char* key: the key to use to do the One-Time Pad decryption
- * char* cipher: the string container to hold the encrypted ciphertext
- * int len: the length of the ciphertext and plaintext
+ * Receive text from a socket file descriptor, validating each chunk as it arrives while it's still in cache
+ * The buffer doubles (up to len) only once what has arrived fills it, so memory follows the text actually sent rather
+ *    than the length the client claimed.
+ * int sockFD: the socket file descriptor the client is connected to the server on
+ * char** str: the malloc()ed string container to hold the data that is received, reallocated as it grows
+ * int len: the length of the data to receive
+ * int size: the number of characters str has room for now (plus the ending null character)
+ * bool* valid: set to whether all the received characters were capital letters or spaces
 */
-void encrypt(char* plain, char* key, char* cipher, int len) {
+int recvvalid(int sockFD, char** str, int len, int size, bool* valid) {
 
-    int i, cPlain, cKey, cCipher;
+    int total = 0; // To calculate the total chars that get received
+    int n;         // To hold how many chars get received with each recv() call
+    int ok = 1;    // Whether every chunk so far was valid
+    char* grown;   // The buffer after growing it
 
-    memset(cipher, '\0', len+1);
-    for (i = 0; i < len; i++) {
+    while (total < len) { // Receive the entire buffer
 
-        // Convert spaces
-        if (plain[i] == ' ') { plain[i] = '@'; }
-        if (key[i] == ' ') { key[i] = '@'; }
-
-        // Get converted characters
-        cPlain = (int)plain[i];
-        cKey = (int)key[i];
+        if (total == size) { // Full, so double it, but no further than the text
+            size = size > len - size ? len : size * 2;
+            if ((grown = realloc(*str, size + 1)) == NULL) { break; }
+            *str = grown;
+        }
+        if ((n = recv(sockFD, *str+total, tunechunk(size-total), 0)) <= 0) { break; }
+        ok &= validchars(*str+total, n);
+        total += n;
+        logmsg(LEVEL_DEBUG, "bytes recv: %d, total %d, remaining %d", n, total, len-total);
+    }
+    (*str)[total] = '\0';
 
-        // Reduce to 0-26 range
-        cPlain -= 64;
-        cKey -= 64;
+    cap.bytesIn += total; // Count for the metrics
+    *valid = (ok && total == len) ? true : false; // A short read fails too
+    logmsg(LEVEL_DEBUG, "total bytes recv: %d out of %d", total, len);
+    return total; // If received successfully, total should equal len
+}
 
-        // OTP encryption formula
-        cCipher = (cPlain + cKey) % 27;
+/*
+ * Reap any child processes that have finished, without waiting for the rest
+*/
+void reapchildren(void) {
 
-        // Convert back and append
-        cipher[i] = (char)(cCipher + 64);
+    pid_t pid;
+    int status;
 
-        // Check for space re-conversion
-        if (cipher[i] == '@') { cipher[i] = ' '; }
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        metricsreap(pid, status); logreap(pid); statsreap(pid, status); adminreap(pid);
     }
 }
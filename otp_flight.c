@@ -0,0 +1,196 @@
+/*************************************************************************************************************************
+ *
+ * NAME
+ *    otp_flight.c
+ * SYNOPSIS
+ *    Decodes a flight recorder dump written by the daemons on SIGUSR2.
+ * DESCRIPTION
+ *    Reads a dump written by otp_enc_d/otp_dec_d --flight (see otp_flight.h) and prints its requests oldest first, one
+ *       per line: when each arrived, its connection number, the client's address, the status, the text and key
+ *       lengths, and the milliseconds it spent in each phase and in total. A summary follows with the span of time the
+ *       dump covers, the count of each outcome and the total latency percentiles.
+ *    With --slowest N, only the N slowest requests are printed, slowest first, which is usually where to start after
+ *       a latency spike. With --json, the requests are printed as one JSON object per line instead, for other tools.
+ * INSTRUCTIONS
+ *    Use the included compileall script to compile this program as well as the other programs.
+ *    Start a daemon with --flight FILE, send it SIGUSR2 when something looks wrong, then run:
+ *       otp_flight [--slowest N] [--json] FILE
+ *    e.g. kill -USR2 <pid>; otp_flight --slowest 20 flight.bin
+ * AUTHOR
+ *    Written by Andrew Swaim
+ *
+*************************************************************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include <arpa/inet.h>
+
+#include "otp_flight.h"
+
+typedef enum { false, true } bool; // Create bool type for C89/C99 compilation.
+
+/*************************************************************************************************************************
+ * Function Declarations
+*************************************************************************************************************************/
+
+struct flightrecord* load(const char*, struct flightheader*); // To read and check a dump
+void print(const struct flightrecord*, bool); // To print one request
+void summarize(const struct flightheader*, struct flightrecord*); // To print the outcomes and latency percentiles
+int slower(const void*, const void*); // To sort requests slowest first
+
+/*************************************************************************************************************************
+ * Main
+*************************************************************************************************************************/
+
+int main(int argc, char *argv[]) {
+
+    struct flightheader h;
+    struct flightrecord* records;
+    int opt, slowest = -1, i, n;
+    bool json = false;
+
+    static struct option longopts[] = {
+        { "slowest", required_argument, NULL, 'n' }, { "json", no_argument, NULL, 'j' }, { NULL, 0, NULL, 0 }
+    };
+
+    // Check usage & args
+    while ((opt = getopt_long(argc, argv, "n:j", longopts, NULL)) != -1) {
+        if (opt == 'n') { slowest = atoi(optarg); }
+        else if (opt == 'j') { json = true; }
+        else { argc = 0; }
+    }
+    if (argc - optind != 1 || (slowest < 1 && slowest != -1)) {
+        fprintf(stderr, "USAGE: %s [--slowest N] [--json] FILE\n", argv[0]); exit(1);
+    }
+    records = load(argv[optind], &h);
+
+    // Print the requests, oldest first or slowest first
+    n = h.count;
+    if (slowest > 0) {
+        qsort(records, h.count, sizeof(*records), slower);
+        if (slowest < n) { n = slowest; }
+    }
+    if (!json) {
+        printf("%s pid %d: %u requests\n", h.daemon, (int)h.pid, h.count);
+        printf("%-26s %8s %-21s %-4s %9s %9s %9s %9s %9s %9s %9s %9s\n", "arrival", "conn", "peer", "stat", "text",
+               "key", "auth ms", "text ms", "key ms", "ciph ms", "send ms", "total ms");
+    }
+    for (i = 0; i < n; i++) { print(&records[i], json); }
+    if (!json) { summarize(&h, records); }
+
+    free(records);
+    return 0;
+}
+
+/*************************************************************************************************************************
+ * Function Definitions
+*************************************************************************************************************************/
+
+/*
+ * Read a dump and check its header
+ * const char* path: the dump file
+ * struct flightheader* h: where to put the header
+ * Returns the records, exiting if the file can't be read or isn't a dump this version writes
+*/
+struct flightrecord* load(const char* path, struct flightheader* h) {
+
+    struct flightrecord* records;
+    FILE* fd;
+
+    if ((fd = fopen(path, "rb")) == NULL) { fprintf(stderr, "otp_flight: ERROR, opening \'%s\'\n", path); exit(2); }
+    if (fread(h, sizeof(*h), 1, fd) != 1 || memcmp(h->magic, FLIGHT_MAGIC, sizeof(h->magic)) != 0) {
+        fprintf(stderr, "otp_flight: ERROR, \'%s\' is not a flight recorder dump\n", path); exit(2);
+    }
+    if (h->version != FLIGHT_VERSION || h->recordSize != sizeof(struct flightrecord)) {
+        fprintf(stderr, "otp_flight: ERROR, \'%s\' is version %u with %u byte records, expected version %d with %d\n",
+                path, h->version, h->recordSize, FLIGHT_VERSION, (int)sizeof(struct flightrecord));
+        exit(2);
+    }
+    h->daemon[sizeof(h->daemon) - 1] = '\0';
+    if (h->count > FLIGHT_RECORDS || (records = malloc((h->count + 1) * sizeof(*records))) == NULL
+        || fread(records, sizeof(*records), h->count, fd) != h->count) {
+        fprintf(stderr, "otp_flight: ERROR, \'%s\' is truncated\n", path); exit(2);
+    }
+    fclose(fd);
+    return records;
+}
+
+/*
+ * Print one request
+ * const struct flightrecord* r: the request
+ * bool json: whether to print it as a JSON object rather than a table row
+*/
+void print(const struct flightrecord* r, bool json) {
+
+    static const char* const names[CAPTURE_PHASES] = { "auth", "text", "key", "cipher", "send" };
+    char arrival[40], peer[32], status[5]; // Room for the peer's address and port
+    time_t secs = r->arrivalUs / 1000000;
+    struct tm tm;
+    int i;
+
+    localtime_r(&secs, &tm);
+    strftime(arrival, 20, "%Y-%m-%d %H:%M:%S", &tm);
+    snprintf(arrival + 19, sizeof(arrival) - 19, ".%06d", (int)(r->arrivalUs % 1000000));
+    inet_ntop(AF_INET, &r->peerAddr, peer, INET_ADDRSTRLEN);
+    snprintf(status, sizeof(status), "%.4s", r->status);
+
+    if (json) {
+        printf("{ \"seq\": %llu, \"arrival_us\": %lld, \"conn\": %u, \"peer\": \"%s:%u\", \"status\": \"%s\", "
+               "\"text_len\": %d, \"key_len\": %d, ", (unsigned long long)r->seq, (long long)r->arrivalUs, r->conn,
+               peer, ntohs(r->peerPort), status, r->textLen, r->keyLen);
+        for (i = 0; i < CAPTURE_PHASES; i++) { printf("\"%s_us\": %u, ", names[i], r->phaseUs[i]); }
+        printf("\"total_us\": %u }\n", r->totalUs);
+        return;
+    }
+    snprintf(peer + strlen(peer), sizeof(peer) - strlen(peer), ":%u", ntohs(r->peerPort));
+    printf("%-26s %8u %-21s %-4s %9d %9d", arrival, r->conn, peer, status, r->textLen, r->keyLen);
+    for (i = 0; i < CAPTURE_PHASES; i++) { printf(" %9.3f", r->phaseUs[i] / 1e3); }
+    printf(" %9.3f\n", r->totalUs / 1e3);
+}
+
+/*
+ * Print the span of the dump, the count of each outcome and the total latency percentiles
+ * const struct flightheader* h: the dump's header
+ * struct flightrecord* records: its records, in any order (they're sorted here)
+*/
+void summarize(const struct flightheader* h, struct flightrecord* records) {
+
+    static const char* const outcomes[] = { "PASS", "FAIL", "BADL", "BADT", "BADK", "SHRT", "-" };
+    static const double pcts[] = { 50, 90, 99, 100 };
+    long long first, last;
+    unsigned i, j, count;
+
+    if (h->count == 0) { printf("\nno requests recorded\n"); return; }
+    first = last = records[0].arrivalUs;
+    for (i = 1; i < h->count; i++) {
+        if (records[i].arrivalUs < first) { first = records[i].arrivalUs; }
+        if (records[i].arrivalUs > last) { last = records[i].arrivalUs; }
+    }
+    printf("\n%u requests arriving over %.3f s, dumped %.3f s after the last\n", h->count, (last - first) / 1e6,
+           (h->dumpedUs - last) / 1e6);
+    printf("outcomes:");
+    for (i = 0; i < sizeof(outcomes) / sizeof(outcomes[0]); i++) {
+        for (j = 0, count = 0; j < h->count; j++) { count += strncmp(records[j].status, outcomes[i], 4) == 0; }
+        if (count > 0) { printf(" %s %u", outcomes[i], count); }
+    }
+    qsort(records, h->count, sizeof(*records), slower);
+    printf("\ntotal latency:");
+    for (i = 0; i < sizeof(pcts) / sizeof(pcts[0]); i++) {
+        j = (unsigned)((100 - pcts[i]) / 100 * h->count); // Slowest first, so p100 is the first record
+        printf(" p%g %.3f ms", pcts[i], records[j < h->count ? j : h->count - 1].totalUs / 1e3);
+    }
+    printf("\n");
+}
+
+/*
+ * Compare two requests for qsort, slowest first
+ * const void* a, b: the requests
+*/
+int slower(const void* a, const void* b) {
+
+    unsigned x = ((const struct flightrecord*)a)->totalUs, y = ((const struct flightrecord*)b)->totalUs;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
@@ -0,0 +1,195 @@
+/*************************************************************************************************************************
+ *
+ * NAME
+ *    otp_flight.h
+ * SYNOPSIS
+ *    Flight recorder for the daemons: a ring of compact records of the most recent requests, dumped on SIGUSR2.
+ * DESCRIPTION
+ *    When a daemon is started with --flight FILE, it maps a ring of FLIGHT_RECORDS fixed size binary records in an
+ *       anonymous shared mapping before it forks anything. Each request process adds one record as it exits: when the
+ *       request arrived, the peer address, the connection number, the text and key lengths, the status, the time in
+ *       each phase and in total (see otp_capture.h). Nothing is written anywhere else, so keeping the last few
+ *       thousand requests costs a 64 byte copy per request.
+ *    Request processes finish concurrently, so each one claims the next record with an atomic add on the ring's head
+ *       and then fills it in, marking it complete last by storing its sequence number. A record being filled in, or
+ *       overwritten while the dump reads it, has the wrong sequence number and is left out of the dump.
+ *    Sending the daemon SIGUSR2 dumps the ring, oldest record first, to FILE (written next to it and renamed into
+ *       place, so a reader never sees half a dump). otp_flight decodes a dump.
+ *    The dump is a struct flightheader followed by its count of struct flightrecord, in the byte order of the machine
+ *       that wrote it.
+ * AUTHOR
+ *    Written by Andrew Swaim
+ *
+*************************************************************************************************************************/
+
+#ifndef OTP_FLIGHT_H
+#define OTP_FLIGHT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+
+#include "otp_capture.h"
+
+#define FLIGHT_RECORDS 4096 // Requests kept in the ring
+#define FLIGHT_MAGIC "OTPFLT1" // Start of a dump file, with its terminating null
+#define FLIGHT_VERSION 1
+
+struct flightrecord { // One request, 64 bytes
+    uint64_t seq; // Position in the ring's history plus 1, stored last; 0 while being filled in
+    int64_t arrivalUs; // Wall clock time the connection was accepted, in microseconds since the epoch
+    uint32_t conn; // The daemon's connection number
+    uint32_t peerAddr; // The client's IPv4 address, in network byte order
+    uint16_t peerPort; // The client's port, in network byte order
+    char status[4]; // PASS, FAIL, BADL, BADT, BADK or SHRT, or "-" if the client went away first
+    uint16_t pad;
+    int32_t textLen, keyLen;
+    uint32_t phaseUs[CAPTURE_PHASES]; // Microseconds in auth, text, key, cipher and send
+    uint32_t totalUs; // Microseconds from accept() to exit
+};
+
+struct flightheader { // Start of a dump file
+    char magic[8];
+    uint32_t version, recordSize, count;
+    int32_t pid;
+    char daemon[16];
+    int64_t dumpedUs; // When the dump was written, in microseconds since the epoch
+};
+
+struct flightring {
+    uint64_t head; // Records claimed so far
+    struct flightrecord records[FLIGHT_RECORDS] __attribute__((aligned(64)));
+};
+
+static struct flightring* flight = NULL; // The ring, or NULL when the flight recorder is off
+static const char* flightPath = NULL; // Where dumps go
+static const char* flightDaemon = ""; // The name of the daemon, for the dump header
+static struct sockaddr_in flightPeer; // This request process's client
+static volatile sig_atomic_t flightDump = 0; // Set by SIGUSR2 to ask the daemon for a dump
+
+/*
+ * Ask for a dump on SIGUSR2, for the daemon to write between connections
+*/
+static void flightsignal(int sig) { (void)sig; flightDump = 1; }
+
+/*
+ * Map the ring and start listening for SIGUSR2, before the daemon forks any request process
+ * const char* path: the file to dump to
+ * const char* daemon: the name of the daemon
+ * Returns 0, or -1 if the ring couldn't be mapped
+*/
+static int flightopen(const char* path, const char* daemon) {
+
+    struct sigaction sa;
+
+    flight = mmap(NULL, sizeof(struct flightring), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (flight == MAP_FAILED) { flight = NULL; return -1; }
+    flightPath = path;
+    flightDaemon = daemon;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = flightsignal; // No SA_RESTART, so the signal wakes the daemon up from accept()
+    sigaction(SIGUSR2, &sa, NULL);
+    return 0;
+}
+
+/*
+ * Clamp microseconds into a record field
+ * double us: the microseconds
+*/
+static inline uint32_t flightus(double us) { return us <= 0 ? 0 : us >= 4294967295.0 ? 4294967295u : (uint32_t)us; }
+
+/*
+ * Add this request process's record to the ring, run at exit
+*/
+static void flightdone(void) {
+
+    struct flightrecord* r;
+    struct timespec wall;
+    uint64_t seq;
+    double total = timingus(cap.start, timingstamp());
+    int i;
+
+    if (flight == NULL) { return; }
+    seq = __atomic_fetch_add(&flight->head, 1, __ATOMIC_RELAXED);
+    r = &flight->records[seq % FLIGHT_RECORDS];
+    __atomic_store_n(&r->seq, 0, __ATOMIC_RELAXED); // Incomplete until the fields are in
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    clock_gettime(CLOCK_REALTIME, &wall);
+    r->arrivalUs = wall.tv_sec * 1000000LL + wall.tv_nsec / 1000 - (int64_t)total;
+    r->conn = (uint32_t)cap.conn;
+    r->peerAddr = flightPeer.sin_addr.s_addr;
+    r->peerPort = flightPeer.sin_port;
+    memset(r->status, 0, sizeof(r->status)); // Not null terminated when it's 4 long
+    memcpy(r->status, cap.status, strnlen(cap.status, sizeof(r->status)));
+    r->pad = 0;
+    r->textLen = cap.textLen;
+    r->keyLen = cap.keyLen;
+    for (i = 0; i < CAPTURE_PHASES; i++) { r->phaseUs[i] = flightus(cap.phase[i]); }
+    r->totalUs = flightus(total);
+    __atomic_store_n(&r->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Start recording a request process, just after the fork
+ * const struct sockaddr_in* peer: the client's address from accept()
+*/
+static void flightstart(const struct sockaddr_in* peer) {
+
+    if (flight == NULL) { return; }
+    signal(SIGUSR2, SIG_IGN); // Dumps are the daemon's job
+    memcpy(&flightPeer, peer, sizeof(flightPeer));
+    atexit(flightdone);
+}
+
+/*
+ * Dump the ring to the flight file, oldest record first, skipping any that are incomplete or being overwritten
+ * Returns the number of records dumped, or -1 if the file couldn't be written
+*/
+static int flightdumpfile(void) {
+
+    static struct flightrecord records[FLIGHT_RECORDS];
+    struct flightheader h;
+    struct flightrecord* r;
+    struct timespec wall;
+    uint64_t head, seq, s;
+    char tmp[4096];
+    int fd, ok, n = 0;
+
+    flightDump = 0;
+    if (flight == NULL) { return -1; }
+    head = __atomic_load_n(&flight->head, __ATOMIC_ACQUIRE);
+    for (seq = head > FLIGHT_RECORDS ? head - FLIGHT_RECORDS : 0; seq < head; seq++) {
+        r = &flight->records[seq % FLIGHT_RECORDS];
+        if ((s = __atomic_load_n(&r->seq, __ATOMIC_ACQUIRE)) != seq + 1) { continue; }
+        memcpy(&records[n], r, sizeof(*r));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE); // The copy is done before the sequence number is checked again
+        if (__atomic_load_n(&r->seq, __ATOMIC_RELAXED) == s) { n++; }
+    }
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, FLIGHT_MAGIC, sizeof(h.magic));
+    h.version = FLIGHT_VERSION;
+    h.recordSize = sizeof(struct flightrecord);
+    h.count = n;
+    h.pid = getpid();
+    snprintf(h.daemon, sizeof(h.daemon), "%s", flightDaemon);
+    clock_gettime(CLOCK_REALTIME, &wall);
+    h.dumpedUs = wall.tv_sec * 1000000LL + wall.tv_nsec / 1000;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", flightPath);
+    if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) { return -1; }
+    ok = write(fd, &h, sizeof(h)) == (ssize_t)sizeof(h)
+         && write(fd, records, n * sizeof(*records)) == (ssize_t)(n * sizeof(*records));
+    close(fd);
+    if (!ok || rename(tmp, flightPath) < 0) { unlink(tmp); return -1; }
+    return n;
+}
+
+#endif
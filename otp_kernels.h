@@ -0,0 +1,336 @@
+/*************************************************************************************************************************
+ *
+ * NAME
+ *    otp_kernels.h
+ * SYNOPSIS
+ *    Hot path kernels shared by the daemons, keygen and otp_microbench.
+ * DESCRIPTION
+ *    encrypt() and decrypt() do the modulo 27 One-Time Pad cipher for otp_enc_d and otp_dec_d.
+ *    validchars() checks that a buffer holds only the 27 characters of the alphabet (A-Z and the space character).
+ *    keychars() generates random key characters for keygen.
+ *    Each kernel has a portable scalar version and, where the compiler targets it, a SIMD version. The plain name
+ *       always calls the fastest version built in, except for encrypt() and decrypt(), which call the tier in
+ *       cipherTier so startup calibration (see otp_calibrate.h) can pick whichever is fastest on the machine.
+ * AUTHOR
+ *    Written by Andrew Swaim
+ *
+*************************************************************************************************************************/
+
+#ifndef OTP_KERNELS_H
+#define OTP_KERNELS_H
+
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+enum { CIPHER_SCALAR, CIPHER_SSE2, CIPHER_TIERS }; // Cipher kernel tiers
+
+static const char* const cipherTierNames[CIPHER_TIERS] = { "scalar", "sse2" };
+static const int cipherTierBuilt[CIPHER_TIERS] = { // Whether each tier is compiled in
+    1,
+#ifdef __SSE2__
+    1,
+#else
+    0,
+#endif
+};
+
+#ifdef __SSE2__
+static int cipherTier = CIPHER_SSE2; // Tier encrypt() and decrypt() use
+#else
+static int cipherTier = CIPHER_SCALAR;
+#endif
+
+/*
+ * Check that every character in a buffer is a capital letter or a space, one character at a time
+ * const char* str: the buffer to check
+ * int len: the length of the buffer
+ * Returns 1 if all the characters are valid, 0 otherwise
+*/
+static inline int validscalar(const char* str, int len) {
+
+    int i, bad = 0;
+
+    // Accumulate instead of returning early so the loop has no data dependent branches
+    for (i = 0; i < len; i++) { bad |= (str[i] != ' ') & ((unsigned char)(str[i] - 'A') > 'Z' - 'A'); }
+    return !bad;
+}
+
+#ifdef __SSE2__
+/*
+ * Check that every character in a buffer is a capital letter or a space, 16 characters at a time
+ * const char* str: the buffer to check
+ * int len: the length of the buffer
+ * Returns 1 if all the characters are valid, 0 otherwise
+*/
+static inline int validsse2(const char* str, int len) {
+
+    const __m128i below = _mm_set1_epi8('A' - 1), above = _mm_set1_epi8('Z' + 1), space = _mm_set1_epi8(' ');
+    __m128i valid = _mm_set1_epi8(-1);
+    int i;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(str + i));
+        __m128i ok = _mm_or_si128(_mm_and_si128(_mm_cmpgt_epi8(x, below), _mm_cmplt_epi8(x, above)),
+                                  _mm_cmpeq_epi8(x, space));
+        valid = _mm_and_si128(valid, ok);
+    }
+    return _mm_movemask_epi8(valid) == 0xFFFF && validscalar(str + i, len - i);
+}
+#endif
+
+/*
+ * Check that every character in a buffer is a capital letter or a space, using the fastest version available
+ * const char* str: the buffer to check
+ * int len: the length of the buffer
+ * Returns 1 if all the characters are valid, 0 otherwise
+*/
+static inline int validchars(const char* str, int len) {
+
+#ifdef __SSE2__
+    return validsse2(str, len);
+#else
+    return validscalar(str, len);
+#endif
+}
+
+/*
+ * Encrypts the given plaintext using the given key to produce the ciphertext message, one character at a time
+ * Assumes keyLen > textLen and that all arguments are valid with no bad characters (validated by recvvalid())
+ * char* plain: the plaintext to encrypt
+ * char* key: the key to use to do the One-Time Pad decryption
+ * char* cipher: the string container to hold the encrypted ciphertext
+ * int len: the length of the ciphertext and plaintext
+*/
+static void encryptscalar(char* plain, char* key, char* cipher, int len) {
+
+    int i, cPlain, cKey, cCipher;
+
+    memset(cipher, '\0', len+1);
+    for (i = 0; i < len; i++) {
+
+        // Convert spaces
+        if (plain[i] == ' ') { plain[i] = '@'; }
+        if (key[i] == ' ') { key[i] = '@'; }
+
+        // Get converted characters
+        cPlain = (int)plain[i];
+        cKey = (int)key[i];
+
+        // Reduce to 0-26 range
+        cPlain -= 64;
+        cKey -= 64;
+
+        // OTP encryption formula
+        cCipher = (cPlain + cKey) % 27;
+
+        // Convert back and append
+        cipher[i] = (char)(cCipher + 64);
+
+        // Check for space re-conversion
+        if (cipher[i] == '@') { cipher[i] = ' '; }
+    }
+}
+
+/*
+ * Decrypts the given ciphertext using the given key to produce the plaintext message, one character at a time
+ * Assumes keyLen > textLen and that all arguments are valid with no bad characters (validated by recvvalid())
+ * char* cipher: the ciphertext to decrypt
+ * char* key: the key to use to do the One-Time Pad decryption
+ * char* plain: the string container to hold the decrypted plaintext
+ * int len: the length of the ciphertext and plaintext
+*/
+static void decryptscalar(char* cipher, char* key, char* plain, int len) {
+
+    int i, cPlain, cKey, cCipher;
+
+    memset(plain, '\0', len+1);
+    for (i = 0; i < len; i++) {
+
+        // Convert spaces
+        if (cipher[i] == ' ') { cipher[i] = '@'; }
+        if (key[i] == ' ') { key[i] = '@'; }
+
+        // Get converted characters
+        cCipher = (int)cipher[i];
+        cKey = (int)key[i];
+
+        // Reduce to 0-26
+        cCipher -= 64;
+        cKey -= 64;
+
+        // OTP decryption formula
+        cPlain = cCipher - cKey;
+        if (cPlain < 0) { cPlain += 27; } // If the result was negative
+
+        // Convert back and append
+        plain[i] = (char)(cPlain + 64);
+
+        // Check for space re-conversion
+        if (plain[i] == '@') { plain[i] = ' '; }
+    }
+}
+
+#ifdef __SSE2__
+/*
+ * Convert 16 characters to their 0-26 values (the space character is 0, 'A' to 'Z' are 1 to 26)
+ * __m128i x: the characters
+ * Returns the values
+*/
+static inline __m128i cipherval(__m128i x) {
+
+    return _mm_andnot_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8(' ')), _mm_sub_epi8(x, _mm_set1_epi8(64)));
+}
+
+/*
+ * Convert 16 values from 0-26 back to characters
+ * __m128i v: the values
+ * Returns the characters
+*/
+static inline __m128i cipherchar(__m128i v) {
+
+    return _mm_sub_epi8(_mm_add_epi8(v, _mm_set1_epi8(64)),
+                        _mm_and_si128(_mm_cmpeq_epi8(v, _mm_setzero_si128()), _mm_set1_epi8(64 - ' ')));
+}
+
+/*
+ * Encrypt 16 characters
+ * __m128i plain: the plaintext characters
+ * __m128i key: the key characters
+ * Returns the ciphertext characters
+*/
+static inline __m128i encryptblock(__m128i plain, __m128i key) {
+
+    __m128i sum = _mm_add_epi8(cipherval(plain), cipherval(key));
+
+    sum = _mm_sub_epi8(sum, _mm_and_si128(_mm_cmpgt_epi8(sum, _mm_set1_epi8(26)), _mm_set1_epi8(27))); // < 54, so % 27
+    return cipherchar(sum);
+}
+
+/*
+ * Decrypt 16 characters
+ * __m128i cipher: the ciphertext characters
+ * __m128i key: the key characters
+ * Returns the plaintext characters
+*/
+static inline __m128i decryptblock(__m128i cipher, __m128i key) {
+
+    __m128i diff = _mm_sub_epi8(cipherval(cipher), cipherval(key));
+
+    diff = _mm_add_epi8(diff, _mm_and_si128(_mm_cmplt_epi8(diff, _mm_setzero_si128()), _mm_set1_epi8(27))); // Wrap
+    return cipherchar(diff);
+}
+
+/*
+ * Encrypts the given plaintext using the given key to produce the ciphertext message, 16 characters at a time
+ * Assumes keyLen > textLen and that all arguments are valid with no bad characters (validated by recvvalid())
+ * char* plain: the plaintext to encrypt (left unchanged)
+ * char* key: the key to use to do the One-Time Pad encryption (left unchanged)
+ * char* cipher: the string container to hold the encrypted ciphertext
+ * int len: the length of the ciphertext and plaintext
+*/
+static void encryptsse2(char* plain, char* key, char* cipher, int len) {
+
+    char p[16], k[16], c[16];
+    int i;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+        _mm_storeu_si128((__m128i*)(cipher + i), encryptblock(_mm_loadu_si128((const __m128i*)(plain + i)),
+                                                              _mm_loadu_si128((const __m128i*)(key + i))));
+    }
+
+    // The rest, as a block padded with spaces in copies (the scalar kernels would write '@' over the inputs' spaces)
+    if (i < len) {
+        memset(p, ' ', 16);
+        memset(k, ' ', 16);
+        memcpy(p, plain + i, len - i);
+        memcpy(k, key + i, len - i);
+        _mm_storeu_si128((__m128i*)c, encryptblock(_mm_loadu_si128((const __m128i*)p),
+                                                   _mm_loadu_si128((const __m128i*)k)));
+        memcpy(cipher + i, c, len - i);
+    }
+    cipher[len] = '\0';
+}
+
+/*
+ * Decrypts the given ciphertext using the given key to produce the plaintext message, 16 characters at a time
+ * Assumes keyLen > textLen and that all arguments are valid with no bad characters (validated by recvvalid())
+ * char* cipher: the ciphertext to decrypt (left unchanged)
+ * char* key: the key to use to do the One-Time Pad decryption (left unchanged)
+ * char* plain: the string container to hold the decrypted plaintext
+ * int len: the length of the ciphertext and plaintext
+*/
+static void decryptsse2(char* cipher, char* key, char* plain, int len) {
+
+    char c[16], k[16], p[16];
+    int i;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+        _mm_storeu_si128((__m128i*)(plain + i), decryptblock(_mm_loadu_si128((const __m128i*)(cipher + i)),
+                                                             _mm_loadu_si128((const __m128i*)(key + i))));
+    }
+
+    // The rest, as a block padded with spaces in copies, like encryptsse2()
+    if (i < len) {
+        memset(c, ' ', 16);
+        memset(k, ' ', 16);
+        memcpy(c, cipher + i, len - i);
+        memcpy(k, key + i, len - i);
+        _mm_storeu_si128((__m128i*)p, decryptblock(_mm_loadu_si128((const __m128i*)c),
+                                                   _mm_loadu_si128((const __m128i*)k)));
+        memcpy(plain + i, p, len - i);
+    }
+    plain[len] = '\0';
+}
+#endif
+
+/*
+ * Encrypts the given plaintext using the given key to produce the ciphertext message, with the tier in cipherTier
+ * char* plain: the plaintext to encrypt
+ * char* key: the key to use to do the One-Time Pad encryption
+ * char* cipher: the string container to hold the encrypted ciphertext
+ * int len: the length of the ciphertext and plaintext
+*/
+static void encrypt(char* plain, char* key, char* cipher, int len) {
+
+#ifdef __SSE2__
+    if (cipherTier == CIPHER_SSE2) { encryptsse2(plain, key, cipher, len); return; }
+#endif
+    encryptscalar(plain, key, cipher, len);
+}
+
+/*
+ * Decrypts the given ciphertext using the given key to produce the plaintext message, with the tier in cipherTier
+ * char* cipher: the ciphertext to decrypt
+ * char* key: the key to use to do the One-Time Pad decryption
+ * char* plain: the string container to hold the decrypted plaintext
+ * int len: the length of the ciphertext and plaintext
+*/
+static void decrypt(char* cipher, char* key, char* plain, int len) {
+
+#ifdef __SSE2__
+    if (cipherTier == CIPHER_SSE2) { decryptsse2(cipher, key, plain, len); return; }
+#endif
+    decryptscalar(cipher, key, plain, len);
+}
+
+/*
+ * Generate random key characters (A-Z and the space character) with rand(), seeded by the caller
+ * char* key: the buffer to fill
+ * int len: the number of characters to generate
+*/
+static void keychars(char* key, int len) {
+
+    int i;
+    char c;
+
+    for (i = 0; i < len; i++) {
+        c = (char)(rand() % 27 + 64); // Generate a random character from '@' to 'Z'
+        if (c == '@') { c = ' '; } // Replace '@' w/ ' '
+        key[i] = c;
+    }
+}
+
+#endif
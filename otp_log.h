@@ -0,0 +1,337 @@
+/*************************************************************************************************************************
+ *
+ * NAME
+ *    otp_log.h
+ * SYNOPSIS
+ *    Asynchronous structured logging for the daemons, through lock-free rings drained by a separate process.
+ * DESCRIPTION
+ *    logmsg() formats a message into the calling process's own ring and returns; it never makes a system call, takes
+ *       a lock or waits (the pid in each message is cached when the process starts logging). A drain process forked
+ *       by logopen() empties the rings and writes them to stderr in batches, one logfmt line per message:
+ *       time=2026-10-18T12:00:00.123456Z level=error daemon=otp_enc_d pid=4242 conn=17 msg="..."
+ *       where conn is the daemon's connection number (0 for the daemon itself).
+ *    While messages keep arriving the drain process checks the rings every LOG_DRAIN_US; each pass that finds them
+ *       empty doubles the wait, up to LOG_DRAIN_MAX_US, so an idle daemon's drain process hardly ever wakes. Waking it
+ *       from logmsg() would take a system call, so a message after a quiet spell waits for the next pass instead.
+ *    The rings live in an anonymous shared mapping made before anything forks. Ring 0 belongs to the daemon, and each
+ *       request process claims a free one of the other LOG_SLOTS - 1 with logstart() (released at exit, or by the
+ *       daemon with logreap() when it reaps a process that died without exiting). So every ring has exactly one
+ *       writer and one reader: the writer only advances head and the drain process only advances tail. A full ring,
+ *       or no free ring, drops the message rather than slowing the request down, and the drain process reports how
+ *       many were dropped.
+ *    Messages above the current level (error, warn, info or debug) are skipped before they're formatted. The level is
+ *       set with --log-level and lives in the shared mapping, so it can be changed while the daemon runs: SIGHUP
+ *       toggles between debug and the starting level.
+ *    Payloads are never logged. logpayload() records only a text's length and a hash of it, and as a backstop any run
+ *       of LOG_REDACT_RUN or more capital letters and spaces (the cipher alphabet) in a formatted message is replaced
+ *       with [redacted] before it reaches the ring.
+ *    Before logopen() (or if the mapping fails) messages are written to stderr synchronously instead.
+ * AUTHOR
+ *    Written by Andrew Swaim
+ *
+*************************************************************************************************************************/
+
+#ifndef OTP_LOG_H
+#define OTP_LOG_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+
+#define LOG_SLOTS 64 // Rings: 0 for the daemon, the rest claimed by request processes
+#define LOG_RING 64 // Messages per ring
+#define LOG_MSG_LEN 200 // Longest message kept, longer ones are cut short
+#define LOG_REDACT_RUN 12 // Shortest run of capital letters and spaces that gets redacted
+#define LOG_DRAIN_US 2000 // How long the drain process first sleeps when the rings are empty
+#define LOG_DRAIN_MAX_US 100000 // Longest it sleeps, after a run of empty passes
+#define LOG_OUT_LEN 65536 // Bytes the drain process batches into each write
+#define LOG_DRAIN_NAME "otp_log_drain" // The drain process's name, in ps and /proc/PID/comm
+
+enum { LEVEL_ERROR, LEVEL_WARN, LEVEL_INFO, LEVEL_DEBUG, LEVELS };
+
+static const char* const logLevelNames[LEVELS] = { "error", "warn", "info", "debug" };
+static const char* const logLevelTags[LEVELS] = { "ERROR", "WARNING", "INFO", "DEBUG" }; // For synchronous messages
+
+struct logentry {
+    struct timespec time;
+    int level, pid;
+    long conn;
+    char msg[LOG_MSG_LEN];
+};
+
+struct logring {
+    int owner; // The process writing to the ring, or 0 if it's free
+    unsigned long head __attribute__((aligned(64))); // Next entry to write, only advanced by the owner
+    unsigned long tail __attribute__((aligned(64))); // Next entry to drain, only advanced by the drain process
+    struct logentry entries[LOG_RING] __attribute__((aligned(64)));
+};
+
+struct logshared {
+    int level; // Messages above this level are skipped
+    long long dropped; // Messages lost to a full ring or no free ring
+    struct logring rings[LOG_SLOTS];
+};
+
+static struct logshared* logShared = NULL; // The shared rings, or NULL if logging synchronously
+static struct logring* logRing = NULL; // This process's ring, or NULL if it didn't get one
+static const char* logDaemon = ""; // The name of the daemon, for each line
+static long logConn = 0; // This process's connection number, 0 for the daemon
+static pid_t logPid = 0; // This process's pid, so logmsg() doesn't have to ask
+static int logLevel = LEVEL_WARN; // The starting level (and the level until logopen())
+static pid_t logDrainPid = 0; // The drain process
+static volatile sig_atomic_t logStop = 0; // Set by SIGTERM in the drain process
+
+/*
+ * Look up a level by name
+ * const char* name: error, warn, info or debug
+ * Returns the level, or -1 if there's no such level
+*/
+static int loglevel(const char* name) {
+
+    int i;
+
+    for (i = 0; i < LEVELS; i++) { if (strcmp(name, logLevelNames[i]) == 0) { return i; } }
+    return -1;
+}
+
+/*
+ * Replace runs of LOG_REDACT_RUN or more capital letters and spaces in a message with [redacted], in place
+ * char* msg: the message
+*/
+static void logredact(char* msg) {
+
+    char* in = msg;
+    char* out = msg;
+    char* run;
+
+    while (*in != '\0') {
+        for (run = in; (*in >= 'A' && *in <= 'Z') || *in == ' '; in++) { }
+        if (in - run >= LOG_REDACT_RUN) { memcpy(out, "[redacted]", 10); out += 10; } // Never longer than the run
+        else { memmove(out, run, in - run); out += in - run; }
+        if (*in != '\0') { *out++ = *in++; }
+    }
+    *out = '\0';
+}
+
+/*
+ * Log a message at a level, if the current level lets it through
+ * int level: LEVEL_ERROR, LEVEL_WARN, LEVEL_INFO or LEVEL_DEBUG
+ * const char* fmt: printf style format, then its arguments
+*/
+__attribute__((format(printf, 2, 3)))
+static void logmsg(int level, const char* fmt, ...) {
+
+    struct logentry* entry;
+    char msg[LOG_MSG_LEN];
+    unsigned long head;
+    va_list args;
+
+    if (level > (logShared != NULL ? __atomic_load_n(&logShared->level, __ATOMIC_RELAXED) : logLevel)) { return; }
+    va_start(args, fmt);
+    if (logShared == NULL) { // Not running yet, so write it out now
+        vsnprintf(msg, sizeof(msg), fmt, args);
+        logredact(msg);
+        fprintf(stderr, "%s: %s, %s\n", logDaemon, logLevelTags[level], msg);
+    }
+    else if (logRing == NULL
+             || (head = logRing->head) - __atomic_load_n(&logRing->tail, __ATOMIC_ACQUIRE) >= LOG_RING) {
+        __atomic_fetch_add(&logShared->dropped, 1, __ATOMIC_RELAXED);
+    }
+    else { // Fill the next entry, then publish it by moving head past it
+        entry = &logRing->entries[head % LOG_RING];
+        clock_gettime(CLOCK_REALTIME, &entry->time);
+        entry->level = level;
+        entry->pid = logPid;
+        entry->conn = logConn;
+        vsnprintf(entry->msg, sizeof(entry->msg), fmt, args);
+        logredact(entry->msg);
+        __atomic_store_n(&logRing->head, head + 1, __ATOMIC_RELEASE);
+    }
+    va_end(args);
+}
+
+/*
+ * Log the length and a hash of a payload (text, key or result) instead of the payload itself
+ * int level: the level to log at
+ * const char* what: what the payload is
+ * const char* buf: the payload
+ * int len: its length
+*/
+static void logpayload(int level, const char* what, const char* buf, int len) {
+
+    unsigned hash = 2166136261u; // FNV-1a, enough to tell whether two logged payloads matched
+    int i;
+
+    if (level > (logShared != NULL ? __atomic_load_n(&logShared->level, __ATOMIC_RELAXED) : logLevel)) { return; }
+    for (i = 0; i < len; i++) { hash = (hash ^ (unsigned char)buf[i]) * 16777619u; }
+    logmsg(level, "%s: %d chars, hash %08x", what, len, hash);
+}
+
+/*
+ * Append one message to the drain process's output as a logfmt line, escaping the message
+ * char* out: the output buffer
+ * int n: how much of it is used
+ * struct logentry* entry: the message
+ * Returns how much of the buffer is used after the line
+*/
+static int logline(char* out, int n, struct logentry* entry) {
+
+    struct tm tm;
+    char* c;
+
+    gmtime_r(&entry->time.tv_sec, &tm);
+    n += strftime(out + n, 32, "time=%Y-%m-%dT%H:%M:%S", &tm);
+    n += sprintf(out + n, ".%06ldZ level=%s daemon=%s pid=%d conn=%ld msg=\"", entry->time.tv_nsec / 1000,
+                 logLevelNames[entry->level], logDaemon, entry->pid, entry->conn);
+    for (c = entry->msg; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\') { out[n++] = '\\'; out[n++] = *c; }
+        else if (*c == '\n') { out[n++] = '\\'; out[n++] = 'n'; }
+        else { out[n++] = *c; }
+    }
+    out[n++] = '"';
+    out[n++] = '\n';
+    return n;
+}
+
+/*
+ * Empty every ring to stderr, in the drain process
+ * long long* dropped: the dropped count last reported, updated if more were dropped since
+ * Returns how many messages were written
+*/
+static int logdrain(long long* dropped) {
+
+    static char out[LOG_OUT_LEN];
+    struct logring* ring;
+    unsigned long head, tail;
+    long long lost;
+    int i, n = 0, count = 0;
+
+    for (i = 0; i < LOG_SLOTS; i++) {
+        ring = &logShared->rings[i];
+        head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        for (tail = ring->tail; tail != head; tail++, count++) {
+            if (n > LOG_OUT_LEN - 2 * LOG_MSG_LEN - 128) { write(STDERR_FILENO, out, n); n = 0; }
+            n = logline(out, n, &ring->entries[tail % LOG_RING]);
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE); // Hand the entries back to the writer
+    }
+    if ((lost = __atomic_load_n(&logShared->dropped, __ATOMIC_RELAXED)) > *dropped) {
+        n += sprintf(out + n, "level=warn daemon=%s msg=\"dropped %lld log messages\"\n", logDaemon, lost - *dropped);
+        *dropped = lost;
+    }
+    if (n > 0) { write(STDERR_FILENO, out, n); }
+    return count;
+}
+
+/*
+ * Stop the drain process after one more pass, on SIGTERM
+*/
+static void logstopsignal(int sig) { (void)sig; logStop = 1; }
+
+/*
+ * Toggle between debug and the starting level, on SIGHUP in the daemon
+*/
+static void loghupsignal(int sig) {
+
+    (void)sig;
+    __atomic_store_n(&logShared->level, logShared->level == LEVEL_DEBUG ? logLevel : LEVEL_DEBUG, __ATOMIC_RELAXED);
+}
+
+/*
+ * Map the shared rings and fork the drain process, before the daemon forks any request process
+ * const char* daemon: the name of the daemon
+ * Returns 0, or -1 if logging stays synchronous
+*/
+static int logopen(const char* daemon) {
+
+    long long dropped = 0;
+    useconds_t sleepUs = LOG_DRAIN_US;
+
+    logDaemon = daemon;
+    logShared = mmap(NULL, sizeof(struct logshared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (logShared == MAP_FAILED) { logShared = NULL; return -1; }
+    logShared->level = logLevel;
+
+    fflush(stdout);
+    fflush(stderr);
+    if ((logDrainPid = fork()) < 0) { munmap(logShared, sizeof(struct logshared)); logShared = NULL; return -1; }
+    if (logDrainPid == 0) { // Drain process
+        prctl(PR_SET_PDEATHSIG, SIGTERM); // Go when the daemon goes, after one last pass
+        prctl(PR_SET_NAME, LOG_DRAIN_NAME);
+        signal(SIGTERM, logstopsignal);
+        signal(SIGUSR1, SIG_IGN);
+        signal(SIGHUP, SIG_IGN);
+        if (getppid() == 1) { logStop = 1; }
+        while (!logStop) {
+            if (logdrain(&dropped) > 0) { sleepUs = LOG_DRAIN_US; continue; }
+            usleep(sleepUs);
+            if ((sleepUs *= 2) > LOG_DRAIN_MAX_US) { sleepUs = LOG_DRAIN_MAX_US; } // Back off while it's quiet
+        }
+        logdrain(&dropped);
+        _exit(0);
+    }
+
+    logPid = getpid();
+    logShared->rings[0].owner = logPid;
+    logRing = &logShared->rings[0];
+    signal(SIGHUP, loghupsignal);
+    return 0;
+}
+
+/*
+ * Give this process's ring back, run at exit
+*/
+static void logdone(void) {
+
+    if (logRing != NULL) { __atomic_store_n(&logRing->owner, 0, __ATOMIC_RELEASE); }
+    logRing = NULL;
+}
+
+/*
+ * Claim a free ring for a request process, just after the fork
+ * long conn: the daemon's connection number, which also picks the first ring to try
+*/
+static void logstart(long conn) {
+
+    struct logring* ring;
+    int i, free;
+
+    logRing = NULL; // Ring 0 is the daemon's
+    logConn = conn;
+    logPid = getpid();
+    if (logShared == NULL) { return; }
+    signal(SIGHUP, SIG_IGN); // The level is the daemon's to change
+    for (i = 0; i < LOG_SLOTS - 1; i++) {
+        ring = &logShared->rings[1 + (conn + i) % (LOG_SLOTS - 1)];
+        free = 0;
+        if (__atomic_compare_exchange_n(&ring->owner, &free, logPid, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            logRing = ring;
+            atexit(logdone);
+            return;
+        }
+    }
+}
+
+/*
+ * Free the ring of a request process that died without exiting, when the daemon reaps it
+ * pid_t pid: the process reaped
+*/
+static void logreap(pid_t pid) {
+
+    int i, owner;
+
+    if (logShared == NULL) { return; }
+    for (i = 1; i < LOG_SLOTS; i++) {
+        owner = pid;
+        __atomic_compare_exchange_n(&logShared->rings[i].owner, &owner, 0, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+    }
+}
+
+#endif
@@ -0,0 +1,386 @@
+/*************************************************************************************************************************
+ *
+ * NAME
+ *    otp_membench.c
+ * SYNOPSIS
+ *    Memory footprint benchmark for the daemons across message sizes and concurrency levels.
+ * DESCRIPTION
+ *    For each message size and number of concurrent connections, starts a fresh daemon, drives it with otp_bench, and
+ *       reports:
+ *       - the peak RSS of its request processes (mean and max), and how much of it the request itself added over what
+ *         the process was forked with, as counted by the daemon itself (see otp_memstat.h) and read with SIGUSR1
+ *       - the growth per message byte, which is what host memory has to be sized by: the slope of the max growth from
+ *         the previous size in the list to this one, at the same number of connections. Growth itself includes a fixed
+ *         few hundred KB every request process takes faulting back in the program and library pages it shares with
+ *         the daemon, whatever the message size, so growth over size would overstate small messages; the slope
+ *         cancels it. The first size has no slope.
+ *       - the daemon process's own peak RSS
+ *       - the peak footprint of the daemon and all of its request processes together, sampled from /proc every
+ *         millisecond during the run: the daemon's RSS plus each request process's RSS less the pages it shares
+ *       - the most request processes alive at once in those samples (the daemon's log drain process, see otp_log.h,
+ *         counts toward the footprint but isn't a request process)
+ *    A fresh daemon for each point keeps the peaks from one point out of the next.
+ *    Each request process keeps its text, key and result on its heap, so a message longer than the daemon's --max-len
+ *       is rejected and shows up as failed requests.
+ * INSTRUCTIONS
+ *    Use the included compileall script to compile this program as well as the other programs.
+ *    Run it from the build directory (it runs otp_bench from the same directory):
+ *       otp_membench [--dec] [--sizes N,...] [--connections N,...] [--requests N] [--port PORT] [--json] [DAEMON]
+ *    DAEMON defaults to otp_enc_d (otp_dec_d with --dec) from the same directory, and has to report its memory on
+ *       SIGUSR1 like they do. Keys are the same length as the messages.
+ *    e.g. otp_membench --sizes 1000,100000,1000000 --connections 1,8,32 --requests 64
+ * AUTHOR
+ *    Written by Andrew Swaim
+ *
+*************************************************************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "otp_log.h"
+
+typedef enum { false, true } bool; // Create bool type for C89/C99 compilation.
+
+#define MAX_POINTS 16 // Most sizes or connection counts allowed in a list
+#define MAX_CHILDREN 4096 // Most request processes read from /proc in one sample
+#define REPORT_TRIES 200 // How many 10ms waits to give request processes to exit, and the daemon to report
+
+/*************************************************************************************************************************
+ * Globals
+*************************************************************************************************************************/
+
+struct result {
+    long size;
+    int conns;
+    long requests; // Requests the daemon counted
+    bool ok; // Whether every request succeeded
+    long long peakMean, peakMax, growthMean, growthMax; // Request process memory in KB, from the daemon
+    long long daemonPeak; // Daemon process peak RSS in KB
+    long long footprint; // Peak sampled footprint of the daemon and its request processes in KB
+    int children; // Most request processes alive in a sample
+};
+
+char binDir[1024] = "."; // Directory holding otp_bench and the daemons
+long pageKB; // Page size in KB
+
+/*************************************************************************************************************************
+ * Function Declarations
+*************************************************************************************************************************/
+
+int parselist(const char*, long*); // To parse a comma separated list of positive numbers
+pid_t startdaemon(const char*, int, const char*); // To start the daemon with its output to a file
+bool measure(pid_t, int, long, int, long, bool, struct result*); // To drive the daemon and sample its footprint
+long long footprint(pid_t, int*); // To sample the footprint of the daemon and its request processes
+bool logdrainer(pid_t); // To tell the daemon's log drain process apart from its request processes
+bool readreport(const char*, long, struct result*); // To read the daemon's memory report
+
+/*************************************************************************************************************************
+ * Main
+*************************************************************************************************************************/
+
+int main(int argc, char *argv[]) {
+
+    int opt, port = 57394, numSizes, numConns, s, c, i, left, failed = 0;
+    long requests = 40, sizeList[MAX_POINTS], connList[MAX_POINTS];
+    long long prevGrowth[MAX_POINTS]; // Max growth at the previous size, for each connection count
+    char perByteStr[32]; // Growth per message byte from the previous size, formatted
+    bool dec = false, json = false;
+    const char* sizes = "1000,16000,256000,1000000";
+    const char* conns = "1,4,16";
+    char daemon[1100], reportFile[] = "/tmp/otp_membench.XXXXXX";
+    struct result r;
+    pid_t pid;
+    int fd;
+
+    static struct option longopts[] = {
+        { "dec", no_argument, NULL, 'd' }, { "sizes", required_argument, NULL, 's' },
+        { "connections", required_argument, NULL, 'c' }, { "requests", required_argument, NULL, 'n' },
+        { "port", required_argument, NULL, 'p' }, { "json", no_argument, NULL, 'j' }, { NULL, 0, NULL, 0 }
+    };
+
+    // Check usage & args
+    while ((opt = getopt_long(argc, argv, "ds:c:n:p:j", longopts, NULL)) != -1) {
+        if (opt == 'd') { dec = true; }
+        else if (opt == 's') { sizes = optarg; }
+        else if (opt == 'c') { conns = optarg; }
+        else if (opt == 'n') { requests = atol(optarg); }
+        else if (opt == 'p') { port = atoi(optarg); }
+        else if (opt == 'j') { json = true; }
+        else { argc = 0; }
+    }
+    numSizes = parselist(sizes, sizeList);
+    numConns = parselist(conns, connList);
+    if (argc == 0 || argc - optind > 1 || numSizes < 1 || numConns < 1 || requests < 1 || port < 1 || port > 65535) {
+        fprintf(stderr, "USAGE: %s [--dec] [--sizes N,...] [--connections N,...] [--requests N] [--port PORT] [--json] "
+                        "[DAEMON]\n", argv[0]);
+        exit(2);
+    }
+    if (strrchr(argv[0], '/') != NULL) { // Find the other programs next to this one
+        snprintf(binDir, sizeof(binDir), "%.*s", (int)(strrchr(argv[0], '/') - argv[0]), argv[0]);
+    }
+    if (optind < argc) { snprintf(daemon, sizeof(daemon), "%s", argv[optind]); }
+    else { snprintf(daemon, sizeof(daemon), "%s/%s", binDir, dec ? "otp_dec_d" : "otp_enc_d"); }
+    if ((fd = mkstemp(reportFile)) < 0) { fprintf(stderr, "otp_membench: ERROR, creating report file\n"); exit(2); }
+    close(fd);
+    pageKB = sysconf(_SC_PAGESIZE) / 1024;
+
+    // Measure every point with a fresh daemon
+    if (json) { printf("[\n"); }
+    else {
+        printf("%10s %6s %8s %21s %21s %11s %10s %12s %9s\n", "size", "conns", "requests", "request peak KB",
+               "request growth KB", "growth/byte", "daemon KB", "footprint KB", "children");
+        printf("%10s %6s %8s %10s %10s %10s %10s\n", "", "", "", "mean", "max", "mean", "max");
+    }
+    for (s = 0; s < numSizes; s++) {
+        for (c = 0; c < numConns; c++) {
+            if ((pid = startdaemon(daemon, port, reportFile)) < 0) {
+                fprintf(stderr, "otp_membench: ERROR, could not start \'%s\' on port %d\n", daemon, port);
+                unlink(reportFile); exit(2);
+            }
+            memset(&r, 0, sizeof(r));
+            r.size = sizeList[s];
+            r.conns = connList[c];
+            r.ok = measure(pid, port, requests, r.conns, r.size, dec, &r);
+            for (i = 0; i < REPORT_TRIES; i++) { // Let the last request processes exit and count themselves
+                footprint(pid, &left);
+                if (left == 0) { break; }
+                usleep(10000);
+            }
+            kill(pid, SIGUSR1);
+            if (!readreport(reportFile, r.size, &r)) {
+                fprintf(stderr, "otp_membench: ERROR, \'%s\' didn't report its memory on SIGUSR1\n", daemon);
+                kill(pid, SIGTERM); unlink(reportFile); exit(2);
+            }
+            kill(pid, SIGTERM);
+            waitpid(pid, NULL, 0);
+            if (!r.ok) { failed++; }
+            if (s > 0 && r.size != sizeList[s - 1]) { // The slope from the previous size
+                snprintf(perByteStr, sizeof(perByteStr), "%.3f",
+                         (r.growthMax - prevGrowth[c]) * 1024.0 / (r.size - sizeList[s - 1]));
+            }
+            else { snprintf(perByteStr, sizeof(perByteStr), "%s", json ? "null" : "-"); }
+            prevGrowth[c] = r.growthMax;
+
+            if (json) {
+                printf("  { \"size\": %ld, \"connections\": %d, \"requests\": %ld, \"ok\": %s, \"request_peak_kb_mean\": "
+                       "%lld, \"request_peak_kb_max\": %lld, \"request_growth_kb_mean\": %lld, \"request_growth_kb_max\": "
+                       "%lld, \"growth_per_byte\": %s, \"daemon_peak_kb\": %lld, \"footprint_kb\": %lld, "
+                       "\"max_children\": %d }%s\n", r.size, r.conns, r.requests, r.ok ? "true" : "false", r.peakMean,
+                       r.peakMax, r.growthMean, r.growthMax, perByteStr, r.daemonPeak, r.footprint,
+                       r.children, s == numSizes - 1 && c == numConns - 1 ? "" : ",");
+            }
+            else {
+                printf("%10ld %6d %8ld %10lld %10lld %10lld %10lld %11s %10lld %12lld %9d%s\n", r.size, r.conns,
+                       r.requests, r.peakMean, r.peakMax, r.growthMean, r.growthMax, perByteStr,
+                       r.daemonPeak, r.footprint, r.children, r.ok ? "" : "  (requests failed)");
+            }
+            fflush(stdout);
+        }
+    }
+    if (json) { printf("]\n"); }
+    unlink(reportFile);
+    return failed > 0 ? 1 : 0;
+}
+
+/*************************************************************************************************************************
+ * Function Definitions
+*************************************************************************************************************************/
+
+/*
+ * Parse a comma separated list of positive numbers
+ * const char* str: the list
+ * long* list: where to put the numbers, MAX_POINTS long
+ * Returns how many there were, or -1 if any wasn't a positive number or there were too many
+*/
+int parselist(const char* str, long* list) {
+
+    char buf[512], *item, *save;
+    int n = 0;
+
+    snprintf(buf, sizeof(buf), "%s", str);
+    for (item = strtok_r(buf, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save)) {
+        if (n == MAX_POINTS || (list[n++] = atol(item)) < 1) { return -1; }
+    }
+    return n;
+}
+
+/*
+ * Start a daemon in the background with its output going to a file, and wait until it accepts connections
+ * const char* daemon: path to the daemon
+ * int port: the port for it to listen on
+ * const char* reportFile: the file for its output (and so its memory report)
+ * Returns the daemon's pid, or -1 if it didn't come up
+*/
+pid_t startdaemon(const char* daemon, int port, const char* reportFile) {
+
+    char portStr[16];
+    struct sockaddr_in addr;
+    pid_t pid;
+    int i, fd, out;
+
+    snprintf(portStr, sizeof(portStr), "%d", port);
+    if ((pid = fork()) < 0) { return -1; }
+    if (pid == 0) { // Daemon process, with its output in the report file
+        if ((out = open(reportFile, O_WRONLY | O_TRUNC)) >= 0) { dup2(out, 1); }
+        if ((out = open("/dev/null", O_WRONLY)) >= 0) { dup2(out, 2); }
+        execl(daemon, daemon, portStr, (char*)NULL);
+        _exit(127);
+    }
+
+    memset((char*)&addr, '\0', sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for (i = 0; i < 50; i++) { // Give it up to 5 seconds
+        usleep(100000);
+        if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) { break; }
+        if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0) { close(fd); return pid; }
+        close(fd);
+        if (waitpid(pid, NULL, WNOHANG) == pid) { return -1; } // It died (port in use?)
+    }
+    kill(pid, SIGTERM);
+    return -1;
+}
+
+/*
+ * Drive the daemon with otp_bench at one size and concurrency, sampling its footprint every millisecond until done
+ * pid_t daemon: the daemon's pid
+ * int port: the daemon's port
+ * long requests: the number of requests to send
+ * int conns: the number of concurrent connections
+ * long size: the message size
+ * bool dec: whether the daemon is otp_dec_d
+ * struct result* r: where to put the peak footprint and most request processes seen
+ * Returns true if every request succeeded
+*/
+bool measure(pid_t daemon, int port, long requests, int conns, long size, bool dec, struct result* r) {
+
+    char bench[1100], portStr[16], connStr[16], reqStr[32], sizeStr[32];
+    long long kb;
+    int status, children, null;
+    pid_t pid;
+
+    snprintf(bench, sizeof(bench), "%s/otp_bench", binDir);
+    snprintf(portStr, sizeof(portStr), "%d", port);
+    snprintf(connStr, sizeof(connStr), "%d", conns);
+    snprintf(reqStr, sizeof(reqStr), "%ld", requests);
+    snprintf(sizeStr, sizeof(sizeStr), "%ld:1", size);
+    if ((pid = fork()) < 0) { return false; }
+    if (pid == 0) { // otp_bench, with its report out of the way of this one
+        if ((null = open("/dev/null", O_WRONLY)) >= 0) { dup2(null, 1); }
+        if (dec) { execl(bench, bench, "--dec", "--connections", connStr, "--requests", reqStr, "--duration", "3600",
+                         "--sizes", sizeStr, portStr, (char*)NULL); }
+        else { execl(bench, bench, "--connections", connStr, "--requests", reqStr, "--duration", "3600", "--sizes",
+                     sizeStr, portStr, (char*)NULL); }
+        _exit(127);
+    }
+
+    while (waitpid(pid, &status, WNOHANG) == 0) {
+        if ((kb = footprint(daemon, &children)) > r->footprint) { r->footprint = kb; }
+        if (children > r->children) { r->children = children; }
+        usleep(1000);
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/*
+ * Sample the footprint of the daemon and its request processes: the daemon's RSS, plus the RSS of each request
+ *    process less the pages it shares (mostly with the daemon, counted once already)
+ * pid_t daemon: the daemon's pid
+ * int* children: where to put the number of request processes seen
+ * Returns the footprint in KB
+*/
+long long footprint(pid_t daemon, int* children) {
+
+    static char list[MAX_CHILDREN * 12];
+    char path[64], *p, *end;
+    long size, resident, shared;
+    long long kb = 0;
+    FILE* fd;
+    int n;
+    pid_t pid;
+
+    *children = 0;
+    snprintf(path, sizeof(path), "/proc/%d/statm", (int)daemon);
+    if ((fd = fopen(path, "r")) == NULL) { return 0; }
+    if (fscanf(fd, "%ld %ld %ld", &size, &resident, &shared) == 3) { kb = resident * pageKB; }
+    fclose(fd);
+
+    snprintf(path, sizeof(path), "/proc/%d/task/%d/children", (int)daemon, (int)daemon);
+    if ((fd = fopen(path, "r")) == NULL) { return kb; }
+    n = fread(list, 1, sizeof(list) - 1, fd);
+    fclose(fd);
+    list[n > 0 ? n : 0] = '\0';
+    for (p = list; (pid = strtol(p, &end, 10)) > 0; p = end) {
+        snprintf(path, sizeof(path), "/proc/%d/statm", (int)pid);
+        if ((fd = fopen(path, "r")) == NULL) { continue; } // It exited since the list was read
+        if (fscanf(fd, "%ld %ld %ld", &size, &resident, &shared) == 3 && resident > 0) { // Not yet reaped if 0
+            kb += (resident - shared) * pageKB;
+            if (!logdrainer(pid)) { (*children)++; } // The log drain process lives as long as the daemon
+        }
+        fclose(fd);
+    }
+    return kb;
+}
+
+/*
+ * Check whether a child of the daemon is its log drain process rather than a request process
+ * pid_t pid: the child
+*/
+bool logdrainer(pid_t pid) {
+
+    char path[64], name[32] = "";
+    FILE* fd;
+
+    snprintf(path, sizeof(path), "/proc/%d/comm", (int)pid);
+    if ((fd = fopen(path, "r")) == NULL) { return false; }
+    if (fgets(name, sizeof(name), fd) == NULL) { name[0] = '\0'; }
+    fclose(fd);
+    return strncmp(name, LOG_DRAIN_NAME, strlen(LOG_DRAIN_NAME)) == 0;
+}
+
+/*
+ * Read the daemon's memory report: the size class holding the message size, and the daemon's own peak
+ * const char* reportFile: the daemon's output
+ * long size: the message size measured
+ * struct result* r: where to put what was read
+ * Returns true once the report has been read, or false if it didn't show up within a couple of seconds
+*/
+bool readreport(const char* reportFile, long size, struct result* r) {
+
+    char line[512];
+    long long classMax, best = -1, requests, peakMean, peakMax, growthMean, growthMax;
+    FILE* fd;
+    int i;
+
+    for (i = 0; i < REPORT_TRIES; i++) {
+        usleep(10000);
+        if ((fd = fopen(reportFile, "r")) == NULL) { return false; }
+        while (fgets(line, sizeof(line), fd) != NULL) {
+            if (sscanf(line, " up to %lld bytes: %lld requests, peak RSS mean %lld KB max %lld KB, growth mean %lld KB "
+                       "max %lld KB", &classMax, &requests, &peakMean, &peakMax, &growthMean, &growthMax) == 6
+                && classMax >= size && (best < 0 || classMax < best)) {
+                best = classMax;
+                r->requests = requests; r->peakMean = peakMean; r->peakMax = peakMax;
+                r->growthMean = growthMean; r->growthMax = growthMax;
+            }
+            else if (strstr(line, "daemon process peak RSS") != NULL) {
+                r->daemonPeak = atoll(strstr(line, "RSS") + 4);
+                fclose(fd);
+                return true;
+            }
+        }
+        fclose(fd);
+    }
+    return false;
+}
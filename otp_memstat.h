@@ -0,0 +1,162 @@
+/*************************************************************************************************************************
+ *
+ * NAME
+ *    otp_memstat.h
+ * SYNOPSIS
+ *    Per request peak memory tracking for the daemons, by message size class.
+ * DESCRIPTION
+ *    Each request process holds its text, key and result in heap buffers sized by the message, so its memory grows
+ *       with the request: about 3 times the message plus the whole key. memstatstart() notes the process's peak RSS
+ *       when it starts, just after the fork, and memstatdone() (run at exit) takes the peak RSS again and adds it to
+ *       the message's size class, along with the growth over the starting peak (the memory the request itself
+ *       needed). Size classes go up by powers of 4 from 1K to 1G.
+ *    The classes live in an anonymous shared mapping made by the daemon before it forks anything, so every request
+ *       process adds to the same counters atomically. Sending the daemon SIGUSR1 prints them, with its own peak RSS:
+ *       otp_enc_d: peak memory per request, by message size
+ *         up to 1024 bytes: 16 requests, peak RSS mean 952 KB max 952 KB, growth mean 388 KB max 388 KB
+ *         ...
+ *       otp_enc_d: daemon process peak RSS 1712 KB
+ *    Requests rejected before their length was received aren't counted.
+ * AUTHOR
+ *    Written by Andrew Swaim
+ *
+*************************************************************************************************************************/
+
+#ifndef OTP_MEMSTAT_H
+#define OTP_MEMSTAT_H
+
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#define MEM_CLASSES 11 // Size classes: up to 1K, 4K, 16K, ... 1G
+
+struct memclass {
+    long long requests;
+    long long peakSum, peakMax; // Peak RSS of the request processes, in KB
+    long long growthSum, growthMax; // Peak RSS over what the process started with, in KB
+};
+
+static struct memclass* memStats = NULL; // Shared size classes, or NULL if they couldn't be mapped
+static long memBase = 0; // This request process's peak RSS when it started, in KB
+static int memLen = 0; // This request's message length, once known
+static volatile sig_atomic_t memReport = 0; // Set by SIGUSR1 to ask the daemon for a report
+
+/*
+ * Get the largest message length in a size class
+ * int i: the class
+*/
+static long long memclassmax(int i) { return 1024LL << (2 * i); }
+
+/*
+ * Get this process's peak RSS so far, in KB (for a request process: getrusage() also counts the program that exec'd
+ *    the daemon, so it's only right after a fork)
+*/
+static long mempeak(void) {
+
+    struct rusage usage;
+
+    return getrusage(RUSAGE_SELF, &usage) == 0 ? usage.ru_maxrss : 0;
+}
+
+/*
+ * Get the daemon's own peak RSS so far from /proc, in KB, or 0 if it can't be read
+*/
+static long memdaemonpeak(void) {
+
+    FILE* fd;
+    char line[128];
+    long peak = 0;
+
+    if ((fd = fopen("/proc/self/status", "r")) == NULL) { return 0; }
+    while (fgets(line, sizeof(line), fd) != NULL && sscanf(line, "VmHWM: %ld", &peak) != 1) { }
+    fclose(fd);
+    return peak;
+}
+
+/*
+ * Ask for a report on SIGUSR1, for the daemon to print between connections
+*/
+static void memstatsignal(int sig) { (void)sig; memReport = 1; }
+
+/*
+ * Map the shared size classes and start listening for SIGUSR1, before the daemon forks any request process
+*/
+static void memstatopen(void) {
+
+    struct sigaction sa;
+
+    memStats = mmap(NULL, MEM_CLASSES * sizeof(struct memclass), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+                    -1, 0);
+    if (memStats == MAP_FAILED) { memStats = NULL; return; }
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = memstatsignal; // No SA_RESTART, so the signal wakes the daemon up from accept()
+    sigaction(SIGUSR1, &sa, NULL);
+}
+
+/*
+ * Raise a shared maximum to a new value if it's larger
+ * long long* max: the maximum
+ * long long value: the new value
+*/
+static void memstatmax(long long* max, long long value) {
+
+    long long old = __atomic_load_n(max, __ATOMIC_RELAXED);
+
+    while (value > old && !__atomic_compare_exchange_n(max, &old, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) { }
+}
+
+/*
+ * Add this request process to its size class, run at exit
+*/
+static void memstatdone(void) {
+
+    long peak = mempeak();
+    int i;
+
+    if (memStats == NULL || memLen < 1) { return; }
+    for (i = 0; i < MEM_CLASSES - 1 && memLen > memclassmax(i); i++) { }
+    __atomic_fetch_add(&memStats[i].requests, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&memStats[i].peakSum, peak, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&memStats[i].growthSum, peak - memBase, __ATOMIC_RELAXED);
+    memstatmax(&memStats[i].peakMax, peak);
+    memstatmax(&memStats[i].growthMax, peak - memBase);
+}
+
+/*
+ * Start tracking a request process, just after the fork
+*/
+static void memstatstart(void) {
+
+    if (memStats == NULL) { return; }
+    signal(SIGUSR1, SIG_IGN); // Reports are the daemon's job
+    memBase = mempeak();
+    atexit(memstatdone);
+}
+
+/*
+ * Print the size classes that have seen requests, and the daemon's own peak RSS
+ * const char* daemon: the name of the daemon
+*/
+static void memstatreport(const char* daemon) {
+
+    struct memclass c;
+    int i;
+
+    memReport = 0;
+    if (memStats == NULL) { return; }
+    printf("%s: peak memory per request, by message size\n", daemon);
+    for (i = 0; i < MEM_CLASSES; i++) {
+        memcpy(&c, &memStats[i], sizeof(c));
+        if (c.requests == 0) { continue; }
+        printf("  up to %lld bytes: %lld requests, peak RSS mean %lld KB max %lld KB, growth mean %lld KB max %lld KB\n",
+               memclassmax(i), c.requests, c.peakSum / c.requests, c.peakMax, c.growthSum / c.requests, c.growthMax);
+    }
+    printf("%s: daemon process peak RSS %ld KB\n", daemon, memdaemonpeak());
+    fflush(stdout);
+}
+
+#endif
@@ -0,0 +1,442 @@
+/*************************************************************************************************************************
+ *
+ * NAME
+ *    otp_metrics.h
+ * SYNOPSIS
+ *    Prometheus text format metrics for the daemons, served by a stats process on a separate port.
+ * DESCRIPTION
+ *    When a daemon is started with --metrics PORT, it forks a stats process that answers HTTP GET /metrics on PORT
+ *       with:
+ *       otp_requests_total{outcome}           requests by outcome: pass, fail (authorization), badl, badt, badk, shrt,
+ *                                             aborted (the client went away early) or killed (the request process died
+ *                                             from a signal, counted when the daemon reaps it)
+ *       otp_connections_accepted_total        connections the daemon accepted
+ *       otp_received_bytes_total              bytes received from clients
+ *       otp_sent_bytes_total                  bytes sent to clients
+ *       otp_active_connections                request processes that haven't finished yet
+ *       otp_listen_queue_depth                connections waiting to be accepted, and otp_listen_queue_limit, its limit
+ *       otp_phase_duration_seconds{phase}     histograms of how long the auth, receive (text and key), cipher and send
+ *                                             phases took
+ *       otp_cpu_seconds_total{size}           CPU time request processes used, by message size class (up to 1K, 4K,
+ *                                             16K, ... 1G), with otp_processed_bytes_total{size} (text bytes) and
+ *                                             otp_size_requests_total{size}
+ *       otp_cpu_seconds_per_gigabyte{size}    the two above divided, the CPU cost of a GB of text at that size
+ *       otp_client_*{client}                  the same CPU time, bytes, requests and cost per GB by client address,
+ *                                             for the first METRIC_CLIENTS clients seen (the rest are "other")
+ *    Each request process times its phases through otp_capture.h and counts its bytes in plain process local
+ *       variables, then publishes everything once as it exits, with relaxed atomic adds into one of METRIC_SLOTS
+ *       slots (picked by connection number, so concurrent request processes rarely share one). The slots live in an
+ *       anonymous shared mapping made before anything forks, and only the stats process adds them up, when it's
+ *       scraped. So the request path takes no locks and shares no cache lines with the scraper while it runs.
+ *    A request process's CPU time is its thread CPU clock when it exits, which starts from zero at the fork, so it's
+ *       everything the request cost in user and system time, and nothing else's. The accept() and fork() in the
+ *       daemon aren't included.
+ *    The queue depth comes from TCP_INFO on the daemon's listening socket, which the stats process inherits.
+ *    The stats process dies with the daemon.
+ * AUTHOR
+ *    Written by Andrew Swaim
+ *
+*************************************************************************************************************************/
+
+#ifndef OTP_METRICS_H
+#define OTP_METRICS_H
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/prctl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "otp_capture.h"
+
+#define METRIC_SLOTS 64 // Slots request processes publish into
+#define METRIC_BUCKETS 15 // Latency histogram buckets, the last one unbounded
+#define METRIC_SIZES 11 // Message size classes for CPU time: up to 1K, 4K, 16K, ... 1G
+#define METRIC_CLIENTS 64 // Client addresses CPU time is kept for separately
+#define METRIC_BODY_LEN 131072 // Most bytes in a metrics response
+#define METRICS_NAME "otp_metrics" // The stats process's name, in ps and /proc/PID/comm
+
+enum { OUT_PASS, OUT_FAIL, OUT_BADL, OUT_BADT, OUT_BADK, OUT_SHRT, OUT_ABORTED, OUT_KILLED, OUTCOMES };
+enum { MPHASE_AUTH, MPHASE_RECEIVE, MPHASE_CIPHER, MPHASE_SEND, MPHASES };
+
+static const char* const outcomeNames[OUTCOMES] = {
+    "pass", "fail", "badl", "badt", "badk", "shrt", "aborted", "killed"
+};
+static const char* const metricPhaseNames[MPHASES] = { "auth", "receive", "cipher", "send" };
+static const long long metricBucketUs[METRIC_BUCKETS - 1] = { // Upper bounds of the bounded buckets
+    100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000
+};
+
+struct metricslot {
+    long long requests[OUTCOMES];
+    long long bytesIn, bytesOut;
+    long long buckets[MPHASES][METRIC_BUCKETS]; // Requests per bucket (not cumulative)
+    long long sumNs[MPHASES]; // Total nanoseconds in each phase
+    long long sizeRequests[METRIC_SIZES], sizeBytes[METRIC_SIZES], sizeCpuNs[METRIC_SIZES]; // By message size class
+} __attribute__((aligned(64)));
+
+struct metricclient {
+    long long key; // The client's IPv4 address plus 1, or 0 while the entry is free
+    long long requests, bytes, cpuNs;
+} __attribute__((aligned(64)));
+
+struct metrics {
+    long long accepted; // Only the daemon writes this
+    struct metricslot slots[METRIC_SLOTS];
+    struct metricclient clients[METRIC_CLIENTS + 1]; // The last one is every client that didn't get an entry
+};
+
+static struct metrics* metrics = NULL; // Shared counters, or NULL when metrics are off
+static pid_t metricsPid = -1; // The stats process
+static struct sockaddr_in metricsPeer; // This request process's client
+
+/*
+ * Add to a shared counter
+ * long long* counter: the counter
+ * long long n: how much to add
+*/
+static inline void metricsadd(long long* counter, long long n) { __atomic_fetch_add(counter, n, __ATOMIC_RELAXED); }
+
+/*
+ * Read a shared counter
+ * long long* counter: the counter
+*/
+static inline long long metricsget(long long* counter) { return __atomic_load_n(counter, __ATOMIC_RELAXED); }
+
+/*
+ * Get the label of a message size class, its largest message length
+ * char* label: where to put it
+ * int len: the size of label
+ * int i: the class
+*/
+static void metricssize(char* label, int len, int i) {
+
+    long long max = 1024LL << (2 * i);
+
+    if (max < (1 << 20)) { snprintf(label, len, "%lldK", max >> 10); }
+    else if (max < (1 << 30)) { snprintf(label, len, "%lldM", max >> 20); }
+    else { snprintf(label, len, "%lldG", max >> 30); }
+}
+
+/*
+ * Add up every slot into one
+ * struct metricslot* total: where to put the sums
+*/
+static void metricssum(struct metricslot* total) {
+
+    long long* from;
+    long long* to = (long long*)total;
+    int s, i, n = sizeof(struct metricslot) / sizeof(long long);
+
+    memset(total, 0, sizeof(*total));
+    for (s = 0; s < METRIC_SLOTS; s++) {
+        from = (long long*)&metrics->slots[s];
+        for (i = 0; i < n; i++) { to[i] += metricsget(&from[i]); }
+    }
+}
+
+/*
+ * Write the metrics in the Prometheus text format
+ * char* body: the buffer to write them to, METRIC_BODY_LEN long
+ * const char* daemon: the name of the daemon, for the labels
+ * int listeningFD: the daemon's listening socket, for the queue depth
+ * Returns the number of bytes written
+*/
+static int metricsformat(char* body, const char* daemon, int listeningFD) {
+
+    struct metricslot t;
+    struct metricclient* c;
+    struct tcp_info info;
+    socklen_t infoLen = sizeof(info);
+    long long finished = 0, cumulative, key;
+    char label[INET_ADDRSTRLEN];
+    int len = 0, i, p;
+
+#define EMIT(...) len += snprintf(body + len, len < METRIC_BODY_LEN ? METRIC_BODY_LEN - len : 0, __VA_ARGS__)
+    metricssum(&t);
+    for (i = 0; i < OUTCOMES; i++) { finished += t.requests[i]; }
+    memset(&info, 0, sizeof(info));
+    getsockopt(listeningFD, IPPROTO_TCP, TCP_INFO, &info, &infoLen); // For a listening socket: the accept queue
+
+    EMIT("# HELP otp_requests_total Requests handled, by outcome.\n# TYPE otp_requests_total counter\n");
+    for (i = 0; i < OUTCOMES; i++) {
+        EMIT("otp_requests_total{daemon=\"%s\",outcome=\"%s\"} %lld\n", daemon, outcomeNames[i], t.requests[i]);
+    }
+    EMIT("# HELP otp_connections_accepted_total Connections accepted.\n"
+         "# TYPE otp_connections_accepted_total counter\n"
+         "otp_connections_accepted_total{daemon=\"%s\"} %lld\n", daemon, metricsget(&metrics->accepted));
+    EMIT("# HELP otp_received_bytes_total Bytes received from clients.\n# TYPE otp_received_bytes_total counter\n"
+         "otp_received_bytes_total{daemon=\"%s\"} %lld\n", daemon, t.bytesIn);
+    EMIT("# HELP otp_sent_bytes_total Bytes sent to clients.\n# TYPE otp_sent_bytes_total counter\n"
+         "otp_sent_bytes_total{daemon=\"%s\"} %lld\n", daemon, t.bytesOut);
+    EMIT("# HELP otp_active_connections Request processes still running.\n# TYPE otp_active_connections gauge\n"
+         "otp_active_connections{daemon=\"%s\"} %lld\n", daemon, metricsget(&metrics->accepted) - finished);
+    EMIT("# HELP otp_listen_queue_depth Connections waiting to be accepted.\n# TYPE otp_listen_queue_depth gauge\n"
+         "otp_listen_queue_depth{daemon=\"%s\"} %u\n", daemon, info.tcpi_unacked);
+    EMIT("# HELP otp_listen_queue_limit Most connections that can wait to be accepted.\n"
+         "# TYPE otp_listen_queue_limit gauge\n"
+         "otp_listen_queue_limit{daemon=\"%s\"} %u\n", daemon, info.tcpi_sacked);
+
+    EMIT("# HELP otp_phase_duration_seconds Time spent in each phase of a request.\n"
+         "# TYPE otp_phase_duration_seconds histogram\n");
+    for (p = 0; p < MPHASES; p++) {
+        for (cumulative = 0, i = 0; i < METRIC_BUCKETS; i++) {
+            cumulative += t.buckets[p][i];
+            if (i < METRIC_BUCKETS - 1) {
+                EMIT("otp_phase_duration_seconds_bucket{daemon=\"%s\",phase=\"%s\",le=\"%g\"} %lld\n", daemon,
+                     metricPhaseNames[p], metricBucketUs[i] / 1e6, cumulative);
+            }
+            else {
+                EMIT("otp_phase_duration_seconds_bucket{daemon=\"%s\",phase=\"%s\",le=\"+Inf\"} %lld\n", daemon,
+                     metricPhaseNames[p], cumulative);
+            }
+        }
+        EMIT("otp_phase_duration_seconds_sum{daemon=\"%s\",phase=\"%s\"} %.6f\n", daemon, metricPhaseNames[p],
+             t.sumNs[p] / 1e9);
+        EMIT("otp_phase_duration_seconds_count{daemon=\"%s\",phase=\"%s\"} %lld\n", daemon, metricPhaseNames[p],
+             cumulative);
+    }
+
+    EMIT("# HELP otp_cpu_seconds_total CPU time used by request processes, by message size.\n"
+         "# TYPE otp_cpu_seconds_total counter\n");
+    for (i = 0; i < METRIC_SIZES; i++) {
+        metricssize(label, sizeof(label), i);
+        EMIT("otp_cpu_seconds_total{daemon=\"%s\",size=\"%s\"} %.6f\n", daemon, label, t.sizeCpuNs[i] / 1e9);
+    }
+    EMIT("# HELP otp_processed_bytes_total Text bytes received, by message size.\n"
+         "# TYPE otp_processed_bytes_total counter\n");
+    for (i = 0; i < METRIC_SIZES; i++) {
+        metricssize(label, sizeof(label), i);
+        EMIT("otp_processed_bytes_total{daemon=\"%s\",size=\"%s\"} %lld\n", daemon, label, t.sizeBytes[i]);
+    }
+    EMIT("# HELP otp_size_requests_total Requests, by message size.\n# TYPE otp_size_requests_total counter\n");
+    for (i = 0; i < METRIC_SIZES; i++) {
+        metricssize(label, sizeof(label), i);
+        EMIT("otp_size_requests_total{daemon=\"%s\",size=\"%s\"} %lld\n", daemon, label, t.sizeRequests[i]);
+    }
+    EMIT("# HELP otp_cpu_seconds_per_gigabyte CPU seconds per GB of text processed so far, by message size.\n"
+         "# TYPE otp_cpu_seconds_per_gigabyte gauge\n");
+    for (i = 0; i < METRIC_SIZES; i++) {
+        metricssize(label, sizeof(label), i);
+        if (t.sizeBytes[i] > 0) { // cpuNs / 1e9 seconds over bytes / 1e9 GB
+            EMIT("otp_cpu_seconds_per_gigabyte{daemon=\"%s\",size=\"%s\"} %.6f\n", daemon, label,
+                 (double)t.sizeCpuNs[i] / t.sizeBytes[i]);
+        }
+    }
+
+    EMIT("# HELP otp_client_requests_total Requests, by client address.\n# TYPE otp_client_requests_total counter\n"
+         "# HELP otp_client_cpu_seconds_total CPU time used by request processes, by client address.\n"
+         "# TYPE otp_client_cpu_seconds_total counter\n"
+         "# HELP otp_client_processed_bytes_total Text bytes received, by client address.\n"
+         "# TYPE otp_client_processed_bytes_total counter\n"
+         "# HELP otp_client_cpu_seconds_per_gigabyte CPU seconds per GB of text processed so far, by client address.\n"
+         "# TYPE otp_client_cpu_seconds_per_gigabyte gauge\n");
+    for (i = 0; i <= METRIC_CLIENTS; i++) {
+        c = &metrics->clients[i];
+        if ((key = metricsget(&c->key)) == 0 && i < METRIC_CLIENTS) { continue; }
+        if (i == METRIC_CLIENTS) { strcpy(label, "other"); }
+        else { inet_ntop(AF_INET, &(in_addr_t){ (in_addr_t)(key - 1) }, label, sizeof(label)); }
+        EMIT("otp_client_requests_total{daemon=\"%s\",client=\"%s\"} %lld\n", daemon, label,
+             metricsget(&c->requests));
+        EMIT("otp_client_cpu_seconds_total{daemon=\"%s\",client=\"%s\"} %.6f\n", daemon, label,
+             metricsget(&c->cpuNs) / 1e9);
+        EMIT("otp_client_processed_bytes_total{daemon=\"%s\",client=\"%s\"} %lld\n", daemon, label,
+             metricsget(&c->bytes));
+        if (metricsget(&c->bytes) > 0) {
+            EMIT("otp_client_cpu_seconds_per_gigabyte{daemon=\"%s\",client=\"%s\"} %.6f\n", daemon, label,
+                 (double)metricsget(&c->cpuNs) / metricsget(&c->bytes));
+        }
+    }
+#undef EMIT
+    return len < METRIC_BODY_LEN ? len : METRIC_BODY_LEN - 1;
+}
+
+/*
+ * Serve scrapes forever, in the stats process
+ * int statsFD: the listening socket for scrapes
+ * const char* daemon: the name of the daemon
+ * int listeningFD: the daemon's listening socket, for the queue depth
+*/
+static void metricsserve(int statsFD, const char* daemon, int listeningFD) {
+
+    static char body[METRIC_BODY_LEN], request[1024];
+    char header[256];
+    int fd, n, total, len, headerLen;
+
+    while (1) {
+        if ((fd = accept(statsFD, NULL, NULL)) < 0) { continue; }
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &(struct timeval){ 1, 0 }, sizeof(struct timeval));
+        for (total = 0; total < (int)sizeof(request) - 1; total += n) { // Read the request line and headers
+            if ((n = recv(fd, request + total, sizeof(request) - 1 - total, 0)) <= 0) { break; }
+            request[total + n] = '\0';
+            if (strstr(request, "\r\n\r\n") != NULL || strstr(request, "\n\n") != NULL) { total += n; break; }
+        }
+        request[total] = '\0';
+        if (strncmp(request, "GET /metrics ", 13) == 0 || strncmp(request, "GET / ", 6) == 0) {
+            len = metricsformat(body, daemon, listeningFD);
+            headerLen = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                                 "Content-Length: %d\r\nConnection: close\r\n\r\n", len);
+        }
+        else {
+            len = snprintf(body, sizeof(body), "only GET /metrics is served\n");
+            headerLen = snprintf(header, sizeof(header), "HTTP/1.0 404 Not Found\r\nContent-Type: text/plain\r\n"
+                                 "Content-Length: %d\r\nConnection: close\r\n\r\n", len);
+        }
+        send(fd, header, headerLen, MSG_NOSIGNAL);
+        for (total = 0; total < len && (n = send(fd, body + total, len - total, MSG_NOSIGNAL)) > 0; total += n) { }
+        close(fd);
+    }
+}
+
+/*
+ * Map the shared counters and fork the stats process listening on its own port, once the daemon is listening
+ * int port: the port to serve metrics on
+ * const char* daemon: the name of the daemon
+ * int listeningFD: the daemon's listening socket
+ * Returns 0 on success, -1 if the metrics port couldn't be set up
+*/
+static int metricsopen(int port, const char* daemon, int listeningFD) {
+
+    struct sockaddr_in addr;
+    int statsFD;
+
+    metrics = mmap(NULL, sizeof(struct metrics), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (metrics == MAP_FAILED) { metrics = NULL; return -1; }
+    memset((char*)&addr, '\0', sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = INADDR_ANY;
+    if ((statsFD = socket(AF_INET, SOCK_STREAM, 0)) < 0) { return -1; }
+    setsockopt(statsFD, SOL_SOCKET, SO_REUSEADDR, &(int){ 1 }, sizeof(int));
+    if (bind(statsFD, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(statsFD, 5) < 0) {
+        close(statsFD); return -1;
+    }
+
+    fflush(stdout);
+    if ((metricsPid = fork()) < 0) { close(statsFD); return -1; }
+    if (metricsPid == 0) { // Stats process
+        prctl(PR_SET_PDEATHSIG, SIGTERM); // Go when the daemon goes
+        prctl(PR_SET_NAME, METRICS_NAME);
+        if (getppid() == 1) { _exit(0); }
+        signal(SIGUSR1, SIG_IGN);
+        metricsserve(statsFD, daemon, listeningFD);
+        _exit(0);
+    }
+    close(statsFD);
+    return 0;
+}
+
+/*
+ * Count an accepted connection, in the daemon
+*/
+static void metricsaccept(void) {
+
+    if (metrics != NULL) { metricsadd(&metrics->accepted, 1); }
+}
+
+/*
+ * Count a request process that died from a signal (and so never published), when the daemon reaps it
+ * pid_t pid: the process reaped
+ * int status: its wait status
+*/
+static void metricsreap(pid_t pid, int status) {
+
+    if (metrics != NULL && pid != metricsPid && WIFSIGNALED(status)) {
+        metricsadd(&metrics->slots[0].requests[OUT_KILLED], 1);
+    }
+}
+
+/*
+ * Add a phase's time to its histogram
+ * struct metricslot* slot: the slot to publish into
+ * int phase: the phase (MPHASE_AUTH, ...)
+ * double us: microseconds spent in it
+*/
+static void metricsphase(struct metricslot* slot, int phase, double us) {
+
+    int i;
+
+    for (i = 0; i < METRIC_BUCKETS - 1 && us > metricBucketUs[i]; i++) { }
+    metricsadd(&slot->buckets[phase][i], 1);
+    metricsadd(&slot->sumNs[phase], (long long)(us * 1000));
+}
+
+/*
+ * Find a client's CPU time entry, claiming a free one the first time the client is seen
+ * in_addr_t addr: the client's address
+ * Returns the entry, or the shared one for every other client if they're all taken
+*/
+static struct metricclient* metricsclient(in_addr_t addr) {
+
+    struct metricclient* c;
+    long long key = (long long)addr + 1, free;
+    int i, start = (int)(ntohl(addr) % METRIC_CLIENTS);
+
+    for (i = 0; i < METRIC_CLIENTS; i++) { // Probe from a spot picked by the address, so lookups are usually short
+        c = &metrics->clients[(start + i) % METRIC_CLIENTS];
+        free = 0;
+        if (metricsget(&c->key) == key
+            || __atomic_compare_exchange_n(&c->key, &free, key, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+            || free == key) { // Another request process from the same client claimed it first
+            return c;
+        }
+    }
+    return &metrics->clients[METRIC_CLIENTS];
+}
+
+/*
+ * Publish this request process's counts, registered with atexit() in the request process
+*/
+static void metricsdone(void) {
+
+    static const char* const statuses[OUT_ABORTED] = { "PASS", "FAIL", "BADL", "BADT", "BADK", "SHRT" };
+    struct metricslot* slot;
+    struct metricclient* client;
+    struct timespec cpu;
+    long long cpuNs, bytes;
+    int i;
+
+    if (metrics == NULL) { return; }
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu); // Counted from zero at the fork, so the whole request
+    cpuNs = cpu.tv_sec * 1000000000LL + cpu.tv_nsec;
+    bytes = cap.textLen > 0 && strcmp(cap.status, "BADL") != 0 ? cap.textLen : 0; // A bad length was never received
+    slot = &metrics->slots[cap.conn % METRIC_SLOTS];
+    for (i = 0; i < METRIC_SIZES - 1 && cap.textLen > (1024LL << (2 * i)); i++) { }
+    metricsadd(&slot->sizeRequests[i], 1);
+    metricsadd(&slot->sizeBytes[i], bytes);
+    metricsadd(&slot->sizeCpuNs[i], cpuNs);
+    client = metricsclient(metricsPeer.sin_addr.s_addr);
+    metricsadd(&client->requests, 1);
+    metricsadd(&client->bytes, bytes);
+    metricsadd(&client->cpuNs, cpuNs);
+    for (i = 0; i < OUT_ABORTED && strcmp(cap.status, statuses[i]) != 0; i++) { }
+    metricsadd(&slot->requests[i], 1); // OUT_ABORTED if it never got a status
+    metricsadd(&slot->bytesIn, cap.bytesIn);
+    metricsadd(&slot->bytesOut, cap.bytesOut);
+    if (cap.phase[PHASE_AUTH] > 0) { metricsphase(slot, MPHASE_AUTH, cap.phase[PHASE_AUTH]); }
+    if (cap.phase[PHASE_TEXT] > 0) { metricsphase(slot, MPHASE_RECEIVE, cap.phase[PHASE_TEXT] + cap.phase[PHASE_KEY]); }
+    if (cap.phase[PHASE_CIPHER] > 0) { metricsphase(slot, MPHASE_CIPHER, cap.phase[PHASE_CIPHER]); }
+    if (cap.phase[PHASE_SEND] > 0) { metricsphase(slot, MPHASE_SEND, cap.phase[PHASE_SEND]); }
+}
+
+/*
+ * Start counting a request process, just after the fork
+ * const struct sockaddr_in* peer: the client's address from accept()
+*/
+static void metricsstart(const struct sockaddr_in* peer) {
+
+    if (metrics == NULL) { return; }
+    memcpy(&metricsPeer, peer, sizeof(metricsPeer));
+    atexit(metricsdone);
+}
+
+#endif
@@ -0,0 +1,390 @@
+/*************************************************************************************************************************
+ *
+ * NAME
+ *    otp_microbench.c
+ * SYNOPSIS
+ *    Microbenchmarks for the One-Time Pad hot path kernels.
+ * DESCRIPTION
+ *    Times every tier of the kernels in otp_kernels.h (encrypt(), decrypt(), validation and keygen's character
+ *       generation), plus a sendrecv() style transfer over a loopback TCP connection, across a sweep of buffer sizes.
+ *    The transfer runs once with default socket options, as the clients use, and once with TCP_NODELAY, which shows
+ *       how much of the small message cost is Nagle's algorithm holding back the message behind its length header.
+ *    Each size is repeated until it has run for at least the minimum time, and the results are printed to stdout as
+ *       JSON (one entry per kernel, tier and size) with the throughput in GB/s and the cost in TSC cycles per byte.
+ * INSTRUCTIONS
+ *    Use the included compileall script to compile this program as well as the other programs.
+ *    Then run it with:
+ *       otp_microbench [--min-size BYTES] [--max-size BYTES] [--min-time SECONDS] [--filter KERNEL] [--perf] > results.json
+ *    Sizes sweep by powers of 4 from --min-size (default 16) up to --max-size (default 64M, at most 1G).
+ *    --filter only runs the kernels whose name contains the given text (e.g. "crypt" or "transfer").
+ *    --perf also wraps each measured loop in hardware performance counters (see otp_perf.h) and adds them per byte,
+ *       with IPC, to each result. They count user space only, so they miss the kernel side of the transfer benchmark.
+ * AUTHOR
+ *    Written by Andrew Swaim
+ *
+*************************************************************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#else
+#define HAVE_TSC 0
+#endif
+
+#include "otp_kernels.h"
+#include "otp_perf.h"
+
+typedef enum { false, true } bool; // Create bool type for C89/C99 compilation.
+
+#define MAX_SIZE (1L << 30) // Largest buffer size that can be benchmarked (1G)
+#define COPY_BYTES (16L << 10) // Bytes of fresh input copies per timed batch, for kernels that write their inputs
+
+/*************************************************************************************************************************
+ * Function Declarations
+*************************************************************************************************************************/
+
+void runencrypt(long); // Kernel wrappers with a common signature, timed by measure()
+void rundecrypt(long);
+#ifdef __SSE2__
+void runencryptsse2(long);
+void rundecryptsse2(long);
+#endif
+void runvalidscalar(long);
+#ifdef __SSE2__
+void runvalidsse2(long);
+#endif
+void runkeychars(long);
+void runtransfer(long);
+void runtransfernodelay(long);
+void measure(const char*, const char*, void (*)(long), bool, long, double, bool*); // To time one kernel at one size
+double timerun(void (*)(long), bool, long, long, unsigned long long*, long long*); // To time a number of iterations
+void startserver(long, bool); // To (re)start the loopback receiver used by the transfer benchmarks
+int sendrecv(int, char*, int, bool); // To send or receive data to or from a socket
+double now(void); // To get a monotonic timestamp in seconds
+unsigned long long cycles(void); // To read the TSC (or 0 where there isn't one)
+
+/*************************************************************************************************************************
+ * Globals
+*************************************************************************************************************************/
+
+struct kernel { const char* name; const char* tier; void (*run)(long); bool dirties; }; // dirties: writes its inputs
+
+struct kernel kernels[] = { // Every kernel tier to benchmark
+    { "encrypt", "scalar", runencrypt, true }, // The scalar cipher kernels write '@' over spaces in the text and key
+    { "decrypt", "scalar", rundecrypt, true },
+#ifdef __SSE2__
+    { "encrypt", "sse2", runencryptsse2, false },
+    { "decrypt", "sse2", rundecryptsse2, false },
+#endif
+    { "validate", "scalar", runvalidscalar, false },
+#ifdef __SSE2__
+    { "validate", "sse2", runvalidsse2, false },
+#endif
+    { "keygen", "scalar", runkeychars, false },
+    { "transfer", "tcp_loopback", runtransfer, false },
+    { "transfer", "tcp_loopback_nodelay", runtransfernodelay, false },
+};
+
+char *text, *key, *out; // Benchmark buffers the kernels use, filled with valid characters
+char *textBuf, *keyBuf; // Where text and key point, with room for COPY_BYTES of copies for kernels that write them
+char *textInit, *keyInit; // What to restore text and key from
+int serverFD = -1; // Client side of the loopback connection for the transfer benchmark
+pid_t serverPid = -1; // Loopback receiver process
+volatile int sink; // Keeps validation results from being optimized away
+bool perfOn = false; // Whether to report hardware performance counters
+struct perfset perf; // Counters for this thread, when perfOn
+
+/*************************************************************************************************************************
+ * Main
+*************************************************************************************************************************/
+
+int main(int argc, char *argv[]) {
+
+    long minSize = 16, maxSize = 64L << 20, size, bufSize;
+    double minTime = 0.2;
+    char* filter = NULL;
+    bool first = true;
+    int opt, i;
+
+    static struct option longopts[] = {
+        { "min-size", required_argument, NULL, 's' }, { "max-size", required_argument, NULL, 'S' },
+        { "min-time", required_argument, NULL, 't' }, { "filter", required_argument, NULL, 'f' },
+        { "perf", no_argument, NULL, 'p' }, { NULL, 0, NULL, 0 }
+    };
+
+    // Check usage & args
+    while ((opt = getopt_long(argc, argv, "s:S:t:f:p", longopts, NULL)) != -1) {
+        if (opt == 's') { minSize = atol(optarg); }
+        else if (opt == 'S') { maxSize = atol(optarg); }
+        else if (opt == 't') { minTime = atof(optarg); }
+        else if (opt == 'f') { filter = optarg; }
+        else if (opt == 'p') { perfOn = true; }
+        else { argc = 0; }
+    }
+    if (argc == 0 || optind != argc || minSize < 1 || maxSize < minSize || maxSize > MAX_SIZE) {
+        fprintf(stderr, "USAGE: %s [--min-size BYTES] [--max-size BYTES] [--min-time SECONDS] [--filter KERNEL] [--perf]\n", argv[0]);
+        exit(1);
+    }
+
+    // Set up buffers of valid characters for the largest size
+    bufSize = maxSize > COPY_BYTES ? maxSize : COPY_BYTES;
+    if ((textBuf = malloc(bufSize + 1)) == NULL || (keyBuf = malloc(bufSize + 1)) == NULL || (out = malloc(maxSize + 1)) == NULL
+        || (textInit = malloc(maxSize + 1)) == NULL || (keyInit = malloc(maxSize + 1)) == NULL) {
+        fprintf(stderr, "otp_microbench: ERROR, out of memory\n"); exit(1);
+    }
+    text = textBuf;
+    key = keyBuf;
+    srand(1);
+    if (perfOn && perfopen(&perf, 0, 0) == 0) {
+        fprintf(stderr, "otp_microbench: WARNING, no performance counters available (check perf_event_paranoid)\n");
+    }
+    keychars(textInit, maxSize);
+    keychars(keyInit, maxSize);
+
+    // Print the context, then every kernel at every size
+    printf("{\n  \"context\": { \"max_size\": %ld, \"min_time\": %g, \"tsc\": %s },\n  \"benchmarks\": [\n",
+           maxSize, minTime, HAVE_TSC ? "true" : "false");
+    for (i = 0; i < (int)(sizeof(kernels) / sizeof(kernels[0])); i++) {
+
+        if (filter != NULL && strstr(kernels[i].name, filter) == NULL) { continue; }
+        if (kernels[i].run == runtransfer || kernels[i].run == runtransfernodelay) {
+            startserver(maxSize, kernels[i].run == runtransfernodelay);
+        }
+        for (size = minSize; size <= maxSize; size *= 4) {
+            memcpy(text, textInit, size);
+            memcpy(key, keyInit, size);
+            measure(kernels[i].name, kernels[i].tier, kernels[i].run, kernels[i].dirties, size, minTime, &first);
+        }
+    }
+    printf("\n  ]\n}\n");
+
+    startserver(0, false); // Shut down the loopback receiver if it was started
+    return 0;
+}
+
+/*************************************************************************************************************************
+ * Function Definitions
+*************************************************************************************************************************/
+
+/*
+ * Kernel wrappers, each processes len bytes of the benchmark buffers once
+ * long len: the number of bytes to process
+*/
+void runencrypt(long len) { encryptscalar(text, key, out, (int)len); }
+void rundecrypt(long len) { decryptscalar(text, key, out, (int)len); }
+#ifdef __SSE2__
+void runencryptsse2(long len) { encryptsse2(text, key, out, (int)len); }
+void rundecryptsse2(long len) { decryptsse2(text, key, out, (int)len); }
+#endif
+void runvalidscalar(long len) { sink = validscalar(text, (int)len); }
+#ifdef __SSE2__
+void runvalidsse2(long len) { sink = validsse2(text, (int)len); }
+#endif
+void runkeychars(long len) { keychars(out, (int)len); }
+
+/*
+ * Send len bytes to the loopback receiver the way the clients send text, and wait for its one byte acknowledgement
+ * long len: the number of bytes to transfer
+*/
+void runtransfer(long len) {
+
+    char header[16], ack[2];
+
+    snprintf(header, sizeof(header), "%9ld", len);
+    if (sendrecv(serverFD, header, 9, true) != 9 || sendrecv(serverFD, text, (int)len, true) != len
+        || sendrecv(serverFD, ack, 1, false) != 1) {
+        fprintf(stderr, "otp_microbench: ERROR, loopback transfer failed\n"); exit(2);
+    }
+}
+void runtransfernodelay(long len) { runtransfer(len); } // Same transfer, startserver() sets TCP_NODELAY for this tier
+
+/*
+ * Time a kernel at one size, doubling the number of iterations until it runs for at least minTime, and print the result
+ * const char* name: the name of the kernel
+ * const char* tier: the name of the kernel's tier
+ * void (*run)(long): the kernel wrapper
+ * bool dirties: whether the kernel writes over its inputs
+ * long size: the number of bytes each iteration processes
+ * double minTime: the minimum number of seconds to run for
+ * bool* first: whether this is the first result (no comma before it), cleared after printing
+*/
+void measure(const char* name, const char* tier, void (*run)(long), bool dirties, long size, double minTime,
+             bool* first) {
+
+    long iters = 1;
+    double elapsed;
+    unsigned long long cyc;
+    long long counts[PERF_COUNTERS];
+
+    run(size); // Warm up caches and fault in pages
+
+    while (1) {
+        elapsed = timerun(run, dirties, size, iters, &cyc, counts);
+        if (elapsed >= minTime || iters >= (1L << 40)) { break; }
+        // Aim just past minTime next time, growing at most 10x per step
+        iters = elapsed > 0 && minTime / elapsed < 10 ? (long)(iters * minTime / elapsed * 1.2) + 1 : iters * 10;
+    }
+
+    printf("%s    { \"name\": \"%s/%s/%ld\", \"kernel\": \"%s\", \"tier\": \"%s\", \"bytes\": %ld, \"iterations\": %ld, "
+           "\"seconds\": %.9f, \"gb_per_sec\": %.6f, \"cycles_per_byte\": %.4f",
+           *first ? "" : ",\n", name, tier, size, name, tier, size, iters, elapsed,
+           (double)size * iters / elapsed / 1e9, HAVE_TSC ? (double)cyc / ((double)size * iters) : 0.0);
+    if (perfOn) { printf(", \"perf_per_byte\": { "); perfjson(stdout, counts, (double)size * iters); printf(" }"); }
+    printf(" }");
+    fflush(stdout);
+    *first = false;
+}
+
+/*
+ * Run a kernel a number of times and time it
+ * A kernel that writes over its inputs gets fresh ones every iteration: it works through batches of copies of
+ *    textInit and keyInit (COPY_BYTES worth, or one copy for larger sizes), restored outside the timed region.
+ * void (*run)(long): the kernel wrapper
+ * bool dirties: whether the kernel writes over its inputs
+ * long size: the number of bytes each iteration processes
+ * long iters: the number of iterations
+ * unsigned long long* cyc: where to put the TSC cycles the iterations took
+ * long long* counts: where to put the performance counts, when perfOn
+ * Returns the number of seconds the iterations took
+*/
+double timerun(void (*run)(long), bool dirties, long size, long iters, unsigned long long* cyc, long long* counts) {
+
+    long copies = !dirties ? iters : COPY_BYTES / size > 0 ? COPY_BYTES / size : 1, done, n, j;
+    long long batch[PERF_COUNTERS];
+    unsigned long long c0;
+    double start, elapsed = 0;
+    int k;
+
+    *cyc = 0;
+    if (perfOn) { memset(counts, 0, sizeof(batch)); }
+    for (done = 0; done < iters; done += n) {
+
+        // Restore the copies this batch will use
+        n = iters - done < copies ? iters - done : copies;
+        for (j = 0; dirties && j < n; j++) {
+            memcpy(textBuf + j * size, textInit, size);
+            memcpy(keyBuf + j * size, keyInit, size);
+        }
+
+        if (perfOn) { perfstart(&perf); }
+        start = now();
+        c0 = cycles();
+        if (dirties) { for (j = 0; j < n; j++) { text = textBuf + j * size; key = keyBuf + j * size; run(size); } }
+        else { for (j = 0; j < n; j++) { run(size); } }
+        *cyc += cycles() - c0;
+        elapsed += now() - start;
+        if (perfOn) {
+            perfstop(&perf, batch);
+            for (k = 0; k < PERF_COUNTERS; k++) { counts[k] = batch[k] < 0 || counts[k] < 0 ? -1 : counts[k] + batch[k]; }
+        }
+    }
+    text = textBuf;
+    key = keyBuf;
+    return elapsed;
+}
+
+/*
+ * Fork a loopback TCP receiver that takes each 9 digit length header and message with sendrecv(), acknowledging each
+ * Any receiver already running is shut down first.
+ * long maxSize: the largest message that will be sent, or 0 to only shut down
+ * bool nodelay: whether to disable Nagle's algorithm on the sending side
+*/
+void startserver(long maxSize, bool nodelay) {
+
+    int listeningFD, connectedFD, len;
+    struct sockaddr_in addr;
+    socklen_t addrSize = sizeof(addr);
+    char header[10], ack[2] = "K";
+    int on = 1;
+
+    if (serverFD >= 0) { close(serverFD); waitpid(serverPid, NULL, 0); serverFD = -1; }
+    if (maxSize == 0) { return; }
+
+    // Listen on any free port on the loopback interface
+    memset((char*)&addr, '\0', sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if ((listeningFD = socket(AF_INET, SOCK_STREAM, 0)) < 0 || bind(listeningFD, (struct sockaddr*)&addr, sizeof(addr)) < 0
+        || listen(listeningFD, 1) < 0 || getsockname(listeningFD, (struct sockaddr*)&addr, &addrSize) < 0) {
+        fprintf(stderr, "otp_microbench: ERROR, setting up loopback socket\n"); exit(2);
+    }
+
+    fflush(stdout); // Don't let the receiver inherit unwritten results
+    if ((serverPid = fork()) < 0) { fprintf(stderr, "otp_microbench: ERROR, fork() failure\n"); exit(2); }
+    if (serverPid == 0) { // Receiver process
+
+        char* buf = malloc(maxSize + 1);
+        if (buf == NULL || (connectedFD = accept(listeningFD, NULL, NULL)) < 0) { exit(2); }
+        while (sendrecv(connectedFD, header, 9, false) == 9) {
+            len = atoi(header);
+            if (sendrecv(connectedFD, buf, len, false) != len) { break; }
+            sendrecv(connectedFD, ack, 1, true);
+        }
+        exit(0);
+    }
+
+    // Connect to the receiver
+    close(listeningFD);
+    if ((serverFD = socket(AF_INET, SOCK_STREAM, 0)) < 0 || connect(serverFD, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "otp_microbench: ERROR, connecting to loopback receiver\n"); exit(2);
+    }
+    if (nodelay) { setsockopt(serverFD, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)); }
+}
+
+/*
+ * Send or receive data to or from a socket file descriptor
+ * int sockFD: the socket file descriptor to use
+ * char* str: the string with the data to send or to hold the data that is received
+ * int len: the length of the data to send or receive
+ * bool sendMode: true for sending data, false for receiving data
+*/
+int sendrecv(int sockFD, char* str, int len, bool sendMode) {
+
+    int total = 0; // To calculate the total chars that get sent/received
+    int n;         // To hold how many chars get sent with each send()/recv() call
+
+    if (!sendMode) { memset(str, '\0', len+1); } // If receiving, clear the str buffer
+
+    while (total < len) { // Process the entire buffer
+
+        if (sendMode) { n = send(sockFD, str+total, len-total, 0); }
+        else { n = recv(sockFD, str+total, len-total, 0); }
+        if (n <= 0) { break; }
+        total += n;
+    }
+    return total; // If processed successfully, total should equal len
+}
+
+/*
+ * Get a monotonic timestamp in seconds
+*/
+double now(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Read the time stamp counter, which counts at a constant rate close to the nominal CPU clock on modern x86
+*/
+unsigned long long cycles(void) {
+
+#if HAVE_TSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
@@ -0,0 +1,330 @@
+/*************************************************************************************************************************
+ *
+ * NAME
+ *    otp_netem.c
+ * SYNOPSIS
+ *    Userspace TCP proxy that adds WAN-like latency, jitter, bandwidth limits and fragmentation.
+ * DESCRIPTION
+ *    Listens on a port and forwards every connection to a daemon, so otp_enc/otp_dec (or otp_bench, otp_replay) can be
+ *       pointed at the proxy instead of the daemon to test over a slow or distant link without root or tc.
+ *    Each direction of each connection is impaired on its own, like one side of a real link:
+ *       - data is read in pieces of at most --mtu bytes and each piece is written on separately (with Nagle's
+ *         algorithm off), so the receiver sees packet sized writes instead of whole messages
+ *       - with --rate, pieces are serialized one after another onto a link of that many bits per second
+ *       - each piece is then held back for --delay milliseconds, plus or minus a uniformly random --jitter (never
+ *         below 0), but never delivered before the piece ahead of it, since TCP doesn't reorder
+ *    --delay is one way, so the round trip time the client sees is twice that. Each connection is handled in its own
+ *       process, like the daemons, with a poll() loop that delivers whichever piece is due next. Both sockets are non
+ *       blocking, so a receiver that's slow to read only holds up its own direction: whatever it won't take yet stays
+ *       queued until poll() says it can take more. Reading from a side stops while more than QUEUE_LIMIT bytes are
+ *       waiting to be delivered from it, which pushes back on the sender the way a full link would.
+ * INSTRUCTIONS
+ *    Use the included compileall script to compile this program as well as the other programs.
+ *    Syntax:
+ *       otp_netem [--delay MS] [--jitter MS] [--rate BITS_PER_SEC] [--mtu BYTES] [--seed N] PORT TARGET_PORT
+ *    --rate takes a k, m or g suffix (e.g. 10m for 10 Mbit/s). The target is a daemon on this machine.
+ *    e.g. 40 ms round trip with 5 ms of jitter on a 20 Mbit/s link, in front of otp_enc_d on port 50001:
+ *       otp_netem --delay 20 --jitter 5 --rate 20m --mtu 1448 50101 50001 &
+ *       otp_enc plaintext1 mykey 50101
+ * AUTHOR
+ *    Written by Andrew Swaim
+ *
+*************************************************************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <getopt.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+typedef enum { false, true } bool; // Create bool type for C89/C99 compilation.
+
+#define MAX_MTU 65536 // Largest piece size allowed
+#define QUEUE_LIMIT (4 << 20) // Most bytes held in one direction before reading from that side stops
+
+/*************************************************************************************************************************
+ * Types and Globals
+*************************************************************************************************************************/
+
+struct piece { // A piece of data waiting to be delivered
+    struct piece* next;
+    double due; // When to deliver it
+    int len, sent; // Its length, and how much of it has been written so far
+    char data[];
+};
+
+struct direction { // One direction of a proxied connection
+    int from, to; // Sockets to read from and deliver to
+    struct piece *head, *tail; // Pieces waiting, in order
+    long queued; // Bytes waiting
+    double linkFree; // When the simulated link finishes serializing the last piece
+    double lastDue; // When the last piece is due, so none is delivered before the one ahead of it
+    bool eof; // Whether the reading side has closed
+};
+
+double delay = 0, jitter = 0, rate = 0; // One way delay and jitter in seconds, and link rate in bits per second
+int mtu = 1448; // Largest piece to read and deliver at once (a typical TCP segment over Ethernet)
+unsigned seed; // Seed for the jitter
+
+/*************************************************************************************************************************
+ * Function Declarations
+*************************************************************************************************************************/
+
+void proxy(int, int); // To impair and forward one connection in both directions until it closes
+bool readpiece(struct direction*); // To read one piece and schedule its delivery
+bool deliver(struct direction*, double); // To write the pieces that are due, as far as the receiver will take them
+double parserate(const char*); // To read a rate with an optional k/m/g suffix
+double now(void); // To get a monotonic timestamp in seconds
+
+/*************************************************************************************************************************
+ * Main
+*************************************************************************************************************************/
+
+int main(int argc, char *argv[]) {
+
+    int listeningFD, connectedFD, targetFD, port, targetPort, opt, status;
+    socklen_t clientSize;
+    struct sockaddr_in server, client, target;
+    pid_t pid;
+
+    static struct option longopts[] = {
+        { "delay", required_argument, NULL, 'd' }, { "jitter", required_argument, NULL, 'j' },
+        { "rate", required_argument, NULL, 'r' }, { "mtu", required_argument, NULL, 'm' },
+        { "seed", required_argument, NULL, 's' }, { NULL, 0, NULL, 0 }
+    };
+
+    seed = (unsigned)time(0);
+
+    // Check usage & args
+    while ((opt = getopt_long(argc, argv, "d:j:r:m:s:", longopts, NULL)) != -1) {
+        if (opt == 'd') { delay = atof(optarg) / 1e3; }
+        else if (opt == 'j') { jitter = atof(optarg) / 1e3; }
+        else if (opt == 'r') { rate = parserate(optarg); }
+        else if (opt == 'm') { mtu = atoi(optarg); }
+        else if (opt == 's') { seed = (unsigned)atoi(optarg); }
+        else { argc = 0; }
+    }
+    if (argc - optind != 2 || delay < 0 || jitter < 0 || rate < 0 || mtu < 1 || mtu > MAX_MTU) {
+        fprintf(stderr, "USAGE: %s [--delay MS] [--jitter MS] [--rate BITS_PER_SEC] [--mtu BYTES] [--seed N] "
+                        "PORT TARGET_PORT\n", argv[0]);
+        exit(1);
+    }
+
+    // Get and validate the port numbers
+    port = atoi(argv[optind]);
+    targetPort = atoi(argv[optind + 1]);
+    if (port < 0 || port > 65535) { fprintf(stderr, "otp_netem: ERROR, invalid port %d\n", port); exit(2); }
+    if (targetPort < 0 || targetPort > 65535) {
+        fprintf(stderr, "otp_netem: ERROR, invalid target port %d\n", targetPort); exit(2);
+    }
+    memset((char*)&server, '\0', sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons(port);
+    server.sin_addr.s_addr = INADDR_ANY;
+    memset((char*)&target, '\0', sizeof(target));
+    target.sin_family = AF_INET;
+    target.sin_port = htons(targetPort);
+    target.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    // Create and set up the listening socket
+    if ((listeningFD = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        fprintf(stderr, "otp_netem: ERROR, opening socket\n"); exit(2);
+    }
+    setsockopt(listeningFD, SOL_SOCKET, SO_REUSEADDR, &(int){ 1 }, sizeof(int));
+    if (bind(listeningFD, (struct sockaddr*)&server, sizeof(server)) < 0) {
+        fprintf(stderr, "otp_netem: ERROR, on binding\n"); exit(2);
+    }
+    listen(listeningFD, 128);
+
+    // Proxy each connection in its own process
+    while (1) {
+
+        clientSize = sizeof(client);
+        if ((connectedFD = accept(listeningFD, (struct sockaddr*)&client, &clientSize)) < 0) {
+            fprintf(stderr, "otp_netem: ERROR, on accept\n"); continue;
+        }
+        seed = seed * 1103515245 + 12345; // A different jitter sequence for each connection
+
+        pid = fork();
+        if (pid < 0) { fprintf(stderr, "otp_netem: ERROR, fork() failure\n"); close(connectedFD); }
+        else if (pid == 0) {
+
+            close(listeningFD);
+            if ((targetFD = socket(AF_INET, SOCK_STREAM, 0)) < 0
+                || connect(targetFD, (struct sockaddr*)&target, sizeof(target)) < 0) {
+                fprintf(stderr, "otp_netem: ERROR, connecting to target port %d\n", targetPort); exit(1);
+            }
+            proxy(connectedFD, targetFD);
+            exit(0);
+        }
+        else {
+            close(connectedFD);
+            while (pid > 0) { pid = waitpid(-1, &status, WNOHANG); } // Reap any finished connections
+        }
+    }
+
+    close(listeningFD);
+    return 0;
+}
+
+/*************************************************************************************************************************
+ * Function Definitions
+*************************************************************************************************************************/
+
+/*
+ * Impair and forward a connection in both directions until both sides have closed and everything is delivered
+ * int clientFD: the socket connected to the client
+ * int targetFD: the socket connected to the daemon
+*/
+void proxy(int clientFD, int targetFD) {
+
+    struct direction dirs[2] = { { clientFD, targetFD }, { targetFD, clientFD } };
+    struct pollfd fds[2];
+    double t, next;
+    int i, timeout;
+
+    // Deliver each piece as its own segment, and never block on either side
+    setsockopt(clientFD, IPPROTO_TCP, TCP_NODELAY, &(int){ 1 }, sizeof(int));
+    setsockopt(targetFD, IPPROTO_TCP, TCP_NODELAY, &(int){ 1 }, sizeof(int));
+    fcntl(clientFD, F_SETFL, fcntl(clientFD, F_GETFL) | O_NONBLOCK);
+    fcntl(targetFD, F_SETFL, fcntl(targetFD, F_GETFL) | O_NONBLOCK);
+    signal(SIGPIPE, SIG_IGN); // A side closing early shows up as a write error instead
+
+    while (!(dirs[0].eof && dirs[0].head == NULL && dirs[1].eof && dirs[1].head == NULL)) {
+
+        // Wait until a side has data (if its queue has room), can take a piece that's due, or the next piece is due
+        // (fds[i] is the socket dirs[i] reads from and dirs[1-i] delivers to)
+        t = now();
+        next = -1;
+        for (i = 0; i < 2; i++) {
+            fds[i].fd = dirs[i].from;
+            fds[i].events = !dirs[i].eof && dirs[i].queued < QUEUE_LIMIT ? POLLIN : 0;
+        }
+        for (i = 0; i < 2; i++) {
+            if (dirs[i].head == NULL) { continue; }
+            if (dirs[i].head->due <= t) { fds[1-i].events |= POLLOUT; } // Due, but the receiver wasn't taking it
+            else if (next < 0 || dirs[i].head->due < next) { next = dirs[i].head->due; }
+        }
+        timeout = next < 0 ? -1 : (int)((next - t) * 1e3) + 1;
+        if (poll(fds, 2, timeout) < 0) { continue; }
+
+        for (i = 0; i < 2; i++) {
+            if ((fds[i].revents & (POLLIN | POLLHUP | POLLERR)) && (fds[i].events & POLLIN) && !readpiece(&dirs[i])) {
+                return;
+            }
+        }
+        t = now();
+        for (i = 0; i < 2; i++) { if (!deliver(&dirs[i], t)) { return; } }
+    }
+    close(clientFD);
+    close(targetFD);
+}
+
+/*
+ * Read up to one MTU from a direction's source and schedule when it should be delivered
+ * struct direction* d: the direction to read for
+ * Returns false if the connection broke
+*/
+bool readpiece(struct direction* d) {
+
+    struct piece* p;
+    double t, due;
+    int n;
+
+    if ((p = malloc(sizeof(struct piece) + mtu)) == NULL) { return false; }
+    if ((n = recv(d->from, p->data, mtu, 0)) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        free(p); // Nothing to read after all
+        return true;
+    }
+    if (n <= 0) { // The side closed, pass that on once the queue drains
+        free(p);
+        d->eof = true;
+        if (d->head == NULL) { shutdown(d->to, SHUT_WR); }
+        return n == 0;
+    }
+
+    // Serialize onto the link, then add the delay and jitter, keeping the pieces in order
+    t = now();
+    if (rate > 0) { d->linkFree = (d->linkFree > t ? d->linkFree : t) + n * 8.0 / rate; }
+    else { d->linkFree = t; }
+    due = d->linkFree + delay + (jitter > 0 ? (rand_r(&seed) / (double)RAND_MAX * 2 - 1) * jitter : 0);
+    if (due < d->linkFree) { due = d->linkFree; }
+    if (due < d->lastDue) { due = d->lastDue; }
+    d->lastDue = due;
+
+    p->next = NULL;
+    p->due = due;
+    p->len = n;
+    p->sent = 0;
+    if (d->tail != NULL) { d->tail->next = p; } else { d->head = p; }
+    d->tail = p;
+    d->queued += n;
+    return true;
+}
+
+/*
+ * Write every piece in a direction that's due, then pass on the close once the source has closed and it's empty
+ * Stops early, leaving the rest queued, when the receiver won't take any more yet.
+ * struct direction* d: the direction to deliver for
+ * double t: the current time
+ * Returns false if the connection broke
+*/
+bool deliver(struct direction* d, double t) {
+
+    struct piece* p;
+    int n;
+
+    while ((p = d->head) != NULL && p->due <= t) {
+
+        while (p->sent < p->len) {
+            n = send(d->to, p->data + p->sent, p->len - p->sent, 0);
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) { return true; } // Full, poll() says when it isn't
+            if (n <= 0) { return false; }
+            p->sent += n;
+        }
+        d->head = p->next;
+        if (d->head == NULL) { d->tail = NULL; if (d->eof) { shutdown(d->to, SHUT_WR); } }
+        d->queued -= p->len;
+        free(p);
+    }
+    return true;
+}
+
+/*
+ * Read a rate in bits per second with an optional k, m or g (10^3, 10^6, 10^9) suffix
+ * const char* str: the rate to read
+ * Returns the rate, or -1 if it's not valid
+*/
+double parserate(const char* str) {
+
+    char* end;
+    double r = strtod(str, &end);
+
+    if (end == str) { return -1; }
+    if (*end == 'k' || *end == 'K') { r *= 1e3; end++; }
+    else if (*end == 'm' || *end == 'M') { r *= 1e6; end++; }
+    else if (*end == 'g' || *end == 'G') { r *= 1e9; end++; }
+    if (strcmp(end, "") != 0 && strcmp(end, "bit") != 0) { return -1; }
+    return r;
+}
+
+/*
+ * Get a monotonic timestamp in seconds
+*/
+double now(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -0,0 +1,148 @@
+/*************************************************************************************************************************
+ *
+ * NAME
+ *    otp_perf.h
+ * SYNOPSIS
+ *    Hardware performance counters for the benchmarks, through perf_event_open(2).
+ * DESCRIPTION
+ *    Opens one counter each for cycles, instructions, L1 data cache read misses, last level cache misses, branch misses
+ *       and context switches, on the calling thread or on another process (optionally including the children it
+ *       forks after the counters are opened, which is how the daemons serve each request).
+ *    Counters the kernel or hardware won't give us (no PMU in a VM, perf_event_paranoid too high) are left closed and
+ *       read back as -1, so callers can report them as unavailable instead of failing.
+ *    Counts are scaled up when the kernel had to multiplex the counters onto fewer hardware registers.
+ * AUTHOR
+ *    Written by Andrew Swaim
+ *
+*************************************************************************************************************************/
+
+#ifndef OTP_PERF_H
+#define OTP_PERF_H
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#define PERF_COUNTERS 6 // Number of counters in a set
+
+enum { PERF_CYCLES, PERF_INSTRUCTIONS, PERF_L1D_MISSES, PERF_LLC_MISSES, PERF_BRANCH_MISSES, PERF_CTX_SWITCHES };
+
+static const char* perfNames[PERF_COUNTERS] = { // Names to report each counter under
+    "cycles", "instructions", "l1d_misses", "llc_misses", "branch_misses", "context_switches"
+};
+
+struct perfset { int fd[PERF_COUNTERS]; long long base[PERF_COUNTERS]; };
+
+/*
+ * Open the set of counters, leaving any that can't be opened closed
+ * struct perfset* p: the set to open
+ * pid_t pid: the process to count, or 0 for the calling thread
+ * int inherit: whether to also count children the process forks from now on
+ * Returns the number of counters opened
+*/
+static int perfopen(struct perfset* p, pid_t pid, int inherit) {
+
+    static const struct { unsigned type; unsigned long long config; } events[PERF_COUNTERS] = {
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+        { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+                              | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+        { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+    };
+    struct perf_event_attr attr;
+    int i, opened = 0;
+
+    for (i = 0; i < PERF_COUNTERS; i++) {
+
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = events[i].type;
+        attr.config = events[i].config;
+        // Count user space only, which perf_event_paranoid 2 allows (except context switches, which are all kernel)
+        attr.exclude_kernel = events[i].type != PERF_TYPE_SOFTWARE;
+        attr.exclude_hv = 1;
+        attr.inherit = inherit ? 1 : 0;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        p->fd[i] = (int)syscall(SYS_perf_event_open, &attr, pid, -1, -1, 0);
+        p->base[i] = 0;
+        if (p->fd[i] >= 0) { opened++; }
+    }
+    return opened;
+}
+
+/*
+ * Read the current value of every counter, scaled for multiplexing, or -1 for counters that aren't open
+ * struct perfset* p: the set to read
+ * long long* vals: array of PERF_COUNTERS values to fill
+*/
+static void perfread(struct perfset* p, long long* vals) {
+
+    unsigned long long buf[3]; // Value, time enabled, time running
+    int i;
+
+    for (i = 0; i < PERF_COUNTERS; i++) {
+
+        vals[i] = -1;
+        if (p->fd[i] < 0 || read(p->fd[i], buf, sizeof(buf)) != sizeof(buf)) { continue; }
+        vals[i] = buf[2] > 0 && buf[2] < buf[1] ? (long long)((double)buf[0] * buf[1] / buf[2]) : (long long)buf[0];
+    }
+}
+
+/*
+ * Mark the start of a measured region
+ * struct perfset* p: the set to start
+*/
+static void perfstart(struct perfset* p) { perfread(p, p->base); }
+
+/*
+ * Get the counts since perfstart(), or -1 for counters that aren't open
+ * struct perfset* p: the set to stop
+ * long long* vals: array of PERF_COUNTERS values to fill
+*/
+static void perfstop(struct perfset* p, long long* vals) {
+
+    int i;
+
+    perfread(p, vals);
+    for (i = 0; i < PERF_COUNTERS; i++) { if (vals[i] >= 0) { vals[i] -= p->base[i]; } }
+}
+
+/*
+ * Close every counter in the set
+ * struct perfset* p: the set to close
+*/
+static void perfclose(struct perfset* p) {
+
+    int i;
+
+    for (i = 0; i < PERF_COUNTERS; i++) { if (p->fd[i] >= 0) { close(p->fd[i]); p->fd[i] = -1; } }
+}
+
+/*
+ * Print counts as JSON object members divided by a unit count (bytes or requests), with IPC, "null" when unavailable
+ * FILE* out: the stream to print to
+ * long long* vals: the counts from perfstop()
+ * double units: what to divide each count by
+*/
+static void perfjson(FILE* out, long long* vals, double units) {
+
+    int i;
+
+    for (i = 0; i < PERF_COUNTERS; i++) {
+        if (vals[i] < 0) { fprintf(out, "\"%s\": null, ", perfNames[i]); }
+        else { fprintf(out, "\"%s\": %.6g, ", perfNames[i], vals[i] / units); }
+    }
+    if (vals[PERF_CYCLES] > 0 && vals[PERF_INSTRUCTIONS] >= 0) {
+        fprintf(out, "\"ipc\": %.3f", (double)vals[PERF_INSTRUCTIONS] / vals[PERF_CYCLES]);
+    }
+    else { fprintf(out, "\"ipc\": null"); }
+}
+
+#endif
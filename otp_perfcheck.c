@@ -0,0 +1,369 @@
+/*************************************************************************************************************************
+ *
+ * NAME
+ *    otp_perfcheck.c
+ * SYNOPSIS
+ *    Performance regression gate for the kernels and the daemons.
+ * DESCRIPTION
+ *    Runs a fixed suite and compares it against a committed baseline:
+ *       - kernel throughput of every otp_microbench kernel tier at 64K (GB/s, higher is better)
+ *       - single request latency against a local otp_enc_d, one connection with 1000 character messages (p50 and p99
+ *         in microseconds, lower is better)
+ *       - concurrent daemon throughput over loopback, 8 connections with a mix of message sizes (requests per second,
+ *         higher is better)
+ *    The daemon metrics run otp_bench with --nodelay, since otherwise the ~40ms Nagle and delayed ACK stall on each
+ *       request's small writes is all they would measure.
+ *    Every metric is measured several times and the median is compared. A metric regresses when it's worse than the
+ *       baseline by more than its tolerance from the baseline file, or by more than 3 times the spread seen between this
+ *       run's repetitions, whichever is larger, so a noisy machine widens the gate instead of failing it.
+ *    Exits 0 when nothing regressed, 1 on a regression, and 2 if the suite couldn't run.
+ * INSTRUCTIONS
+ *    Build it with make and run it from the build directory (it runs otp_microbench, otp_bench and otp_enc_d from the
+ *       same directory). The committed perf_baseline.json gates the default make release build
+ *       (build/release-x86-64-v2); compileall's unoptimized programs or another configuration are several times slower
+ *       in the kernels, so they need a baseline of their own:
+ *       otp_perfcheck [--baseline FILE] [--repeat N] [--port PORT] [--update]
+ *    The baseline defaults to perf_baseline.json. --update rewrites it from this run instead of comparing, which is
+ *       needed once per machine since the numbers are only comparable on the same hardware and build. The baseline
+ *       records the build it came from, and a comparison against a different build warns that it isn't meaningful.
+ * AUTHOR
+ *    Written by Andrew Swaim
+ *
+*************************************************************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+typedef enum { false, true } bool; // Create bool type for C89/C99 compilation.
+
+#define MAX_METRICS 32 // Most metrics in the suite
+#define MAX_REPEAT 15 // Most repetitions of the suite
+#define NAME_LEN 64 // Longest metric name
+#define LINE_LEN 4096 // Longest line read from a benchmark or the baseline
+#define DEFAULT_TOLERANCE 0.10 // Tolerance given to new metrics when the baseline is updated
+#define NOISE_FACTOR 3.0 // How many times this run's spread a metric may move before it counts as a regression
+#if defined(OTP_BUILD) // Set by the Makefile to the configuration and MARCH tier
+#define PERFCHECK_BUILD OTP_BUILD
+#else
+#define PERFCHECK_BUILD "compileall"
+#endif
+
+/*************************************************************************************************************************
+ * Types and Globals
+*************************************************************************************************************************/
+
+struct metric {
+    char name[NAME_LEN];
+    bool higherBetter; // Whether a bigger value is an improvement
+    double samples[MAX_REPEAT]; // One value per repetition
+    int numSamples;
+    double value, spread; // Median of the samples, and (max - min) / median
+    double baseline, tolerance; // From the baseline file (baseline < 0 if it has none)
+};
+
+struct metric metrics[MAX_METRICS];
+int numMetrics = 0;
+char binDir[1024] = "."; // Directory holding the other programs
+char baselineBuild[NAME_LEN] = ""; // The build the baseline was recorded from, if it says
+
+/*************************************************************************************************************************
+ * Function Declarations
+*************************************************************************************************************************/
+
+void record(const char*, bool, double); // To add a sample to a metric
+bool runsuite(int); // To run the whole suite once
+bool runcmd(const char*, int); // To run a benchmark and record the metrics in its output
+double jsonnum(const char*, const char*); // To find a number in a line of JSON
+pid_t startdaemon(int); // To start otp_enc_d and wait for it to listen
+void summarize(struct metric*); // To work out a metric's median and spread
+int readbaseline(const char*); // To load the baseline values and tolerances
+bool writebaseline(const char*); // To save this run as the new baseline
+int cmpdouble(const void*, const void*); // To sort samples
+
+/*************************************************************************************************************************
+ * Main
+*************************************************************************************************************************/
+
+int main(int argc, char *argv[]) {
+
+    char* baseline = "perf_baseline.json";
+    int repeat = 3, port = 57391, opt, i, regressions = 0;
+    bool update = false;
+    pid_t daemon;
+    double allowed, change;
+    struct metric* m;
+
+    static struct option longopts[] = {
+        { "baseline", required_argument, NULL, 'b' }, { "repeat", required_argument, NULL, 'r' },
+        { "port", required_argument, NULL, 'p' }, { "update", no_argument, NULL, 'u' }, { NULL, 0, NULL, 0 }
+    };
+
+    // Check usage & args
+    while ((opt = getopt_long(argc, argv, "b:r:p:u", longopts, NULL)) != -1) {
+        if (opt == 'b') { baseline = optarg; }
+        else if (opt == 'r') { repeat = atoi(optarg); }
+        else if (opt == 'p') { port = atoi(optarg); }
+        else if (opt == 'u') { update = true; }
+        else { argc = 0; }
+    }
+    if (argc == 0 || optind != argc || repeat < 1 || repeat > MAX_REPEAT || port < 1 || port > 65535) {
+        fprintf(stderr, "USAGE: %s [--baseline FILE] [--repeat N] [--port PORT] [--update]\n", argv[0]); exit(2);
+    }
+    if (strrchr(argv[0], '/') != NULL) { // Find the other programs next to this one
+        snprintf(binDir, sizeof(binDir), "%.*s", (int)(strrchr(argv[0], '/') - argv[0]), argv[0]);
+    }
+
+    // Run the suite against a fresh daemon
+    if ((daemon = startdaemon(port)) < 0) { fprintf(stderr, "otp_perfcheck: ERROR, could not start otp_enc_d\n"); exit(2); }
+    for (i = 0; i < repeat; i++) {
+        if (!runsuite(port)) { kill(daemon, SIGTERM); fprintf(stderr, "otp_perfcheck: ERROR, suite failed\n"); exit(2); }
+    }
+    kill(daemon, SIGTERM);
+    waitpid(daemon, NULL, 0);
+    for (i = 0; i < numMetrics; i++) { summarize(&metrics[i]); }
+
+    if (update) {
+        if (!writebaseline(baseline)) { fprintf(stderr, "otp_perfcheck: ERROR, writing \'%s\'\n", baseline); exit(2); }
+        printf("otp_perfcheck: baseline \'%s\' updated with %d metrics\n", baseline, numMetrics);
+        return 0;
+    }
+    if (readbaseline(baseline) < 0) { fprintf(stderr, "otp_perfcheck: ERROR, reading \'%s\'\n", baseline); exit(2); }
+    if (strcmp(baselineBuild, PERFCHECK_BUILD) != 0) {
+        fprintf(stderr, "otp_perfcheck: WARNING, \'%s\' was recorded from the %s build but this is the %s build, "
+                        "so the comparison isn't meaningful\n", baseline,
+                baselineBuild[0] != '\0' ? baselineBuild : "unknown", PERFCHECK_BUILD);
+    }
+
+    // Compare each metric against its baseline
+    printf("%-40s %14s %14s %9s %9s  %s\n", "metric", "baseline", "current", "change", "allowed", "result");
+    for (i = 0; i < numMetrics; i++) {
+
+        m = &metrics[i];
+        if (m->baseline <= 0) { printf("%-40s %14s %14.4g %9s %9s  new\n", m->name, "-", m->value, "-", "-"); continue; }
+        change = (m->value - m->baseline) / m->baseline; // Positive is bigger
+        if (!m->higherBetter) { change = -change; } // Now positive is always better
+        allowed = m->tolerance > NOISE_FACTOR * m->spread ? m->tolerance : NOISE_FACTOR * m->spread;
+        printf("%-40s %14.4g %14.4g %+8.1f%% %8.1f%%  %s\n", m->name, m->baseline, m->value, change * 100,
+               allowed * 100, change < -allowed ? "REGRESSED" : "ok");
+        if (change < -allowed) { regressions++; }
+    }
+
+    if (regressions > 0) { printf("otp_perfcheck: %d metric(s) regressed\n", regressions); return 1; }
+    printf("otp_perfcheck: no regressions\n");
+    return 0;
+}
+
+/*************************************************************************************************************************
+ * Function Definitions
+*************************************************************************************************************************/
+
+/*
+ * Add a sample to a metric, creating the metric the first time it's seen
+ * const char* name: the name of the metric
+ * bool higherBetter: whether a bigger value is an improvement
+ * double value: the sample
+*/
+void record(const char* name, bool higherBetter, double value) {
+
+    int i;
+
+    for (i = 0; i < numMetrics && strcmp(metrics[i].name, name) != 0; i++) { }
+    if (i == numMetrics) {
+        if (numMetrics == MAX_METRICS) { return; }
+        memset(&metrics[i], 0, sizeof(metrics[i]));
+        snprintf(metrics[i].name, NAME_LEN, "%s", name);
+        metrics[i].higherBetter = higherBetter;
+        metrics[i].baseline = -1;
+        numMetrics++;
+    }
+    if (metrics[i].numSamples < MAX_REPEAT) { metrics[i].samples[metrics[i].numSamples++] = value; }
+}
+
+/*
+ * Run every benchmark in the suite once
+ * int port: the port otp_enc_d is listening on
+ * Returns false if any benchmark failed
+*/
+bool runsuite(int port) {
+
+    char cmd[2048];
+
+    snprintf(cmd, sizeof(cmd), "\'%s/otp_microbench\' --min-size 65536 --max-size 65536 --min-time 0.2", binDir);
+    if (!runcmd(cmd, 0)) { return false; }
+    snprintf(cmd, sizeof(cmd), "\'%s/otp_bench\' --json --nodelay --connections 1 --requests 50 --sizes 1000 %d",
+             binDir, port);
+    if (!runcmd(cmd, 1)) { return false; }
+    snprintf(cmd, sizeof(cmd),
+             "\'%s/otp_bench\' --json --nodelay --connections 8 --duration 3 --sizes 100:70,10000:25,100000:5 %d",
+             binDir, port);
+    return runcmd(cmd, 8);
+}
+
+/*
+ * Run a benchmark and record the metrics in its JSON output
+ * const char* cmd: the command line to run
+ * int conns: 0 for otp_microbench, otherwise the number of otp_bench connections (1 records latency, more throughput)
+ * Returns false if the benchmark failed or printed nothing usable
+*/
+bool runcmd(const char* cmd, int conns) {
+
+    FILE* out;
+    char line[LINE_LEN], name[NAME_LEN], *p;
+    bool found = false;
+
+    if ((out = popen(cmd, "r")) == NULL) { return false; }
+    while (fgets(line, sizeof(line), out) != NULL) {
+
+        if (conns == 0 && (p = strstr(line, "\"name\": \"")) != NULL) { // One kernel result per line
+            snprintf(name, sizeof(name), "kernel.%.*s.gb_per_sec", (int)strcspn(p + 9, "\""), p + 9);
+            record(name, true, jsonnum(line, "gb_per_sec"));
+            found = true;
+        }
+        else if (conns == 1 && strstr(line, "\"latency_us\"") != NULL) {
+            record("request.latency_p50_us", false, jsonnum(strstr(line, "\"latency_us\""), "p50"));
+            record("request.latency_p99_us", false, jsonnum(strstr(line, "\"latency_us\""), "p99"));
+            found = jsonnum(line, "errors") == 0;
+        }
+        else if (conns > 1 && strstr(line, "\"req_per_sec\"") != NULL) {
+            snprintf(name, sizeof(name), "daemon.concurrent%d.req_per_sec", conns);
+            record(name, true, jsonnum(line, "req_per_sec"));
+            found = jsonnum(line, "errors") == 0;
+        }
+    }
+    return pclose(out) == 0 && found;
+}
+
+/*
+ * Find the number after a key in a line of JSON
+ * const char* line: the JSON text
+ * const char* key: the key to look for (without quotes)
+ * Returns the number, or -1 if the key isn't there
+*/
+double jsonnum(const char* line, const char* key) {
+
+    char pattern[NAME_LEN + 4];
+    const char* p;
+
+    snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+    if (line == NULL || (p = strstr(line, pattern)) == NULL) { return -1; }
+    return strtod(p + strlen(pattern), NULL);
+}
+
+/*
+ * Start otp_enc_d in the background and wait until it accepts connections
+ * int port: the port for it to listen on
+ * Returns the daemon's pid, or -1 if it didn't come up
+*/
+pid_t startdaemon(int port) {
+
+    char path[1100], portStr[16];
+    struct sockaddr_in addr;
+    pid_t pid;
+    int i, fd, null;
+
+    snprintf(path, sizeof(path), "%s/otp_enc_d", binDir);
+    snprintf(portStr, sizeof(portStr), "%d", port);
+    if ((pid = fork()) < 0) { return -1; }
+    if (pid == 0) { // Daemon process, with its output out of the way of the report
+        if ((null = open("/dev/null", O_WRONLY)) >= 0) { dup2(null, 1); dup2(null, 2); }
+        execl(path, path, portStr, (char*)NULL);
+        _exit(127);
+    }
+
+    memset((char*)&addr, '\0', sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for (i = 0; i < 50; i++) { // Give it up to 5 seconds
+        usleep(100000);
+        if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) { break; }
+        if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0) { close(fd); return pid; }
+        close(fd);
+        if (waitpid(pid, NULL, WNOHANG) == pid) { return -1; } // It died (port in use?)
+    }
+    kill(pid, SIGTERM);
+    return -1;
+}
+
+/*
+ * Work out a metric's median and relative spread from its samples
+ * struct metric* m: the metric
+*/
+void summarize(struct metric* m) {
+
+    qsort(m->samples, m->numSamples, sizeof(double), cmpdouble);
+    m->value = m->numSamples % 2 ? m->samples[m->numSamples / 2]
+                                 : (m->samples[m->numSamples / 2 - 1] + m->samples[m->numSamples / 2]) / 2;
+    m->spread = m->value > 0 ? (m->samples[m->numSamples - 1] - m->samples[0]) / m->value : 0;
+}
+
+/*
+ * Load the baseline value and tolerance of every metric that has one
+ * Expects one metric per line, as written by writebaseline(), after the build it was recorded from:
+ *    "build": "BUILD",
+ *    "NAME": { "value": V, "tolerance": T, "higher_is_better": true|false },
+ * const char* filename: the baseline file
+ * Returns the number of metrics matched, or -1 if the file can't be read
+*/
+int readbaseline(const char* filename) {
+
+    FILE* fd;
+    char line[LINE_LEN];
+    int i, matched = 0;
+
+    if ((fd = fopen(filename, "r")) == NULL) { return -1; }
+    while (fgets(line, sizeof(line), fd) != NULL) {
+        if (sscanf(line, " \"build\": \"%63[^\"]\"", baselineBuild) == 1) { continue; }
+        for (i = 0; i < numMetrics; i++) {
+            if (strncmp(line + strspn(line, " \t") + 1, metrics[i].name, strlen(metrics[i].name)) != 0
+                || line[strspn(line, " \t") + 1 + strlen(metrics[i].name)] != '"') { continue; }
+            metrics[i].baseline = jsonnum(line, "value");
+            metrics[i].tolerance = jsonnum(line, "tolerance");
+            if (metrics[i].tolerance < 0) { metrics[i].tolerance = DEFAULT_TOLERANCE; }
+            matched++;
+        }
+    }
+    fclose(fd);
+    return matched;
+}
+
+/*
+ * Save this run as the new baseline, keeping the tolerances of metrics the old baseline already had
+ * const char* filename: the baseline file
+ * Returns false if the file can't be written
+*/
+bool writebaseline(const char* filename) {
+
+    FILE* fd;
+    int i;
+
+    readbaseline(filename); // Pick up existing tolerances, if any
+    if ((fd = fopen(filename, "w")) == NULL) { return false; }
+    fprintf(fd, "{\n  \"build\": \"%s\",\n  \"metrics\": {\n", PERFCHECK_BUILD);
+    for (i = 0; i < numMetrics; i++) {
+        fprintf(fd, "    \"%s\": { \"value\": %.6g, \"tolerance\": %.2f, \"higher_is_better\": %s }%s\n", metrics[i].name,
+                metrics[i].value, metrics[i].baseline > 0 ? metrics[i].tolerance : DEFAULT_TOLERANCE,
+                metrics[i].higherBetter ? "true" : "false", i < numMetrics - 1 ? "," : "");
+    }
+    fprintf(fd, "  }\n}\n");
+    return fclose(fd) == 0;
+}
+
+/*
+ * Compare two doubles for qsort()
+*/
+int cmpdouble(const void* a, const void* b) {
+
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
@@ -0,0 +1,77 @@
+/*************************************************************************************************************************
+ *
+ * NAME
+ *    otp_probe.h
+ * SYNOPSIS
+ *    USDT static tracepoints for the daemons, for perf, bpftrace or gdb to attach to while they run.
+ * DESCRIPTION
+ *    Each probe compiles to a single nop, plus a .note.stapsdt ELF note saying where the nop is and where to find
+ *       its arguments (registers, stack slots or constants). Nothing runs when no tracer is attached; a tracer turns
+ *       the nop into a breakpoint and reads the arguments from the note. So the probes can stay in release builds and
+ *       be traced in production without rebuilding or restarting anything:
+ *       bpftrace -e 'usdt:./otp_enc_d:otp:cipher_end { @[arg1] = count(); }'
+ *       perf probe -x ./otp_enc_d sdt_otp:reply
+ *    Every probe is in the otp provider and carries the connection number (the same one otp_capture.h records)
+ *       first:
+ *       accept(conn, fd)                      the daemon accepted a connection, before forking for it
+ *       auth(conn, passed)                    the authorization result was sent, 1 for PASS
+ *       header(conn, which, len)              a length header was parsed, which is 0 for the text and 1 for the key
+ *       payload(conn, which, bytes)           a text (0) or key (1) was received, bytes is how much arrived
+ *       cipher_start(conn, len)               the cipher is about to run over len characters
+ *       cipher_end(conn, len)                 the cipher finished
+ *       reply(conn, bytesIn, bytesOut)        the result was sent, with the request's byte counts so far
+ *    With systemtap's sys/sdt.h installed, its DTRACE_PROBEn macros are used. Otherwise the same notes are written
+ *       here with inline assembly on x86-64, and on anything else the probes compile to nothing.
+ * AUTHOR
+ *    Written by Andrew Swaim
+ *
+*************************************************************************************************************************/
+
+#ifndef OTP_PROBE_H
+#define OTP_PROBE_H
+
+#if defined(__has_include) && __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PROBE2(name, a, b) DTRACE_PROBE2(otp, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(otp, name, a, b, c)
+
+#elif defined(__x86_64__) && defined(__GNUC__)
+
+// The note sys/sdt.h writes (version 3): the probe's address, the .stapsdt.base address (so tools can adjust for
+//    prelinking), no semaphore, then the provider, name and arguments, each argument as -8@OPERAND (signed, 8 bytes)
+#define PROBE_ASM(name, args) \
+    "990: nop\n" \
+    ".pushsection .note.stapsdt,\"\",\"note\"\n" \
+    ".balign 4\n" \
+    ".4byte 992f-991f, 994f-993f, 3\n" \
+    "991: .asciz \"stapsdt\"\n" \
+    "992: .balign 4\n" \
+    "993: .8byte 990b\n" \
+    ".8byte _.stapsdt.base\n" \
+    ".8byte 0\n" \
+    ".asciz \"otp\"\n" \
+    ".asciz \"" #name "\"\n" \
+    ".asciz \"" args "\"\n" \
+    "994: .balign 4\n" \
+    ".popsection\n" \
+    ".ifndef _.stapsdt.base\n" \
+    ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+    ".weak _.stapsdt.base\n" \
+    ".hidden _.stapsdt.base\n" \
+    "_.stapsdt.base: .space 1\n" \
+    ".size _.stapsdt.base, 1\n" \
+    ".popsection\n" \
+    ".endif\n"
+
+#define PROBE2(name, a, b) \
+    __asm__ __volatile__ (PROBE_ASM(name, "-8@%0 -8@%1") :: "nor"((long long)(a)), "nor"((long long)(b)))
+#define PROBE3(name, a, b, c) \
+    __asm__ __volatile__ (PROBE_ASM(name, "-8@%0 -8@%1 -8@%2") \
+                          :: "nor"((long long)(a)), "nor"((long long)(b)), "nor"((long long)(c)))
+
+#else
+#define PROBE2(name, a, b) do { } while (0)
+#define PROBE3(name, a, b, c) do { } while (0)
+#endif
+
+#endif
@@ -0,0 +1,396 @@
+/*************************************************************************************************************************
+ *
+ * NAME
+ *    otp_replay.c
+ * SYNOPSIS
+ *    Replays traffic captured by the daemons against local daemons, at real speed or faster.
+ * DESCRIPTION
+ *    Reads a capture file written by otp_enc_d/otp_dec_d --capture (see otp_capture.h) and sends every request in it
+ *       again with the same relative arrival times divided by the speed factor, the same text and key lengths, and
+ *       synthetic payloads. Requests the daemon originally rejected are reproduced as well: a failed authorization
+ *       sends the other client's id, BADT and BADK send a text or key with an invalid character, and SHRT falls out of
+ *       the recorded lengths. Connections the client dropped early (status "-") and bad lengths aren't replayed.
+ *    Requests are started open loop by a pool of threads, each one at its scheduled time whether or not earlier ones
+ *       have finished, and latency is measured from the scheduled time so a slow daemon can't hide its queueing delay.
+ *       How late each request actually started is reported as the start lag; if it grows, the replay needs more
+ *       threads to keep up with the schedule.
+ *    Reports the recorded and replayed rates, the replayed latency percentiles next to the ones recorded in the
+ *       capture, and any request whose status didn't match the capture.
+ * INSTRUCTIONS
+ *    Use the included compileall script to compile this program as well as the other programs.
+ *    Start the daemons to test, then run:
+ *       otp_replay [--speed FACTOR] [--threads N] [--json] CAPTURE ENC_PORT [DEC_PORT]
+ *    --speed defaults to 1 (real time); 100 replays 100 seconds of traffic in one second. Requests captured from
+ *       otp_dec_d are skipped unless DEC_PORT is given.
+ * AUTHOR
+ *    Written by Andrew Swaim
+ *
+*************************************************************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "otp_kernels.h"
+
+typedef enum { false, true } bool; // Create bool type for C89/C99 compilation.
+
+#define ID_LEN 7 // Number of characters to send for the client id
+#define AUTH_LEN 4 // Number of characters to receive for the server's authorization
+#define BUF_LEN 9 // Number of digits (characters) to send for the length of the next transmission
+#define STAT_LEN 4 // Number of characters to receive for the server's validation of the text and key
+#define MAX_THREADS 1024 // Most replay threads allowed
+#define LINE_LEN 512 // Longest capture line read
+
+/*************************************************************************************************************************
+ * Types and Globals
+*************************************************************************************************************************/
+
+struct record { // One captured request and how its replay went
+    double offset; // Seconds after the first captured arrival
+    bool dec; // Whether it was captured from otp_dec_d
+    int textLen, keyLen;
+    char status[STAT_LEN+1]; // Status the daemon sent in the capture
+    double recorded; // Total time the request took in the capture, in seconds
+    double latency, lag; // Replayed latency from the scheduled start, and how late it started, in seconds
+    bool ok, match; // Whether the replay finished, and whether the status matched the capture
+};
+
+struct record* records;
+long numRecords = 0, skipped = 0;
+struct sockaddr_in encServer, decServer; // Addresses of the daemons under test
+bool haveDec = false; // Whether a port was given for otp_dec_d
+double speed = 1.0; // Replay speed factor
+double startTime; // When the replay started
+long nextRecord = 0; // Next request to claim (shared between threads)
+pthread_mutex_t recordLock = PTHREAD_MUTEX_INITIALIZER; // Guards nextRecord
+char *valid, *invalid; // Payloads as long as the longest text or key, all valid and with one bad character
+
+/*************************************************************************************************************************
+ * Function Declarations
+*************************************************************************************************************************/
+
+bool readcapture(const char*); // To load and sort the captured requests
+void* runworker(void*); // To replay requests from one thread until they're all claimed
+bool request(struct record*); // To replay one request through to the result
+int sendrecv(int, char*, int, bool); // To send or receive data to or from a server
+int comparerecord(const void*, const void*); // To sort requests by arrival
+int comparedouble(const void*, const void*); // To sort values for percentiles
+double percentile(double*, long, double); // To read a percentile from sorted values
+double now(void); // To get a monotonic timestamp in seconds
+
+/*************************************************************************************************************************
+ * Main
+*************************************************************************************************************************/
+
+int main(int argc, char *argv[]) {
+
+    int threads = 64, opt, port, i;
+    bool json = false;
+    long maxLen = 1, n, done = 0, errors = 0, mismatches = 0;
+    double elapsed, span, *lat, *lag, *rec;
+    pthread_t pool[MAX_THREADS];
+
+    static struct option longopts[] = {
+        { "speed", required_argument, NULL, 's' }, { "threads", required_argument, NULL, 't' },
+        { "json", no_argument, NULL, 'j' }, { NULL, 0, NULL, 0 }
+    };
+
+    // Check usage & args
+    while ((opt = getopt_long(argc, argv, "s:t:j", longopts, NULL)) != -1) {
+        if (opt == 's') { speed = atof(optarg); }
+        else if (opt == 't') { threads = atoi(optarg); }
+        else if (opt == 'j') { json = true; }
+        else { argc = 0; }
+    }
+    if (argc - optind < 2 || argc - optind > 3 || speed <= 0 || threads < 1 || threads > MAX_THREADS) {
+        fprintf(stderr, "USAGE: %s [--speed FACTOR] [--threads N] [--json] CAPTURE ENC_PORT [DEC_PORT]\n", argv[0]);
+        exit(1);
+    }
+
+    // Get and validate the port numbers
+    for (i = 1; i < argc - optind; i++) {
+        struct sockaddr_in* server = i == 1 ? &encServer : &decServer;
+        port = atoi(argv[optind + i]);
+        if (port < 0 || port > 65535) { fprintf(stderr, "otp_replay: ERROR, invalid port %d\n", port); exit(2); }
+        memset((char*)server, '\0', sizeof(*server));
+        server->sin_family = AF_INET;
+        server->sin_port = htons(port);
+        server->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    }
+    haveDec = argc - optind == 3;
+
+    if (!readcapture(argv[optind])) { exit(1); }
+    if (numRecords == 0) { fprintf(stderr, "otp_replay: ERROR, nothing to replay in \'%s\'\n", argv[optind]); exit(1); }
+
+    // Generate payloads for the longest text or key (the same bytes are reused for every request)
+    for (n = 0; n < numRecords; n++) {
+        if (records[n].textLen > maxLen) { maxLen = records[n].textLen; }
+        if (records[n].keyLen > maxLen) { maxLen = records[n].keyLen; }
+    }
+    if ((valid = malloc(maxLen + 1)) == NULL || (invalid = malloc(maxLen + 1)) == NULL) {
+        fprintf(stderr, "otp_replay: ERROR, out of memory\n"); exit(1);
+    }
+    srand(time(0));
+    keychars(valid, maxLen);
+    memcpy(invalid, valid, maxLen);
+    invalid[0] = '#';
+
+    // Replay every request on its schedule
+    if (threads > numRecords) { threads = (int)numRecords; }
+    startTime = now();
+    for (i = 0; i < threads; i++) {
+        if (pthread_create(&pool[i], NULL, runworker, NULL) != 0) {
+            fprintf(stderr, "otp_replay: ERROR, creating thread\n"); exit(1);
+        }
+    }
+    for (i = 0; i < threads; i++) { pthread_join(pool[i], NULL); }
+    elapsed = now() - startTime;
+
+    // Gather the results, sorted for percentiles
+    if ((lat = malloc(numRecords * sizeof(double))) == NULL || (lag = malloc(numRecords * sizeof(double))) == NULL
+        || (rec = malloc(numRecords * sizeof(double))) == NULL) {
+        fprintf(stderr, "otp_replay: ERROR, out of memory\n"); exit(1);
+    }
+    for (n = 0; n < numRecords; n++) {
+        if (!records[n].ok) { errors++; continue; }
+        if (!records[n].match) { mismatches++; }
+        lat[done] = records[n].latency;
+        lag[done] = records[n].lag;
+        rec[done++] = records[n].recorded;
+    }
+    qsort(lat, done, sizeof(double), comparedouble);
+    qsort(lag, done, sizeof(double), comparedouble);
+    qsort(rec, done, sizeof(double), comparedouble);
+    span = records[numRecords - 1].offset;
+
+    // Report the results
+    if (json) {
+        printf("{ \"speed\": %g, \"requests\": %ld, \"skipped\": %ld, \"errors\": %ld, \"mismatches\": %ld, "
+               "\"captured_seconds\": %.3f, \"replay_seconds\": %.3f, \"captured_req_per_sec\": %.1f, "
+               "\"replay_req_per_sec\": %.1f, \"latency_us\": { \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, "
+               "\"max\": %.1f }, \"captured_latency_us\": { \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, "
+               "\"max\": %.1f }, \"start_lag_us\": { \"p50\": %.1f, \"p99\": %.1f, \"max\": %.1f } }\n",
+               speed, numRecords, skipped, errors, mismatches, span, elapsed, span > 0 ? numRecords / span : 0,
+               numRecords / elapsed, percentile(lat, done, 50) * 1e6, percentile(lat, done, 90) * 1e6,
+               percentile(lat, done, 99) * 1e6, percentile(lat, done, 100) * 1e6, percentile(rec, done, 50) * 1e6,
+               percentile(rec, done, 90) * 1e6, percentile(rec, done, 99) * 1e6, percentile(rec, done, 100) * 1e6,
+               percentile(lag, done, 50) * 1e6, percentile(lag, done, 99) * 1e6, percentile(lag, done, 100) * 1e6);
+    }
+    else {
+        printf("%ld requests replayed at %gx (%ld skipped, %ld errors, %ld status mismatches)\n", numRecords, speed,
+               skipped, errors, mismatches);
+        printf("captured: %.2fs, %.1f req/s   replay: %.2fs, %.1f req/s\n", span, span > 0 ? numRecords / span : 0,
+               elapsed, numRecords / elapsed);
+        printf("latency (us):  replay p50 %.1f  p90 %.1f  p99 %.1f  max %.1f\n", percentile(lat, done, 50) * 1e6,
+               percentile(lat, done, 90) * 1e6, percentile(lat, done, 99) * 1e6, percentile(lat, done, 100) * 1e6);
+        printf("             captured p50 %.1f  p90 %.1f  p99 %.1f  max %.1f\n", percentile(rec, done, 50) * 1e6,
+               percentile(rec, done, 90) * 1e6, percentile(rec, done, 99) * 1e6, percentile(rec, done, 100) * 1e6);
+        printf("start lag (us): p50 %.1f  p99 %.1f  max %.1f\n", percentile(lag, done, 50) * 1e6,
+               percentile(lag, done, 99) * 1e6, percentile(lag, done, 100) * 1e6);
+    }
+    return errors > 0 || mismatches > 0 ? 1 : 0;
+}
+
+/*************************************************************************************************************************
+ * Function Definitions
+*************************************************************************************************************************/
+
+/*
+ * Load the requests from a capture file and sort them by arrival (request processes write their lines as they
+ *    finish, so the file isn't in arrival order)
+ * const char* filename: the capture file
+ * Returns true on success, false (after printing why) on failure
+*/
+bool readcapture(const char* filename) {
+
+    FILE* fd;
+    char line[LINE_LEN], daemon[32], status[8];
+    long conn, req, cap = 1024;
+    double arrival, phase[6];
+    int textLen, keyLen;
+    struct record* r;
+
+    if ((fd = fopen(filename, "r")) == NULL || (records = malloc(cap * sizeof(struct record))) == NULL) {
+        fprintf(stderr, "otp_replay: ERROR, reading \'%s\'\n", filename); return false;
+    }
+    while (fgets(line, sizeof(line), fd) != NULL) {
+
+        if (line[0] == '#' || line[0] == '\n') { continue; }
+        if (sscanf(line, "%31s %ld %ld %lf %d %d %7s %lf %lf %lf %lf %lf %lf", daemon, &conn, &req, &arrival, &textLen,
+                   &keyLen, status, &phase[0], &phase[1], &phase[2], &phase[3], &phase[4], &phase[5]) != 13) {
+            fprintf(stderr, "otp_replay: ERROR, bad capture line \'%s\'\n", strtok(line, "\n")); fclose(fd); return false;
+        }
+
+        // Skip what can't be reproduced
+        if (strlen(status) != STAT_LEN || strcmp(status, "BADL") == 0 || (strcmp(daemon, "otp_dec_d") == 0 && !haveDec)) {
+            skipped++; continue;
+        }
+        if (numRecords == cap && (records = realloc(records, (cap *= 2) * sizeof(struct record))) == NULL) {
+            fprintf(stderr, "otp_replay: ERROR, out of memory\n"); fclose(fd); return false;
+        }
+        r = &records[numRecords++];
+        memset(r, 0, sizeof(*r));
+        r->offset = arrival;
+        r->dec = strcmp(daemon, "otp_dec_d") == 0;
+        r->textLen = textLen;
+        r->keyLen = keyLen;
+        strcpy(r->status, status);
+        r->recorded = phase[5] / 1e6;
+    }
+    fclose(fd);
+
+    // Sort by arrival and make the times relative to the first one
+    qsort(records, numRecords, sizeof(struct record), comparerecord);
+    for (req = numRecords - 1; req >= 0; req--) { records[req].offset -= records[0].offset; }
+    return true;
+}
+
+/*
+ * Claim requests one at a time, wait for each one's scheduled start, and replay it
+ * void* arg: unused
+*/
+void* runworker(void* arg) {
+
+    struct record* r;
+    double scheduled, wait, started;
+
+    (void)arg;
+    for (;;) {
+
+        pthread_mutex_lock(&recordLock);
+        r = nextRecord < numRecords ? &records[nextRecord++] : NULL;
+        pthread_mutex_unlock(&recordLock);
+        if (r == NULL) { return NULL; }
+
+        scheduled = startTime + r->offset / speed;
+        if ((wait = scheduled - now()) > 0) { usleep((useconds_t)(wait * 1e6)); }
+        started = now();
+        r->ok = request(r);
+        r->latency = now() - scheduled; // From the scheduled start, not the actual one
+        r->lag = started - scheduled;
+    }
+}
+
+/*
+ * Replay one request through the same protocol as otp_enc/otp_dec, reproducing the captured status
+ * struct record* r: the request to replay, whose match field is set
+ * Returns true if the exchange finished (with whatever status), false if the connection failed
+*/
+bool request(struct record* r) {
+
+    int sockFD;
+    bool ok = false;
+    char id[ID_LEN+1], auth[AUTH_LEN+1], lenBuf[BUF_LEN+1], result[STAT_LEN+1];
+    char* reply = malloc(r->textLen + 1);
+    struct sockaddr_in* server = r->dec ? &decServer : &encServer;
+    bool fail = strcmp(r->status, "FAIL") == 0;
+
+    if (reply == NULL || (sockFD = socket(AF_INET, SOCK_STREAM, 0)) < 0) { free(reply); return false; }
+    if (connect(sockFD, (struct sockaddr*)server, sizeof(*server)) < 0) { close(sockFD); free(reply); return false; }
+    setsockopt(sockFD, SOL_SOCKET, SO_RCVTIMEO, &(struct timeval){ 30, 0 }, sizeof(struct timeval)); // Don't hang forever
+
+    // Authorize (as the wrong client to reproduce a failed authorization)
+    strcpy(id, r->dec != fail ? "otp_dec" : "otp_enc");
+    if (sendrecv(sockFD, id, ID_LEN, true) != ID_LEN || sendrecv(sockFD, auth, AUTH_LEN, false) != AUTH_LEN) {
+        close(sockFD); free(reply); return false;
+    }
+    if (strcmp(auth, "PASS") != 0) { r->match = fail; close(sockFD); free(reply); return true; }
+
+    // Send the text and key, invalid ones to reproduce a rejection, then check the status and read the output back
+    memset(lenBuf, '\0', sizeof(lenBuf));
+    snprintf(lenBuf, sizeof(lenBuf), "%d", r->textLen);
+    if (sendrecv(sockFD, lenBuf, BUF_LEN, true) == BUF_LEN
+        && sendrecv(sockFD, strcmp(r->status, "BADT") == 0 ? invalid : valid, r->textLen, true) == r->textLen) {
+        memset(lenBuf, '\0', sizeof(lenBuf));
+        snprintf(lenBuf, sizeof(lenBuf), "%d", r->keyLen);
+        if (sendrecv(sockFD, lenBuf, BUF_LEN, true) == BUF_LEN
+            && sendrecv(sockFD, strcmp(r->status, "BADK") == 0 ? invalid : valid, r->keyLen, true) == r->keyLen
+            && sendrecv(sockFD, result, STAT_LEN, false) == STAT_LEN) {
+            r->match = strcmp(result, r->status) == 0;
+            ok = strcmp(result, "PASS") != 0 || sendrecv(sockFD, reply, r->textLen, false) == r->textLen;
+        }
+    }
+
+    close(sockFD);
+    free(reply);
+    return ok;
+}
+
+/*
+ * Send or receive data to or from a socket file descriptor
+ * int sockFD: the socket file descriptor the client is connected to the server on
+ * char* str: the string with the data to send or to hold the data that is received
+ * int len: the length of the data to send or receive
+ * bool sendMode: true for sending data, false for receiving data
+*/
+int sendrecv(int sockFD, char* str, int len, bool sendMode) {
+
+    int total = 0; // To calculate the total chars that get sent/received
+    int n;         // To hold how many chars get sent with each send()/recv() call
+
+    if (!sendMode) { memset(str, '\0', len+1); } // If receiving, clear buffer
+
+    while (total < len) { // Loop to ensure that all data is sent or received
+
+        if (sendMode) { n = send(sockFD, str+total, len-total, MSG_NOSIGNAL); } // Errors instead of SIGPIPE
+        else { n = recv(sockFD, str+total, len-total, 0); }
+        if (n <= 0) { break; }
+        total += n;
+    }
+    return total; // If successful, total should equal len
+}
+
+/*
+ * Order requests by arrival, for qsort()
+*/
+int comparerecord(const void* a, const void* b) {
+
+    double x = ((const struct record*)a)->offset, y = ((const struct record*)b)->offset;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Order values from low to high, for qsort()
+*/
+int comparedouble(const void* a, const void* b) {
+
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Get the value at a percentile of a sorted array (nearest rank)
+ * double* vals: the sorted values
+ * long n: the number of values
+ * double pct: the percentile (0-100)
+ * Returns the value, or 0 if there are none
+*/
+double percentile(double* vals, long n, double pct) {
+
+    long rank = (long)(pct / 100.0 * n + 0.999999);
+
+    if (n == 0) { return 0; }
+    if (rank < 1) { rank = 1; }
+    if (rank > n) { rank = n; }
+    return vals[rank - 1];
+}
+
+/*
+ * Get a monotonic timestamp in seconds
+*/
+double now(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -0,0 +1,172 @@
+/*************************************************************************************************************************
+ *
+ * NAME
+ *    otp_scale.h
+ * SYNOPSIS
+ *    Autoscaling of the daemons' worker limit, from the listen queue wait and the host's CPU use.
+ * DESCRIPTION
+ *    When a daemon is started with --scale MIN:MAX, the most request processes (workers) it runs at once (see
+ *       otp_admin.h) starts at MIN and is revisited every SCALE_INTERVAL seconds:
+ *       - queue wait: the mean time connections waited in the listen queue over the interval, worked out with
+ *         Little's law from the queue depth (sampled from TCP_INFO on the listening socket every time round the
+ *         daemon's loop, weighted by how long it stayed at that depth) and the connections accepted
+ *       - CPU use: the share of the host's CPU time that wasn't idle over the interval, from /proc/stat
+ *       If connections waited more than SCALE_WAIT_HIGH ms while every worker was busy (so the limit is what held them
+ *       up) and there are cores to spare (CPU use under SCALE_CPU_HIGH), the limit doubles, up to MAX. When the CPU is
+ *       saturated it holds, since more processes would only take turns on the same cores. If connections waited less
+ *       than SCALE_WAIT_LOW ms and never more than half the workers were busy, for SCALE_CALM intervals running, it
+ *       drops by a quarter, down to MIN.
+ *    The daemon reaps a finished request process as soon as SIGCHLD arrives (see otp_admin.h), so a connection waits
+ *       at the limit only as long as every worker really is busy. With 4 closed loop clients and the limit at 4 the
+ *       measured wait is about 0.1 ms, well under SCALE_WAIT_LOW, and the limit holds; with 12 clients it waits 10 to
+ *       30 ms, and the limit grows until it covers them.
+ *    The gap between the two wait thresholds, the run of calm intervals before shrinking and shrinking more slowly
+ *       than growing are the hysteresis: a load that sits near a threshold doesn't make the limit flap, a burst gets
+ *       capacity within an interval, and an idle host gives it back over several.
+ *    A lower limit never stops a running request; the daemon just doesn't accept more until enough have finished.
+ *       Each change is logged at info level.
+ * AUTHOR
+ *    Written by Andrew Swaim
+ *
+*************************************************************************************************************************/
+
+#ifndef OTP_SCALE_H
+#define OTP_SCALE_H
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "otp_log.h"
+
+#define SCALE_INTERVAL 1.0 // Seconds between decisions
+#define SCALE_WAIT_HIGH 2.0 // Mean queue wait in ms over which to grow
+#define SCALE_WAIT_LOW 0.2 // Mean queue wait in ms under which to consider shrinking
+#define SCALE_CPU_HIGH 0.9 // CPU use over which growing won't help
+#define SCALE_CALM 5 // Calm intervals in a row before shrinking
+
+static int scaleMin = 0, scaleMax = 0; // The bounds, or 0 when not scaling
+static double scaleStarted = 0; // When the current interval started, in seconds
+static double scaleSampled = 0; // When the queue depth was last sampled
+static int scaleDepth = 0; // The queue depth at the last sample
+static double scaleQueued = 0; // Queue depth integrated over the interval: the total seconds connections waited
+static long long scaleAccepted = 0; // Connections accepted in the interval
+static int scalePeak = 0; // Most workers busy at once in the interval
+static int scaleCalm = 0; // Calm intervals in a row
+static long long scaleCpuBusy = 0, scaleCpuTotal = 0; // CPU time from /proc/stat at the start of the interval
+static double scaleWaitMs = 0, scaleCpu = 0; // What the last decision saw, for the admin status
+
+/*
+ * Get a monotonic timestamp in seconds
+*/
+static double scalenow(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Read the host's CPU time so far from /proc/stat
+ * long long* busy: where to put the time that wasn't idle
+ * long long* total: where to put the total
+*/
+static void scalecpu(long long* busy, long long* total) {
+
+    long long t[8] = { 0 };
+    FILE* fd;
+    int i;
+
+    *busy = *total = 0;
+    if ((fd = fopen("/proc/stat", "r")) == NULL) { return; }
+    if (fscanf(fd, "cpu %lld %lld %lld %lld %lld %lld %lld %lld", &t[0], &t[1], &t[2], &t[3], &t[4], &t[5], &t[6],
+               &t[7]) == 8) {
+        for (i = 0; i < 8; i++) { *total += t[i]; }
+        *busy = *total - t[3] - t[4]; // Less idle and iowait
+    }
+    fclose(fd);
+}
+
+/*
+ * Start scaling between bounds, or stop
+ * int min, max: the bounds, 0 and 0 to stop
+*/
+static void scaleset(int min, int max) {
+
+    scaleMin = min;
+    scaleMax = max;
+    scaleStarted = scaleSampled = scalenow();
+    scaleQueued = scaleAccepted = scalePeak = scaleCalm = 0;
+    scalecpu(&scaleCpuBusy, &scaleCpuTotal);
+}
+
+/*
+ * Sample the listen queue depth and busy workers, every time round the daemon's loop
+ * int depth: connections waiting to be accepted
+ * int active: request processes running
+*/
+static void scalesample(int depth, int active) {
+
+    double now = scalenow();
+
+    scaleQueued += scaleDepth * (now - scaleSampled); // The last depth held until now
+    scaleSampled = now;
+    scaleDepth = depth;
+    if (active > scalePeak) { scalePeak = active; }
+}
+
+/*
+ * Count an accepted connection
+*/
+static void scaleaccept(void) { scaleAccepted++; }
+
+/*
+ * Get how long until the next decision
+ * Returns the milliseconds, at least 1
+*/
+static int scaletimeout(void) {
+
+    int ms = (int)((scaleStarted + SCALE_INTERVAL - scalenow()) * 1000) + 1;
+    return ms > 1 ? ms : 1;
+}
+
+/*
+ * Decide the worker limit, once an interval has passed
+ * int workers: the limit now
+ * Returns the new limit
+*/
+static int scaletick(int workers) {
+
+    long long busy, total;
+    double now = scalenow();
+    int next = workers;
+
+    if (scaleMax == 0 || now - scaleStarted < SCALE_INTERVAL) { return workers; }
+    scalecpu(&busy, &total);
+    scaleCpu = total > scaleCpuTotal ? (double)(busy - scaleCpuBusy) / (total - scaleCpuTotal) : 0;
+    scaleWaitMs = scaleQueued * 1000 / (scaleAccepted > 0 ? scaleAccepted : 1); // Little's law
+
+    if (scaleWaitMs > SCALE_WAIT_HIGH && scalePeak >= workers && scaleCpu < SCALE_CPU_HIGH) {
+        next = workers * 2;
+        scaleCalm = 0;
+    }
+    else if (scaleWaitMs < SCALE_WAIT_LOW && scalePeak * 2 <= workers) {
+        if (++scaleCalm >= SCALE_CALM) { next = workers - (workers + 3) / 4; scaleCalm = 0; }
+    }
+    else { scaleCalm = 0; }
+    if (next > scaleMax) { next = scaleMax; }
+    if (next < scaleMin) { next = scaleMin; }
+    if (next != workers) {
+        logmsg(LEVEL_INFO, "scale: workers %d -> %d (queue wait %.3f ms, %lld accepted, peak %d busy, cpu %.0f%%)",
+               workers, next, scaleWaitMs, scaleAccepted, scalePeak, scaleCpu * 100);
+    }
+
+    scaleStarted = now;
+    scaleQueued = scaleAccepted = 0;
+    scalePeak = 0;
+    scaleCpuBusy = busy;
+    scaleCpuTotal = total;
+    return next;
+}
+
+#endif
@@ -0,0 +1,216 @@
+/*************************************************************************************************************************
+ *
+ * NAME
+ *    otp_stats.h
+ * SYNOPSIS
+ *    Live counters for otp_top, in a named shared memory segment the daemons publish into.
+ * DESCRIPTION
+ *    When a daemon is started with --stats, it creates the POSIX shared memory segment /otp_stats_PORT (so
+ *       /dev/shm/otp_stats_PORT on Linux) holding a header and STATS_SLOTS worker slots. otp_top maps it read-only and
+ *       works out request and byte rates, latency quantiles, active connections and busy workers from it, without the
+ *       daemon doing anything for it.
+ *    Each request process (worker) claims a free slot when it starts, marking it busy with its connection number,
+ *       and when it exits adds its request, outcome, bytes and latency to the slot's running totals and frees it. A
+ *       slot has one writer at a time, so it's guarded by a seqlock rather than atomics: the writer makes the sequence
+ *       number odd, updates the slot with plain stores, and makes it even again; a reader copies the slot and retries
+ *       if the sequence number was odd or changed under it. A worker never waits on a reader.
+ *    The daemon itself only writes the header: connections accepted, and workers killed by a signal (counted when
+ *       it reaps them, which also frees their slots). The listen queue depth is read by otp_top from /proc/net/tcp.
+ *    Workers that find no free slot add their request to an overflow count in the header, and are otherwise left out.
+ *    The segment stays behind when the daemon stops, and is replaced when one starts again on the same port.
+ * AUTHOR
+ *    Written by Andrew Swaim
+ *
+*************************************************************************************************************************/
+
+#ifndef OTP_STATS_H
+#define OTP_STATS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "otp_capture.h"
+
+#define STATS_MAGIC 0x4f545053 // "OTPS"
+#define STATS_VERSION 1
+#define STATS_SLOTS 1024 // Workers that can be tracked at once
+#define STATS_BUCKETS 32 // Latency buckets by powers of 2 microseconds: under 2us, 2-4us, ... over 35 minutes
+
+struct statslot {
+    unsigned seq; // Odd while the owner is writing
+    int owner; // The worker using the slot, or 0 if it's free
+    long long conn; // The connection the owner is serving
+    long long requests, failed; // Requests finished in this slot, and those that didn't end with PASS
+    long long bytesIn, bytesOut;
+    long long buckets[STATS_BUCKETS]; // Requests by latency, accept() to exit
+} __attribute__((aligned(64)));
+
+struct statsseg {
+    int magic, version;
+    char daemon[16];
+    int port, backlog;
+    pid_t pid;
+    long long started; // When the daemon started, in seconds since the epoch
+    long long accepted; // Connections accepted, only written by the daemon
+    long long killed; // Workers that died from a signal, only written by the daemon
+    long long overflow; // Workers that finished without a slot
+    struct statslot slots[STATS_SLOTS];
+};
+
+static struct statsseg* statsSeg = NULL; // The segment, or NULL when stats are off
+static struct statslot* statsSlot = NULL; // This worker's slot
+
+/*
+ * Get the name of a daemon's segment
+ * char* name: where to put it, at least 32 long
+ * int port: the daemon's port
+*/
+static void statsname(char* name, int port) { snprintf(name, 32, "/otp_stats_%d", port); }
+
+/*
+ * Create the segment, before the daemon forks any worker
+ * int port: the daemon's port
+ * const char* daemon: the name of the daemon
+ * int backlog: the listen backlog
+ * Returns 0, or -1 if it couldn't be created
+*/
+static int statsopen(int port, const char* daemon, int backlog) {
+
+    char name[32];
+    int fd;
+
+    statsname(name, port);
+    shm_unlink(name); // Replace any left behind, so a reader never sees it change size under it
+    if ((fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644)) < 0) { return -1; }
+    if (ftruncate(fd, sizeof(struct statsseg)) < 0) { close(fd); shm_unlink(name); return -1; }
+    statsSeg = mmap(NULL, sizeof(struct statsseg), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (statsSeg == MAP_FAILED) { statsSeg = NULL; shm_unlink(name); return -1; }
+    snprintf(statsSeg->daemon, sizeof(statsSeg->daemon), "%s", daemon);
+    statsSeg->port = port;
+    statsSeg->backlog = backlog;
+    statsSeg->pid = getpid();
+    statsSeg->started = time(0);
+    statsSeg->version = STATS_VERSION;
+    __atomic_store_n(&statsSeg->magic, STATS_MAGIC, __ATOMIC_RELEASE); // Last, so a reader sees a finished header
+    return 0;
+}
+
+/*
+ * Count an accepted connection, in the daemon
+*/
+static void statsaccept(void) {
+
+    if (statsSeg != NULL) { __atomic_store_n(&statsSeg->accepted, statsSeg->accepted + 1, __ATOMIC_RELAXED); }
+}
+
+/*
+ * Start writing to a slot
+ * struct statslot* slot: the slot
+*/
+static inline void statsbegin(struct statslot* slot) {
+
+    __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE); // The odd sequence number is seen before any of the writes
+}
+
+/*
+ * Finish writing to a slot
+ * struct statslot* slot: the slot
+*/
+static inline void statsend(struct statslot* slot) { __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE); }
+
+/*
+ * Add this worker's request to its slot and free it, run at exit
+*/
+static void statsdone(void) {
+
+    double us = timingus(cap.start, timingstamp());
+    int i;
+
+    if (statsSeg == NULL) { return; }
+    if (statsSlot == NULL) { __atomic_fetch_add(&statsSeg->overflow, 1, __ATOMIC_RELAXED); return; }
+    for (i = 0; i < STATS_BUCKETS - 1 && us >= (2LL << i); i++) { }
+    statsbegin(statsSlot);
+    statsSlot->requests++;
+    if (strcmp(cap.status, "PASS") != 0) { statsSlot->failed++; }
+    statsSlot->bytesIn += cap.bytesIn;
+    statsSlot->bytesOut += cap.bytesOut;
+    statsSlot->buckets[i]++;
+    statsend(statsSlot);
+    __atomic_store_n(&statsSlot->owner, 0, __ATOMIC_RELEASE);
+    statsSlot = NULL;
+}
+
+/*
+ * Claim a free slot for a worker, just after the fork
+ * long conn: the daemon's connection number, which also picks the first slot to try
+*/
+static void statsstart(long conn) {
+
+    struct statslot* slot;
+    int i, free;
+
+    if (statsSeg == NULL) { return; }
+    for (i = 0; i < STATS_SLOTS && statsSlot == NULL; i++) {
+        slot = &statsSeg->slots[(conn + i) % STATS_SLOTS];
+        free = 0;
+        if (__atomic_compare_exchange_n(&slot->owner, &free, getpid(), 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            statsSlot = slot;
+            statsbegin(slot);
+            slot->conn = conn;
+            statsend(slot);
+        }
+    }
+    atexit(statsdone);
+}
+
+/*
+ * Count a worker that died from a signal and free its slot, when the daemon reaps it
+ * pid_t pid: the process reaped
+ * int status: its wait status
+*/
+static void statsreap(pid_t pid, int status) {
+
+    struct statslot* slot;
+    int i, owner;
+
+    if (statsSeg == NULL || !WIFSIGNALED(status)) { return; }
+    __atomic_store_n(&statsSeg->killed, statsSeg->killed + 1, __ATOMIC_RELAXED);
+    for (i = 0; i < STATS_SLOTS; i++) {
+        slot = &statsSeg->slots[i];
+        owner = pid;
+        if (__atomic_load_n(&slot->owner, __ATOMIC_RELAXED) != pid) { continue; }
+        if (slot->seq & 1) { statsend(slot); } // It died writing, so settle the slot for readers and the next owner
+        __atomic_compare_exchange_n(&slot->owner, &owner, 0, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Copy a slot consistently, retrying while its owner is writing to it
+ * const struct statslot* slot: the slot, in a segment mapped by a reader
+ * struct statslot* copy: where to put the copy
+ * Returns 0, or -1 if the slot never settled (its owner was killed in the middle of writing it)
+*/
+static int statsread(const struct statslot* slot, struct statslot* copy) {
+
+    unsigned seq;
+    int tries;
+
+    for (tries = 0; tries < 100000; tries++) {
+        if ((seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE)) & 1) { continue; }
+        memcpy(copy, (const void*)slot, sizeof(*copy));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE); // The copy is done before the sequence number is checked again
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq) { return 0; }
+    }
+    return -1;
+}
+
+#endif
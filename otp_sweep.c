@@ -0,0 +1,405 @@
+/*************************************************************************************************************************
+ *
+ * NAME
+ *    otp_sweep.c
+ * SYNOPSIS
+ *    Sweeps chunk sizes, socket buffer sizes and thread counts for request sized transfers, and recommends defaults.
+ * DESCRIPTION
+ *    For every combination of transport (loopback TCP and Unix sockets), message size, chunk size (the most bytes
+ *       asked of each send()/recv() call, or the whole rest of the message), socket buffer size (SO_SNDBUF and
+ *       SO_RCVBUF together, or the kernel's default) and thread count, runs that many threads for a fixed time, each
+ *       sending messages through its own connection to an echo thread that reads the whole message and sends it back
+ *       the way the daemons answer a request. The connections are kept open so only the transfer itself is measured.
+ *    Like tuneapply() in the daemons, the buffer sizes are only set on the echo thread's end, once the first length
+ *       header has arrived, so the handshake and the header run with the kernel's defaults just as they do for --tune.
+ *    Prints one tab separated row per combination (transport, size, threads, chunk, buffer, requests/s, MB/s), which
+ *       can be pivoted straight into a heatmap; --grid also prints a chunk by buffer grid of MB/s for each transport,
+ *       size and thread count.
+ *    With --recommend FILE, writes the best chunk and buffer size for each transport and message size to FILE in the
+ *       format otp_enc_d/otp_dec_d --tune loads (see otp_tune.h). The best one is the combination with the highest
+ *       throughput relative to the best at each thread count, averaged over the thread counts, so it holds up under
+ *       concurrency as well as for a single client.
+ * INSTRUCTIONS
+ *    Use the included compileall script to compile this program as well as the other programs.
+ *    Syntax:
+ *       otp_sweep [--sizes N,...] [--chunks N,...] [--buffers N,...] [--threads N,...] [--time SECONDS]
+ *                 [--transport tcp|unix|both] [--grid] [--recommend FILE]
+ *    A chunk or buffer size of 0 means no limit or the kernel's default.
+ *    e.g. otp_sweep --recommend otp_tune.conf && otp_enc_d --tune otp_tune.conf 50001 &
+ * AUTHOR
+ *    Written by Andrew Swaim
+ *
+*************************************************************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stddef.h>
+#include <time.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+typedef enum { false, true } bool; // Create bool type for C89/C99 compilation.
+
+#define BUF_LEN 9 // Number of digits (characters) sent for the length of each message, like the protocol
+#define MAX_VALUES 16 // Most values swept in one dimension
+#define MAX_THREADS 256 // Most threads allowed in one run
+
+/*************************************************************************************************************************
+ * Types and Globals
+*************************************************************************************************************************/
+
+enum { TCP, UNIX_SOCKET };
+static const char* transportNames[2] = { "tcp", "unix" };
+
+struct list { long vals[MAX_VALUES]; int count; }; // Values to sweep in one dimension
+
+struct worker { // One client thread and its echo thread
+    pthread_t thread, echo;
+    int clientFD, serverFD;
+    long requests;
+};
+
+struct list sizes = { { 1000, 65536, 1048576 }, 3 };
+struct list chunks = { { 0, 4096, 16384, 65536, 262144 }, 5 };
+struct list buffers = { { 0, 65536, 262144, 1048576, 4194304 }, 5 };
+struct list threadCounts = { { 1, 4 }, 2 };
+int listeners[2]; // Listening sockets for each transport
+struct sockaddr_in tcpAddr;
+struct sockaddr_un unixAddr;
+socklen_t unixAddrLen;
+int transport; // Transport, message size, chunk and buffer size for the current run
+long size, chunk, buffer;
+volatile bool stop; // Set when the current run's time is up
+pthread_mutex_t connectLock = PTHREAD_MUTEX_INITIALIZER; // Pairs each connect() with its accept()
+double* results; // MB/s for every combination
+
+/*************************************************************************************************************************
+ * Function Declarations
+*************************************************************************************************************************/
+
+bool parselist(struct list*, char*); // To read a comma separated list of values
+void openlisteners(void); // To create the listening sockets for both transports
+double run(int, double); // To run the current combination with some number of threads and get its MB/s
+void* runclient(void*); // To send messages and read them back until the run is over
+void* runecho(void*); // To read each message and send it back
+int xfer(int, char*, long, bool); // To send or receive a whole message in chunks
+long resultindex(int, int, int, int, int); // To find a combination in the results
+double now(void); // To get a monotonic timestamp in seconds
+
+/*************************************************************************************************************************
+ * Main
+*************************************************************************************************************************/
+
+int main(int argc, char *argv[]) {
+
+    int opt, t, s, c, b, n, i, j, bestChunk, bestBuf, first = TCP, last = UNIX_SOCKET;
+    bool grid = false;
+    const char* recommend = NULL;
+    double seconds = 0.2, score, bestScore, top, mbps;
+    FILE* fd;
+
+    static struct option longopts[] = {
+        { "sizes", required_argument, NULL, 's' }, { "chunks", required_argument, NULL, 'c' },
+        { "buffers", required_argument, NULL, 'b' }, { "threads", required_argument, NULL, 'n' },
+        { "time", required_argument, NULL, 't' }, { "transport", required_argument, NULL, 'T' },
+        { "grid", no_argument, NULL, 'g' }, { "recommend", required_argument, NULL, 'r' }, { NULL, 0, NULL, 0 }
+    };
+
+    // Check usage & args
+    while ((opt = getopt_long(argc, argv, "s:c:b:n:t:T:gr:", longopts, NULL)) != -1) {
+        if (opt == 's') { if (!parselist(&sizes, optarg)) { argc = 0; } }
+        else if (opt == 'c') { if (!parselist(&chunks, optarg)) { argc = 0; } }
+        else if (opt == 'b') { if (!parselist(&buffers, optarg)) { argc = 0; } }
+        else if (opt == 'n') { if (!parselist(&threadCounts, optarg)) { argc = 0; } }
+        else if (opt == 't') { seconds = atof(optarg); }
+        else if (opt == 'g') { grid = true; }
+        else if (opt == 'r') { recommend = optarg; }
+        else if (opt == 'T' && strcmp(optarg, "tcp") == 0) { last = TCP; }
+        else if (opt == 'T' && strcmp(optarg, "unix") == 0) { first = UNIX_SOCKET; }
+        else if (opt == 'T' && strcmp(optarg, "both") == 0) { }
+        else { argc = 0; }
+    }
+    if (argc == 0 || optind != argc || seconds <= 0) {
+        fprintf(stderr, "USAGE: %s [--sizes N,...] [--chunks N,...] [--buffers N,...] [--threads N,...] [--time SECONDS]\n"
+                        "       [--transport tcp|unix|both] [--grid] [--recommend FILE]\n", argv[0]);
+        exit(1);
+    }
+    for (n = 0; n < sizes.count; n++) {
+        if (sizes.vals[n] < 1 || sizes.vals[n] > 999999999) { fprintf(stderr, "otp_sweep: ERROR, bad size\n"); exit(1); }
+    }
+    for (n = 0; n < threadCounts.count; n++) {
+        if (threadCounts.vals[n] < 1 || threadCounts.vals[n] > MAX_THREADS) {
+            fprintf(stderr, "otp_sweep: ERROR, bad thread count\n"); exit(1);
+        }
+    }
+    if ((results = calloc(2 * sizes.count * threadCounts.count * chunks.count * buffers.count, sizeof(double))) == NULL) {
+        fprintf(stderr, "otp_sweep: ERROR, out of memory\n"); exit(1);
+    }
+    openlisteners();
+
+    // Run every combination, printing a row for each
+    printf("transport\tsize\tthreads\tchunk\tbuffer\treq_per_sec\tmb_per_sec\n");
+    for (transport = first; transport <= last; transport++) {
+        for (s = 0; s < sizes.count; s++) {
+            for (n = 0; n < threadCounts.count; n++) {
+                for (c = 0; c < chunks.count; c++) {
+                    for (b = 0; b < buffers.count; b++) {
+                        size = sizes.vals[s]; chunk = chunks.vals[c]; buffer = buffers.vals[b];
+                        mbps = run((int)threadCounts.vals[n], seconds);
+                        results[resultindex(transport, s, n, c, b)] = mbps;
+                        printf("%s\t%ld\t%ld\t%ld\t%ld\t%.1f\t%.2f\n", transportNames[transport], size,
+                               threadCounts.vals[n], chunk, buffer, mbps * 1e6 / (2.0 * size), mbps);
+                        fflush(stdout);
+                    }
+                }
+            }
+        }
+    }
+
+    // Print a chunk by buffer grid for each transport, size and thread count
+    for (t = first; grid && t <= last; t++) {
+        for (s = 0; s < sizes.count; s++) {
+            for (n = 0; n < threadCounts.count; n++) {
+                printf("\n%s, %ld byte messages, %ld threads (MB/s, chunk down, buffer across)\n%10s", transportNames[t],
+                       sizes.vals[s], threadCounts.vals[n], "");
+                for (b = 0; b < buffers.count; b++) { printf("%10ld", buffers.vals[b]); }
+                for (c = 0; c < chunks.count; c++) {
+                    printf("\n%10ld", chunks.vals[c]);
+                    for (b = 0; b < buffers.count; b++) { printf("%10.1f", results[resultindex(t, s, n, c, b)]); }
+                }
+                printf("\n");
+            }
+        }
+    }
+
+    // Recommend the chunk and buffer size that does best across thread counts for each transport and size
+    if (recommend == NULL) { return 0; }
+    if ((fd = fopen(recommend, "w")) == NULL) { fprintf(stderr, "otp_sweep: ERROR, writing \'%s\'\n", recommend); exit(1); }
+    fprintf(fd, "# Recommended by otp_sweep (%.2fs per combination), load with otp_enc_d/otp_dec_d --tune\n"
+                "# transport max_size chunk sndbuf rcvbuf\n", seconds);
+    for (t = first; t <= last; t++) {
+        for (s = 0; s < sizes.count; s++) {
+
+            bestScore = -1; bestChunk = bestBuf = 0;
+            for (c = 0; c < chunks.count; c++) {
+                for (b = 0; b < buffers.count; b++) {
+                    for (score = 0, n = 0; n < threadCounts.count; n++) {
+                        for (top = 0, i = 0; i < chunks.count; i++) {
+                            for (j = 0; j < buffers.count; j++) {
+                                if (results[resultindex(t, s, n, i, j)] > top) { top = results[resultindex(t, s, n, i, j)]; }
+                            }
+                        }
+                        score += top > 0 ? results[resultindex(t, s, n, c, b)] / top : 0;
+                    }
+                    if (score > bestScore) { bestScore = score; bestChunk = c; bestBuf = b; }
+                }
+            }
+            fprintf(fd, "%s %ld %ld %ld %ld\n", transportNames[t], sizes.vals[s], chunks.vals[bestChunk],
+                    buffers.vals[bestBuf], buffers.vals[bestBuf]);
+        }
+    }
+    fclose(fd);
+    fprintf(stderr, "otp_sweep: recommendations written to \'%s\'\n", recommend);
+    return 0;
+}
+
+/*************************************************************************************************************************
+ * Function Definitions
+*************************************************************************************************************************/
+
+/*
+ * Read a comma separated list of values
+ * struct list* l: the list to fill
+ * char* str: the values, e.g. "0,4096,65536"
+ * Returns true if the list was valid
+*/
+bool parselist(struct list* l, char* str) {
+
+    char* item;
+
+    for (l->count = 0; (item = strtok(str, ",")) != NULL && l->count < MAX_VALUES; str = NULL) {
+        if ((l->vals[l->count++] = atol(item)) < 0) { return false; }
+    }
+    return l->count > 0;
+}
+
+/*
+ * Create a listening socket on an ephemeral loopback TCP port and one on an abstract Unix socket
+*/
+void openlisteners(void) {
+
+    socklen_t len = sizeof(tcpAddr);
+
+    memset(&tcpAddr, '\0', sizeof(tcpAddr));
+    tcpAddr.sin_family = AF_INET;
+    tcpAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    memset(&unixAddr, '\0', sizeof(unixAddr));
+    unixAddr.sun_family = AF_UNIX;
+    snprintf(unixAddr.sun_path + 1, sizeof(unixAddr.sun_path) - 1, "otp_sweep.%d", (int)getpid()); // Abstract name
+    unixAddrLen = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + 1 + strlen(unixAddr.sun_path + 1));
+
+    if ((listeners[TCP] = socket(AF_INET, SOCK_STREAM, 0)) < 0
+        || bind(listeners[TCP], (struct sockaddr*)&tcpAddr, sizeof(tcpAddr)) < 0
+        || getsockname(listeners[TCP], (struct sockaddr*)&tcpAddr, &len) < 0 || listen(listeners[TCP], MAX_THREADS) < 0
+        || (listeners[UNIX_SOCKET] = socket(AF_UNIX, SOCK_STREAM, 0)) < 0
+        || bind(listeners[UNIX_SOCKET], (struct sockaddr*)&unixAddr, unixAddrLen) < 0
+        || listen(listeners[UNIX_SOCKET], MAX_THREADS) < 0) {
+        fprintf(stderr, "otp_sweep: ERROR, opening listening sockets\n"); exit(2);
+    }
+}
+
+/*
+ * Run the current transport, size, chunk and buffer size with some number of client threads
+ * int threads: the number of client threads (each with its own connection and echo thread)
+ * double seconds: how long to run for
+ * Returns the throughput in MB/s, counting each message both ways
+*/
+double run(int threads, double seconds) {
+
+    struct worker workers[MAX_THREADS];
+    long requests = 0;
+    double start;
+    int i;
+
+    // Connect every client to its own echo thread (which sets the buffer sizes once it has a message length)
+    for (i = 0; i < threads; i++) {
+
+        pthread_mutex_lock(&connectLock);
+        workers[i].clientFD = socket(transport == TCP ? AF_INET : AF_UNIX, SOCK_STREAM, 0);
+        if (workers[i].clientFD < 0 || (transport == TCP
+                ? connect(workers[i].clientFD, (struct sockaddr*)&tcpAddr, sizeof(tcpAddr))
+                : connect(workers[i].clientFD, (struct sockaddr*)&unixAddr, unixAddrLen)) < 0
+            || (workers[i].serverFD = accept(listeners[transport], NULL, NULL)) < 0) {
+            fprintf(stderr, "otp_sweep: ERROR, connecting\n"); exit(2);
+        }
+        pthread_mutex_unlock(&connectLock);
+        workers[i].requests = 0;
+    }
+
+    // Run them all for the time given
+    stop = false;
+    start = now();
+    for (i = 0; i < threads; i++) {
+        if (pthread_create(&workers[i].echo, NULL, runecho, &workers[i]) != 0
+            || pthread_create(&workers[i].thread, NULL, runclient, &workers[i]) != 0) {
+            fprintf(stderr, "otp_sweep: ERROR, creating thread\n"); exit(1);
+        }
+    }
+    while (now() - start < seconds) { usleep(10000); }
+    stop = true;
+    for (i = 0; i < threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        close(workers[i].clientFD); // Ends the echo thread
+        pthread_join(workers[i].echo, NULL);
+        close(workers[i].serverFD);
+        requests += workers[i].requests;
+    }
+    return requests * 2.0 * size / (now() - start) / 1e6;
+}
+
+/*
+ * Send a message and read it back, over and over until the run is over
+ * void* arg: the thread's struct worker
+*/
+void* runclient(void* arg) {
+
+    struct worker* w = arg;
+    char header[BUF_LEN+1];
+    char* msg = malloc(size);
+
+    if (msg == NULL) { return NULL; }
+    memset(msg, 'A', size);
+    memset(header, '\0', sizeof(header));
+    snprintf(header, sizeof(header), "%ld", size);
+    while (!stop) {
+        if (xfer(w->clientFD, header, BUF_LEN, true) != BUF_LEN || xfer(w->clientFD, msg, size, true) != size
+            || xfer(w->clientFD, msg, size, false) != size) {
+            break;
+        }
+        w->requests++;
+    }
+    shutdown(w->clientFD, SHUT_WR);
+    free(msg);
+    return NULL;
+}
+
+/*
+ * Read each message (its length, then the message) and send it back until the client closes
+ * The buffer sizes are set after the first length, on this end only, where and when tuneapply() sets them
+ * void* arg: the thread's struct worker
+*/
+void* runecho(void* arg) {
+
+    struct worker* w = arg;
+    char header[BUF_LEN+1];
+    char* msg = malloc(size);
+    long len;
+    int buf = (int)buffer;
+    bool tuned = buffer == 0; // Nothing to set for the kernel's defaults
+
+    if (msg == NULL) { return NULL; }
+    while (xfer(w->serverFD, header, BUF_LEN, false) == BUF_LEN) {
+        header[BUF_LEN] = '\0';
+        if (!tuned) {
+            setsockopt(w->serverFD, SOL_SOCKET, SO_SNDBUF, &buf, sizeof(int));
+            setsockopt(w->serverFD, SOL_SOCKET, SO_RCVBUF, &buf, sizeof(int));
+            tuned = true;
+        }
+        if ((len = atol(header)) != size || xfer(w->serverFD, msg, len, false) != len
+            || xfer(w->serverFD, msg, len, true) != len) {
+            break;
+        }
+    }
+    free(msg);
+    return NULL;
+}
+
+/*
+ * Send or receive a whole message, asking for at most the current chunk size per call
+ * int sockFD: the connected socket
+ * char* str: the message to send or the buffer to receive it into
+ * long len: the length of the message
+ * bool sendMode: true for sending, false for receiving
+ * Returns the number of bytes transferred, less than len if the connection closed
+*/
+int xfer(int sockFD, char* str, long len, bool sendMode) {
+
+    long total = 0, want;
+    int n;
+
+    while (total < len) {
+        want = chunk > 0 && len - total > chunk ? chunk : len - total;
+        if (sendMode) { n = send(sockFD, str + total, want, MSG_NOSIGNAL); }
+        else { n = recv(sockFD, str + total, want, 0); }
+        if (n <= 0) { break; }
+        total += n;
+    }
+    return (int)total;
+}
+
+/*
+ * Find a combination's slot in the results
+ * int t, s, n, c, b: the transport, size, thread count, chunk and buffer indexes
+ * Returns the index into results
+*/
+long resultindex(int t, int s, int n, int c, int b) {
+
+    return (((long)(t * sizes.count + s) * threadCounts.count + n) * chunks.count + c) * buffers.count + b;
+}
+
+/*
+ * Get a monotonic timestamp in seconds
+*/
+double now(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
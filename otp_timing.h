@@ -0,0 +1,164 @@
+/*************************************************************************************************************************
+ *
+ * NAME
+ *    otp_timing.h
+ * SYNOPSIS
+ *    Cheap phase timestamps for the daemons, and the timing trailer they send clients after a result.
+ * DESCRIPTION
+ *    timingstamp() reads the TSC on x86 (a few nanoseconds, no system call), or CLOCK_MONOTONIC elsewhere.
+ *       timingcalibrate() measures the TSC rate against CLOCK_MONOTONIC once when the daemon starts (about 5ms), so
+ *       stamps can be turned into microseconds. The TSC has to be constant rate and synchronized across cores, which
+ *       it is on any x86 CPU from the last decade (constant_tsc and nonstop_tsc in /proc/cpuinfo).
+ *    Every request is timed at its phase boundaries (see otp_capture.h). A client asks for the server side breakdown
+ *       of its request by sending TIMING_ASK in place of the '_' in its id ("otp+enc" instead of "otp_enc"), and after
+ *       the result the daemon sends it a trailer:
+ *       TIME<auth><text><key><cipher><send><total>
+ *    where each field is 12 digits of nanoseconds: receiving the id and sending the authorization, receiving the text
+ *       length and text, receiving the key length and key, the cipher, sending the status and result, and the whole
+ *       request from accept() to the trailer, each capped at TIMING_FIELD_MAX. Clients that don't ask for it don't get
+ *       it, so they don't pay for the extra send, and don't close the connection with it unread (which resets it).
+ *    Clients run with --timing read the trailer and print it with timingprint(), next to their own time for the
+ *       request, so what's left over is the network and the client itself.
+ * AUTHOR
+ *    Written by Andrew Swaim
+ *
+*************************************************************************************************************************/
+
+#ifndef OTP_TIMING_H
+#define OTP_TIMING_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define TIMING_PHASES 5 // Phases in the trailer, before the total
+#define TIMING_FIELD_LEN 12 // Digits of nanoseconds per field
+#define TIMING_FIELD_MAX 999999999999ULL // Most nanoseconds a field holds, about 1000 seconds
+#define TIMING_LEN (4 + (TIMING_PHASES + 1) * TIMING_FIELD_LEN) // Length of the trailer
+#define TIMING_ASK '+' // Sent in place of the '_' in a client's id to ask for the trailer
+
+static const char* const timingPhaseNames[TIMING_PHASES] = { "auth", "text", "key", "cipher", "send" };
+static double timingTicksPerUs = 1000; // Stamp ticks per microsecond (nanoseconds without the TSC)
+
+/*
+ * Get a timestamp in ticks: TSC cycles on x86, nanoseconds elsewhere
+*/
+static inline unsigned long long timingstamp(void) {
+
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+/*
+ * Measure how many ticks timingstamp() counts per microsecond, spinning for about 5ms
+*/
+static void timingcalibrate(void) {
+
+#if defined(__x86_64__) || defined(__i386__)
+    struct timespec start, now;
+    unsigned long long ticks = timingstamp();
+    double us;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        us = (now.tv_sec - start.tv_sec) * 1e6 + (now.tv_nsec - start.tv_nsec) / 1e3;
+    } while (us < 5000);
+    timingTicksPerUs = (timingstamp() - ticks) / us;
+#endif
+}
+
+/*
+ * Get the microseconds between two timestamps
+ * unsigned long long from: the earlier timestamp
+ * unsigned long long to: the later timestamp
+*/
+static inline double timingus(unsigned long long from, unsigned long long to) {
+
+    return to > from ? (to - from) / timingTicksPerUs : 0;
+}
+
+/*
+ * Write a timing trailer
+ * char* buf: where to write it, TIMING_LEN + 1 long
+ * const double* phaseUs: microseconds in each phase
+ * double totalUs: microseconds for the whole request
+*/
+static void timingformat(char* buf, const double* phaseUs, double totalUs) {
+
+    double ns;
+    int i;
+
+    memcpy(buf, "TIME", 4);
+    for (i = 0; i <= TIMING_PHASES; i++) {
+        ns = (i < TIMING_PHASES ? phaseUs[i] : totalUs) * 1000;
+        snprintf(buf + 4 + i * TIMING_FIELD_LEN, TIMING_FIELD_LEN + 1, "%012llu",
+                 ns <= 0 ? 0 : ns >= TIMING_FIELD_MAX ? TIMING_FIELD_MAX : (unsigned long long)ns);
+    }
+}
+
+/*
+ * Read a timing trailer
+ * const char* buf: the trailer, TIMING_LEN long
+ * double* phaseUs: where to put the microseconds in each phase, TIMING_PHASES long
+ * double* totalUs: where to put the microseconds for the whole request
+ * Returns 0 on success, or -1 if it isn't a timing trailer
+*/
+static int timingparse(const char* buf, double* phaseUs, double* totalUs) {
+
+    char field[TIMING_FIELD_LEN + 1];
+    int i, j;
+
+    if (memcmp(buf, "TIME", 4) != 0) { return -1; }
+    for (i = 0; i <= TIMING_PHASES; i++) {
+        memcpy(field, buf + 4 + i * TIMING_FIELD_LEN, TIMING_FIELD_LEN);
+        field[TIMING_FIELD_LEN] = '\0';
+        for (j = 0; j < TIMING_FIELD_LEN; j++) { if (field[j] < '0' || field[j] > '9') { return -1; } }
+        if (i < TIMING_PHASES) { phaseUs[i] = atoll(field) / 1000.0; }
+        else { *totalUs = atoll(field) / 1000.0; }
+    }
+    return 0;
+}
+
+/*
+ * Get the time on the monotonic clock in microseconds, for clients timing their side of a request
+*/
+static double timingnow(void) {
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/*
+ * Print a client's timing of a request next to the server's breakdown from its trailer, on stderr
+ * const char* prog: the name of the client
+ * double clientUs: microseconds the client took, from before connecting until the trailer was received
+ * const char* trailer: the trailer, TIMING_LEN long
+*/
+static void timingprint(const char* prog, double clientUs, const char* trailer) {
+
+    double phaseUs[TIMING_PHASES], totalUs = 0;
+    int i;
+
+    if (timingparse(trailer, phaseUs, &totalUs) < 0) {
+        fprintf(stderr, "%s: WARNING, server did not send its timing, it may be an older daemon\n", prog); return;
+    }
+    fprintf(stderr, "%s: timing: client %.3f ms, server %.3f ms (", prog, clientUs / 1000, totalUs / 1000);
+    for (i = 0; i < TIMING_PHASES; i++) {
+        fprintf(stderr, "%s%s %.3f", i > 0 ? ", " : "", timingPhaseNames[i], phaseUs[i] / 1000);
+    }
+    fprintf(stderr, "), network and client %.3f ms\n", clientUs > totalUs ? (clientUs - totalUs) / 1000 : 0);
+}
+
+#endif
@@ -0,0 +1,288 @@
+/*************************************************************************************************************************
+ *
+ * NAME
+ *    otp_top.c
+ * SYNOPSIS
+ *    Live view of running daemons, read from the shared memory stats segments they publish.
+ * DESCRIPTION
+ *    Maps the stats segment of each daemon started with --stats (see otp_stats.h) read-only and redraws a summary
+ *       every interval: request and failure rates, GB/s in and out, active connections, busy workers, the listen
+ *       queue depth and latency quantiles, all over the last interval, plus running totals. The rates and quantiles
+ *       come from the difference between two snapshots of the running totals, so the daemons never do any work for
+ *       it, however often it redraws.
+ *    Quantiles come from the power of 2 latency buckets, interpolated within the bucket, so they're rough (within a
+ *       factor of 2 at worst) but cheap to keep.
+ *    The listen queue depth comes from /proc/net/tcp, where a listening socket's receive queue is its accept queue,
+ *       and its limit is the backlog the daemon recorded in the segment.
+ * INSTRUCTIONS
+ *    Use the included compileall script to compile this program as well as the other programs.
+ *    Start the daemons with --stats, then run:
+ *       otp_top [--interval SECONDS] [--once] PORT [PORT...]
+ *    --interval defaults to 1 second. --once prints one view of one interval without clearing the screen, for scripts.
+ *    e.g. otp_top 50001 50002
+ * AUTHOR
+ *    Written by Andrew Swaim
+ *
+*************************************************************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "otp_stats.h"
+
+typedef enum { false, true } bool; // Create bool type for C89/C99 compilation.
+
+#define MAX_DAEMONS 16 // Most daemons watched at once
+
+/*************************************************************************************************************************
+ * Types and Globals
+*************************************************************************************************************************/
+
+struct sample { // Totals read from a segment at one time
+    double time;
+    long long accepted, requests, failed, bytesIn, bytesOut, killed, overflow;
+    long long buckets[STATS_BUCKETS];
+    int busy;
+};
+
+struct daemonview { // One daemon being watched
+    int port;
+    struct statsseg* seg; // Its segment, or NULL until it's found
+    struct sample last; // The snapshot at the start of the interval
+};
+
+/*************************************************************************************************************************
+ * Function Declarations
+*************************************************************************************************************************/
+
+struct statsseg* attach(int); // To map a daemon's stats segment read-only
+void snapshot(struct statsseg*, struct sample*); // To add up a segment's totals
+void render(struct daemonview*, struct sample*); // To print one daemon's view of the last interval
+double quantile(long long*, long long, double); // To estimate a latency quantile from bucket counts
+bool queuedepth(int, long*); // To read a listening port's accept queue from /proc
+double now(void); // To get a monotonic timestamp in seconds
+
+/*************************************************************************************************************************
+ * Main
+*************************************************************************************************************************/
+
+int main(int argc, char *argv[]) {
+
+    struct daemonview views[MAX_DAEMONS];
+    struct sample current;
+    int numViews = 0, opt, i;
+    double interval = 1.0;
+    bool once = false;
+    char stamp[32];
+    time_t t;
+
+    static struct option longopts[] = {
+        { "interval", required_argument, NULL, 'i' }, { "once", no_argument, NULL, 'o' }, { NULL, 0, NULL, 0 }
+    };
+
+    // Check usage & args
+    while ((opt = getopt_long(argc, argv, "i:o", longopts, NULL)) != -1) {
+        if (opt == 'i') { interval = atof(optarg); }
+        else if (opt == 'o') { once = true; }
+        else { argc = 0; }
+    }
+    if (argc - optind < 1 || argc - optind > MAX_DAEMONS || interval <= 0) {
+        fprintf(stderr, "USAGE: %s [--interval SECONDS] [--once] PORT [PORT...]\n", argv[0]); exit(1);
+    }
+    for (i = optind; i < argc; i++, numViews++) {
+        memset(&views[numViews], 0, sizeof(views[numViews]));
+        views[numViews].port = atoi(argv[i]);
+        if (views[numViews].port < 1 || views[numViews].port > 65535) {
+            fprintf(stderr, "otp_top: ERROR, invalid port %s\n", argv[i]); exit(1);
+        }
+        if ((views[numViews].seg = attach(views[numViews].port)) != NULL) {
+            snapshot(views[numViews].seg, &views[numViews].last);
+        }
+    }
+
+    // Redraw every interval, from the difference between the snapshots at either end of it
+    while (1) {
+        usleep((useconds_t)(interval * 1e6));
+        t = time(0);
+        strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", localtime(&t));
+        if (!once) { printf("\033[H\033[2J"); } // Clear the screen
+        printf("otp_top  %s  every %.1fs\n", stamp, interval);
+        for (i = 0; i < numViews; i++) {
+            if (views[i].seg == NULL && (views[i].seg = attach(views[i].port)) != NULL) { // Started since
+                snapshot(views[i].seg, &views[i].last);
+                printf("\nport %d: attached, waiting for an interval\n", views[i].port);
+                continue;
+            }
+            if (views[i].seg == NULL) {
+                printf("\nport %d: no stats segment (start the daemon with --stats)\n", views[i].port);
+                continue;
+            }
+            snapshot(views[i].seg, &current);
+            render(&views[i], &current);
+            views[i].last = current;
+        }
+        fflush(stdout);
+        if (once) { break; }
+    }
+    return 0;
+}
+
+/*************************************************************************************************************************
+ * Function Definitions
+*************************************************************************************************************************/
+
+/*
+ * Map a daemon's stats segment read-only
+ * int port: the daemon's port
+ * Returns the segment, or NULL if there isn't a valid one
+*/
+struct statsseg* attach(int port) {
+
+    struct statsseg* seg;
+    struct stat st;
+    char name[32];
+    int fd;
+
+    statsname(name, port);
+    if ((fd = shm_open(name, O_RDONLY, 0)) < 0) { return NULL; }
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(struct statsseg)) { close(fd); return NULL; }
+    seg = mmap(NULL, sizeof(struct statsseg), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (seg == MAP_FAILED) { return NULL; }
+    if (__atomic_load_n(&seg->magic, __ATOMIC_ACQUIRE) != STATS_MAGIC || seg->version != STATS_VERSION) {
+        munmap(seg, sizeof(struct statsseg)); return NULL;
+    }
+    return seg;
+}
+
+/*
+ * Add up a segment's header and slots
+ * struct statsseg* seg: the segment
+ * struct sample* s: where to put the totals
+*/
+void snapshot(struct statsseg* seg, struct sample* s) {
+
+    struct statslot slot;
+    int i, j;
+
+    memset(s, 0, sizeof(*s));
+    s->time = now();
+    s->accepted = __atomic_load_n(&seg->accepted, __ATOMIC_RELAXED);
+    s->killed = __atomic_load_n(&seg->killed, __ATOMIC_RELAXED);
+    s->overflow = __atomic_load_n(&seg->overflow, __ATOMIC_RELAXED);
+    for (i = 0; i < STATS_SLOTS; i++) {
+        if (statsread(&seg->slots[i], &slot) < 0) { continue; }
+        if (slot.owner != 0) { s->busy++; }
+        s->requests += slot.requests;
+        s->failed += slot.failed;
+        s->bytesIn += slot.bytesIn;
+        s->bytesOut += slot.bytesOut;
+        for (j = 0; j < STATS_BUCKETS; j++) { s->buckets[j] += slot.buckets[j]; }
+    }
+}
+
+/*
+ * Print one daemon's view of the last interval
+ * struct daemonview* v: the daemon, with the snapshot from the start of the interval
+ * struct sample* s: the snapshot from the end of the interval
+*/
+void render(struct daemonview* v, struct sample* s) {
+
+    long long buckets[STATS_BUCKETS], done = s->requests - v->last.requests, finished, up;
+    double secs = s->time - v->last.time;
+    long depth;
+    bool alive;
+    int i;
+
+    for (i = 0; i < STATS_BUCKETS; i++) { buckets[i] = s->buckets[i] - v->last.buckets[i]; }
+    finished = s->requests + s->killed + s->overflow;
+    up = time(0) - v->seg->started;
+    alive = kill(v->seg->pid, 0) == 0 || errno == EPERM;
+
+    printf("\n%s  port %d  pid %d  %s %lld:%02lld:%02lld\n", v->seg->daemon, v->port, (int)v->seg->pid,
+           alive ? "up" : "NOT RUNNING, was up", up / 3600, up / 60 % 60, up % 60);
+    printf("  requests %9.1f/s   failed %7.1f/s   in %7.3f GB/s   out %7.3f GB/s\n", done / secs,
+           (s->failed - v->last.failed) / secs, (s->bytesIn - v->last.bytesIn) / secs / 1e9,
+           (s->bytesOut - v->last.bytesOut) / secs / 1e9);
+    printf("  active %lld   workers busy %d/%d", s->accepted - finished, s->busy, STATS_SLOTS);
+    if (alive && queuedepth(v->port, &depth)) { printf("   queue %ld/%d", depth, v->seg->backlog); }
+    printf("\n");
+    if (done > 0) {
+        printf("  latency  p50 %.3f ms   p90 %.3f ms   p99 %.3f ms   p99.9 %.3f ms\n",
+               quantile(buckets, done, 50) / 1e3, quantile(buckets, done, 90) / 1e3, quantile(buckets, done, 99) / 1e3,
+               quantile(buckets, done, 99.9) / 1e3);
+    }
+    else { printf("  latency  no requests finished\n"); }
+    printf("  total    %lld requests (%lld failed), %lld killed, %lld untracked, %.3f GB in, %.3f GB out\n",
+           s->requests, s->failed, s->killed, s->overflow, s->bytesIn / 1e9, s->bytesOut / 1e9);
+}
+
+/*
+ * Estimate a latency quantile from power of 2 bucket counts, interpolating linearly within the bucket it falls in
+ * long long* buckets: requests per bucket, STATS_BUCKETS long
+ * long long total: the requests in all the buckets
+ * double pct: the percentile (0-100)
+ * Returns the latency in microseconds
+*/
+double quantile(long long* buckets, long long total, double pct) {
+
+    double target = total * pct / 100.0, seen = 0, low;
+    int i;
+
+    for (i = 0; i < STATS_BUCKETS; i++) {
+        if (buckets[i] > 0 && seen + buckets[i] >= target) {
+            low = i == 0 ? 0 : (double)(1LL << i);
+            return low + ((double)(2LL << i) - low) * (target - seen) / buckets[i];
+        }
+        seen += buckets[i];
+    }
+    return (double)(2LL << (STATS_BUCKETS - 1));
+}
+
+/*
+ * Read a listening port's accept queue from /proc/net/tcp (or tcp6)
+ * int port: the port
+ * long* depth: where to put the connections waiting to be accepted
+ * Returns true if a listening socket was found on the port
+*/
+bool queuedepth(int port, long* depth) {
+
+    static const char* const files[] = { "/proc/net/tcp", "/proc/net/tcp6" };
+    char line[512];
+    unsigned localPort, state;
+    FILE* fd;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        if ((fd = fopen(files[i], "r")) == NULL) { continue; }
+        while (fgets(line, sizeof(line), fd) != NULL) {
+            if (sscanf(line, " %*d: %*[0-9A-Fa-f]:%x %*[0-9A-Fa-f]:%*x %x %*x:%lx", &localPort, &state, depth) == 3
+                && localPort == (unsigned)port && state == 0x0A) { // TCP_LISTEN
+                fclose(fd);
+                return true;
+            }
+        }
+        fclose(fd);
+    }
+    return false;
+}
+
+/*
+ * Get a monotonic timestamp in seconds
+*/
+double now(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -0,0 +1,88 @@
+/*************************************************************************************************************************
+ *
+ * NAME
+ *    otp_tune.h
+ * SYNOPSIS
+ *    Per message size transfer tuning for the daemons, recommended by otp_sweep.
+ * DESCRIPTION
+ *    A tuning file has one line per message size class for each transport:
+ *       TRANSPORT MAX_SIZE CHUNK SNDBUF RCVBUF
+ *    e.g. "tcp 65536 16384 262144 262144" means messages up to 65536 characters (and over the previous class) are sent
+ *       and received at most 16384 bytes per send()/recv() call on sockets with 256K send and receive buffers. A CHUNK
+ *       of 0 means the whole rest of the message per call, and a buffer size of 0 leaves the kernel's default. The
+ *       last class also covers anything larger. Lines starting with "#" are comments.
+ *    tuneload() reads the classes for one transport, tuneapply() picks the class for a message once its length is
+ *       known and sets the socket buffers, and tunechunk() limits each send()/recv() call to the class's chunk size.
+ *       With no file loaded nothing is changed.
+ * AUTHOR
+ *    Written by Andrew Swaim
+ *
+*************************************************************************************************************************/
+
+#ifndef OTP_TUNE_H
+#define OTP_TUNE_H
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#define TUNE_CLASSES 32 // Most size classes in a tuning file
+
+struct tuneclass { long maxSize; int chunk, sndbuf, rcvbuf; };
+
+static struct tuneclass tuneClasses[TUNE_CLASSES]; // Size classes loaded, in increasing size
+static int tuneCount = 0;
+static int tuneChunk = 0; // Chunk size for the current message (0 for no limit, calibrate() may set a default)
+
+/*
+ * Load the size classes for one transport from a tuning file
+ * const char* path: the tuning file
+ * const char* transport: the transport to load ("tcp" or "unix")
+ * Returns the number of classes loaded, or -1 if the file couldn't be read or has a bad line
+*/
+static int tuneload(const char* path, const char* transport) {
+
+    FILE* fd;
+    char line[256], name[16];
+    struct tuneclass c;
+
+    if ((fd = fopen(path, "r")) == NULL) { return -1; }
+    tuneCount = 0;
+    while (fgets(line, sizeof(line), fd) != NULL) {
+
+        if (line[0] == '#' || line[0] == '\n') { continue; }
+        if (sscanf(line, "%15s %ld %d %d %d", name, &c.maxSize, &c.chunk, &c.sndbuf, &c.rcvbuf) != 5 || c.maxSize < 1
+            || c.chunk < 0 || c.sndbuf < 0 || c.rcvbuf < 0
+            || (tuneCount > 0 && strcmp(name, transport) == 0 && c.maxSize <= tuneClasses[tuneCount - 1].maxSize)) {
+            fclose(fd); tuneCount = 0; return -1;
+        }
+        if (strcmp(name, transport) == 0 && tuneCount < TUNE_CLASSES) { tuneClasses[tuneCount++] = c; }
+    }
+    fclose(fd);
+    return tuneCount;
+}
+
+/*
+ * Tune a socket for a message once its length is known: set its buffer sizes and the chunk size used by tunechunk()
+ * int sockFD: the connected socket
+ * long len: the length of the message
+*/
+static void tuneapply(int sockFD, long len) {
+
+    int i;
+
+    if (tuneCount == 0) { return; }
+    for (i = 0; i < tuneCount - 1 && len > tuneClasses[i].maxSize; i++) { }
+    tuneChunk = tuneClasses[i].chunk;
+    if (tuneClasses[i].sndbuf > 0) { setsockopt(sockFD, SOL_SOCKET, SO_SNDBUF, &tuneClasses[i].sndbuf, sizeof(int)); }
+    if (tuneClasses[i].rcvbuf > 0) { setsockopt(sockFD, SOL_SOCKET, SO_RCVBUF, &tuneClasses[i].rcvbuf, sizeof(int)); }
+}
+
+/*
+ * Limit how much to send or receive in one call to the current chunk size
+ * int rem: the number of bytes left to send or receive
+ * Returns how many to ask for in the next call
+*/
+static inline int tunechunk(int rem) { return tuneChunk > 0 && rem > tuneChunk ? tuneChunk : rem; }
+
+#endif